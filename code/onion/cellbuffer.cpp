@@ -0,0 +1,170 @@
+#include "cellbuffer.h"
+
+#include <QDebug>
+
+struct CellBuffer::Slab {
+    CellPool *pool; // null once the pool is gone
+    int live;       // cells handed out and not yet released
+    int cellSize;
+    Cell *cells;
+    char *storage;  // the data of all cells, back to back
+
+    ~Slab() {
+        delete[] cells;
+        delete[] storage;
+    }
+};
+
+CellBuffer::CellBuffer(const CellBuffer &other) : cell_(other.cell_)
+{
+    if(cell_ != nullptr) {
+        cell_->ref++;
+    }
+}
+
+CellBuffer::~CellBuffer()
+{
+    clear();
+}
+
+bool CellBuffer::isShared() const
+{
+    return cell_ != nullptr && cell_->ref > 1;
+}
+
+void CellBuffer::clear()
+{
+    if(cell_ == nullptr) {
+        return;
+    }
+
+    if(--cell_->ref == 0) {
+        Slab *slab = cell_->slab;
+        if(slab->pool != nullptr) {
+            slab->pool->release(cell_);
+        } else if(--slab->live == 0) {
+            // orphaned by its pool, we were the last user
+            delete slab;
+        }
+    }
+    cell_ = nullptr;
+}
+
+char *CellBuffer::data()
+{
+    return cell_ != nullptr ? cell_->data : nullptr;
+}
+
+const char *CellBuffer::constData() const
+{
+    return cell_ != nullptr ? cell_->data : nullptr;
+}
+
+int CellBuffer::capacity() const
+{
+    return cell_ != nullptr ? cell_->slab->cellSize : 0;
+}
+
+QByteArray CellBuffer::bytes(int length) const
+{
+    return mid(0, length);
+}
+
+QByteArray CellBuffer::mid(int offset, int length) const
+{
+    const int size = capacity();
+    if(cell_ == nullptr || offset < 0 || offset > size) {
+        return QByteArray();
+    }
+    if(length < 0 || offset + length > size) {
+        length = size - offset;
+    }
+    return QByteArray::fromRawData(cell_->data + offset, length);
+}
+
+QByteArray CellBuffer::payload(int length) const
+{
+    if(cell_ != nullptr && length == cell_->payload.size()) {
+        return cell_->payload;
+    }
+    return mid(PayloadOffset, length);
+}
+
+CellPool::CellPool(int cellsPerSlab, int cellSize) :
+    cellsPerSlab_(qMax(1, cellsPerSlab)), cellSize_(qMax(1, cellSize))
+{
+
+}
+
+CellPool::~CellPool()
+{
+    for(CellBuffer::Slab *slab : slabs_) {
+        if(slab->live == 0) {
+            delete slab;
+        } else {
+            // someone still holds cells of this slab, the last one frees it
+            slab->pool = nullptr;
+        }
+    }
+}
+
+CellBuffer CellPool::acquire()
+{
+    if(freeList_ == nullptr) {
+        grow();
+    }
+
+    CellBuffer::Cell *cell = freeList_;
+    freeList_ = cell->nextFree;
+    cell->nextFree = nullptr;
+    cell->ref = 1;
+    cell->slab->live++;
+
+    stats_.acquired++;
+    stats_.inUse++;
+    return CellBuffer(cell);
+}
+
+CellPool::Stats CellPool::stats() const
+{
+    return stats_;
+}
+
+int CellPool::cellSize() const
+{
+    return cellSize_;
+}
+
+void CellPool::grow()
+{
+    CellBuffer::Slab *slab = new CellBuffer::Slab;
+    slab->pool = this;
+    slab->live = 0;
+    slab->cellSize = cellSize_;
+    slab->cells = new CellBuffer::Cell[cellsPerSlab_];
+    slab->storage = new char[(size_t)cellsPerSlab_ * cellSize_];
+    slabs_.append(slab);
+
+    for(int i = cellsPerSlab_ - 1; i >= 0; i--) {
+        CellBuffer::Cell &cell = slab->cells[i];
+        cell.slab = slab;
+        cell.data = slab->storage + (size_t)i * cellSize_;
+        if(cellSize_ > CellBuffer::PayloadOffset) {
+            cell.payload = QByteArray::fromRawData(cell.data + CellBuffer::PayloadOffset, cellSize_ - CellBuffer::PayloadOffset);
+        }
+        cell.ref = 0;
+        cell.nextFree = freeList_;
+        freeList_ = &cell;
+    }
+
+    stats_.slabAllocations++;
+    stats_.capacity += cellsPerSlab_;
+}
+
+void CellPool::release(CellBuffer::Cell *cell)
+{
+    cell->slab->live--;
+    cell->nextFree = freeList_;
+    freeList_ = cell;
+    stats_.inUse--;
+}
@@ -0,0 +1,93 @@
+#ifndef CELLBUFFER_H
+#define CELLBUFFER_H
+
+#include <QByteArray>
+#include <QVector>
+#include <utility>
+
+// fixed size storage for one p2p cell, MESSAGE_LENGTH bytes unless the pool is for larger ones.
+// see peertopeermessage.h
+#define CELL_CAPACITY 1027
+
+class CellPool;
+
+// refcounted handle to one pooled cell. copies share the cell, it goes back to its pool
+// when the last handle is gone. not thread safe: keep cells on the thread of their pool.
+class CellBuffer
+{
+public:
+    CellBuffer() { }
+    CellBuffer(const CellBuffer &other);
+    CellBuffer(CellBuffer &&other) : cell_(other.cell_) { other.cell_ = nullptr; }
+    CellBuffer &operator =(CellBuffer other) { std::swap(cell_, other.cell_); return *this; }
+    ~CellBuffer();
+
+    bool isNull() const { return cell_ == nullptr; }
+    bool isShared() const;
+    void clear();
+
+    char *data();
+    const char *constData() const;
+    // the cell size of its pool, 0 for a null buffer
+    int capacity() const;
+
+    // non-owning views, only valid while a handle to this cell lives
+    QByteArray bytes(int length = -1) const;
+    QByteArray mid(int offset, int length = -1) const;
+    // the view from PayloadOffset on, length bytes. up to the end of the cell it is made with
+    // the slab, other views allocate a QByteArray header each
+    QByteArray payload(int length) const;
+
+    // of the payload, after the unencrypted header (UNENCRYPTED_HEADER_LEN in peertopeermessage.h)
+    static constexpr int PayloadOffset = 3;
+
+private:
+    friend class CellPool;
+    struct Slab;
+    struct Cell {
+        Slab *slab;
+        int ref;
+        Cell *nextFree;
+        char *data; // cellSize bytes in the storage of its slab
+        QByteArray payload; // view of data from PayloadOffset on
+    };
+
+    explicit CellBuffer(Cell *cell) : cell_(cell) { }
+
+    Cell *cell_ = nullptr;
+};
+
+// slab allocator for cells of cellSize bytes. cells are carved from slabs of cellsPerSlab cells
+// and recycled through a free list, so the steady state of the relay does not touch the heap at all.
+// slabs with cells still in use outlive the pool and are freed with their last cell.
+class CellPool
+{
+public:
+    explicit CellPool(int cellsPerSlab = 256, int cellSize = CELL_CAPACITY);
+    ~CellPool();
+
+    int cellSize() const;
+
+    struct Stats {
+        quint64 slabAllocations = 0; // the pool only allocates a slab at a time, its cells and their payload views
+        quint64 acquired = 0;
+        int inUse = 0;
+        int capacity = 0;
+    };
+
+    CellBuffer acquire();
+    Stats stats() const;
+
+private:
+    friend class CellBuffer;
+    void grow();
+    void release(CellBuffer::Cell *cell);
+
+    int cellsPerSlab_;
+    int cellSize_;
+    QVector<CellBuffer::Slab *> slabs_;
+    CellBuffer::Cell *freeList_ = nullptr;
+    Stats stats_;
+};
+
+#endif // CELLBUFFER_H
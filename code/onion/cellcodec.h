@@ -0,0 +1,306 @@
+#ifndef CELLCODEC_H
+#define CELLCODEC_H
+
+#include <QByteArray>
+#include <QDebug>
+#include <QtEndian>
+#include <cstring>
+#include <type_traits>
+#include "cellview.h"
+#include "peertopeermessage.h"
+#include "randompool.h"
+
+// compile-time schemas for the cell layouts in peertopeermessage.h. a layout is a list of
+// fields, each bound to a member of PeerToPeerMessage, and encodes/decodes them in order as
+// big-endian values straight into a fixed buffer, no QDataStream and no reallocation.
+
+// writes fields into a buffer of capacity bytes. a field that does not fit is not written and
+// fails the writer, the fields after it are skipped as well
+class CellWriter
+{
+public:
+    CellWriter(char *data, int capacity) : data_(data), capacity_(capacity) { }
+
+    template<typename T> void put(T value) {
+        static_assert(std::is_unsigned<T>::value, "cell fields are unsigned");
+        if(reserve(sizeof(T))) {
+            qToBigEndian<T>(value, data_ + pos_);
+            pos_ += sizeof(T);
+        }
+    }
+    void putRaw(const char *source, int length) {
+        if(reserve(length)) {
+            memcpy(data_ + pos_, source, length);
+            pos_ += length;
+        }
+    }
+    // fills the rest of the buffer, handshake cells are padded with '?'
+    void pad(char fill = '?') {
+        memset(data_ + pos_, fill, capacity_ - pos_);
+        pos_ = capacity_;
+    }
+    // fills the rest with random bytes, for relay payloads
+    void padRandom() {
+        RandomPool::local().fill(data_ + pos_, capacity_ - pos_);
+        pos_ = capacity_;
+    }
+
+    int size() const { return pos_; }
+    int remaining() const { return capacity_ - pos_; }
+    bool ok() const { return ok_; }
+
+private:
+    bool reserve(int length) {
+        ok_ &= pos_ + length <= capacity_;
+        return ok_;
+    }
+
+    char *data_;
+    int capacity_;
+    int pos_ = 0;
+    bool ok_ = true;
+};
+
+// reads fields from size bytes at data. reading past the end fails the reader and yields zeros
+class CellReader
+{
+public:
+    CellReader(const char *data, int size) : data_(data), size_(size) { }
+
+    template<typename T> T get() {
+        static_assert(std::is_unsigned<T>::value, "cell fields are unsigned");
+        if(!reserve(sizeof(T))) {
+            return 0;
+        }
+        T value = qFromBigEndian<T>(data_ + pos_);
+        pos_ += sizeof(T);
+        return value;
+    }
+    // a deep copy, the cell usually goes back to its pool before the message is done
+    QByteArray getRaw(int length) {
+        if(!reserve(length)) {
+            return QByteArray();
+        }
+        QByteArray value(data_ + pos_, length);
+        pos_ += length;
+        return value;
+    }
+
+    bool atEnd() const { return pos_ >= size_; }
+    bool ok() const { return ok_; }
+    void fail() { ok_ = false; }
+
+private:
+    bool reserve(int length) {
+        ok_ &= length >= 0 && pos_ + length <= size_;
+        return ok_;
+    }
+
+    const char *data_;
+    int size_;
+    int pos_ = 0;
+    bool ok_ = true;
+};
+
+// an unsigned integer member
+template<typename T, T PeerToPeerMessage::*Member>
+struct IntField
+{
+    static const int FixedSize = sizeof(T);
+    static void encode(CellWriter &out, const PeerToPeerMessage &message) { out.put<T>(message.*Member); }
+    static void decode(CellReader &in, PeerToPeerMessage *message) { message->*Member = in.get<T>(); }
+};
+
+// an enum member in one byte, Celltype or Commandtype
+template<typename E, E PeerToPeerMessage::*Member>
+struct TypeField
+{
+    static const int FixedSize = 1;
+    static void encode(CellWriter &out, const PeerToPeerMessage &message) {
+        out.put<quint8>(static_cast<quint8>(message.*Member));
+    }
+    static void decode(CellReader &in, PeerToPeerMessage *message) {
+        message->*Member = static_cast<E>(in.get<quint8>());
+    }
+};
+
+// | len (2B) | data. longer data is truncated to MaxSize on write and rejected on read
+template<QByteArray PeerToPeerMessage::*Member, int MaxSize = MAX_RELAY_DATA_SIZE>
+struct SizedField
+{
+    static const int FixedSize = 2; // only the length
+    static void encode(CellWriter &out, const PeerToPeerMessage &message) {
+        const QByteArray &source = message.*Member;
+        quint16 size = source.size();
+        if(source.size() > MaxSize) {
+            qDebug() << "unreasonable payload size to write" << source.size() << "truncating to" << MaxSize;
+            size = MaxSize;
+        }
+        out.put<quint16>(size);
+        out.putRaw(source.constData(), size);
+    }
+    static void decode(CellReader &in, PeerToPeerMessage *message) {
+        quint16 size = in.get<quint16>();
+        if(size > MaxSize) {
+            qDebug() << "unreasonable payload size to read" << size;
+            in.fail();
+            return;
+        }
+        message->*Member = in.getRaw(size);
+    }
+};
+
+// | flags (2 bit) len (14 bit) | data, a SizedField that leaves the top bits of its length to flags
+template<QByteArray PeerToPeerMessage::*Member, quint8 PeerToPeerMessage::*Flags>
+struct FlaggedSizedField
+{
+    static const int FixedSize = 2;
+    static const int FlagShift = 14;
+    static_assert(MAX_RELAY_DATA_SIZE < (1 << FlagShift), "the length runs into the flags");
+    static void encode(CellWriter &out, const PeerToPeerMessage &message) {
+        const QByteArray &source = message.*Member;
+        quint16 size = source.size();
+        if(source.size() > MAX_RELAY_DATA_SIZE) {
+            qDebug() << "unreasonable payload size to write" << source.size() << "truncating to" << MAX_RELAY_DATA_SIZE;
+            size = MAX_RELAY_DATA_SIZE;
+        }
+        out.put<quint16>((message.*Flags << FlagShift) | size);
+        out.putRaw(source.constData(), size);
+    }
+    static void decode(CellReader &in, PeerToPeerMessage *message) {
+        quint16 field = in.get<quint16>();
+        quint16 size = field & ((1 << FlagShift) - 1);
+        if(size > MAX_RELAY_DATA_SIZE) {
+            qDebug() << "unreasonable payload size to read" << size;
+            in.fail();
+            return;
+        }
+        message->*Flags = field >> FlagShift;
+        message->*Member = in.getRaw(size);
+    }
+};
+
+// a CellSize in one byte. sizes we do not know are larger than all we do, they read as CELL_MAX
+template<PeerToPeerMessage::CellSize PeerToPeerMessage::*Member>
+struct CellSizeField
+{
+    static const int FixedSize = 1;
+    static void encode(CellWriter &out, const PeerToPeerMessage &message) {
+        out.put<quint8>(static_cast<quint8>(message.*Member));
+    }
+    static void decode(CellReader &in, PeerToPeerMessage *message) {
+        quint8 size = qMin<quint8>(PeerToPeerMessage::CELL_MAX, in.get<quint8>());
+        message->*Member = static_cast<PeerToPeerMessage::CellSize>(size);
+    }
+};
+
+// | ip_v (1B) | ip (4B/16B)
+template<QHostAddress PeerToPeerMessage::*Member>
+struct AddressField
+{
+    static const int FixedSize = 1; // only ip_v
+    static void encode(CellWriter &out, const PeerToPeerMessage &message) {
+        const QHostAddress &address = message.*Member;
+        if(address.isNull()) {
+            qDebug() << "invalid hostaddress while building RELAY_EXTEND message";
+        }
+        if(address.protocol() == QAbstractSocket::IPv4Protocol) {
+            out.put<quint8>(4);
+            out.put<quint32>(address.toIPv4Address());
+        } else {
+            Q_IPV6ADDR ip = address.toIPv6Address();
+            out.put<quint8>(6);
+            out.putRaw(reinterpret_cast<const char *>(ip.c), 16);
+        }
+    }
+    static void decode(CellReader &in, PeerToPeerMessage *message) {
+        quint8 ipv = in.get<quint8>();
+        if(ipv == 4) {
+            (message->*Member).setAddress(in.get<quint32>());
+        } else if(ipv == 6) {
+            QByteArray ip = in.getRaw(16);
+            if(in.ok()) {
+                (message->*Member).setAddress(reinterpret_cast<const quint8 *>(ip.constData()));
+            }
+        } else {
+            qDebug() << "IPV invalid in RELAY_EXTEND message" << ipv;
+            in.fail();
+        }
+    }
+};
+
+// the fields of a layout, in wire order. FixedSize is known at compile time
+template<typename... Fields>
+struct CellLayout;
+
+template<>
+struct CellLayout<>
+{
+    static const int FixedSize = 0;
+    static void encode(CellWriter &, const PeerToPeerMessage &) { }
+    static bool decode(CellReader &in, PeerToPeerMessage *) { return in.ok(); }
+};
+
+template<typename Field, typename... Rest>
+struct CellLayout<Field, Rest...>
+{
+    static const int FixedSize = Field::FixedSize + CellLayout<Rest...>::FixedSize;
+    static void encode(CellWriter &out, const PeerToPeerMessage &message) {
+        Field::encode(out, message);
+        CellLayout<Rest...>::encode(out, message);
+    }
+    // false if a field did not fit or was invalid, the fields after it are left alone
+    static bool decode(CellReader &in, PeerToPeerMessage *message) {
+        Field::decode(in, message);
+        return in.ok() && CellLayout<Rest...>::decode(in, message);
+    }
+};
+
+// the schemas, see the layout in peertopeermessage.h
+typedef PeerToPeerMessage P2PM;
+
+// | celltype (1B) | circ_id (2B)
+typedef CellLayout<TypeField<P2PM::Celltype, &P2PM::celltype>,
+                   IntField<quint16, &P2PM::circuitId>> CellHeaderLayout;
+// | 01/02 | circ_id (2B) | handshake_len (2B) | handshake
+typedef CellLayout<TypeField<P2PM::Celltype, &P2PM::celltype>,
+                   IntField<quint16, &P2PM::circuitId>,
+                   SizedField<&P2PM::data>> HandshakeLayout;
+
+// | command (1B) | digest (4B) | streamId (2B)
+typedef CellLayout<TypeField<P2PM::Commandtype, &P2PM::command>,
+                   IntField<quint32, &P2PM::digest>,
+                   IntField<quint16, &P2PM::streamId>> RelayHeaderLayout;
+// RELAY_DATA: | flags (2 bit) len (14 bit) | data
+typedef CellLayout<FlaggedSizedField<&P2PM::data, &P2PM::dataFlags>> RelayDataLayout;
+// RELAY_DATA_RECORDS: | len (2B) | data
+typedef CellLayout<SizedField<&P2PM::data>> RelayPayloadLayout;
+// RELAY_EXTENDED: | handshake_len (2B) | handshake | cell_size (1B)
+typedef CellLayout<SizedField<&P2PM::data>,
+                   CellSizeField<&P2PM::circuitCellSize>> RelayExtendedLayout;
+// RELAY_DATA_FRAGMENT: | message_id (2B) | fragment (1B) | flags (1B) | len (2B) | data
+typedef CellLayout<IntField<quint16, &P2PM::messageId>,
+                   IntField<quint8, &P2PM::fragmentIndex>,
+                   IntField<quint8, &P2PM::fragmentFlags>,
+                   SizedField<&P2PM::data, P2PM::maxFragmentData(P2PM::CELL_MAX)>> RelayFragmentLayout;
+// RELAY_EXTEND: | ip_v (1B) | ip (4B/16B) | port (2B) | handshake_len (2B) | handshake | cell_size (1B)
+typedef CellLayout<AddressField<&P2PM::address>,
+                   IntField<quint16, &P2PM::port>,
+                   SizedField<&P2PM::data>,
+                   CellSizeField<&P2PM::circuitCellSize>> RelayExtendLayout;
+// RELAY_TRUNCATED, CMD_DESTROY, CMD_COVER
+typedef CellLayout<> EmptyLayout;
+
+static_assert(CellHeaderLayout::FixedSize == UNENCRYPTED_HEADER_LEN, "cell header does not match the layout");
+static_assert(CellBuffer::PayloadOffset == UNENCRYPTED_HEADER_LEN, "cell payloads do not start after the header");
+static_assert(RelayHeaderLayout::FixedSize == CellView::RelayHeaderLength, "relay header does not match CellView");
+static_assert(P2PM::MaxCellData == CellView::PayloadLength - RelayHeaderLayout::FixedSize - RelayPayloadLayout::FixedSize,
+              "MaxCellData does not match the layout");
+static_assert(RelayDataLayout::FixedSize == RelayPayloadLayout::FixedSize, "RELAY_DATA and RELAY_DATA_RECORDS hold different amounts");
+static_assert(P2PM::FragmentHeaderLength == RelayFragmentLayout::FixedSize - RelayPayloadLayout::FixedSize,
+              "FragmentHeaderLength does not match the layout");
+static_assert(P2PM::MaxMessageData <= 256 * P2PM::MaxFragmentData, "fragment index is one byte");
+static_assert(P2PM::cellLength(P2PM::CELL_1K) == MESSAGE_LENGTH && P2PM::cellLength(P2PM::CELL_MAX) == MAX_MESSAGE_LENGTH,
+              "cell sizes do not match MESSAGE_LENGTH and MAX_MESSAGE_LENGTH");
+
+#endif // CELLCODEC_H
@@ -0,0 +1,202 @@
+#include "celldigest.h"
+#include "cellview.h"
+
+#include <QtEndian>
+#include <cstring>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+// compiled for sse4.2 function by function, used only if the cpu reports it
+#define ONION_CRC32C_SSE42
+#include <nmmintrin.h>
+#endif
+
+// reflected Castagnoli polynomial
+static const quint32 Crc32cPolynomial = 0x82F63B78;
+
+struct CrcTable {
+    quint32 entries[256];
+
+    CrcTable() {
+        for(quint32 i = 0; i < 256; i++) {
+            quint32 crc = i;
+            for(int bit = 0; bit < 8; bit++) {
+                crc = (crc >> 1) ^ (crc & 1 ? Crc32cPolynomial : 0);
+            }
+            entries[i] = crc;
+        }
+    }
+};
+
+static const quint32 *crcTable()
+{
+    // built once, thread safe, relay shards share it
+    static const CrcTable table;
+    return table.entries;
+}
+
+// raw crc state, without the pre and post inversion
+static quint32 crcSoftware(quint32 crc, const char *data, int size)
+{
+    const quint32 *table = crcTable();
+    for(int i = 0; i < size; i++) {
+        crc = table[(crc ^ (quint8)data[i]) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#ifdef ONION_CRC32C_SSE42
+__attribute__((target("sse4.2")))
+static quint32 crcHardware(quint32 crc, const char *data, int size)
+{
+    int i = 0;
+#ifdef __x86_64__
+    quint64 wide = crc;
+    for(; i + 8 <= size; i += 8) {
+        quint64 word;
+        memcpy(&word, data + i, 8);
+        wide = _mm_crc32_u64(wide, word);
+    }
+    crc = (quint32)wide;
+#endif
+    for(; i < size; i++) {
+        crc = _mm_crc32_u8(crc, (quint8)data[i]);
+    }
+    return crc;
+}
+
+static bool hasSse42()
+{
+    static const bool supported = __builtin_cpu_supports("sse4.2");
+    return supported;
+}
+#endif
+
+static quint32 crcUpdate(quint32 crc, const char *data, int size)
+{
+#ifdef ONION_CRC32C_SSE42
+    if(hasSse42()) {
+        return crcHardware(crc, data, size);
+    }
+#endif
+    return crcSoftware(crc, data, size);
+}
+
+bool CellDigest::accelerated()
+{
+#ifdef ONION_CRC32C_SSE42
+    return hasSse42();
+#else
+    return false;
+#endif
+}
+
+quint32 CellDigest::crc32c(const char *data, int size, quint32 crc)
+{
+    return ~crcUpdate(~crc, data, size);
+}
+
+static inline quint64 rotl(quint64 x, int b)
+{
+    return (x << b) | (x >> (64 - b));
+}
+
+#define SIPROUND \
+    do { \
+        v0 += v1; v1 = rotl(v1, 13); v1 ^= v0; v0 = rotl(v0, 32); \
+        v2 += v3; v3 = rotl(v3, 16); v3 ^= v2; \
+        v0 += v3; v3 = rotl(v3, 21); v3 ^= v0; \
+        v2 += v1; v1 = rotl(v1, 17); v1 ^= v2; v2 = rotl(v2, 32); \
+    } while(0)
+
+// SipHash-2-4 of size bytes at data
+static quint64 sipHash(const CellDigest::Key &key, const char *data, int size)
+{
+    quint64 v0 = 0x736f6d6570736575ULL ^ key.k0;
+    quint64 v1 = 0x646f72616e646f6dULL ^ key.k1;
+    quint64 v2 = 0x6c7967656e657261ULL ^ key.k0;
+    quint64 v3 = 0x7465646279746573ULL ^ key.k1;
+
+    int i = 0;
+    for(; i + 8 <= size; i += 8) {
+        quint64 m = qFromLittleEndian<quint64>(data + i);
+        v3 ^= m;
+        SIPROUND;
+        SIPROUND;
+        v0 ^= m;
+    }
+
+    quint64 last = (quint64)(size & 0xff) << 56;
+    for(int j = 0; i + j < size; j++) {
+        last |= (quint64)(quint8)data[i + j] << (8 * j);
+    }
+    v3 ^= last;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= last;
+
+    v2 ^= 0xff;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+#undef SIPROUND
+
+// raw crc state after the relay header, digest field as zero
+static quint32 headerCrc(const char *payload)
+{
+    static const char zeros[4] = { 0, 0, 0, 0 };
+    quint32 crc = crcUpdate(~0u, payload + CellView::CommandOffset, 1);
+    crc = crcUpdate(crc, zeros, sizeof(zeros));
+    return crcUpdate(crc, payload + CellView::StreamIdOffset, CellView::RelayHeaderLength - CellView::StreamIdOffset);
+}
+
+static quint32 finish(const CellDigest::Key &key, quint32 crc, int size)
+{
+    // the size goes in as well, so a payload cut short does not verify by chance
+    char block[8];
+    qToLittleEndian<quint32>(~crc, block);
+    qToLittleEndian<quint32>((quint32)size, block + 4);
+    return (quint32)sipHash(key, block, sizeof(block));
+}
+
+CellDigest::Key CellDigest::deriveKey(const QByteArray &handshake)
+{
+    // fixed domain keys, what differs per hop is the handshake
+    Key domain;
+    domain.k0 = 0x6f6e696f6e2d6469ULL;
+    domain.k1 = 0x676573742d6b6579ULL;
+
+    Key key;
+    key.k0 = sipHash(domain, handshake.constData(), handshake.size());
+    domain.k0 = ~domain.k0;
+    key.k1 = sipHash(domain, handshake.constData(), handshake.size());
+    return key;
+}
+
+quint32 CellDigest::compute(const Key &key, const char *payload, int size)
+{
+    Q_ASSERT(size >= CellView::RelayHeaderLength);
+    quint32 crc = headerCrc(payload);
+    crc = crcUpdate(crc, payload + CellView::RelayHeaderLength, size - CellView::RelayHeaderLength);
+    return finish(key, crc, size);
+}
+
+void CellDigest::seal(const Key &key, QByteArray *payload)
+{
+    if(!CellView::hasRelayHeader(*payload)) {
+        return;
+    }
+    quint32 digest = compute(key, payload->constData(), payload->size());
+    qToBigEndian<quint32>(digest, payload->data() + CellView::DigestOffset);
+}
+
+bool CellDigest::verify(const Key &key, const QByteArray &payload)
+{
+    if(!CellView::hasRelayHeader(payload)) {
+        return false;
+    }
+    return CellView::digest(payload) == compute(key, payload.constData(), payload.size());
+}
@@ -0,0 +1,41 @@
+#ifndef CELLDIGEST_H
+#define CELLDIGEST_H
+
+#include <QByteArray>
+#include <QtGlobal>
+
+// the digest in the relay header of a cell payload, see peertopeermessage.h. every hop of a
+// circuit has its own key, a hop knows a peeled payload is meant for it when the digest
+// verifies under its key. otherwise the payload is still encrypted for a later hop.
+//
+// CRC32C over the payload with the digest field taken as zero (SSE4.2 if the cpu has it),
+// finished with SipHash-2-4 under the hop key. it recognizes cells and tells hops apart,
+// it is no MAC: the crc is linear, integrity is up to the encryption in auth. the session
+// secret never leaves auth, keys come from the handshakes and whoever saw one has the key.
+// auth answers decrypts one at a time, so cells are verified one at a time as well
+class CellDigest
+{
+public:
+    struct Key {
+        quint64 k0 = 0;
+        quint64 k1 = 0;
+        bool operator ==(const Key &other) const { return k0 == other.k0 && k1 == other.k1; }
+    };
+
+    // key of a hop, from the handshake half it answered with in CREATED/RELAY_EXTENDED.
+    // both ends of the hop see that handshake
+    static Key deriveKey(const QByteArray &handshake);
+
+    // payload is a relay payload, at least CellView::RelayHeaderLength bytes
+    static quint32 compute(const Key &key, const char *payload, int size);
+    // writes the digest into the relay header of payload
+    static void seal(const Key &key, QByteArray *payload);
+    static bool verify(const Key &key, const QByteArray &payload);
+
+    // plain CRC32C (Castagnoli), continuing from crc
+    static quint32 crc32c(const char *data, int size, quint32 crc = 0);
+    // true if crc32c() runs on the SSE4.2 crc32 instruction
+    static bool accelerated();
+};
+
+#endif // CELLDIGEST_H
@@ -0,0 +1,190 @@
+#include "cellscheduler.h"
+
+#include <QtMath>
+
+CellScheduler::CellScheduler(QObject *parent) : QObject(parent), timer_(this)
+{
+    clock_.start();
+    timer_.setSingleShot(true);
+    timer_.setTimerType(Qt::PreciseTimer);
+    connect(&timer_, &QTimer::timeout, this, &CellScheduler::onTimer);
+}
+
+int CellScheduler::rate() const
+{
+    return rate_;
+}
+
+int CellScheduler::burst() const
+{
+    return burst_;
+}
+
+void CellScheduler::setRate(int cellsPerSecond, int burst)
+{
+    rate_ = qMax(0, cellsPerSecond);
+    burst_ = qMax(1, burst);
+}
+
+int CellScheduler::queueLimit() const
+{
+    return queueLimit_;
+}
+
+void CellScheduler::setQueueLimit(int cells)
+{
+    queueLimit_ = qMax(1, cells);
+}
+
+bool CellScheduler::enqueue(Endpoint neighbour, quint16 circuitId, CellBuffer cell, bool isCover)
+{
+    if(rate_ == 0) {
+        // unpaced
+        stats_.dispatched++;
+        emit dispatch(neighbour, std::move(cell), isCover);
+        return true;
+    }
+
+    qint64 now = clock_.nsecsElapsed();
+    bool known = neighbours_.contains(neighbour);
+    if(!known && neighbours_.size() >= expireAt_) {
+        expireIdle(now);
+    }
+    Neighbour &state = neighbours_[neighbour];
+    if(!known) {
+        // new neighbours start with a full bucket
+        state.to = neighbour;
+        state.tokens = burst_;
+        state.lastRefill = now;
+    }
+    refill(state, now);
+
+    if(state.queued == 0 && state.tokens >= 1) {
+        state.tokens -= 1;
+        stats_.dispatched++;
+        emit dispatch(neighbour, std::move(cell), isCover);
+        return true;
+    }
+
+    if(state.queued >= queueLimit_) {
+        stats_.dropped++;
+        return false;
+    }
+
+    CircuitQueue &queue = state.circuits[circuitId];
+    if(queue.isEmpty()) {
+        state.active.append(circuitId);
+    }
+    Pending pending;
+    pending.cell = std::move(cell);
+    pending.isCover = isCover;
+    queue.cells.append(std::move(pending));
+
+    state.queued++;
+    queued_++;
+    stats_.delayed++;
+    stats_.maxQueued = qMax(stats_.maxQueued, state.queued);
+    armTimer();
+    return true;
+}
+
+int CellScheduler::queued(Endpoint neighbour) const
+{
+    return neighbours_.value(neighbour).queued;
+}
+
+CellScheduler::Stats CellScheduler::stats() const
+{
+    Stats stats = stats_;
+    stats.queued = queued_;
+    stats.neighbours = neighbours_.size();
+    return stats;
+}
+
+void CellScheduler::onTimer()
+{
+    qint64 now = clock_.nsecsElapsed();
+    for(QHash<Endpoint, Neighbour>::iterator it = neighbours_.begin(); it != neighbours_.end(); ++it) {
+        if(it->queued > 0) {
+            refill(it.value(), now);
+            drain(it.value());
+        }
+    }
+    armTimer();
+}
+
+void CellScheduler::expireIdle(qint64 now)
+{
+    // nothing queued and a full bucket, the neighbour would start the same if it came back
+    for(QHash<Endpoint, Neighbour>::iterator it = neighbours_.begin(); it != neighbours_.end();) {
+        if(it->queued == 0) {
+            refill(it.value(), now);
+            if(it->tokens >= burst_) {
+                it = neighbours_.erase(it);
+                continue;
+            }
+        }
+        ++it;
+    }
+    // the next sweep once as many came again, every new neighbour pays for one sweep step
+    expireAt_ = 2 * neighbours_.size() > MinExpireAt ? 2 * neighbours_.size() : MinExpireAt;
+}
+
+void CellScheduler::refill(Neighbour &neighbour, qint64 now)
+{
+    double elapsed = (now - neighbour.lastRefill) / 1e9;
+    neighbour.tokens = qMin<double>(burst_, neighbour.tokens + elapsed * rate_);
+    neighbour.lastRefill = now;
+}
+
+void CellScheduler::drain(Neighbour &neighbour)
+{
+    while(neighbour.queued > 0 && neighbour.tokens >= 1) {
+        // next circuit in line, it goes to the back if it has more
+        quint16 circuitId = neighbour.active[neighbour.activeHead++];
+        CircuitQueue &queue = neighbour.circuits[circuitId];
+        Pending pending = queue.take();
+        if(queue.isEmpty()) {
+            neighbour.circuits.remove(circuitId);
+        } else {
+            neighbour.active.append(circuitId);
+        }
+
+        if(neighbour.activeHead == neighbour.active.size()) {
+            neighbour.active.resize(0);
+            neighbour.activeHead = 0;
+        } else if(neighbour.activeHead > 64 && neighbour.activeHead * 2 > neighbour.active.size()) {
+            neighbour.active.remove(0, neighbour.activeHead);
+            neighbour.activeHead = 0;
+        }
+
+        neighbour.tokens -= 1;
+        neighbour.queued--;
+        queued_--;
+        stats_.dispatched++;
+        emit dispatch(neighbour.to, std::move(pending.cell), pending.isCover);
+    }
+}
+
+void CellScheduler::armTimer()
+{
+    if(queued_ == 0 || timer_.isActive()) {
+        return;
+    }
+    // roughly when the next token is there
+    timer_.start(qMax(1, qCeil(1000.0 / rate_)));
+}
+
+CellScheduler::Pending CellScheduler::CircuitQueue::take()
+{
+    Pending pending = std::move(cells[head++]);
+    if(head == cells.size()) {
+        cells.resize(0);
+        head = 0;
+    } else if(head > 64 && head * 2 > cells.size()) {
+        // a circuit that never drains must not grow forever
+        cells.remove(0, head);
+        head = 0;
+    }
+    return pending;
+}
@@ -0,0 +1,99 @@
+#ifndef CELLSCHEDULER_H
+#define CELLSCHEDULER_H
+
+#include <QElapsedTimer>
+#include <QHash>
+#include <QObject>
+#include <QTimer>
+#include <QVector>
+
+#include "endpoint.h"
+#include "cellbuffer.h"
+
+// paces outgoing cells per neighbour and shares each neighbour's rate fairly among circuits.
+// every neighbour has a token bucket of burst() cells refilled at rate() cells per second.
+// cells that find the bucket empty wait in a queue per circuit, queues are served round
+// robin (deficit round robin with fixed size cells), so a bulk circuit cannot hold back
+// the few cells of an interactive one. with rate 0 cells are dispatched right away.
+class CellScheduler : public QObject
+{
+    Q_OBJECT
+public:
+    explicit CellScheduler(QObject *parent = 0);
+
+    struct Stats {
+        quint64 dispatched = 0;
+        quint64 delayed = 0; // had to wait for tokens
+        quint64 dropped = 0; // neighbour queue was full
+        int queued = 0;
+        int maxQueued = 0; // deepest a single neighbour's queue got
+        int neighbours = 0; // tracked right now, idle ones are forgotten
+    };
+
+    int rate() const;
+    int burst() const;
+    void setRate(int cellsPerSecond, int burst);
+
+    // cells that may wait per neighbour, beyond that new cells are dropped
+    int queueLimit() const;
+    void setQueueLimit(int cells);
+
+    // dispatches now or queues the cell. returns false if it was dropped
+    bool enqueue(Endpoint neighbour, quint16 circuitId, CellBuffer cell, bool isCover);
+
+    int queued(Endpoint neighbour) const;
+    Stats stats() const;
+
+signals:
+    void dispatch(Endpoint to, CellBuffer cell, bool isCover);
+
+private slots:
+    void onTimer();
+
+private:
+    struct Pending {
+        CellBuffer cell;
+        bool isCover = false;
+    };
+
+    // fifo of one circuit, popped from head, storage is reused once drained
+    struct CircuitQueue {
+        QVector<Pending> cells;
+        int head = 0;
+
+        bool isEmpty() const { return head == cells.size(); }
+        Pending take();
+    };
+
+    struct Neighbour {
+        Endpoint to;
+        double tokens = 0;
+        qint64 lastRefill = 0; // ns on clock_
+        QHash<quint16, CircuitQueue> circuits;
+        QVector<quint16> active; // circuits with queued cells, in round robin order
+        int activeHead = 0;
+        int queued = 0;
+    };
+
+    void refill(Neighbour &neighbour, qint64 now);
+    // forgets the neighbours that are as good as new
+    void expireIdle(qint64 now);
+    void drain(Neighbour &neighbour);
+    void armTimer();
+
+    int rate_ = 0;
+    int burst_ = 32;
+    int queueLimit_ = 1024;
+
+    QHash<Endpoint, Neighbour> neighbours_;
+    // idle neighbours are looked for when there are this many
+    static const int MinExpireAt = 256;
+    int expireAt_ = MinExpireAt;
+    int queued_ = 0;
+    Stats stats_;
+
+    QElapsedTimer clock_;
+    QTimer timer_;
+};
+
+#endif // CELLSCHEDULER_H
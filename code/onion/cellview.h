@@ -0,0 +1,54 @@
+#ifndef CELLVIEW_H
+#define CELLVIEW_H
+
+#include <QByteArray>
+#include "peertopeermessage.h"
+
+// non-owning view on the raw bytes of a cell, see the layout in peertopeermessage.h.
+// reads header fields in place, for classifying and relaying cells without decoding them.
+// the bytes must outlive the view.
+class CellView
+{
+public:
+    // cell header, unencrypted
+    static constexpr int CelltypeOffset = 0;
+    static constexpr int CircuitIdOffset = 1;
+    static constexpr int PayloadOffset = UNENCRYPTED_HEADER_LEN;
+    static constexpr int PayloadLength = MESSAGE_LENGTH - UNENCRYPTED_HEADER_LEN; // of a default size cell
+
+    // relay header, at the start of a decrypted payload
+    static constexpr int CommandOffset = 0;
+    static constexpr int DigestOffset = 1;
+    static constexpr int StreamIdOffset = 5;
+    static constexpr int RelayHeaderLength = 7;
+
+    CellView(const char *data, int size) : data_(data), size_(size) { }
+    explicit CellView(const QByteArray &cell) : data_(cell.constData()), size_(cell.size()) { }
+
+    // all accessors below need a valid cell
+    bool isValid() const { return data_ != nullptr && PeerToPeerMessage::cellSizeOf(size_) >= 0; }
+
+    PeerToPeerMessage::Celltype celltype() const {
+        return static_cast<PeerToPeerMessage::Celltype>((quint8)data_[CelltypeOffset]);
+    }
+    quint16 circuitId() const { return readU16(data_ + CircuitIdOffset); }
+
+    const char *payload() const { return data_ + PayloadOffset; }
+    int payloadLength() const { return size_ - PayloadOffset; }
+    QByteArray payloadView() const { return QByteArray::fromRawData(payload(), payloadLength()); }
+
+    // relay header fields of a payload as returned by auth
+    static bool hasRelayHeader(const QByteArray &payload) { return payload.size() >= RelayHeaderLength; }
+    static quint32 digest(const QByteArray &payload) {
+        const char *p = payload.constData() + DigestOffset;
+        return ((quint32)readU16(p) << 16) | readU16(p + 2);
+    }
+
+private:
+    static quint16 readU16(const char *p) { return ((quint8)p[0] << 8) | (quint8)p[1]; }
+
+    const char *data_;
+    int size_;
+};
+
+#endif // CELLVIEW_H
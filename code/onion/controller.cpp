@@ -58,43 +58,13 @@ bool Controller::start()
         p2pAddr.port = overridePort_;
     }
 
-    p2p_.setDebugLog(verbose_);
-    p2p_.setInterface(p2pAddr.address);
-    p2p_.setPort(p2pAddr.port);
-    p2p_.setNHops(2);
-
-    // connect to rps api
-    p2p_.setPeerSampler(rpsApiProxy_);
-
-    // connect to onion api
-    if(!marcoPolo()) {
-        connect(&onionApi_, &OnionApi::requestBuildTunnel, &p2p_, &PeerToPeer::buildTunnel);
-        connect(&onionApi_, &OnionApi::requestDestroyTunnel, &p2p_, &PeerToPeer::destroyTunnel);
-        connect(&onionApi_, &OnionApi::requestSendTunnel, &p2p_, &PeerToPeer::sendData);
-        connect(&onionApi_, &OnionApi::requestBuildCoverTunnel, &p2p_, &PeerToPeer::coverTunnel);
-        connect(&p2p_, &PeerToPeer::tunnelReady, &onionApi_, &OnionApi::sendTunnelReady);
-        connect(&p2p_, &PeerToPeer::tunnelIncoming, &onionApi_, &OnionApi::sendTunnelIncoming);
-        connect(&p2p_, &PeerToPeer::tunnelData, &onionApi_, &OnionApi::sendTunnelData);
-        connect(&p2p_, &PeerToPeer::tunnelError, &onionApi_, &OnionApi::sendTunnelError);
+    if(settings_.relayThreads() > 1) {
+        shardedP2p_ = new ShardedPeerToPeer(settings_.relayThreads(), this);
+        setupP2p(shardedP2p_, p2pAddr);
+    } else {
+        setupP2p(&p2p_, p2pAddr);
     }
 
-    // connect to oauth api
-    connect(oAuthApi_, &OAuthApi::recvSessionHS1, &p2p_, &PeerToPeer::onSessionHS1);
-    connect(oAuthApi_, &OAuthApi::recvSessionHS2, &p2p_, &PeerToPeer::onSessionHS2);
-    connect(oAuthApi_, &OAuthApi::recvEncrypted, &p2p_, &PeerToPeer::onEncrypted);
-    connect(oAuthApi_, &OAuthApi::recvDecrypted, &p2p_, &PeerToPeer::onDecrypted);
-
-    connect(&p2p_, &PeerToPeer::requestEncrypt, oAuthApi_, &OAuthApi::requestAuthCipherEncrypt);
-    connect(&p2p_, &PeerToPeer::requestDecrypt, oAuthApi_, &OAuthApi::requestAuthCipherDecrypt);
-    connect(&p2p_, &PeerToPeer::requestStartSession, oAuthApi_, &OAuthApi::requestAuthSessionStart);
-    connect(&p2p_, &PeerToPeer::sessionIncomingHS1, oAuthApi_, &OAuthApi::requestAuthSessionIncomingHS1);
-    connect(&p2p_, &PeerToPeer::sessionIncomingHS2, oAuthApi_, &OAuthApi::requestAuthSessionIncomingHS2);
-    connect(&p2p_, &PeerToPeer::requestEndSession, oAuthApi_, &OAuthApi::requestAuthSessionClose);
-    connect(&p2p_, &PeerToPeer::requestLayeredEncrypt, oAuthApi_, &OAuthApi::requestAuthLayerEncrypt);
-    connect(&p2p_, &PeerToPeer::requestLayeredDecrypt, oAuthApi_, &OAuthApi::requestAuthLayerDecrypt);
-
-    setupMarcoPolo();
-
 //    bool debugOnion = true;
 //    if(debugOnion) {
 //        connect(&onionApi_, &OnionApi::requestBuildCoverTunnel, [=](quint16 b) {
@@ -122,7 +92,8 @@ bool Controller::start()
         }
     }
 
-    if(p2p_.start()) {
+    bool p2pOk = shardedP2p_ ? shardedP2p_->start() : p2p_.start();
+    if(p2pOk) {
         qDebug() << "p2p running on" << settings_.p2pAddress().toString();
     } else {
         qDebug() << "could not start p2p";
@@ -171,7 +142,58 @@ void Controller::setVerbose(bool v)
     verbose_ = v;
 }
 
-void Controller::setupMarcoPolo()
+template<typename P2P>
+void Controller::setupP2p(P2P *p2p, Binding p2pAddr)
+{
+    p2p->setDebugLog(verbose_);
+    p2p->setInterface(p2pAddr.address);
+    p2p->setPort(p2pAddr.port);
+    p2p->setNHops(2);
+    p2p->setSocketBufferSizes(settings_.receiveBufferSize(), settings_.sendBufferSize());
+    p2p->setIoUring(settings_.ioUring());
+    p2p->setSegmentationOffload(settings_.segmentationOffload());
+    p2p->setCellPacking(settings_.cellPacking(), settings_.pathMtu());
+    p2p->setMaxCellSize(settings_.cellSize());
+    p2p->setNeighbourRate(settings_.neighbourRate(), settings_.neighbourBurst());
+    p2p->setCoalesceDelay(settings_.coalesceDelay());
+    p2p->setCompression(settings_.compressData());
+
+    // connect to rps api
+    p2p->setPeerSampler(rpsApiProxy_);
+
+    // connect to onion api
+    if(!marcoPolo()) {
+        connect(&onionApi_, &OnionApi::requestBuildTunnel, p2p, &P2P::buildTunnel);
+        connect(&onionApi_, &OnionApi::requestDestroyTunnel, p2p, &P2P::destroyTunnel);
+        connect(&onionApi_, &OnionApi::requestSendTunnel, p2p, &P2P::sendData);
+        connect(&onionApi_, &OnionApi::requestBuildCoverTunnel, p2p, &P2P::coverTunnel);
+        connect(p2p, &P2P::tunnelReady, &onionApi_, &OnionApi::sendTunnelReady);
+        connect(p2p, &P2P::tunnelIncoming, &onionApi_, &OnionApi::sendTunnelIncoming);
+        connect(p2p, &P2P::tunnelData, &onionApi_, &OnionApi::sendTunnelData);
+        connect(p2p, &P2P::tunnelError, &onionApi_, &OnionApi::sendTunnelError);
+    }
+
+    // connect to oauth api
+    connect(oAuthApi_, &OAuthApi::recvSessionHS1, p2p, &P2P::onSessionHS1);
+    connect(oAuthApi_, &OAuthApi::recvSessionHS2, p2p, &P2P::onSessionHS2);
+    connect(oAuthApi_, &OAuthApi::recvEncrypted, p2p, &P2P::onEncrypted);
+    connect(oAuthApi_, &OAuthApi::recvDecrypted, p2p, &P2P::onDecrypted);
+    connect(oAuthApi_, &OAuthApi::recvError, p2p, &P2P::onAuthError);
+
+    connect(p2p, &P2P::requestEncrypt, oAuthApi_, &OAuthApi::requestAuthCipherEncrypt);
+    connect(p2p, &P2P::requestDecrypt, oAuthApi_, &OAuthApi::requestAuthCipherDecrypt);
+    connect(p2p, &P2P::requestStartSession, oAuthApi_, &OAuthApi::requestAuthSessionStart);
+    connect(p2p, &P2P::sessionIncomingHS1, oAuthApi_, &OAuthApi::requestAuthSessionIncomingHS1);
+    connect(p2p, &P2P::sessionIncomingHS2, oAuthApi_, &OAuthApi::requestAuthSessionIncomingHS2);
+    connect(p2p, &P2P::requestEndSession, oAuthApi_, &OAuthApi::requestAuthSessionClose);
+    connect(p2p, &P2P::requestLayeredEncrypt, oAuthApi_, &OAuthApi::requestAuthLayerEncrypt);
+    connect(p2p, &P2P::requestLayeredDecrypt, oAuthApi_, &OAuthApi::requestAuthLayerDecrypt);
+
+    setupMarcoPolo(p2p);
+}
+
+template<typename P2P>
+void Controller::setupMarcoPolo(P2P *p2p)
 {
     if(marcoPolo()) {
         MarcoPolo *marcopolo = new MarcoPolo(this);
@@ -179,14 +201,14 @@ void Controller::setupMarcoPolo()
         marcopolo->setPolo(polo_);
 
         // marcopolo connects onionapi-lik
-        connect(marcopolo, &MarcoPolo::requestBuildTunnel, &p2p_, &PeerToPeer::buildTunnel);
-        connect(marcopolo, &MarcoPolo::requestDestroyTunnel, &p2p_, &PeerToPeer::destroyTunnel);
-        connect(marcopolo, &MarcoPolo::requestSendTunnel, &p2p_, &PeerToPeer::sendData);
-        connect(marcopolo, &MarcoPolo::requestBuildCoverTunnel, &p2p_, &PeerToPeer::coverTunnel);
-        connect(&p2p_, &PeerToPeer::tunnelReady, marcopolo, &MarcoPolo::onTunnelReady);
-        connect(&p2p_, &PeerToPeer::tunnelIncoming, marcopolo, &MarcoPolo::onTunnelIncoming);
-        connect(&p2p_, &PeerToPeer::tunnelData, marcopolo, &MarcoPolo::onTunnelData);
-        connect(&p2p_, &PeerToPeer::tunnelError, marcopolo, &MarcoPolo::onTunnelError);
+        connect(marcopolo, &MarcoPolo::requestBuildTunnel, p2p, &P2P::buildTunnel);
+        connect(marcopolo, &MarcoPolo::requestDestroyTunnel, p2p, &P2P::destroyTunnel);
+        connect(marcopolo, &MarcoPolo::requestSendTunnel, p2p, &P2P::sendData);
+        connect(marcopolo, &MarcoPolo::requestBuildCoverTunnel, p2p, &P2P::coverTunnel);
+        connect(p2p, &P2P::tunnelReady, marcopolo, &MarcoPolo::onTunnelReady);
+        connect(p2p, &P2P::tunnelIncoming, marcopolo, &MarcoPolo::onTunnelIncoming);
+        connect(p2p, &P2P::tunnelData, marcopolo, &MarcoPolo::onTunnelData);
+        connect(p2p, &P2P::tunnelError, marcopolo, &MarcoPolo::onTunnelError);
 
         marcopolo->start();
     }
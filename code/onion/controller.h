@@ -5,6 +5,7 @@
 #include <QTcpSocket>
 #include "onionapi.h"
 #include "peertopeer.h"
+#include "shardedpeertopeer.h"
 #include "settings.h"
 #include "oauthapi.h"
 #include "rpsapi.h"
@@ -27,12 +28,15 @@ public:
 private:
     bool mockRPS() const { return !mockPeers_.isEmpty(); }
     bool marcoPolo() const { return marco_.isValid() || polo_; }
-    void setupMarcoPolo();
+    // wires either p2p flavour to the apis, they share slot and signal names
+    template<typename P2P> void setupP2p(P2P *p2p, Binding p2pAddr);
+    template<typename P2P> void setupMarcoPolo(P2P *p2p);
 
     QByteArray readHostkey(QString file);
 
     OnionApi onionApi_;
     PeerToPeer p2p_;
+    ShardedPeerToPeer *shardedP2p_ = nullptr; // only with [onion]->relay_threads > 1
     RPSApi rpsApi_;
     OAuthApi *oAuthApi_ = nullptr;
 
@@ -0,0 +1,195 @@
+#include "datacompressor.h"
+
+#include <QtEndian>
+#include <cstring>
+
+// the LZ4 block format: sequences of
+// | token (1B) | [literal length] | literals | offset (2B LE) | [match length] |
+// the token holds the literal length and the match length - MinMatch in four bits each, 15
+// means more follows in bytes of 255 up to one that is less. the last sequence is literals
+// only and ends the block
+static const int SizeLength = 2;
+static const int MinMatch = 4;
+// the last five bytes are literals and no match starts in the last twelve, as LZ4 wants it
+static const int LastLiterals = 5;
+static const int MatchLimit = 12;
+static const int HashLog = 12;
+// after 2^SkipTrigger misses in a row the search takes larger steps, incompressible data
+// is through in a fraction of the time
+static const int SkipTrigger = 6;
+
+static inline quint32 read32(const uchar *p)
+{
+    quint32 value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline quint32 hash(quint32 sequence)
+{
+    // the multiplier of LZ4, the top bits are the best mixed
+    return (sequence * 2654435761U) >> (32 - HashLog);
+}
+
+static inline uchar *writeLength(uchar *out, int length)
+{
+    while(length >= 255) {
+        *out++ = 255;
+        length -= 255;
+    }
+    *out++ = length;
+    return out;
+}
+
+static inline uchar *writeLiterals(uchar *out, uchar *token, const uchar *literals, int length)
+{
+    if(length >= 15) {
+        *token = 15 << 4;
+        out = writeLength(out, length - 15);
+    } else {
+        *token = length << 4;
+    }
+    memcpy(out, literals, length);
+    return out + length;
+}
+
+// false if the length runs past end or gets absurd
+static inline bool readLength(const uchar **in, const uchar *end, int *length)
+{
+    quint8 byte;
+    do {
+        if(*in >= end || *length > DataCompressor::MaxSize) {
+            return false;
+        }
+        byte = *(*in)++;
+        *length += byte;
+    } while(byte == 255);
+    return true;
+}
+
+QByteArray DataCompressor::compress(const QByteArray &data)
+{
+    Q_ASSERT(data.size() <= MaxSize);
+    const int size = data.size();
+    const uchar *in = reinterpret_cast<const uchar *>(data.constData());
+
+    // all literals is the worst case
+    QByteArray compressed(SizeLength + 1 + size / 255 + 1 + size, Qt::Uninitialized);
+    qToBigEndian<quint16>(size, compressed.data());
+    uchar *out = reinterpret_cast<uchar *>(compressed.data()) + SizeLength;
+
+    int anchor = 0; // start of the literals not written yet
+    if(size > MatchLimit) {
+        // positions by hash of the four bytes there. 0 doubles as empty, candidates are checked anyway
+        quint16 table[1 << HashLog];
+        memset(table, 0, sizeof(table));
+
+        const int limit = size - MatchLimit;
+        int pos = 0;
+        int misses = 0;
+        while(pos < limit) {
+            const quint32 sequence = read32(in + pos);
+            const quint32 h = hash(sequence);
+            int candidate = table[h];
+            table[h] = pos;
+            if(candidate >= pos || read32(in + candidate) != sequence) {
+                pos += 1 + (misses++ >> SkipTrigger);
+                continue;
+            }
+            misses = 0;
+
+            // the match may start before the four bytes that found it
+            while(pos > anchor && candidate > 0 && in[pos - 1] == in[candidate - 1]) {
+                pos--;
+                candidate--;
+            }
+            int length = MinMatch;
+            while(pos + length < size - LastLiterals && in[pos + length] == in[candidate + length]) {
+                length++;
+            }
+
+            uchar *token = out++;
+            out = writeLiterals(out, token, in + anchor, pos - anchor);
+            const int offset = pos - candidate;
+            *out++ = offset & 0xFF;
+            *out++ = offset >> 8;
+            if(length - MinMatch >= 15) {
+                *token |= 15;
+                out = writeLength(out, length - MinMatch - 15);
+            } else {
+                *token |= length - MinMatch;
+            }
+
+            pos += length;
+            anchor = pos;
+        }
+    }
+
+    uchar *token = out++;
+    out = writeLiterals(out, token, in + anchor, size - anchor);
+    compressed.resize(out - reinterpret_cast<uchar *>(compressed.data()));
+    return compressed;
+}
+
+bool DataCompressor::decompress(const QByteArray &compressed, QByteArray *data)
+{
+    if(compressed.size() < SizeLength + 1) {
+        return false;
+    }
+    const int size = qFromBigEndian<quint16>(compressed.constData());
+    const uchar *in = reinterpret_cast<const uchar *>(compressed.constData()) + SizeLength;
+    const uchar *inEnd = reinterpret_cast<const uchar *>(compressed.constData()) + compressed.size();
+
+    data->resize(size);
+    uchar *begin = reinterpret_cast<uchar *>(data->data());
+    uchar *out = begin;
+    uchar *outEnd = begin + size;
+
+    while(true) {
+        if(in >= inEnd) {
+            return false;
+        }
+        const quint8 token = *in++;
+
+        int literals = token >> 4;
+        if(literals == 15 && !readLength(&in, inEnd, &literals)) {
+            return false;
+        }
+        if(literals > inEnd - in || literals > outEnd - out) {
+            return false;
+        }
+        memcpy(out, in, literals);
+        in += literals;
+        out += literals;
+        if(in == inEnd) {
+            // the last sequence has no match
+            break;
+        }
+
+        if(inEnd - in < 2) {
+            return false;
+        }
+        const int offset = in[0] | (in[1] << 8);
+        in += 2;
+        int length = token & 15;
+        if(length == 15 && !readLength(&in, inEnd, &length)) {
+            return false;
+        }
+        length += MinMatch;
+        if(offset == 0 || offset > out - begin || length > outEnd - out) {
+            return false;
+        }
+
+        const uchar *match = out - offset;
+        if(offset >= length) {
+            memcpy(out, match, length);
+        } else {
+            // overlapping, repeats the last offset bytes
+            for(int i = 0; i < length; i++) {
+                out[i] = match[i];
+            }
+        }
+        out += length;
+    }
+    return out == outEnd;
+}
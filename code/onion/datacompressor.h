@@ -0,0 +1,30 @@
+#ifndef DATACOMPRESSOR_H
+#define DATACOMPRESSOR_H
+
+#include <QByteArray>
+#include <QtGlobal>
+
+// fast compression of tunnel writes, see PeerToPeer::setCompression(). trades ratio for speed:
+// one greedy pass with a small hash table, no entropy coding. text and json shrink by about
+// half, data that does not compress is given up on quickly and costs little.
+//
+// | size (2B) | LZ4 block |
+// size is the length of the data, the block is in the LZ4 block format, so liblz4 can take
+// over either end. decompress() checks every length and offset against its input and the
+// size, anything off is rejected
+class DataCompressor
+{
+public:
+    // the size field is two bytes
+    static const int MaxSize = 0xFFFF;
+    // smaller data does not get any smaller
+    static const int MinSize = 32;
+
+    // data of up to MaxSize bytes, compressed. may be larger than data, it is up to the
+    // caller to send the smaller of both
+    static QByteArray compress(const QByteArray &data);
+    // false if compressed is not what compress() makes, data is undefined then
+    static bool decompress(const QByteArray &compressed, QByteArray *data);
+};
+
+#endif // DATACOMPRESSOR_H
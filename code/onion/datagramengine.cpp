@@ -0,0 +1,1086 @@
+#include "datagramengine.h"
+#include "peertopeermessage.h"
+
+#include <QNetworkDatagram>
+#include <QTimer>
+#include <QVarLengthArray>
+#include <cstring>
+
+#ifdef Q_OS_LINUX
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <sys/socket.h>
+#include <linux/filter.h>
+
+// a coalesced GRO buffer is at most a full udp datagram
+static const int GroSlotSize = 65536;
+
+static Endpoint fromSockaddr(const sockaddr_storage &storage)
+{
+    if(storage.ss_family == AF_INET) {
+        const sockaddr_in *in = reinterpret_cast<const sockaddr_in *>(&storage);
+        return Endpoint::fromIPv4(ntohl(in->sin_addr.s_addr), ntohs(in->sin_port));
+    }
+
+    if(storage.ss_family == AF_INET6) {
+        // v4 peers of a dual stack socket are ::ffff:a.b.c.d already, like Endpoint has them
+        const sockaddr_in6 *in6 = reinterpret_cast<const sockaddr_in6 *>(&storage);
+        return Endpoint::fromIPv6(in6->sin6_addr.s6_addr, ntohs(in6->sin6_port));
+    }
+
+    return Endpoint();
+}
+
+static socklen_t toSockaddr(const Endpoint &endpoint, int family, sockaddr_storage *storage)
+{
+    memset(storage, 0, sizeof(sockaddr_storage));
+
+    if(family == AF_INET) {
+        if(!endpoint.isIPv4()) {
+            return 0;
+        }
+        sockaddr_in *in = reinterpret_cast<sockaddr_in *>(storage);
+        in->sin_family = AF_INET;
+        in->sin_port = htons(endpoint.port);
+        in->sin_addr.s_addr = htonl(endpoint.ipv4());
+        return sizeof(sockaddr_in);
+    }
+
+    sockaddr_in6 *in6 = reinterpret_cast<sockaddr_in6 *>(storage);
+    in6->sin6_family = AF_INET6;
+    in6->sin6_port = htons(endpoint.port);
+    memcpy(in6->sin6_addr.s6_addr, endpoint.address, 16);
+    return sizeof(sockaddr_in6);
+}
+#endif
+
+// one GSO buffer carries at most this many datagrams (UDP_MAX_SEGMENTS is 64), and at most
+// this many bytes, below the 64k limit of a udp datagram
+static const int MaxSegments = 63;
+static const int MaxSegmentBytes = 65000;
+
+DatagramEngine::DatagramEngine(QObject *parent) : QObject(parent)
+#ifndef Q_OS_LINUX
+  , socket_(this)
+#endif
+{
+#ifndef Q_OS_LINUX
+    connect(&socket_, &QUdpSocket::readyRead, this, &DatagramEngine::readyRead);
+#endif
+}
+
+DatagramEngine::~DatagramEngine()
+{
+#ifdef Q_OS_LINUX
+    close();
+#endif
+    qDeleteAll(sizedPools_);
+}
+
+int DatagramEngine::batchSize() const
+{
+    return batchSize_;
+}
+
+void DatagramEngine::setBatchSize(int batchSize)
+{
+    batchSize_ = qMax(1, batchSize);
+}
+
+void DatagramEngine::setIoUring(bool ioUring)
+{
+    ioUring_ = ioUring;
+}
+
+void DatagramEngine::setSegmentationOffload(bool offload)
+{
+    offload_ = offload;
+}
+
+bool DatagramEngine::segmentationOffload() const
+{
+    return offload_;
+}
+
+void DatagramEngine::setMaxPackedCells(int cells)
+{
+    // a packed datagram has to stay below the 64k udp limit, like a GSO buffer
+    maxPacked_ = qBound(1, cells, MaxSegments);
+}
+
+int DatagramEngine::maxPackedCells() const
+{
+    return maxPacked_;
+}
+
+void DatagramEngine::setCellSizes(const QVector<int> &sizes)
+{
+    qDeleteAll(sizedPools_);
+    sizedPools_.clear();
+    maxCellSize_ = CELL_CAPACITY;
+    for(int size : sizes) {
+        if(size <= CELL_CAPACITY || size > MaxSegmentBytes || cellPool(size) != nullptr) {
+            continue;
+        }
+        // large cells are rare next to the standard ones, keep their slabs small
+        sizedPools_.append(new CellPool(32, size));
+        maxCellSize_ = qMax(maxCellSize_, size);
+    }
+}
+
+int DatagramEngine::maxCellSize() const
+{
+    return maxCellSize_;
+}
+
+void DatagramEngine::setPacking(Endpoint neighbour, int cells)
+{
+    cells = qBound(1, cells, maxPacked_);
+    if(cells > 1) {
+        packing_[neighbour] = cells;
+    } else {
+        packing_.remove(neighbour);
+    }
+
+    QHash<Endpoint, EgressQueue>::iterator it = egress_.find(neighbour);
+    if(it != egress_.end()) {
+        it->packing = cells;
+    }
+}
+
+int DatagramEngine::packing(Endpoint neighbour) const
+{
+    return packing_.value(neighbour, 1);
+}
+
+int DatagramEngine::packedCells(Endpoint sender, int size) const
+{
+    // anything else is passed on as is, and rejected for its size
+    const int capacity = CELL_CAPACITY;
+    if(size <= capacity || size % capacity != 0 || size / capacity > packing(sender)) {
+        return 1;
+    }
+    return size / capacity;
+}
+
+bool DatagramEngine::usesIoUring() const
+{
+#ifdef ONION_IO_URING
+    return uring_ != nullptr;
+#else
+    return false;
+#endif
+}
+
+DatagramEngine::Stats DatagramEngine::stats() const
+{
+    Stats stats = stats_;
+    stats.queuedDatagrams = queued_;
+    stats.egressQueues = egress_.size();
+    return stats;
+}
+
+QString DatagramEngine::errorString() const
+{
+    return errorString_;
+}
+
+void DatagramEngine::setSocketBufferSizes(int receive, int send)
+{
+    receiveBufferSize_ = qMax(0, receive);
+    sendBufferSize_ = qMax(0, send);
+}
+
+void DatagramEngine::setReusePort(bool reusePort)
+{
+    reusePort_ = reusePort;
+}
+
+int DatagramEngine::egressLimit() const
+{
+    return egressLimit_;
+}
+
+void DatagramEngine::setEgressLimit(int cells)
+{
+    egressLimit_ = qMax(1, cells);
+    spareRings_.clear();
+}
+
+bool DatagramEngine::send(Endpoint to, QByteArray data, bool cover)
+{
+    Outgoing item;
+    item.data = data;
+    item.cover = cover;
+    return enqueue(to, std::move(item));
+}
+
+bool DatagramEngine::send(Endpoint to, CellBuffer cell, bool cover)
+{
+    Outgoing item;
+    item.cell = std::move(cell);
+    item.cover = cover;
+    return enqueue(to, std::move(item));
+}
+
+int DatagramEngine::queueDepth(Endpoint to) const
+{
+    return egress_.value(to).count;
+}
+
+CellPool *DatagramEngine::cellPool(int cellSize)
+{
+    if(cellSize == CELL_CAPACITY) {
+        return &pool_;
+    }
+    for(CellPool *pool : sizedPools_) {
+        if(pool->cellSize() == cellSize) {
+            return pool;
+        }
+    }
+    return nullptr;
+}
+
+CellPool::Stats DatagramEngine::cellPoolStats() const
+{
+    return pool_.stats();
+}
+
+bool DatagramEngine::enqueue(Endpoint to, Outgoing item)
+{
+    EgressQueue &queue = egress_[to];
+    if(queue.ring.isEmpty()) {
+        queue.to = to;
+        if(!spareRings_.isEmpty()) {
+            queue.ring = spareRings_.takeLast();
+        } else {
+            queue.ring.resize(egressLimit_);
+        }
+        queue.packing = packing(to);
+    }
+
+    if(queue.count == queue.ring.size()) {
+        // full, make room by dropping cover traffic. real data is only dropped if there is none
+        if(item.cover || !queue.evictCover()) {
+            if(item.cover) {
+                stats_.droppedCover++;
+            } else {
+                stats_.droppedData++;
+            }
+            return false;
+        }
+        stats_.droppedCover++;
+        queued_--;
+    }
+
+    queue.push(std::move(item));
+    queued_++;
+    stats_.maxQueueDepth = qMax(stats_.maxQueueDepth, queue.count);
+
+    if(writeBlocked_) {
+        // onWritable() continues
+        return true;
+    }
+    // with GSO, wait for a full run before flushing early
+    if(queued_ >= (gso_ ? qMax(batchSize_, MaxSegments) : batchSize_)) {
+        flush();
+    } else {
+        scheduleFlush();
+    }
+    return true;
+}
+
+void DatagramEngine::EgressQueue::push(Outgoing item)
+{
+    at(count) = std::move(item);
+    count++;
+}
+
+void DatagramEngine::EgressQueue::popFront()
+{
+    ring[head] = Outgoing(); // lets go of the cell
+    head = (head + 1) % ring.size();
+    count--;
+}
+
+bool DatagramEngine::EgressQueue::evictCover()
+{
+    for(int i = 0; i < count; i++) {
+        if(at(i).cover) {
+            for(int j = i; j < count - 1; j++) {
+                at(j) = std::move(at(j + 1));
+            }
+            at(count - 1) = Outgoing();
+            count--;
+            return true;
+        }
+    }
+    return false;
+}
+
+void DatagramEngine::collectBatch(QVarLengthArray<BatchEntry, 64> *batch, int max, int runLength)
+{
+    // round by round, so the cells of one neighbour keep their order within the batch
+    batch->clear();
+    int total = 0;
+    bool found = true;
+    while(found && total < max) {
+        found = false;
+        for(QHash<Endpoint, EgressQueue>::iterator it = egress_.begin(); it != egress_.end() && total < max; ++it) {
+            EgressQueue &queue = it.value();
+            if(queue.batched == queue.count) {
+                continue;
+            }
+
+            int segment = queue.at(queue.batched).size();
+            int count = 1;
+            bool packed = false;
+            if(queue.packing > 1) {
+                // only full cells, the receiver tells them apart by the datagram size
+                while(segment == CELL_CAPACITY && count < queue.packing && total + count < max &&
+                      queue.batched + count < queue.count && queue.at(queue.batched + count).size() == segment) {
+                    count++;
+                }
+                packed = count > 1;
+            } else {
+                // a GSO buffer is cut into datagrams of the first one's size, only the last may be shorter
+                int last = segment, bytes = segment;
+                while(count < runLength && total + count < max && queue.batched + count < queue.count && last == segment) {
+                    int next = queue.at(queue.batched + count).size();
+                    if(next > segment || bytes + next > MaxSegmentBytes) {
+                        break;
+                    }
+                    last = next;
+                    bytes += next;
+                    count++;
+                }
+            }
+
+            BatchEntry entry;
+            entry.queue = &queue;
+            entry.depth = queue.batched;
+            entry.count = count;
+            entry.packed = packed;
+            batch->append(entry);
+            queue.batched += count;
+            total += count;
+            found = true;
+        }
+    }
+}
+
+void DatagramEngine::releaseBatch(const QVarLengthArray<BatchEntry, 64> &batch)
+{
+    // drained queues go, so egress_ only holds neighbours with something to send. a queue
+    // can be in the batch more than once, all of them are looked at before any goes
+    QVarLengthArray<Endpoint, 64> drained;
+    for(const BatchEntry &entry : batch) {
+        entry.queue->batched = 0;
+        if(entry.queue->count == 0) {
+            drained.append(entry.queue->to);
+        }
+    }
+    for(const Endpoint &to : drained) {
+        removeQueue(to);
+    }
+}
+
+void DatagramEngine::removeQueue(const Endpoint &to)
+{
+    QHash<Endpoint, EgressQueue>::iterator it = egress_.find(to);
+    if(it == egress_.end()) {
+        return;
+    }
+    // the slots are empty again, popFront() let go of the cells
+    if(spareRings_.size() < MaxSpareRings) {
+        spareRings_.append(std::move(it->ring));
+    }
+    egress_.erase(it);
+}
+
+void DatagramEngine::dropQueued()
+{
+    for(QHash<Endpoint, EgressQueue>::iterator it = egress_.begin(); it != egress_.end(); ++it) {
+        while(it->count > 0) {
+            it->popFront();
+        }
+        if(spareRings_.size() < MaxSpareRings) {
+            spareRings_.append(std::move(it->ring));
+        }
+    }
+    egress_.clear();
+    queued_ = 0;
+}
+
+void DatagramEngine::onWritable()
+{
+#ifdef Q_OS_LINUX
+    writeNotifier_->setEnabled(false);
+#endif
+    writeBlocked_ = false;
+    flush();
+}
+
+void DatagramEngine::scheduleFlush()
+{
+    if(flushScheduled_) {
+        return;
+    }
+
+    // everything queued until the event loop comes around again goes out in one batch
+    flushScheduled_ = true;
+    QTimer::singleShot(0, this, &DatagramEngine::flush);
+}
+
+#ifdef Q_OS_LINUX
+
+bool DatagramEngine::bind(quint16 port)
+{
+    close();
+
+    family_ = AF_INET6;
+    fd_ = ::socket(AF_INET6, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(fd_ == -1) {
+        family_ = AF_INET;
+        fd_ = ::socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    }
+    if(fd_ == -1) {
+        errorString_ = QString("socket: %1").arg(strerror(errno));
+        return false;
+    }
+
+    if(reusePort_) {
+        int on = 1;
+        if(setsockopt(fd_, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == -1) {
+            errorString_ = QString("SO_REUSEPORT: %1").arg(strerror(errno));
+            close();
+            return false;
+        }
+    }
+
+    // the *FORCE variants may exceed rmem_max/wmem_max, but need CAP_NET_ADMIN
+    if(receiveBufferSize_ > 0 &&
+            setsockopt(fd_, SOL_SOCKET, SO_RCVBUFFORCE, &receiveBufferSize_, sizeof(int)) == -1 &&
+            setsockopt(fd_, SOL_SOCKET, SO_RCVBUF, &receiveBufferSize_, sizeof(int)) == -1) {
+        qDebug() << "DatagramEngine: could not set SO_RCVBUF:" << strerror(errno);
+    }
+    if(sendBufferSize_ > 0 &&
+            setsockopt(fd_, SOL_SOCKET, SO_SNDBUFFORCE, &sendBufferSize_, sizeof(int)) == -1 &&
+            setsockopt(fd_, SOL_SOCKET, SO_SNDBUF, &sendBufferSize_, sizeof(int)) == -1) {
+        qDebug() << "DatagramEngine: could not set SO_SNDBUF:" << strerror(errno);
+    }
+
+    // every datagram then carries the socket's drop counter
+    int on = 1;
+    if(setsockopt(fd_, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof(on)) == -1) {
+        qDebug() << "DatagramEngine: SO_RXQ_OVFL unavailable, kernel drops are not counted";
+    }
+
+    sockaddr_storage addr;
+    memset(&addr, 0, sizeof(addr));
+    socklen_t addrLen;
+    if(family_ == AF_INET6) {
+        int off = 0;
+        setsockopt(fd_, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+        sockaddr_in6 *in6 = reinterpret_cast<sockaddr_in6 *>(&addr);
+        in6->sin6_family = AF_INET6;
+        in6->sin6_addr = in6addr_any;
+        in6->sin6_port = htons(port);
+        addrLen = sizeof(sockaddr_in6);
+    } else {
+        sockaddr_in *in = reinterpret_cast<sockaddr_in *>(&addr);
+        in->sin_family = AF_INET;
+        in->sin_addr.s_addr = htonl(INADDR_ANY);
+        in->sin_port = htons(port);
+        addrLen = sizeof(sockaddr_in);
+    }
+
+    if(::bind(fd_, reinterpret_cast<sockaddr *>(&addr), addrLen) == -1) {
+        errorString_ = QString("bind: %1").arg(strerror(errno));
+        close();
+        return false;
+    }
+
+    addrLen = sizeof(addr);
+    getsockname(fd_, reinterpret_cast<sockaddr *>(&addr), &addrLen);
+    localPort_ = fromSockaddr(addr).port;
+
+    int readFd = fd_;
+#ifdef ONION_IO_URING
+    if(ioUring_) {
+        // room for the largest packed datagram or cell and the SO_RXQ_OVFL counter in every ring buffer
+        const int uringBuffers = 256;
+        uring_ = new UringReceiver();
+        if(uring_->open(fd_, uringBuffers, qMax(maxPacked_ * CELL_CAPACITY, maxCellSize_), CMSG_SPACE(sizeof(quint32)))) {
+            readFd = uring_->eventFd();
+        } else {
+            qDebug() << "DatagramEngine: io_uring unavailable, using recvmmsg:" << uring_->errorString();
+            delete uring_;
+            uring_ = nullptr;
+        }
+    }
+#else
+    if(ioUring_) {
+        qDebug() << "DatagramEngine: built without io_uring support, using recvmmsg";
+    }
+#endif
+
+    if(offload_) {
+        // the kernel checks GSO per send, a rejected send turns it off again
+        gso_ = true;
+        int on = 1;
+        if(usesIoUring()) {
+            qDebug() << "DatagramEngine: UDP_GRO is not used with io_uring";
+        } else if(setsockopt(fd_, SOL_UDP, UDP_GRO, &on, sizeof(on)) == 0) {
+            gro_ = true;
+            groBuffer_.resize(batchSize_ * GroSlotSize);
+        } else {
+            qDebug() << "DatagramEngine: UDP_GRO unavailable:" << strerror(errno);
+        }
+    }
+
+    if(!usesIoUring() && !gro_) {
+        receiveCells_.resize(batchSize_ * maxPacked_);
+        for(CellBuffer &cell : receiveCells_) {
+            if(cell.isNull()) {
+                cell = pool_.acquire();
+            }
+        }
+        overflowSize_ = qMax(0, maxCellSize_ - maxPacked_ * CELL_CAPACITY);
+        overflow_.resize(batchSize_ * overflowSize_);
+    }
+
+    readNotifier_ = new QSocketNotifier(readFd, QSocketNotifier::Read, this);
+    connect(readNotifier_, &QSocketNotifier::activated, this, &DatagramEngine::readyRead);
+    writeNotifier_ = new QSocketNotifier(fd_, QSocketNotifier::Write, this);
+    writeNotifier_->setEnabled(false);
+    connect(writeNotifier_, &QSocketNotifier::activated, this, &DatagramEngine::onWritable);
+    return true;
+}
+
+bool DatagramEngine::isBound() const
+{
+    return fd_ != -1;
+}
+
+bool DatagramEngine::setShardSteering(int count)
+{
+    if(fd_ == -1 || !reusePort_ || count < 1) {
+        return false;
+    }
+
+    // the program runs on the udp payload: A = circ_id (bytes 1-2), return A % count.
+    // datagrams too short for the load end up at socket 0, which rejects them
+    sock_filter code[] = {
+        BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 1),
+        BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, (quint32)count),
+        BPF_STMT(BPF_RET | BPF_A, 0)
+    };
+    sock_fprog program;
+    program.len = sizeof(code) / sizeof(code[0]);
+    program.filter = code;
+
+    if(setsockopt(fd_, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &program, sizeof(program)) == -1) {
+        errorString_ = QString("SO_ATTACH_REUSEPORT_CBPF: %1").arg(strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+quint16 DatagramEngine::localPort() const
+{
+    return localPort_;
+}
+
+int DatagramEngine::receiveBufferSize() const
+{
+    int size = 0;
+    socklen_t len = sizeof(size);
+    if(fd_ == -1 || getsockopt(fd_, SOL_SOCKET, SO_RCVBUF, &size, &len) == -1) {
+        return 0;
+    }
+    return size;
+}
+
+int DatagramEngine::sendBufferSize() const
+{
+    int size = 0;
+    socklen_t len = sizeof(size);
+    if(fd_ == -1 || getsockopt(fd_, SOL_SOCKET, SO_SNDBUF, &size, &len) == -1) {
+        return 0;
+    }
+    return size;
+}
+
+void DatagramEngine::close()
+{
+    delete readNotifier_;
+    readNotifier_ = nullptr;
+    delete writeNotifier_;
+    writeNotifier_ = nullptr;
+    writeBlocked_ = false;
+    gso_ = false;
+    gro_ = false;
+#ifdef ONION_IO_URING
+    // before the socket, the ring has a receive pending on it
+    delete uring_;
+    uring_ = nullptr;
+#endif
+    if(fd_ != -1) {
+        ::close(fd_);
+        fd_ = -1;
+    }
+}
+
+int DatagramEngine::receive(QVector<Datagram> *out)
+{
+    out->resize(0); // keeps the capacity, drops the cells of the last batch
+    if(fd_ == -1) {
+        return 0;
+    }
+#ifdef ONION_IO_URING
+    if(uring_ != nullptr) {
+        return receiveUring(out);
+    }
+#endif
+
+    // without GRO, a packed datagram is scattered straight into maxPacked_ cells. a large cell
+    // spills over into the overflow of the slot if they are not enough
+    const int slotCells = gro_ ? 1 : maxPacked_;
+    const int slotIovecs = gro_ ? 1 : slotCells + (overflowSize_ > 0);
+    QVarLengthArray<mmsghdr, 64> headers(batchSize_);
+    QVarLengthArray<iovec, 64> iovecs(batchSize_ * slotIovecs);
+    QVarLengthArray<sockaddr_storage, 64> addresses(batchSize_);
+    // room for the SO_RXQ_OVFL counter and the GRO segment size
+    const int controlSize = CMSG_SPACE(sizeof(quint32)) + CMSG_SPACE(sizeof(int));
+    QVarLengthArray<char, 64 * (CMSG_SPACE(sizeof(quint32)) + CMSG_SPACE(sizeof(int)))> control(batchSize_ * controlSize);
+
+    for(int i = 0; i < batchSize_; i++) {
+        if(gro_) {
+            iovecs[i].iov_base = groBuffer_.data() + i * GroSlotSize;
+            iovecs[i].iov_len = GroSlotSize;
+        } else {
+            for(int j = 0; j < slotCells; j++) {
+                iovecs[i * slotIovecs + j].iov_base = receiveCells_[i * slotCells + j].data();
+                iovecs[i * slotIovecs + j].iov_len = CELL_CAPACITY;
+            }
+            if(overflowSize_ > 0) {
+                iovecs[i * slotIovecs + slotCells].iov_base = overflow_.data() + i * overflowSize_;
+                iovecs[i * slotIovecs + slotCells].iov_len = overflowSize_;
+            }
+        }
+        memset(&headers[i], 0, sizeof(mmsghdr));
+        headers[i].msg_hdr.msg_name = &addresses[i];
+        headers[i].msg_hdr.msg_namelen = sizeof(sockaddr_storage);
+        headers[i].msg_hdr.msg_iov = &iovecs[i * slotIovecs];
+        headers[i].msg_hdr.msg_iovlen = slotIovecs;
+        headers[i].msg_hdr.msg_control = control.data() + i * controlSize;
+        headers[i].msg_hdr.msg_controllen = controlSize;
+    }
+
+    // MSG_TRUNC: msg_len reports the real datagram size, even if it did not fit the slot
+    int n = recvmmsg(fd_, headers.data(), batchSize_, MSG_TRUNC, nullptr);
+    if(n <= 0) {
+        if(n == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            qDebug() << "recvmmsg failed:" << strerror(errno);
+        }
+        return 0;
+    }
+
+    if(!gro_) {
+        for(int i = 0; i < n; i++) {
+            Endpoint sender = fromSockaddr(addresses[i]);
+            int size = headers[i].msg_len;
+            CellPool *sized = size > CELL_CAPACITY ? cellPool(size) : nullptr;
+            if(sized != nullptr) {
+                // a large cell, gather it from the cells of the slot and its overflow
+                Datagram datagram;
+                datagram.sender = sender;
+                datagram.size = size;
+                datagram.cell = sized->acquire();
+                int copied = 0;
+                for(int j = 0; j < slotCells && copied < size; j++) {
+                    int length = qMin(CELL_CAPACITY, size - copied);
+                    memcpy(datagram.cell.data() + copied, receiveCells_[i * slotCells + j].constData(), length);
+                    copied += length;
+                }
+                memcpy(datagram.cell.data() + copied, overflow_.constData() + i * overflowSize_, size - copied);
+                out->append(std::move(datagram));
+                readControl(&headers[i].msg_hdr);
+                continue;
+            }
+
+            int cells = packedCells(sender, size);
+            if(cells > 1) {
+                stats_.packedReceives++;
+            }
+            for(int j = 0; j < cells; j++) {
+                // hand the filled cells over, the slot gets fresh ones from the pool
+                CellBuffer &slot = receiveCells_[i * slotCells + j];
+                Datagram datagram;
+                datagram.sender = sender;
+                datagram.size = cells > 1 ? CELL_CAPACITY : size;
+                datagram.cell = std::move(slot);
+                slot = pool_.acquire();
+                out->append(std::move(datagram));
+            }
+            readControl(&headers[i].msg_hdr);
+        }
+    } else {
+        for(int i = 0; i < n; i++) {
+            int size = headers[i].msg_len;
+            int segment = readControl(&headers[i].msg_hdr);
+            splitReceived(fromSockaddr(addresses[i]), groBuffer_.constData() + i * GroSlotSize,
+                          size, qMin(size, GroSlotSize), segment, out);
+        }
+    }
+
+    stats_.receiveCalls++;
+    stats_.receivedDatagrams += out->size();
+    stats_.maxReceiveBatch = qMax(stats_.maxReceiveBatch, out->size());
+    return out->size();
+}
+
+int DatagramEngine::readControl(msghdr *header)
+{
+    int segment = 0;
+    for(cmsghdr *cmsg = CMSG_FIRSTHDR(header); cmsg != nullptr; cmsg = CMSG_NXTHDR(header, cmsg)) {
+        if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL) {
+            // cumulative, keep the newest value
+            quint32 drops;
+            memcpy(&drops, CMSG_DATA(cmsg), sizeof(drops));
+            if(drops > stats_.kernelDrops) {
+                stats_.kernelDrops = drops;
+            }
+        } else if(cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+            memcpy(&segment, CMSG_DATA(cmsg), sizeof(segment));
+        }
+    }
+    return segment;
+}
+
+void DatagramEngine::splitReceived(Endpoint sender, const char *data, int size, int received, int segment,
+                                   QVector<Datagram> *out)
+{
+    // a coalesced buffer holds datagrams of segment bytes, only the last may be shorter
+    if(segment > 0 && segment < size) {
+        stats_.coalescedReceives++;
+    } else {
+        segment = qMax(size, 1);
+    }
+
+    const int capacity = CELL_CAPACITY;
+    int offset = 0;
+    do {
+        int length = qMin(segment, size - offset);
+        CellPool *sized = length > capacity ? cellPool(length) : nullptr;
+        int cells = sized != nullptr ? 1 : packedCells(sender, length);
+        if(cells > 1) {
+            stats_.packedReceives++;
+        }
+        for(int j = 0; j < cells; j++) {
+            int start = offset + j * capacity;
+            Datagram datagram;
+            datagram.sender = sender;
+            datagram.size = cells > 1 ? capacity : length;
+            datagram.cell = sized != nullptr ? sized->acquire() : pool_.acquire();
+            memcpy(datagram.cell.data(), data + start, qBound(0, received - start, qMin(datagram.size, datagram.cell.capacity())));
+            out->append(std::move(datagram));
+        }
+        offset += segment;
+    } while(offset < size);
+}
+
+#ifdef ONION_IO_URING
+int DatagramEngine::receiveUring(QVector<Datagram> *out)
+{
+    uring_->clearEvent();
+
+    // the ring buffers go straight back to the kernel, so the payload is copied into a cell
+    UringReceiver::Message message;
+    int datagrams = 0;
+    while(datagrams < batchSize_ && uring_->next(&message)) {
+        msghdr header;
+        memset(&header, 0, sizeof(header));
+        header.msg_control = message.control;
+        header.msg_controllen = message.controlLength;
+        readControl(&header);
+
+        Endpoint sender = fromSockaddr(*reinterpret_cast<const sockaddr_storage *>(message.name));
+        splitReceived(sender, message.payload, message.size, message.received, 0, out);
+        uring_->recycle(message);
+        datagrams++;
+    }
+    uring_->finish();
+
+    int n = out->size();
+    if(n > 0) {
+        stats_.receiveCalls++;
+        stats_.receivedDatagrams += n;
+        stats_.maxReceiveBatch = qMax(stats_.maxReceiveBatch, n);
+    }
+    return n;
+}
+#endif
+
+void DatagramEngine::flush()
+{
+    flushScheduled_ = false;
+    if(queued_ == 0 || writeBlocked_) {
+        return;
+    }
+
+    if(fd_ == -1) {
+        qDebug() << "DatagramEngine: dropping" << queued_ << "datagrams, socket is not bound";
+        stats_.sendErrors += queued_;
+        dropQueued();
+        return;
+    }
+
+    // datagrams per round, UIO_MAXIOV caps a single sendmmsg
+    const int maxBatch = 1024;
+    const int controlSize = CMSG_SPACE(sizeof(quint16));
+    QVarLengthArray<BatchEntry, 64> batch;
+    QVarLengthArray<mmsghdr, 64> headers;
+    QVarLengthArray<iovec, 64> iovecs;
+    QVarLengthArray<sockaddr_storage, 64> addresses;
+    QVarLengthArray<char, 64 * CMSG_SPACE(sizeof(quint16))> control;
+
+    while(queued_ > 0) {
+        collectBatch(&batch, maxBatch, gso_ ? MaxSegments : 1);
+        int count = batch.size();
+        int datagrams = 0;
+        for(const BatchEntry &entry : batch) {
+            datagrams += entry.count;
+        }
+        headers.resize(count);
+        iovecs.resize(datagrams);
+        addresses.resize(count);
+        control.resize(count * controlSize);
+
+        int iov = 0;
+        for(int i = 0; i < count; i++) {
+            const BatchEntry &entry = batch[i];
+            msghdr &header = headers[i].msg_hdr;
+            memset(&headers[i], 0, sizeof(mmsghdr));
+            header.msg_name = &addresses[i];
+            header.msg_namelen = toSockaddr(entry.queue->to, family_, &addresses[i]);
+            header.msg_iov = &iovecs[iov];
+            header.msg_iovlen = entry.count;
+
+            for(int j = 0; j < entry.count; j++) {
+                Outgoing &item = entry.queue->at(entry.depth + j);
+                if(!item.cell.isNull()) {
+                    iovecs[iov].iov_base = item.cell.data();
+                    iovecs[iov].iov_len = item.cell.capacity();
+                } else {
+                    iovecs[iov].iov_base = item.data.data();
+                    iovecs[iov].iov_len = item.data.size();
+                }
+                iov++;
+            }
+
+            if(entry.count > 1 && !entry.packed) {
+                // the kernel cuts the buffer into datagrams of the first one's size
+                header.msg_control = control.data() + i * controlSize;
+                header.msg_controllen = controlSize;
+                cmsghdr *cmsg = CMSG_FIRSTHDR(&header);
+                cmsg->cmsg_level = SOL_UDP;
+                cmsg->cmsg_type = UDP_SEGMENT;
+                cmsg->cmsg_len = CMSG_LEN(sizeof(quint16));
+                quint16 segment = (quint16)entry.queue->at(entry.depth).size();
+                memcpy(CMSG_DATA(cmsg), &segment, sizeof(segment));
+            }
+        }
+
+        int done = 0, failed = 0;
+        bool blocked = false;
+        while(done < count) {
+            int n = sendmmsg(fd_, headers.data() + done, count - done, 0);
+            if(n > 0) {
+                done += n;
+                continue;
+            }
+
+            if(errno == EAGAIN || errno == EWOULDBLOCK) {
+                // socket buffer is full, keep the rest queued until we can write again
+                blocked = true;
+                break;
+            }
+
+            if(batch[done].packed && errno == EMSGSIZE) {
+                // the path mtu is smaller than negotiated, send single cells to this neighbour
+                EgressQueue *queue = batch[done].queue;
+                qDebug() << "DatagramEngine: packed datagram to" << queue->to.toString()
+                         << "too large, no more packing:" << strerror(errno);
+                setPacking(queue->to, 1);
+                break;
+            }
+
+            if(batch[done].count > 1 && !batch[done].packed && (errno == EIO || errno == EINVAL)) {
+                // no GSO for this socket or route, e.g. no checksum offload. the next round
+                // sends the rest one by one
+                qDebug() << "DatagramEngine: UDP_SEGMENT rejected, sending without GSO:" << strerror(errno);
+                gso_ = false;
+                break;
+            }
+
+            // only the first message failed, e.g. unreachable peer. skip it and go on
+            qDebug() << "DatagramEngine: send to" << batch[done].queue->to.toString() << "failed:" << strerror(errno);
+            failed += batch[done].count;
+            done++;
+        }
+
+        // sent messages are a prefix of every queue, in batch order
+        int sent = 0;
+        for(int i = 0; i < done; i++) {
+            for(int j = 0; j < batch[i].count; j++) {
+                batch[i].queue->popFront();
+            }
+            if(batch[i].packed) {
+                stats_.packedSends++;
+            } else if(batch[i].count > 1) {
+                stats_.offloadedSends++;
+            }
+            sent += batch[i].count;
+        }
+        releaseBatch(batch);
+        queued_ -= sent;
+
+        stats_.sendCalls++;
+        stats_.sentDatagrams += sent - failed;
+        stats_.sendErrors += failed;
+        stats_.maxSendBatch = qMax(stats_.maxSendBatch, sent);
+
+        if(blocked) {
+            stats_.writeBlocked++;
+            writeBlocked_ = true;
+            writeNotifier_->setEnabled(true);
+            return;
+        }
+    }
+}
+
+#else
+
+bool DatagramEngine::bind(quint16 port)
+{
+    bool ok = socket_.bind(port);
+    if(!ok) {
+        errorString_ = socket_.errorString();
+        return false;
+    }
+
+    if(receiveBufferSize_ > 0) {
+        socket_.setSocketOption(QAbstractSocket::ReceiveBufferSizeSocketOption, receiveBufferSize_);
+    }
+    if(sendBufferSize_ > 0) {
+        socket_.setSocketOption(QAbstractSocket::SendBufferSizeSocketOption, sendBufferSize_);
+    }
+    if(offload_) {
+        qDebug() << "DatagramEngine: segmentation offload is linux only";
+    }
+    if(maxPacked_ > 1) {
+        qDebug() << "DatagramEngine: packing several cells per datagram is linux only";
+        maxPacked_ = 1;
+    }
+    return true;
+}
+
+bool DatagramEngine::isBound() const
+{
+    return socket_.state() == QAbstractSocket::BoundState;
+}
+
+bool DatagramEngine::setShardSteering(int count)
+{
+    Q_UNUSED(count);
+    errorString_ = "shard steering needs SO_ATTACH_REUSEPORT_CBPF (linux)";
+    return false;
+}
+
+quint16 DatagramEngine::localPort() const
+{
+    return socket_.localPort();
+}
+
+int DatagramEngine::receiveBufferSize() const
+{
+    return const_cast<QUdpSocket &>(socket_).socketOption(QAbstractSocket::ReceiveBufferSizeSocketOption).toInt();
+}
+
+int DatagramEngine::sendBufferSize() const
+{
+    return const_cast<QUdpSocket &>(socket_).socketOption(QAbstractSocket::SendBufferSizeSocketOption).toInt();
+}
+
+int DatagramEngine::receive(QVector<Datagram> *out)
+{
+    out->resize(0);
+    while(out->size() < batchSize_ && socket_.hasPendingDatagrams()) {
+        Datagram d;
+        d.size = (int)socket_.pendingDatagramSize();
+        CellPool *sized = d.size > CELL_CAPACITY ? cellPool(d.size) : nullptr;
+        d.cell = sized != nullptr ? sized->acquire() : pool_.acquire();
+        QHostAddress address;
+        quint16 port = 0;
+        if(socket_.readDatagram(d.cell.data(), d.cell.capacity(), &address, &port) == -1) {
+            qDebug() << "error receiving p2p datagram." << socket_.error() << socket_.errorString();
+            continue;
+        }
+
+        d.sender = Endpoint(address, port);
+        out->append(d);
+    }
+
+    if(!out->isEmpty()) {
+        stats_.receiveCalls++;
+        stats_.receivedDatagrams += out->size();
+        stats_.maxReceiveBatch = qMax(stats_.maxReceiveBatch, out->size());
+    }
+    return out->size();
+}
+
+void DatagramEngine::flush()
+{
+    flushScheduled_ = false;
+    if(queued_ == 0 || writeBlocked_) {
+        return;
+    }
+
+    QVarLengthArray<BatchEntry, 64> batch;
+    collectBatch(&batch, queued_);
+
+    int done = 0, failed = 0;
+    for(const BatchEntry &entry : batch) {
+        EgressQueue *queue = entry.queue;
+        const Outgoing &item = queue->at(0); // earlier ones of this queue are popped already
+        QByteArray data = item.cell.isNull() ? item.data : item.cell.bytes();
+        if(socket_.writeDatagram(data, queue->to.hostAddress(), queue->to.port) == -1) {
+            if(socket_.error() == QAbstractSocket::TemporaryError) {
+                // no writability signal for udp, poll again shortly
+                stats_.writeBlocked++;
+                writeBlocked_ = true;
+                QTimer::singleShot(1, this, &DatagramEngine::onWritable);
+                break;
+            }
+            qDebug() << "DatagramEngine: send to" << queue->to.toString() << "failed:" << socket_.errorString();
+            failed++;
+        }
+        queue->popFront();
+        done++;
+    }
+    releaseBatch(batch);
+    queued_ -= done;
+
+    stats_.sendCalls++;
+    stats_.sentDatagrams += done - failed;
+    stats_.sendErrors += failed;
+    stats_.maxSendBatch = qMax(stats_.maxSendBatch, done);
+}
+
+#endif
@@ -0,0 +1,261 @@
+#ifndef DATAGRAMENGINE_H
+#define DATAGRAMENGINE_H
+
+#include <QObject>
+#include <QSocketNotifier>
+#include <QUdpSocket>
+#include <QVarLengthArray>
+#include <QVector>
+
+#include "endpoint.h"
+#include "cellbuffer.h"
+#include "uringreceiver.h"
+
+#ifdef Q_OS_LINUX
+struct msghdr;
+#endif
+
+// batched UDP transport for p2p cells.
+// on linux, every wakeup receives up to batchSize() datagrams with a single recvmmsg into
+// preallocated buffers, and datagrams queued with send() during one event loop iteration
+// go out with a single sendmmsg. other platforms fall back to QUdpSocket.
+// datagrams are received straight into pooled cells, see cellPool().
+// optionally, the receive side runs on io_uring instead, see setIoUring().
+// with setSegmentationOffload(), runs of cells to one neighbour leave as one UDP_SEGMENT
+// (GSO) buffer and coalesced UDP_GRO buffers are split back into cells on receive.
+// links that negotiated it with setPacking() carry several cells per datagram, receive()
+// unpacks them so that every returned datagram is a single cell again.
+// cells larger than CELL_CAPACITY are received if their size was registered with setCellSizes().
+// outgoing datagrams wait in a bounded queue per neighbour, only while it has some. when the
+// socket buffer is full the queues are kept and retried once the socket is writable, full
+// queues drop cover cells before anything else.
+class DatagramEngine : public QObject
+{
+    Q_OBJECT
+public:
+    explicit DatagramEngine(QObject *parent = 0);
+    ~DatagramEngine();
+
+    struct Datagram {
+        Endpoint sender;
+        CellBuffer cell;
+        int size = 0; // size on the wire, the cell only holds the first capacity() bytes
+
+        // view on the received bytes, valid while cell is held
+        QByteArray data() const { return cell.bytes(qMin(size, cell.capacity())); }
+    };
+
+    struct Stats {
+        quint64 receiveCalls = 0; // wakeups that returned data
+        quint64 receivedDatagrams = 0;
+        int maxReceiveBatch = 0;
+
+        quint64 sendCalls = 0; // flushes
+        quint64 sentDatagrams = 0;
+        int maxSendBatch = 0;
+        quint64 sendErrors = 0;
+
+        int queuedDatagrams = 0; // waiting in the egress queues right now
+        int maxQueueDepth = 0; // deepest a single neighbour's queue got
+        int egressQueues = 0; // neighbours with datagrams queued right now
+        quint64 droppedCover = 0; // dropped because a queue was full
+        quint64 droppedData = 0;
+        quint64 writeBlocked = 0; // times the socket buffer was full
+
+        quint64 offloadedSends = 0; // GSO buffers, each carried several datagrams
+        quint64 coalescedReceives = 0; // GRO buffers split back into datagrams
+        quint64 packedSends = 0; // datagrams that carried several cells, see setPacking()
+        quint64 packedReceives = 0;
+
+        // datagrams the kernel dropped since bind because our receive buffer was full,
+        // i.e. we did not keep up (SO_RXQ_OVFL, linux only)
+        quint64 kernelDrops = 0;
+
+        double averageReceiveBatch() const { return receiveCalls ? (double)receivedDatagrams / receiveCalls : 0; }
+        double averageSendBatch() const { return sendCalls ? (double)sentDatagrams / sendCalls : 0; }
+    };
+
+    // binds to all interfaces, dual stack if available
+    bool bind(quint16 port);
+    bool isBound() const;
+    quint16 localPort() const;
+    QString errorString() const;
+
+    int batchSize() const;
+    void setBatchSize(int batchSize); // only before bind()
+
+    // receive through io_uring (linux 6.0+), falls back to recvmmsg if the kernel does not
+    // support it. only before bind()
+    void setIoUring(bool ioUring);
+    bool usesIoUring() const; // after bind()
+
+    // UDP_SEGMENT on send and UDP_GRO on receive, linux only. GRO is not used together
+    // with io_uring. only before bind()
+    void setSegmentationOffload(bool offload);
+    bool segmentationOffload() const;
+
+    // largest number of full cells one received datagram may carry, the receive buffers
+    // are sized for it. only before bind(), after it 1 if packing is not supported (linux only)
+    void setMaxPackedCells(int cells);
+    int maxPackedCells() const;
+    // cells per datagram negotiated with a neighbour, capped at maxPackedCells(). full cells
+    // queued to it leave up to this many in one datagram, and datagrams of as many cells
+    // from it are unpacked. 1, the default, sends and accepts single cells only
+    void setPacking(Endpoint neighbour, int cells);
+    int packing(Endpoint neighbour) const;
+
+    // cell sizes above CELL_CAPACITY to receive, every size gets a pool of its own. datagrams
+    // of these sizes come out of receive() in a cell of their size. only before bind()
+    void setCellSizes(const QVector<int> &sizes);
+    int maxCellSize() const;
+
+    // kernel socket buffer sizes in bytes, 0 keeps the system default. only before bind()
+    void setSocketBufferSizes(int receive, int send);
+    // effective sizes as reported by the kernel, after bind()
+    int receiveBufferSize() const;
+    int sendBufferSize() const;
+
+    // lets several engines bind the same port (SO_REUSEPORT), only before bind()
+    void setReusePort(bool reusePort);
+    // steers datagrams of the reuseport group by circuit id, so that all cells of one
+    // circuit reach the same socket. socket i of the group (in bind order) gets the
+    // circuits with TunnelIdMapper::shardOfCircuit(circId, count) == i. linux only
+    bool setShardSteering(int count);
+
+    // reads one batch of pending datagrams into out, returns how many were read
+    int receive(QVector<Datagram> *out);
+
+    // cells each neighbour may have queued, only before the first send()
+    int egressLimit() const;
+    void setEgressLimit(int cells);
+
+    // queues a datagram, it is sent with the next flush. cover marks cells that may be
+    // dropped first. returns false if the queue to this neighbour was full and it was dropped
+    bool send(Endpoint to, QByteArray data, bool cover = false);
+    // same for a full cell, sent without copying it
+    bool send(Endpoint to, CellBuffer cell, bool cover = false);
+    int queueDepth(Endpoint to) const;
+
+    // cells for receiving, and for composing outgoing cells. the pool of cellSize bytes,
+    // null for a size that was not registered with setCellSizes()
+    CellPool *cellPool(int cellSize = CELL_CAPACITY);
+    CellPool::Stats cellPoolStats() const; // of the CELL_CAPACITY pool
+
+    Stats stats() const;
+
+public slots:
+    void flush();
+
+private slots:
+    void onWritable();
+
+signals:
+    void readyRead();
+
+private:
+    void scheduleFlush();
+
+    int batchSize_ = 32;
+    bool ioUring_ = false;
+    bool offload_ = false;
+    bool gso_ = false; // turned off again if the kernel rejects a segmented send
+    bool reusePort_ = false;
+    int receiveBufferSize_ = 0;
+    int sendBufferSize_ = 0;
+    QString errorString_;
+    Stats stats_;
+
+    struct Outgoing {
+        CellBuffer cell; // either a cell or data is set
+        QByteArray data;
+        bool cover = false;
+
+        int size() const { return cell.isNull() ? data.size() : cell.capacity(); }
+    };
+
+    // fifo towards one neighbour, a ring of egressLimit_ slots
+    struct EgressQueue {
+        Endpoint to;
+        QVector<Outgoing> ring;
+        int head = 0;
+        int count = 0;
+        int batched = 0; // datagrams from head on that are part of the batch being built
+        int packing = 1; // see setPacking()
+
+        Outgoing &at(int i) { return ring[(head + i) % ring.size()]; }
+        void push(Outgoing item);
+        void popFront();
+        bool evictCover(); // drops the oldest queued cover cell, if there is one
+    };
+
+    // count datagrams of queue, starting with the depth-th. several only with GSO, or if
+    // packed into one datagram
+    struct BatchEntry {
+        EgressQueue *queue;
+        int depth;
+        int count;
+        bool packed;
+    };
+
+    bool enqueue(Endpoint to, Outgoing item);
+    // up to max datagrams, round robin over the neighbours so none of them starves the others.
+    // up to runLength datagrams to the same neighbour make one entry, if they can share a GSO buffer.
+    // on packed links, the entry is a run of full cells for one datagram instead
+    void collectBatch(QVarLengthArray<BatchEntry, 64> *batch, int max, int runLength = 1);
+    // and removes the queues it drained
+    void releaseBatch(const QVarLengthArray<BatchEntry, 64> &batch);
+    void removeQueue(const Endpoint &to);
+    void dropQueued();
+    // cells a received datagram of size bytes from sender carries, 1 unless it is a packed one
+    int packedCells(Endpoint sender, int size) const;
+
+    CellPool pool_;
+    QVector<CellPool *> sizedPools_; // see setCellSizes()
+    int maxCellSize_ = CELL_CAPACITY;
+    int egressLimit_ = 256;
+    int maxPacked_ = 1;
+    QHash<Endpoint, int> packing_;
+    QHash<Endpoint, EgressQueue> egress_; // neighbours with datagrams queued
+    // rings of drained queues for the next ones, egressLimit_ slots each
+    QVector<QVector<Outgoing>> spareRings_;
+    static const int MaxSpareRings = 64;
+    int queued_ = 0;
+    bool writeBlocked_ = false;
+    bool flushScheduled_ = false;
+
+#ifdef Q_OS_LINUX
+    void close();
+    // updates kernelDrops, returns the GRO segment size or 0 if the buffer is a single datagram
+    int readControl(msghdr *header);
+    // copies a received buffer of size bytes, received of them at data, into cells. GRO
+    // buffers are cut into their segments of segment bytes, packed datagrams into their cells
+    void splitReceived(Endpoint sender, const char *data, int size, int received, int segment,
+                       QVector<Datagram> *out);
+
+    int fd_ = -1;
+    int family_ = 0;
+    quint16 localPort_ = 0;
+    QSocketNotifier *readNotifier_ = nullptr;
+    QSocketNotifier *writeNotifier_ = nullptr; // only enabled while writes are blocked
+
+    // receive side, maxPacked_ cells per datagram of the batch, refilled after every receive
+    QVector<CellBuffer> receiveCells_;
+    // the part of a large cell that does not fit the cells of its slot, overflowSize_ per slot.
+    // large cells are gathered into a cell of their size
+    QByteArray overflow_;
+    int overflowSize_ = 0;
+    // with GRO a slot takes a whole coalesced buffer, its cells are copied out
+    bool gro_ = false;
+    QByteArray groBuffer_;
+
+#ifdef ONION_IO_URING
+    int receiveUring(QVector<Datagram> *out);
+
+    UringReceiver *uring_ = nullptr; // set if the receive side runs on io_uring
+#endif
+#else
+    QUdpSocket socket_;
+#endif
+};
+
+#endif // DATAGRAMENGINE_H
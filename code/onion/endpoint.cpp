@@ -0,0 +1,145 @@
+#include "endpoint.h"
+
+#include <QtEndian>
+#include <cstring>
+#include <random>
+#include <type_traits>
+
+static_assert(sizeof(Endpoint) == 20, "Endpoint is compared and hashed as 20 bytes");
+static_assert(std::is_trivially_copyable<Endpoint>::value, "Endpoint is copied with memcpy");
+
+Endpoint::Endpoint(const QHostAddress &hostAddress, quint16 port)
+{
+    bool isIPv4;
+    quint32 ipv4 = hostAddress.toIPv4Address(&isIPv4);
+    if(isIPv4) {
+        *this = fromIPv4(ipv4, port);
+    } else if(hostAddress.protocol() == QAbstractSocket::IPv6Protocol) {
+        Q_IPV6ADDR ipv6 = hostAddress.toIPv6Address();
+        *this = fromIPv6(ipv6.c, port);
+    } else {
+        this->port = port;
+    }
+}
+
+Endpoint::Endpoint(const Binding &binding) :
+    Endpoint(binding.address, binding.port)
+{
+}
+
+Endpoint Endpoint::fromIPv4(quint32 address, quint16 port)
+{
+    Endpoint endpoint;
+    endpoint.address[10] = 0xff;
+    endpoint.address[11] = 0xff;
+    qToBigEndian<quint32>(address, endpoint.address + 12);
+    endpoint.port = port;
+    return endpoint;
+}
+
+Endpoint Endpoint::fromIPv6(const quint8 *address, quint16 port)
+{
+    Endpoint endpoint;
+    memcpy(endpoint.address, address, sizeof(endpoint.address));
+    endpoint.port = port;
+    return endpoint;
+}
+
+bool Endpoint::isValid() const
+{
+    static const quint8 none[16] = {};
+    return port != 0 && memcmp(address, none, sizeof(address)) != 0;
+}
+
+bool Endpoint::isIPv4() const
+{
+    static const quint8 mapped[12] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff };
+    return memcmp(address, mapped, sizeof(mapped)) == 0;
+}
+
+quint32 Endpoint::ipv4() const
+{
+    return qFromBigEndian<quint32>(address + 12);
+}
+
+QHostAddress Endpoint::hostAddress() const
+{
+    static const quint8 none[16] = {};
+    if(memcmp(address, none, sizeof(address)) == 0) {
+        return QHostAddress();
+    }
+    return isIPv4() ? QHostAddress(ipv4()) : QHostAddress(address);
+}
+
+Binding Endpoint::toBinding() const
+{
+    return Binding(hostAddress(), port);
+}
+
+QString Endpoint::toString() const
+{
+    return QString("%1:%2").arg(hostAddress().toString(), QString::number(port));
+}
+
+bool Endpoint::operator ==(const Endpoint &other) const
+{
+    return memcmp(this, &other, sizeof(Endpoint)) == 0;
+}
+
+static inline quint64 rotl(quint64 x, int b)
+{
+    return (x << b) | (x >> (64 - b));
+}
+
+static inline void sipRound(quint64 &v0, quint64 &v1, quint64 &v2, quint64 &v3)
+{
+    v0 += v1; v1 = rotl(v1, 13); v1 ^= v0; v0 = rotl(v0, 32);
+    v2 += v3; v3 = rotl(v3, 16); v3 ^= v2;
+    v0 += v3; v3 = rotl(v3, 21); v3 ^= v0;
+    v2 += v1; v1 = rotl(v1, 17); v1 ^= v2; v2 = rotl(v2, 32);
+}
+
+struct ProcessKey {
+    ProcessKey() {
+        std::random_device device;
+        for(quint64 &word : k) {
+            word = (quint64)device() << 32 | device();
+        }
+    }
+    quint64 k[2];
+};
+
+quint64 keyedHash(const void *data, int size, quint64 seed)
+{
+    static const ProcessKey key;
+    const quint64 k0 = key.k[0] ^ seed;
+    const quint64 k1 = key.k[1];
+    quint64 v0 = k0 ^ 0x736f6d6570736575ULL;
+    quint64 v1 = k1 ^ 0x646f72616e646f6dULL;
+    quint64 v2 = k0 ^ 0x6c7967656e657261ULL;
+    quint64 v3 = k1 ^ 0x7465646279746573ULL;
+
+    const uchar *in = static_cast<const uchar *>(data);
+    const uchar *end = in + (size & ~7);
+    for(; in != end; in += 8) {
+        quint64 m = qFromLittleEndian<quint64>(in);
+        v3 ^= m;
+        sipRound(v0, v1, v2, v3);
+        v0 ^= m;
+    }
+
+    // the last bytes and the length
+    quint64 b = (quint64)size << 56;
+    for(int i = 0; i < (size & 7); i++) {
+        b |= (quint64)in[i] << (8 * i);
+    }
+    v3 ^= b;
+    sipRound(v0, v1, v2, v3);
+    v0 ^= b;
+
+    v2 ^= 0xff;
+    sipRound(v0, v1, v2, v3);
+    sipRound(v0, v1, v2, v3);
+    sipRound(v0, v1, v2, v3);
+    return v0 ^ v1 ^ v2 ^ v3;
+}
@@ -0,0 +1,52 @@
+#ifndef ENDPOINT_H
+#define ENDPOINT_H
+
+#include <QHostAddress>
+#include <QString>
+#include <QtGlobal>
+
+#include "binding.h"
+
+// a neighbour on the data path: an IPv6 address, IPv4 ones as ::ffff:a.b.c.d, and a port.
+// 20 bytes that are copied, compared and hashed as they are, there is no QHostAddress to
+// allocate and convert for every cell. QHostAddress and Binding are for the apis and the
+// settings, addresses become endpoints where they come in from there
+struct Endpoint {
+    Endpoint() {}
+    Endpoint(const QHostAddress &hostAddress, quint16 port);
+    explicit Endpoint(const Binding &binding);
+    // address in host byte order
+    static Endpoint fromIPv4(quint32 address, quint16 port);
+    // 16 bytes in network byte order
+    static Endpoint fromIPv6(const quint8 *address, quint16 port);
+
+    quint8 address[16] = {};
+    quint16 port = 0;
+    quint16 reserved = 0; // always 0, the 20 bytes are compared and hashed whole
+
+    bool isValid() const;
+    bool isIPv4() const;
+    // host byte order, for isIPv4() endpoints
+    quint32 ipv4() const;
+
+    QHostAddress hostAddress() const;
+    Binding toBinding() const;
+    QString toString() const;
+
+    bool operator ==(const Endpoint &other) const;
+    bool operator !=(const Endpoint &other) const { return !(*this == other); }
+};
+
+Q_DECLARE_TYPEINFO(Endpoint, Q_PRIMITIVE_TYPE);
+
+// SipHash-1-3 of size bytes, keyed with a random key per process and seed. peers choose
+// their addresses and circuit ids, they must not be able to choose what collides
+quint64 keyedHash(const void *data, int size, quint64 seed = 0);
+
+// QHash seeds it randomly per process as well
+inline uint qHash(const Endpoint &endpoint, uint seed = 0)
+{
+    return keyedHash(&endpoint, sizeof(Endpoint), seed);
+}
+
+#endif // ENDPOINT_H
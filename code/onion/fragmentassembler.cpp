@@ -0,0 +1,155 @@
+#include "fragmentassembler.h"
+
+#include <QDebug>
+
+FragmentAssembler::FragmentAssembler(int memoryLimit) :
+    memoryLimit_(memoryLimit)
+{
+}
+
+bool FragmentAssembler::add(quint32 tunnelId, const PeerToPeerMessage &fragment, QByteArray *message)
+{
+    Q_ASSERT(fragment.command == PeerToPeerMessage::RELAY_DATA_FRAGMENT);
+    const quint64 k = key(tunnelId, fragment.messageId);
+    const int index = fragment.fragmentIndex;
+    const int size = fragment.data.size();
+    const bool last = fragment.isFinalFragment();
+    const int full = PeerToPeerMessage::maxFragmentData(fragment.cellSize);
+
+    // all but the last fragment are full, so the index says where a fragment goes and how
+    // large the message gets at least. all fragments of a message come in cells of one size
+    // and are compressed or not alike
+    bool valid = last ? size <= full : size == full;
+    valid &= index * full + size <= PeerToPeerMessage::MaxMessageData;
+    valid &= !partials_.contains(k) || (partials_[k].cellSize == fragment.cellSize &&
+                                        partials_[k].compressed == fragment.isCompressed());
+    if(!valid) {
+        qDebug() << "invalid fragment" << index << "of message" << fragment.messageId << "with" << size << "bytes";
+        if(partials_.contains(k)) {
+            remove(k);
+            stats_.dropped++;
+        }
+        return false;
+    }
+
+    if(!partials_.contains(k)) {
+        if(last && index == 0) {
+            // nothing to wait for
+            *message = fragment.data;
+            stats_.completed++;
+            return true;
+        }
+        quint64 evict;
+        while(pendingPerTunnel_.value(tunnelId) >= MaxPendingPerTunnel && oldest(false, tunnelId, &evict)) {
+            remove(evict);
+            stats_.dropped++;
+        }
+        Partial partial;
+        partial.cellSize = fragment.cellSize;
+        partial.compressed = fragment.isCompressed();
+        partial.started = nextStart_++;
+        partials_.insert(k, partial);
+        pendingPerTunnel_[tunnelId]++;
+    }
+
+    {
+        const Partial &partial = partials_[k];
+        bool ok = !partial.have.test(index);
+        if(partial.finalIndex >= 0) {
+            ok &= index < partial.finalIndex || (index == partial.finalIndex && last);
+        } else if(last) {
+            ok &= index >= partial.fragments.size();
+        }
+        if(!ok) {
+            qDebug() << "duplicate or conflicting fragment" << index << "of message" << fragment.messageId;
+            remove(k);
+            stats_.dropped++;
+            return false;
+        }
+    }
+
+    // room for it, the oldest messages go first. that may well be this one
+    while(stats_.bufferedBytes + size > memoryLimit_) {
+        quint64 evict;
+        if(!oldest(true, 0, &evict)) {
+            return false;
+        }
+        remove(evict);
+        stats_.dropped++;
+        if(evict == k) {
+            return false;
+        }
+    }
+
+    Partial &partial = partials_[k];
+    if(index >= partial.fragments.size()) {
+        partial.fragments.resize(index + 1);
+    }
+    partial.fragments[index] = fragment.data;
+    partial.have.set(index);
+    partial.received++;
+    partial.size += size;
+    stats_.bufferedBytes += size;
+    if(last) {
+        partial.finalIndex = index;
+    }
+
+    if(partial.finalIndex < 0 || partial.received != partial.finalIndex + 1) {
+        return false;
+    }
+
+    message->clear();
+    message->reserve(partial.size);
+    for(const QByteArray &data : partial.fragments) {
+        message->append(data);
+    }
+    remove(k);
+    stats_.completed++;
+    return true;
+}
+
+void FragmentAssembler::removeTunnel(quint32 tunnelId)
+{
+    if(!pendingPerTunnel_.contains(tunnelId)) {
+        return;
+    }
+    for(quint64 k : partials_.keys()) {
+        if(tunnelOf(k) == tunnelId) {
+            remove(k);
+            stats_.dropped++;
+        }
+    }
+}
+
+FragmentAssembler::Stats FragmentAssembler::stats() const
+{
+    Stats stats = stats_;
+    stats.pending = partials_.size();
+    return stats;
+}
+
+void FragmentAssembler::remove(quint64 k)
+{
+    stats_.bufferedBytes -= partials_.take(k).size;
+    quint32 tunnelId = tunnelOf(k);
+    if(--pendingPerTunnel_[tunnelId] == 0) {
+        pendingPerTunnel_.remove(tunnelId);
+    }
+}
+
+bool FragmentAssembler::oldest(bool anyTunnel, quint32 tunnelId, quint64 *k) const
+{
+    bool found = false;
+    quint64 started = 0;
+    for(QHash<quint64, Partial>::const_iterator it = partials_.constBegin(); it != partials_.constEnd(); it++) {
+        if(!anyTunnel && tunnelOf(it.key()) != tunnelId) {
+            continue;
+        }
+        if(!found || it.value().started < started) {
+            found = true;
+            started = it.value().started;
+            *k = it.key();
+        }
+    }
+    return found;
+}
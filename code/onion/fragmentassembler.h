@@ -0,0 +1,68 @@
+#ifndef FRAGMENTASSEMBLER_H
+#define FRAGMENTASSEMBLER_H
+
+#include <QByteArray>
+#include <QHash>
+#include <QVector>
+#include <bitset>
+
+#include "peertopeermessage.h"
+
+// puts RELAY_DATA_FRAGMENTs back together, per tunnel and message id. fragments may arrive in
+// any order, a message is complete once the final fragment and all before it are in.
+// fragments are as large as the cells of their tunnel allow, see PeerToPeerMessage::CellSize
+//
+// bounded: a tunnel has at most MaxPendingPerTunnel messages in the making and all of them
+// together hold at most memoryLimit bytes. a message that would go over either limit makes
+// room by dropping the oldest incomplete ones, fragments are lost on udp and their messages
+// would never complete. malformed messages are dropped as a whole
+class FragmentAssembler
+{
+public:
+    static const int MaxPendingPerTunnel = 4;
+    static const int DefaultMemoryLimit = 16 * PeerToPeerMessage::MaxMessageData;
+
+    struct Stats {
+        quint64 completed = 0;
+        quint64 dropped = 0; // incomplete messages given up on
+        int pending = 0;
+        int bufferedBytes = 0;
+    };
+
+    explicit FragmentAssembler(int memoryLimit = DefaultMemoryLimit);
+
+    // adds a RELAY_DATA_FRAGMENT from tunnelId. true if it completed its message, which is
+    // in message then, compressed if fragment isCompressed()
+    bool add(quint32 tunnelId, const PeerToPeerMessage &fragment, QByteArray *message);
+    // drops what tunnelId left incomplete
+    void removeTunnel(quint32 tunnelId);
+
+    Stats stats() const;
+
+private:
+    struct Partial {
+        QVector<QByteArray> fragments; // by index
+        std::bitset<256> have;
+        int received = 0;
+        int finalIndex = -1;
+        int size = 0;
+        PeerToPeerMessage::CellSize cellSize = PeerToPeerMessage::CELL_1K;
+        bool compressed = false;
+        quint64 started = 0; // age, lower is older
+    };
+
+    static quint64 key(quint32 tunnelId, quint16 messageId) { return ((quint64)tunnelId << 16) | messageId; }
+    static quint32 tunnelOf(quint64 k) { return k >> 16; }
+
+    void remove(quint64 k);
+    // the oldest incomplete message, of any tunnel or of tunnelId only. false if there is none
+    bool oldest(bool anyTunnel, quint32 tunnelId, quint64 *k) const;
+
+    QHash<quint64, Partial> partials_;
+    QHash<quint32, int> pendingPerTunnel_;
+    int memoryLimit_;
+    quint64 nextStart_ = 0;
+    Stats stats_;
+};
+
+#endif // FRAGMENTASSEMBLER_H
@@ -0,0 +1,179 @@
+// libFuzzer target for the cell parser, built with CONFIG += fuzz (see onion.pro).
+//
+// the first byte picks what the rest is fed to:
+//  even: a cell as received from the network, padded or cut to MESSAGE_LENGTH unless it
+//        is as long as a cell of some size
+//  odd:  a relay payload as auth hands it back after decryption, any size
+// whatever parses must encode again and parse back to the same message. compressed data is
+// decompressed as the exit would.
+//
+// ./onionfuzz --write-corpus=corpus writes seeds from the make* factories, then
+// ./onionfuzz corpus
+#include "cellview.h"
+#include "celldigest.h"
+#include "datacompressor.h"
+#include "fragmentassembler.h"
+#include "peertopeermessage.h"
+#include "tests/cellsamples.h"
+
+#include <QDir>
+#include <QFile>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+static void check(bool condition, const char *what)
+{
+    if(!condition) {
+        fprintf(stderr, "cell fuzzer: %s\n", what);
+        abort();
+    }
+}
+
+static void quiet(QtMsgType, const QMessageLogContext &, const QString &)
+{
+    // malformed input is the normal case here
+}
+
+static void writeCorpus(const QString &path)
+{
+    QDir().mkpath(path);
+    for(const QPair<QString, PeerToPeerMessage> &sample : cellSamples()) {
+        QFile cell(QDir(path).filePath("cell_" + sample.first));
+        if(cell.open(QIODevice::WriteOnly)) {
+            cell.write(QByteArray(1, 0x00) + sample.second.toBytes());
+        }
+        if(!sample.second.isEncrypted()) {
+            continue;
+        }
+        QFile payload(QDir(path).filePath("payload_" + sample.first));
+        if(payload.open(QIODevice::WriteOnly)) {
+            payload.write(QByteArray(1, 0x01) + sample.second.toEncryptedPayload());
+        }
+    }
+}
+
+extern "C" int LLVMFuzzerInitialize(int *argc, char ***argv)
+{
+    qInstallMessageHandler(quiet);
+
+    // libFuzzer leaves flags starting with -- alone
+    for(int i = 1; i < *argc; i++) {
+        const char *flag = "--write-corpus=";
+        if(strncmp((*argv)[i], flag, strlen(flag)) == 0) {
+            writeCorpus(QString::fromLocal8Bit((*argv)[i] + strlen(flag)));
+            exit(0);
+        }
+    }
+    return 0;
+}
+
+static bool sameRelay(const PeerToPeerMessage &a, const PeerToPeerMessage &b)
+{
+    return a.command == b.command && a.digest == b.digest && a.streamId == b.streamId
+            && a.data == b.data && a.dataFlags == b.dataFlags && a.address == b.address && a.port == b.port
+            && a.messageId == b.messageId && a.fragmentIndex == b.fragmentIndex && a.fragmentFlags == b.fragmentFlags
+            && a.cellSize == b.cellSize && a.circuitCellSize == b.circuitCellSize;
+}
+
+static void fuzzCell(const QByteArray &input)
+{
+    // the size check first, then a cell of the right size
+    PeerToPeerMessage::fromBytes(input);
+    QByteArray cell = input;
+    if(PeerToPeerMessage::cellSizeOf(input.size()) < 0) {
+        cell = input.left(MESSAGE_LENGTH);
+        cell.append(QByteArray(MESSAGE_LENGTH - cell.size(), '?'));
+    }
+
+    const char *data = cell.constData();
+    int size = cell.size();
+    PeerToPeerMessage::HeaderBatch headers;
+    int valid = PeerToPeerMessage::decodeHeaders(&data, &size, 1, &headers);
+    CellView view(cell);
+    check(valid == (headers.celltypes[0] != PeerToPeerMessage::Invalid), "header batch count");
+    check(headers.circuitIds[0] == view.circuitId(), "header batch circuit id");
+
+    PeerToPeerMessage message = PeerToPeerMessage::fromBytes(cell);
+    check(message.malformed || headers.celltypes[0] == message.celltype, "celltype differs from the header");
+    if(message.malformed) {
+        return;
+    }
+
+    PeerToPeerMessage again = PeerToPeerMessage::fromBytes(message.toBytes());
+    check(!again.malformed, "re-encoded cell is malformed");
+    check(again.celltype == message.celltype && again.circuitId == message.circuitId, "header round trip");
+    if(message.isEncrypted()) {
+        check(sameRelay(again, message), "relay round trip");
+    } else {
+        check(again.data == message.data && again.packing == message.packing
+              && again.circuitCellSize == message.circuitCellSize, "handshake round trip");
+    }
+}
+
+static void fuzzCompressed(const QByteArray &compressed)
+{
+    QByteArray data;
+    if(!DataCompressor::decompress(compressed, &data)) {
+        return;
+    }
+    check(data.size() <= DataCompressor::MaxSize, "decompressed too large");
+    QByteArray again;
+    check(DataCompressor::decompress(DataCompressor::compress(data), &again) && again == data, "compression round trip");
+}
+
+static void fuzzPayload(const QByteArray &payload)
+{
+    CellDigest::verify(CellDigest::Key(), payload);
+
+    PeerToPeerMessage message = PeerToPeerMessage::fromEncryptedPayload(payload, 1);
+    check(message.isEncrypted(), "payload parsed as a handshake");
+    if(message.malformed || payload.size() > PeerToPeerMessage::cellLength(message.cellSize) - UNENCRYPTED_HEADER_LEN) {
+        // longer payloads than a cell holds never come back from auth for a real cell
+        return;
+    }
+
+    PeerToPeerMessage again = PeerToPeerMessage::fromEncryptedPayload(message.toEncryptedPayload(), 1);
+    check(!again.malformed, "re-encoded payload is malformed");
+    check(sameRelay(again, message), "payload round trip");
+
+    if(message.command == PeerToPeerMessage::RELAY_DATA && message.isCompressed()) {
+        fuzzCompressed(message.data);
+    }
+
+    QList<QByteArray> records;
+    if(message.command == PeerToPeerMessage::RELAY_DATA_RECORDS && PeerToPeerMessage::splitRecords(message.data, &records)) {
+        QByteArray joined;
+        for(const QByteArray &record : records) {
+            PeerToPeerMessage::appendRecord(&joined, record);
+        }
+        check(joined == message.data, "records round trip");
+    }
+
+    // fragments from every input pile up in one assembler, it has to stay in its bounds
+    static FragmentAssembler fragments(4 * PeerToPeerMessage::MaxFragmentData);
+    QByteArray whole;
+    if(message.command == PeerToPeerMessage::RELAY_DATA_FRAGMENT && fragments.add(message.streamId, message, &whole)) {
+        check(whole.size() <= PeerToPeerMessage::MaxMessageData, "reassembled message too large");
+        if(message.isCompressed()) {
+            fuzzCompressed(whole);
+        }
+    }
+    check(fragments.stats().bufferedBytes <= 4 * PeerToPeerMessage::MaxFragmentData, "reassembly over its memory limit");
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    if(size < 1 || size > 2 * MAX_MESSAGE_LENGTH) {
+        return 0;
+    }
+
+    // raw view, the parser copies what it keeps
+    QByteArray input = QByteArray::fromRawData(reinterpret_cast<const char *>(data) + 1, (int)size - 1);
+    if(data[0] & 1) {
+        fuzzPayload(input);
+    } else {
+        fuzzCell(input);
+    }
+    return 0;
+}
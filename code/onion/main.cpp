@@ -1,5 +1,6 @@
 ﻿#include <QCoreApplication>
 #include "controller.h"
+#include "metatypes.h"
 
 #define ASSERT_ARG() if(args.isEmpty()) { qDebug() << "ran out of args"; parseOk = false; break; }
 
@@ -43,6 +44,10 @@ int main(int argc, char *argv[])
 
     // meta type setup
     qRegisterMetaType<QHostAddress>();
+    // queued between the relay threads, see ShardedPeerToPeer
+    qRegisterMetaType<MessageType>();
+    qRegisterMetaType<QVector<quint16>>();
+    qRegisterMetaType<QList<PeerSampler::Peer>>();
 
 
     QStringList args = a.arguments();
@@ -3,7 +3,9 @@
 
 #include <QMetaType>
 #include <QHostAddress>
+#include "messagetypes.h"
 
 Q_DECLARE_METATYPE(QHostAddress);
+Q_DECLARE_METATYPE(MessageType);
 
 #endif // METATYPES_H
@@ -1,4 +1,5 @@
 #include "mockoauthapi.h"
+#include "peertopeermessage.h"
 
 MockOAuthApi::MockOAuthApi(QObject *parent) : OAuthApi(parent)
 {
@@ -58,8 +59,8 @@ void MockOAuthApi::requestAuthCipherEncrypt(quint32 requestId, quint16 sessionId
 {
     // actual work o.0
     // encrypt == digest++
-    if(payload.size() != 1024) {
-        qDebug() << "requestAuthCipherEncrypt payload size is" << payload.size() << "expected 1024.";
+    if(PeerToPeerMessage::cellSizeOf(UNENCRYPTED_HEADER_LEN + payload.size()) < 0) {
+        qDebug() << "requestAuthCipherEncrypt payload size is" << payload.size() << "expected the payload of a cell.";
     }
 
     if(!establishedIds_.contains(sessionId)) {
@@ -80,8 +81,8 @@ void MockOAuthApi::requestAuthCipherDecrypt(quint32 requestId, quint16 sessionId
 {
     // actual work o.0
     // encrypt == digest--
-    if(payload.size() != 1024) {
-        qDebug() << "requestAuthCipherDecrypt payload size is" << payload.size() << "expected 1024.";
+    if(PeerToPeerMessage::cellSizeOf(UNENCRYPTED_HEADER_LEN + payload.size()) < 0) {
+        qDebug() << "requestAuthCipherDecrypt payload size is" << payload.size() << "expected the payload of a cell.";
     }
 
     if(!establishedIds_.contains(sessionId)) {
@@ -369,9 +369,10 @@ void OAuthApi::readAuthError(QByteArray message)
 
 
 
-    if(checkRequestId(sessionId, requestId))
+    // errors come for requests that have no session yet as well
+    if(checkRequestId(requestId))
     {
-
+        emit recvError(requestId);
     }
 }
 
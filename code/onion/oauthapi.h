@@ -33,6 +33,8 @@ signals:
     void recvDecrypted(quint32 requestId, QByteArray payload);
     void recvSessionHS1(quint32 requestId, quint16 sessionId, QByteArray handshake);
     void recvSessionHS2(quint32 requestId, quint16 sessionId, QByteArray handshake);
+    // auth could not do request requestId
+    void recvError(quint32 requestId);
 
 public slots:
 //    void requestAuthSessionStart(Binding peer, QByteArray key);
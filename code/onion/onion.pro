@@ -3,6 +3,8 @@ QT -= gui
 
 # uncomment here to build tests
 #CONFIG += test
+# or this one for the libFuzzer target of the cell parser, with clang
+#CONFIG += fuzz
 
 CONFIG += c++11
 
@@ -15,12 +17,24 @@ TEMPLATE = app
 SOURCES += \
     controller.cpp \
     peertopeer.cpp \
+    datagramengine.cpp \
+    uringreceiver.cpp \
+    shardedpeertopeer.cpp \
+    cellbuffer.cpp \
+    celldigest.cpp \
+    randompool.cpp \
+    cellscheduler.cpp \
+    fragmentassembler.cpp \
+    datacompressor.cpp \
     settings.cpp \
     onionapi.cpp \
     rpsapi.cpp \
     peertopeermessage.cpp \
     sessionkeystore.cpp \
     tunnelidmapper.cpp \
+    tunneltable.cpp \
+    routetable.cpp \
+    endpoint.cpp \
     oauthapi.cpp \
     peersampler.cpp \
     mockpeersampler.cpp \
@@ -41,6 +55,17 @@ DEFINES += QT_DEPRECATED_WARNINGS
 HEADERS += \
     controller.h \
     peertopeer.h \
+    datagramengine.h \
+    uringreceiver.h \
+    shardedpeertopeer.h \
+    cellbuffer.h \
+    cellview.h \
+    cellcodec.h \
+    celldigest.h \
+    randompool.h \
+    cellscheduler.h \
+    fragmentassembler.h \
+    datacompressor.h \
     settings.h \
     binding.h \
     onionapi.h \
@@ -49,7 +74,11 @@ HEADERS += \
     metatypes.h \
     peertopeermessage.h \
     sessionkeystore.h \
+    requestslots.h \
     tunnelidmapper.h \
+    tunneltable.h \
+    routetable.h \
+    endpoint.h \
     oauthapi.h \
     peersampler.h \
     mockpeersampler.h \
@@ -69,13 +98,49 @@ test{
         tests/rpsapitester.cpp \
         tests/peertopeermessagetester.cpp \
         tests/oauthapitester.cpp \
+        tests/datagramenginetester.cpp \
+        tests/cellbuffertester.cpp \
+        tests/cellschedulertester.cpp \
+        tests/celldigesttester.cpp \
+        tests/randompooltester.cpp \
+        tests/fragmentassemblertester.cpp \
+        tests/datacompressortester.cpp \
+        tests/tunneltabletester.cpp \
+        tests/tunnelidmappertester.cpp \
+        tests/routetabletester.cpp \
+        tests/requestslotstester.cpp \
+        tests/endpointtester.cpp \
+        tests/peertopeertester.cpp \
         test.cpp
 
     HEADERS += \
         tests/onionapitester.h \
         tests/rpsapitester.h \
         tests/peertopeermessagetester.h \
-        tests/oauthapitester.h
+        tests/oauthapitester.h \
+        tests/datagramenginetester.h \
+        tests/cellbuffertester.h \
+        tests/cellschedulertester.h \
+        tests/celldigesttester.h \
+        tests/randompooltester.h \
+        tests/fragmentassemblertester.h \
+        tests/datacompressortester.h \
+        tests/tunneltabletester.h \
+        tests/tunnelidmappertester.h \
+        tests/routetabletester.h \
+        tests/requestslotstester.h \
+        tests/endpointtester.h \
+        tests/peertopeertester.h \
+        tests/cellsamples.h
+} else:fuzz {
+    TARGET = onionfuzz
+
+    # libFuzzer brings main()
+    SOURCES += fuzz/cellfuzzer.cpp
+    HEADERS += tests/cellsamples.h
+
+    QMAKE_CXXFLAGS += -fsanitize=fuzzer,address,undefined
+    QMAKE_LFLAGS += -fsanitize=fuzzer,address,undefined
 } else {
     SOURCES += main.cpp
 }
@@ -12,7 +12,7 @@ class PeerSampler : public QObject
 public:
     explicit PeerSampler(QObject *parent = 0);
 
-    virtual int requestPeers(int n);
+    Q_INVOKABLE virtual int requestPeers(int n);
     virtual void setRpsApi(RPSApi *api);
 
     struct Peer {
@@ -40,4 +40,6 @@ private:
     QTimer timer_;
 };
 
+Q_DECLARE_METATYPE(PeerSampler::Peer)
+
 #endif // PEERSAMPLER_H
@@ -1,10 +1,19 @@
 #include "peertopeer.h"
+#include "cellview.h"
+#include "datacompressor.h"
+#include "randompool.h"
 
 #include <QTimer>
+#include <QVarLengthArray>
 
-PeerToPeer::PeerToPeer(QObject *parent) : QObject(parent), socket_(this)
+PeerToPeer::PeerToPeer(QObject *parent) : QObject(parent), transport_(this), scheduler_(this), coalesceTimer_(this)
 {
-    connect(&socket_, &QUdpSocket::readyRead, this, &PeerToPeer::onDatagram);
+    connect(&transport_, &DatagramEngine::readyRead, this, &PeerToPeer::onDatagram);
+    connect(&scheduler_, &CellScheduler::dispatch, this, &PeerToPeer::sendCell);
+
+    coalesceTimer_.setSingleShot(true);
+    coalesceTimer_.setTimerType(Qt::PreciseTimer);
+    connect(&coalesceTimer_, &QTimer::timeout, this, &PeerToPeer::flushAllCoalesced);
 }
 
 QHostAddress PeerToPeer::interface() const
@@ -29,67 +38,244 @@ void PeerToPeer::setPort(int port)
 
 bool PeerToPeer::start()
 {
-    bool ok = socket_.bind(port_);
+    transport_.setReusePort(shardCount_ > 1);
+    transport_.setSocketBufferSizes(receiveBufferSize_, sendBufferSize_);
+    transport_.setIoUring(ioUring_);
+    transport_.setSegmentationOffload(segmentationOffload_);
+    if(cellPacking_ > 1 && shardCount_ > 1) {
+        // the kernel steers a datagram by its first circuit id, the other cells could belong to another shard
+        qDebug() << "p2p packs no cells into one datagram with several relay threads";
+        cellPacking_ = 1;
+    }
+    transport_.setMaxPackedCells(cellPacking_);
+    // pools and receive buffers for the larger cells we may agree to
+    QVector<int> cellSizes;
+    for(int size = PeerToPeerMessage::CELL_4K; size <= maxCellSize_; size++) {
+        cellSizes.append(PeerToPeerMessage::cellLength(static_cast<PeerToPeerMessage::CellSize>(size)));
+    }
+    transport_.setCellSizes(cellSizes);
+    bool ok = transport_.bind(port_);
     if(!ok) {
-        qDebug() << "p2p api failed to bind" << socket_.error() << socket_.errorString();
+        qDebug() << "p2p api failed to bind" << transport_.errorString();
+        return false;
+    }
+    // neighbours see us there, it splits the circuit ids between us and them
+    tunnelIds_.setLocalEndpoint(Endpoint(interface_, transport_.localPort()));
+    if(debugLog_) {
+        qDebug() << "p2p receives through" << (transport_.usesIoUring() ? "io_uring" : "recvmmsg");
+    }
+    // 1 if the platform cannot do it
+    cellPacking_ = transport_.maxPackedCells();
+
+    // linux reports twice the requested size, the kernel keeps half for bookkeeping
+    if(receiveBufferSize_ > 0 && transport_.receiveBufferSize() < receiveBufferSize_) {
+        qDebug() << "p2p receive buffer capped at" << transport_.receiveBufferSize()
+                 << "bytes, raise net.core.rmem_max to get" << receiveBufferSize_;
+    }
+    if(sendBufferSize_ > 0 && transport_.sendBufferSize() < sendBufferSize_) {
+        qDebug() << "p2p send buffer capped at" << transport_.sendBufferSize()
+                 << "bytes, raise net.core.wmem_max to get" << sendBufferSize_;
+    }
+
+    // the filter is per reuseport group, the first shard installs it
+    if(shardCount_ > 1 && shardIndex_ == 0) {
+        ok = transport_.setShardSteering(shardCount_);
+        if(!ok) {
+            qDebug() << "p2p could not install shard steering:" << transport_.errorString();
+        }
     }
     return ok;
 }
 
-void PeerToPeer::onDatagram()
+void PeerToPeer::setSocketBufferSizes(int receive, int send)
 {
-//    qDebug() << "onDatagram";
-    while (socket_.hasPendingDatagrams()) {
-        handleDatagram(socket_.receiveDatagram());
+    receiveBufferSize_ = receive;
+    sendBufferSize_ = send;
+}
+
+void PeerToPeer::setIoUring(bool ioUring)
+{
+    ioUring_ = ioUring;
+}
+
+void PeerToPeer::setSegmentationOffload(bool offload)
+{
+    segmentationOffload_ = offload;
+}
+
+void PeerToPeer::setCellPacking(int cells, int pathMtu)
+{
+    // ip and udp headers, ipv6 being the larger
+    const int headers = 40 + 8;
+    // the engine caps it further, a packed datagram has to fit 64k
+    cellPacking_ = qMax(1, qMin(cells, (pathMtu - headers) / MESSAGE_LENGTH));
+}
+
+void PeerToPeer::setMaxCellSize(int bytes)
+{
+    int size = PeerToPeerMessage::cellSizeOf(bytes);
+    if(size < 0) {
+        qDebug() << "p2p cell size" << bytes << "is none of"
+                 << PeerToPeerMessage::cellLength(PeerToPeerMessage::CELL_1K)
+                 << PeerToPeerMessage::cellLength(PeerToPeerMessage::CELL_4K)
+                 << PeerToPeerMessage::cellLength(PeerToPeerMessage::CELL_8K) << "using the default";
+        size = PeerToPeerMessage::CELL_1K;
     }
+    maxCellSize_ = static_cast<PeerToPeerMessage::CellSize>(size);
 }
 
-void PeerToPeer::handleDatagram(QNetworkDatagram datagram)
+void PeerToPeer::setNeighbourRate(int cellsPerSecond, int burst)
 {
-    if(!datagram.isValid()) {
-        qDebug() << "error receiving p2p datagram." << socket_.error() << socket_.errorString();
-        return;
+    scheduler_.setRate(cellsPerSecond, burst);
+}
+
+void PeerToPeer::setCoalesceDelay(int msecs)
+{
+    coalesceDelay_ = qMax(0, msecs);
+}
+
+void PeerToPeer::setCompression(bool compress)
+{
+    compress_ = compress;
+}
+
+quint64 PeerToPeer::kernelDrops() const
+{
+    return transport_.stats().kernelDrops;
+}
+
+void PeerToPeer::setShard(int index, int count)
+{
+    shardIndex_ = index;
+    shardCount_ = qMax(1, count);
+    tunnelIds_.setShard(shardIndex_, shardCount_);
+    encryptQueue_.setStride(shardCount_);
+    decryptQueue_.setStride(shardCount_);
+
+    // auth answers are routed back to the shard by request id
+    nextAuthRequest_ = shardIndex_ == 0 ? shardCount_ : shardIndex_;
+}
+
+int PeerToPeer::shardIndex() const
+{
+    return shardIndex_;
+}
+
+quint32 PeerToPeer::nextAuthRequestId()
+{
+    quint32 id = nextAuthRequest_;
+    nextAuthRequest_ += shardCount_;
+    return id;
+}
+
+int PeerToPeer::requestPeerSample(int n)
+{
+    if(peerSampler_ != nullptr) {
+        return peerSampler_->requestPeers(n);
     }
 
-    QByteArray data = datagram.data();
-    if(data.size() != MESSAGE_LENGTH) {
-        qDebug() << "P2P data with invalid length" << data.size() << "should be" << MESSAGE_LENGTH;
-        disconnectPeer(Binding(datagram.senderAddress(), datagram.senderPort()));
-        return;
+    // we are a relay shard, the sampler lives on the main thread. ShardedPeerToPeer asks it
+    // and queues the peers back to peersArrived() under our id, nobody waits for the other
+    int id = nextPeerSample_++;
+    requestPeers(id, n);
+    return id;
+}
+
+void PeerToPeer::onDatagram()
+{
+//    qDebug() << "onDatagram";
+    // one batch per wakeup, the notifier fires again if more is pending
+    transport_.receive(&receiveBatch_);
+    int count = receiveBatch_.size();
+
+    // headers of the whole batch first, then dispatch cell by cell
+    QVarLengthArray<const char *, 64> cells(count);
+    QVarLengthArray<int, 64> sizes(count);
+    for(int i = 0; i < count; i++) {
+        cells[i] = receiveBatch_[i].cell.constData();
+        sizes[i] = receiveBatch_[i].size;
     }
+    PeerToPeerMessage::decodeHeaders(cells.constData(), sizes.constData(), count, &receiveHeaders_);
 
-    PeerToPeerMessage message = PeerToPeerMessage::fromDatagram(datagram);
-    Binding peer = message.sender;
-    if(debugLog_) {
-        qDebug() << "P2P data from" << peer.toString() << message.typeString();
+    // and their tunnel ids, the table fetches ahead while it looks up
+    receiveKeys_.resize(count);
+    receiveTunnelIds_.resize(count);
+    for(int i = 0; i < count; i++) {
+        receiveKeys_[i] = RouteKey::make(receiveBatch_[i].sender, receiveHeaders_.circuitIds[i]);
     }
+    tunnelIds_.findBatch(receiveKeys_.constData(), count, receiveTunnelIds_.data());
 
-    if(message.malformed) {
-        qDebug() << "P2P malformed message from" << peer.toString() << message.typeString()
-                 << "; closing connection.";
-        disconnectPeer(Binding(datagram.senderAddress(), datagram.senderPort()));
+    for(int i = 0; i < count; i++) {
+        handleDatagram(receiveBatch_[i], i);
+    }
+    // let go of the cells, so pending auth requests own theirs exclusively
+    receiveBatch_.resize(0);
+}
+
+void PeerToPeer::handleDatagram(const DatagramEngine::Datagram &datagram, int index)
+{
+    // packed datagrams were already unpacked into cells by the transport, anything that is
+    // not a multiple of a cell or more than the link negotiated ends up here with its full size.
+    // larger cells are fine up to our own limit, the circuit agreed on them
+    int cellSize = PeerToPeerMessage::cellSizeOf(datagram.size);
+    if(cellSize < 0 || cellSize > maxCellSize_) {
+        qDebug() << "P2P data with invalid length" << datagram.size << "should be" << MESSAGE_LENGTH
+                 << "or a larger cell up to" << PeerToPeerMessage::cellLength(maxCellSize_);
+        disconnectPeer(datagram.sender);
         return;
     }
 
-    if(message.celltype == PeerToPeerMessage::BUILD) {
-        handleBuild(message);
+    // classify from the raw header in receiveHeaders_, only handshakes get a full decode.
+    // encrypted cells are relayed or decrypted without parsing their (still encrypted) payload
+    Endpoint peer = datagram.sender;
+    PeerToPeerMessage::Celltype celltype = receiveHeaders_.celltypes[index];
+
+    if(celltype == PeerToPeerMessage::BUILD || celltype == PeerToPeerMessage::CREATED) {
+        PeerToPeerMessage message = PeerToPeerMessage::fromBytes(datagram.data());
+        message.sender = peer;
+        if(debugLog_) {
+            qDebug() << "P2P data from" << peer.toString() << message.typeString();
+        }
+
+        if(message.malformed) {
+            qDebug() << "P2P malformed message from" << peer.toString() << message.typeString()
+                     << "; closing connection.";
+            disconnectPeer(peer);
+            return;
+        }
+
+        if(celltype == PeerToPeerMessage::BUILD) {
+            handleBuild(message);
+        } else {
+            handleCreated(message);
+        }
         return;
     }
 
-    if(message.celltype == PeerToPeerMessage::CREATED) {
-        handleCreated(message);
+    if(celltype != PeerToPeerMessage::ENCRYPTED) {
+        qDebug() << "P2P invalid celltype" << (quint8)datagram.cell.constData()[0] << "from" << peer.toString()
+                 << "; closing connection.";
+        disconnectPeer(peer);
         return;
     }
 
-    QByteArray preface = data.left(UNENCRYPTED_HEADER_LEN);
-    QByteArray encryptedPayload = data.mid(UNENCRYPTED_HEADER_LEN);
+    quint16 circuitId = receiveHeaders_.circuitIds[index];
+    if(debugLog_) {
+        qDebug() << "P2P data from" << peer.toString() << "ENCRYPTED on circuit" << circuitId;
+    }
+
+    // auth reads the payload straight from the cell, the request keeps the cell alive
+    QByteArray encryptedPayload = datagram.cell.payload(datagram.size - UNENCRYPTED_HEADER_LEN);
 
     // we'll need auth at one point, so init here
     OnionAuthRequest storage;
     storage.peer = peer;
-    storage.circuitId = message.circuitId;
+    storage.circuitId = circuitId;
+    storage.cell = datagram.cell;
 
-    quint32 tunnelId = tunnelIds_.tunnelId(peer, message.circuitId);
+    // only looked up, cells for circuits we do not know leave nothing behind. a BUILD
+    // earlier in the batch makes an id, but its tunnel is only set up when auth answers
+    quint32 tunnelId = receiveTunnelIds_[index];
 
     // incoming encrypted message -> flowchart:
     //
@@ -130,13 +316,14 @@ void PeerToPeer::handleDatagram(QNetworkDatagram datagram)
     }
 
 
-    TunnelState *state = findTunnelByPreviousHopId(tunnelId);
+    TunnelState *state = tunnels_.findByPreviousHop(tunnelId);
     if(state != nullptr) {
         // from prevHop towards dest
         // 3. decrypt once, then forward to nexthop
         storage.type = OnionAuthRequest::DecryptOnce;
         storage.nextHop = state->nextHop;
         storage.nextHopCircuitId = state->circIdNextHop;
+        storage.digestKey = state->digestKey;
 
         // decrypt with K_src,us,
         // which is the key associated with tunnelIdPreviousHop
@@ -148,13 +335,13 @@ void PeerToPeer::handleDatagram(QNetworkDatagram datagram)
         }
 
         quint16 session = sessions_.get(state->tunnelIdPreviousHop);
-        quint32 reqId = nextAuthRequest_++;
-        decryptQueue_[reqId] = storage;
+        quint32 reqId = nextAuthRequestId();
+        decryptQueue_.insert(reqId, std::move(storage));
         requestDecrypt(reqId, session, encryptedPayload);
         return;
     }
 
-    state = findTunnelByNextHopId(tunnelId);
+    state = tunnels_.findByNextHop(tunnelId);
     if(state != nullptr) {
         // from nextHop -> towards src
         // 2. encrypt once, then forward
@@ -172,15 +359,14 @@ void PeerToPeer::handleDatagram(QNetworkDatagram datagram)
         }
 
         quint16 session = sessions_.get(state->tunnelIdPreviousHop);
-        quint32 reqId = nextAuthRequest_++;
-        encryptQueue_[reqId] = storage;
+        quint32 reqId = nextAuthRequestId();
+        encryptQueue_.insert(reqId, std::move(storage));
         requestEncrypt(reqId, session, encryptedPayload);
         return;
     }
 
     // tunnel not found
-    qDebug() << "Discarding message with unknown tunnelId" << tunnelId << "<=>"
-             << tunnelIds_.describe(tunnelId);
+    qDebug() << "Discarding message from" << peer.toString() << "on unknown circuit" << circuitId;
 }
 
 void PeerToPeer::handleBuild(PeerToPeerMessage message)
@@ -190,11 +376,22 @@ void PeerToPeer::handleBuild(PeerToPeerMessage message)
     if(debugLog_) {
         qDebug() << "handleBuild, requesting session";
     }
+    // we answer with our limit in CREATED, both ends use the smaller one
+    negotiatePacking(message);
 
-    quint32 reqId = nextAuthRequest_++;
-    incomingTunnels_[reqId] = tunnelIds_.tunnelId(message.sender, message.circuitId);
+    IncomingTunnel incoming;
+    incoming.tunnelId = tunnelIds_.accept(message.sender, message.circuitId);
+    if(incoming.tunnelId == 0) {
+        return;
+    }
+    // the largest cells both of us take, the source learns it from CREATED or RELAY_EXTENDED
+    incoming.cellSize = qMin(message.circuitCellSize, maxCellSize_);
+
+    quint32 reqId = nextAuthRequestId();
+    incomingTunnels_[reqId] = incoming;
     sessionIncomingHS1(reqId, message.data);
-    // triggers onSessionHS2
+    // triggers onSessionHS2. if auth does not answer, not before the source retries
+    QTimer::singleShot(20000, this, [=]() { dropIncomingTunnel(reqId); });
 }
 
 void PeerToPeer::handleCreated(PeerToPeerMessage message)
@@ -202,25 +399,27 @@ void PeerToPeer::handleCreated(PeerToPeerMessage message)
     // nexthop established
     // a) part of a circuit we initiated
     // b) part of an incomming tunnel, i.e. an earlier relay_extend
-    quint32 nextHopTunnelId = tunnelIds_.tunnelId(message.sender, message.circuitId);
+    negotiatePacking(message);
+    quint32 nextHopTunnelId = tunnelIds_.find(message.sender, message.circuitId);
     if(pendingTunnelExtensions_.contains(nextHopTunnelId)) {
         // b)
         // setup extended tunnel
-        quint32 incomingTunnelId = pendingTunnelExtensions_[nextHopTunnelId];
-        TunnelState *state = findTunnelByPreviousHopId(incomingTunnelId);
+        quint32 incomingTunnelId = pendingTunnelExtensions_.take(nextHopTunnelId);
+        TunnelState *state = tunnels_.findByPreviousHop(incomingTunnelId);
         if(state == nullptr) {
             qDebug() << "got an orphaned relay_extend->created response from"
                      << tunnelIds_.describe(nextHopTunnelId) << "originator is"
                      << tunnelIds_.describe(incomingTunnelId);
+            releaseTunnelId(nextHopTunnelId);
             return;
         }
 
-        state->tunnelIdNextHop = nextHopTunnelId;
-        state->nextHop = message.sender;
-        state->circIdNextHop = message.circuitId;
+        tunnels_.setNextHop(state, message.sender, message.circuitId, nextHopTunnelId);
 
-        // send relay_extended with handshake response
+        // send relay_extended with handshake response, and the cell size of the new hop. we
+        // offered it no more than our own, it should not have answered with more
         PeerToPeerMessage msg = PeerToPeerMessage::makeRelayExtended(state->circIdPreviousHop, 0, message.data);
+        msg.circuitCellSize = qMin(message.circuitCellSize, state->cellSize);
         sendPeerToPeerMessage(msg, state->previousHop);
         return;
     }
@@ -236,7 +435,9 @@ void PeerToPeer::handleCreated(PeerToPeerMessage message)
     CircuitState &state = circuits_[nextHopTunnelId];
     HopState &hop = state.hopStates.first();
     // finish handshake -> send to auth
-    sessionIncomingHS2(nextAuthRequest_++, hop.sessionKey, message.data);
+    sessionIncomingHS2(nextAuthRequestId(), hop.sessionKey, message.data);
+    hop.digestKey = CellDigest::deriveKey(message.data);
+    hop.cellSize = qMin(message.circuitCellSize, maxCellSize_);
     // set status in circuit
     hop.status = Created;
     // continue circuit build
@@ -246,12 +447,23 @@ void PeerToPeer::handleCreated(PeerToPeerMessage message)
     }
 }
 
+void PeerToPeer::negotiatePacking(const PeerToPeerMessage &message)
+{
+    int cells = qMin(cellPacking_, (int)message.packing);
+    if(cells != transport_.packing(message.sender)) {
+        if(debugLog_) {
+            qDebug() << "packing" << cells << "cells per datagram with" << message.sender.toString();
+        }
+        transport_.setPacking(message.sender, cells);
+    }
+}
+
 void PeerToPeer::handleMessage(PeerToPeerMessage message, quint32 originatorTunnelId)
 {
+    // the digest was verified in onDecrypted
     if(message.malformed || message.celltype != PeerToPeerMessage::ENCRYPTED ||
-            message.command == PeerToPeerMessage::CMD_INVALID || !message.isValidDigest()) {
+            message.command == PeerToPeerMessage::CMD_INVALID) {
         qDebug() << "invalid message in handleMessage" << message.typeString()
-                 << "digest ok? ->" << message.isValidDigest()
                  << "originator seems to be" << tunnelIds_.describe(originatorTunnelId);
         return;
     }
@@ -264,29 +476,64 @@ void PeerToPeer::handleMessage(PeerToPeerMessage message, quint32 originatorTunn
     case PeerToPeerMessage::RELAY_DATA:
         // get tunnelId
         // emit tunnelData with tunnelId_us_src
+        if(message.isCompressed() && !decompressData(originatorTunnelId, &message.data)) {
+            break;
+        }
         emit tunnelData(originatorTunnelId, message.data);
         break;
+    case PeerToPeerMessage::RELAY_DATA_RECORDS:
+    {
+        // small writes the other end coalesced, delivered one by one and in order
+        QList<QByteArray> records;
+        if(!PeerToPeerMessage::splitRecords(message.data, &records)) {
+            qDebug() << "RELAY_DATA_RECORDS cut short, originator seems to be" << tunnelIds_.describe(originatorTunnelId);
+            break;
+        }
+        for(const QByteArray &record : records) {
+            emit tunnelData(originatorTunnelId, record);
+        }
+    }
+        break;
+    case PeerToPeerMessage::RELAY_DATA_FRAGMENT:
+    {
+        // part of a large write, delivered once all of it is here
+        QByteArray data;
+        if(!fragments_.add(originatorTunnelId, message, &data)) {
+            break;
+        }
+        if(message.isCompressed() && !decompressData(originatorTunnelId, &data)) {
+            break;
+        }
+        emit tunnelData(originatorTunnelId, data);
+    }
+        break;
     case PeerToPeerMessage::RELAY_EXTEND:
     {
         // save binding, setup tunnel/circuit ids
-        Binding nexthop(message.address, message.port);
-        quint16 nextHopCircuitId = tunnelIds_.nextCircId(nexthop);
-        quint32 nextHopId = tunnelIds_.tunnelId(nexthop, nextHopCircuitId);
+        Endpoint nexthop(message.address, message.port);
+        quint16 nextHopCircuitId;
+        quint32 nextHopId = tunnelIds_.allocate(nexthop, &nextHopCircuitId);
+        if(nextHopId == 0) {
+            return;
+        }
         pendingTunnelExtensions_[nextHopId] = originatorTunnelId;
 
-        // send build with handshake we got
+        // send build with handshake we got. the next hop gets offered what the source offered,
+        // but no more than we agreed with the source, cells to it pass us
         PeerToPeerMessage build = PeerToPeerMessage::makeBuild(nextHopCircuitId, message.data);
-        QNetworkDatagram dgram = build.toDatagram(nexthop); // cant encrypt this message, directly send
-        dgram.setSender(interface_, port_);
+        build.packing = cellPacking_;
+        TunnelState *originator = tunnels_.findByPreviousHop(originatorTunnelId);
+        build.circuitCellSize = originator != nullptr ? qMin(message.circuitCellSize, originator->cellSize)
+                                                      : PeerToPeerMessage::CELL_1K;
         qDebug() << "RELAY_EXTEND -> sending build to" << nexthop.toString();
-        socket_.writeDatagram(dgram);
+        transport_.send(nexthop, build.toBytes()); // cant encrypt this message, directly send
         // await created, then send relay_extended
     }
         break;
     case PeerToPeerMessage::RELAY_EXTENDED:
     {
         // get circuit that we extended -> circuitId is tunnelId of this message
-        quint32 circuitTunnelId = tunnelIds_.tunnelId(message.sender, message.circuitId);
+        quint32 circuitTunnelId = tunnelIds_.find(message.sender, message.circuitId);
 
         if(!circuits_.contains(circuitTunnelId)) {
             qDebug() << "orphaned RELAY_EXTENDED received from neighbour"
@@ -311,7 +558,10 @@ void PeerToPeer::handleMessage(PeerToPeerMessage message, quint32 originatorTunn
                 qDebug() << "Tunnel extended successfully until" << hopState.peer.toString();
 
                 // finish session establishment
-                sessionIncomingHS2(nextAuthRequest_++, hopState.sessionKey, message.data);
+                sessionIncomingHS2(nextAuthRequestId(), hopState.sessionKey, message.data);
+                hopState.digestKey = CellDigest::deriveKey(message.data);
+                // the hops before it carry its cells as well
+                hopState.cellSize = qMin(message.circuitCellSize, i > 0 ? state.hopStates[i - 1].cellSize : maxCellSize_);
                 // apply state change
                 hopState.status = Created;
                 // continue building tunnel
@@ -332,7 +582,7 @@ void PeerToPeer::handleMessage(PeerToPeerMessage message, quint32 originatorTunn
         }
 
         // find circuit
-        quint32 circuitTunnelId = tunnelIds_.tunnelId(message.sender, message.circuitId);
+        quint32 circuitTunnelId = tunnelIds_.find(message.sender, message.circuitId);
         if(!circuits_.contains(circuitTunnelId)) {
             return;
         }
@@ -351,8 +601,18 @@ void PeerToPeer::handleMessage(PeerToPeerMessage message, quint32 originatorTunn
             return;
         }
 
-        // fix circuit state, to represent the truncated connection
+        // the hops behind it are gone, cleanCircuit() only sees those left. each of them got
+        // an id and an auth session for its handshake, built or not
+        for(int i = lastPeerIndex + 1; i < circuit.hopStates.size(); i++) {
+            const HopState &hop = circuit.hopStates[i];
+            requestEndSession(hop.sessionKey);
+            sessions_.remove(hop.tunnelId);
+            releaseTunnelId(hop.tunnelId);
+        }
+        // fix circuit state, to represent the truncated connection. it no longer reaches the
+        // destination, writes to the api tunnel must not end up at the hop that is left
         circuit.hopStates = circuit.hopStates.mid(0, lastPeerIndex + 1);
+        circuitsByApiId_.remove(circuit.circuitApiTunnelId);
         // now tear the circuit
         tearCircuit(circuitTunnelId, true);
         // announce circuit failure to api
@@ -365,13 +625,10 @@ void PeerToPeer::handleMessage(PeerToPeerMessage message, quint32 originatorTunn
         if(debugLog_) {
             qDebug() << "tunnel destroyed by source";
         }
-        TunnelState *state = findTunnelByPreviousHopId(originatorTunnelId);
+        TunnelState *state = tunnels_.findByPreviousHop(originatorTunnelId);
         if(state != nullptr) {
             // we cannot talk to nexthop directly, originator must send destroys to all hops
-            // cleanup tunnel
-            requestEndSession(sessions_.get(state->tunnelIdPreviousHop));
-            sessions_.remove(state->tunnelIdPreviousHop);
-            tunnels_.removeOne(*state);
+            removeRelayTunnel(state);
         }
     }
         break;
@@ -401,10 +658,11 @@ void PeerToPeer::continueLayeredDecrypt(PeerToPeer::OnionAuthRequest request, QB
     }
 
     request.operations++;
+    request.digestKey = hop.digestKey;
 
     // request decrypt
-    quint32 reqId = nextAuthRequest_++;
-    decryptQueue_[reqId] = request;
+    quint32 reqId = nextAuthRequestId();
+    decryptQueue_.insert(reqId, std::move(request));
     requestDecrypt(reqId, hop.sessionKey, payload);
 }
 
@@ -428,36 +686,65 @@ void PeerToPeer::continueLayeredEncrypt(PeerToPeer::OnionAuthRequest request, QB
     request.operations++;
 
     // request encrypt
-    quint32 reqId = nextAuthRequest_++;
-    encryptQueue_[reqId] = request;
+    quint32 reqId = nextAuthRequestId();
+    encryptQueue_.insert(reqId, std::move(request));
     requestEncrypt(reqId, hop.sessionKey, payload);
 }
 
-void PeerToPeer::forwardEncryptedMessage(Binding to, quint16 circuitId, QByteArray payload)
+void PeerToPeer::forwardEncryptedMessage(Endpoint to, quint16 circuitId, QByteArray payload, CellBuffer cell, bool isCover)
+{
+    // relayed cells go out in the cell they came in with, unless someone else still reads it.
+    // the cell is as large as the payload, auth keeps its size
+    const int length = UNENCRYPTED_HEADER_LEN + payload.size();
+    if(cell.isNull() || cell.isShared() || cell.capacity() != length) {
+        CellPool *pool = transport_.cellPool(length);
+        cell = (pool != nullptr ? pool : transport_.cellPool())->acquire();
+    }
+    PeerToPeerMessage::composeEncrypted(circuitId, payload, &cell);
+    if(!scheduler_.enqueue(to, circuitId, std::move(cell), isCover)) {
+        if(debugLog_) {
+            qDebug() << "pacing queue to" << to.toString() << "is full, dropped" << (isCover ? "cover" : "data") << "cell";
+        }
+    }
+}
+
+void PeerToPeer::sendCell(Endpoint to, CellBuffer cell, bool isCover)
 {
-    QByteArray newMessage = PeerToPeerMessage::composeEncrypted(circuitId, payload);
-    QNetworkDatagram packet(newMessage, to.address, to.port);
-    packet.setSender(interface_, port_);
-    qint64 ok = socket_.writeDatagram(packet);
+    if(!transport_.send(to, std::move(cell), isCover)) {
+        if(debugLog_) {
+            qDebug() << "egress queue to" << to.toString() << "is full, dropped" << (isCover ? "cover" : "data") << "cell";
+        }
+        return;
+    }
     if(debugLog_) {
-        qDebug() << (ok == -1 ? QString("FAIL") : QString("OK")) << "sent packet to" << to.toString();
+        qDebug() << "queued packet to" << to.toString();
     }
 }
 
-void PeerToPeer::sendPeerToPeerMessage(PeerToPeerMessage unencrypted, Binding target)
+void PeerToPeer::sendPeerToPeerMessage(PeerToPeerMessage unencrypted, Endpoint target)
 {
+    // we are a hop answering the source, digest with our key for this tunnel
+    quint32 tunnelId = tunnelIds_.find(target, unencrypted.circuitId);
+    TunnelState *tunnel = tunnels_.findByPreviousHop(tunnelId);
+    if(tunnel == nullptr) {
+        qDebug() << "no tunnel to" << target.toString() << "for" << unencrypted.typeString();
+        return;
+    }
+    unencrypted.cellSize = tunnel->cellSize;
     QByteArray msgPayload = unencrypted.toEncryptedPayload();
+    CellDigest::seal(tunnel->digestKey, &msgPayload);
 
     // encrypt once then send
     OnionAuthRequest request;
     request.type = OnionAuthRequest::EncryptOnce;
     request.nextHop = target;
     request.nextHopCircuitId = unencrypted.circuitId;
+    request.isCover = unencrypted.command == PeerToPeerMessage::CMD_COVER;
     request.debugString = QString("direct-encrypt %1 to %2").arg(unencrypted.typeString(), target.toString());
 
-    quint16 sessionId = sessions_.get(tunnelIds_.tunnelId(target, unencrypted.circuitId));
-    quint32 reqId = nextAuthRequest_++;
-    encryptQueue_[reqId] = request;
+    quint16 sessionId = sessions_.get(tunnelId);
+    quint32 reqId = nextAuthRequestId();
+    encryptQueue_.insert(reqId, std::move(request));
     requestEncrypt(reqId, sessionId, msgPayload);
 }
 
@@ -467,13 +754,17 @@ void PeerToPeer::sendPeerToPeerMessage(PeerToPeerMessage unencrypted, QVector<Pe
         return;
     }
 
+    // the last hop peels the last layer, digest with its key. all hops before it take its cells
+    unencrypted.cellSize = tunnel.last().cellSize;
     QByteArray msgPayload = unencrypted.toEncryptedPayload();
+    CellDigest::seal(tunnel.last().digestKey, &msgPayload);
 
     OnionAuthRequest request;
     request.type = OnionAuthRequest::LayeredEncrypt;
     request.nextHop = tunnel[0].peer;
     request.nextHopCircuitId = tunnel[0].circuitId;
     request.remainingHops = tunnel;
+    request.isCover = unencrypted.command == PeerToPeerMessage::CMD_COVER;
     request.debugString = QString("onion-encrypt %1 towards %2").arg(unencrypted.typeString(), tunnel.last().peer.toString());
 
     continueLayeredEncrypt(request, msgPayload);
@@ -510,13 +801,71 @@ void PeerToPeer::cleanCircuit(quint32 tunnelId)
     }
 
     CircuitState state = circuits_.take(tunnelId);
+    if(circuitsByApiId_.value(state.circuitApiTunnelId) == tunnelId) {
+        circuitsByApiId_.remove(state.circuitApiTunnelId);
+    }
     state.retryEstablishingTimer->deleteLater();
+    coalesced_.remove(state.circuitApiTunnelId);
+    fragments_.removeTunnel(state.circuitApiTunnelId);
     for(HopState hop : state.hopStates) {
         if(hop.status == Created) {
             // clear auth sessions
             requestEndSession(hop.sessionKey);
             sessions_.remove(hop.tunnelId);
         }
+        releaseTunnelId(hop.tunnelId);
+    }
+}
+
+void PeerToPeer::removeRelayTunnel(TunnelState *state)
+{
+    quint32 tunnelId = state->tunnelIdPreviousHop;
+    requestEndSession(sessions_.get(tunnelId));
+    sessions_.remove(tunnelId);
+    coalesced_.remove(tunnelId);
+    fragments_.removeTunnel(tunnelId);
+
+    // an extension still waiting for CREATED is given up, a late one finds nothing
+    if(state->hasNextHop()) {
+        releaseTunnelId(state->tunnelIdNextHop);
+    } else {
+        for(QHash<quint32, quint32>::iterator it = pendingTunnelExtensions_.begin(); it != pendingTunnelExtensions_.end();) {
+            if(it.value() == tunnelId) {
+                releaseTunnelId(it.key());
+                it = pendingTunnelExtensions_.erase(it);
+            } else {
+                it++;
+            }
+        }
+    }
+    releaseTunnelId(tunnelId);
+    tunnels_.remove(state);
+}
+
+void PeerToPeer::dropIncomingTunnel(quint32 requestId)
+{
+    if(!incomingTunnels_.contains(requestId)) {
+        return;
+    }
+    quint32 tunnelId = incomingTunnels_.take(requestId).tunnelId;
+    // the id stays with a tunnel that is up already, or another BUILD of it auth works on
+    if(tunnels_.findByPreviousHop(tunnelId) != nullptr) {
+        return;
+    }
+    for(const IncomingTunnel &incoming : incomingTunnels_) {
+        if(incoming.tunnelId == tunnelId) {
+            return;
+        }
+    }
+    releaseTunnelId(tunnelId);
+}
+
+void PeerToPeer::releaseTunnelId(quint32 tunnelId)
+{
+    Endpoint neighbour;
+    if(tunnelIds_.release(tunnelId, &neighbour) && !tunnelIds_.hasTunnels(neighbour)) {
+        // nothing uses the link any more, the next BUILD or CREATED negotiates packing again
+        transport_.setPacking(neighbour, 1);
     }
 }
 
@@ -544,9 +893,9 @@ void PeerToPeer::peersArrived(int id, QList<PeerSampler::Peer> peers)
 
     for(auto hop : peers) {
         BuildTunnelPeer peer;
-        peer.peer = hop.address;
+        peer.peer = Endpoint(hop.address);
         peer.hostkey = hop.hostkey;
-        peer.authRequestId = nextAuthRequest_++;
+        peer.authRequestId = nextAuthRequestId();
         handshakes.peers.append(peer);
     }
 
@@ -563,6 +912,15 @@ void PeerToPeer::continueBuildingTunnel(quint32 id, bool isRetry)
         return;
     }
 
+    if(isRetry) {
+        // the first retry is for a lost CREATED. with no answer to that either, the first hop
+        // may have picked the same circuit id for a circuit of its own and rejects ours
+        HopState &first = circuits_[id].hopStates.first();
+        if(first.status == BuildSent && first.retries++ > 0) {
+            id = renumberFirstHop(id);
+        }
+    }
+
     CircuitState &state = circuits_[id];
     int nextBuildIndex = -1;
     for(int i = 0; i < state.hopStates.size(); i++) {
@@ -602,14 +960,15 @@ void PeerToPeer::continueBuildingTunnel(quint32 id, bool isRetry)
     if(nextBuildIndex == 0) {
         // send a build
         PeerToPeerMessage build = PeerToPeerMessage::makeBuild(circId, nextHopState.peerHandshakeHS1);
-        QNetworkDatagram dgram = build.toDatagram(nextHopState.peer);
-        dgram.setSender(interface_, port_);
+        build.packing = cellPacking_;
+        build.circuitCellSize = maxCellSize_;
         qDebug() << "building circuit -> sent build to" << nextHopState.peer.toString();
-        socket_.writeDatagram(dgram);
+        transport_.send(nextHopState.peer, build.toBytes());
     } else {
         // send a relay extend
         QVector<HopState> halfOnion = state.hopStates.mid(0, nextBuildIndex); // should go until predecessor of nextHop
         PeerToPeerMessage extend = PeerToPeerMessage::makeRelayExtend(circId, 0, nextHopState.peer, nextHopState.peerHandshakeHS1);
+        extend.circuitCellSize = halfOnion.last().cellSize;
         sendPeerToPeerMessage(extend, halfOnion);
     }
 
@@ -617,6 +976,33 @@ void PeerToPeer::continueBuildingTunnel(quint32 id, bool isRetry)
     state.retryEstablishingTimer->start();
 }
 
+quint32 PeerToPeer::renumberFirstHop(quint32 id)
+{
+    CircuitState &state = circuits_[id];
+    HopState &first = state.hopStates.first();
+    // picked while the old one is live, so it is another one
+    quint16 circId;
+    quint32 tunnelId = tunnelIds_.allocate(first.peer, &circId);
+    if(tunnelId == 0) {
+        return id;
+    }
+    releaseTunnelId(first.tunnelId);
+    first.circuitId = circId;
+    first.tunnelId = tunnelId;
+
+    if(state.circuitApiTunnelId == id) {
+        // a circuit of one hop, not announced yet
+        circuitsByApiId_.remove(id);
+        state.circuitApiTunnelId = tunnelId;
+    }
+    circuitsByApiId_[state.circuitApiTunnelId] = tunnelId;
+    QTimer *retry = state.retryEstablishingTimer;
+    retry->disconnect(this);
+    connect(retry, &QTimer::timeout, this, [=]() { continueBuildingTunnel(tunnelId, true); });
+    circuits_.insert(tunnelId, circuits_.take(id));
+    return tunnelId;
+}
+
 void PeerToPeer::sendCoverData(quint32 tunnelId)
 {
     if(!circuits_.contains(tunnelId)) {
@@ -628,19 +1014,18 @@ void PeerToPeer::sendCoverData(quint32 tunnelId)
         return;
     }
 
-    state.remainingCoverData -= MESSAGE_LENGTH;
+    state.remainingCoverData -= PeerToPeerMessage::cellLength(state.hopStates.last().cellSize);
     PeerToPeerMessage message = PeerToPeerMessage::makeCommandCover(state.hopStates.first().circuitId);
     sendPeerToPeerMessage(message, state.hopStates);
 
     // random backoff for next cover message
-    float rand = (float)qrand() / (float)RAND_MAX;
     int minWait = 300, maxWait = 2000;
-    int wait = (int)((maxWait - minWait) * rand) + minWait;
+    int wait = minWait + (int)RandomPool::local().bounded(maxWait - minWait);
 
     QTimer::singleShot(wait, [=]() { sendCoverData(tunnelId); });
 }
 
-void PeerToPeer::disconnectPeer(Binding who)
+void PeerToPeer::disconnectPeer(Endpoint who)
 {
     // phew this is a lot
     // tear circuits with this guy
@@ -651,31 +1036,49 @@ void PeerToPeer::disconnectPeer(Binding who)
     }
 }
 
-PeerToPeer::TunnelState *PeerToPeer::findTunnelByPreviousHopId(quint32 tId)
+PeerToPeer::CircuitState *PeerToPeer::findCircuitByApiId(quint32 tunnelId)
 {
-    for(TunnelState &candidate : tunnels_) {
-        if(candidate.tunnelIdPreviousHop == tId) {
-            return &candidate;
-        }
+    QHash<quint32, quint32>::const_iterator id = circuitsByApiId_.constFind(tunnelId);
+    if(id == circuitsByApiId_.constEnd()) {
+        return nullptr;
     }
+    QHash<quint32, CircuitState>::iterator it = circuits_.find(id.value());
+    return it != circuits_.end() ? &it.value() : nullptr;
+}
 
-    return nullptr;
+void PeerToPeer::setDebugLog(bool debugLog)
+{
+    debugLog_ = debugLog;
 }
 
-PeerToPeer::TunnelState *PeerToPeer::findTunnelByNextHopId(quint32 tId)
+DatagramEngine::Stats PeerToPeer::transportStats() const
 {
-    for(TunnelState &candidate : tunnels_) {
-        if(candidate.tunnelIdNextHop == tId) {
-            return &candidate;
-        }
-    }
+    return transport_.stats();
+}
 
-    return nullptr;
+int PeerToPeer::egressQueueDepth(Endpoint neighbour) const
+{
+    return transport_.queueDepth(neighbour);
 }
 
-void PeerToPeer::setDebugLog(bool debugLog)
+CellPool::Stats PeerToPeer::cellStats() const
 {
-    debugLog_ = debugLog;
+    return transport_.cellPoolStats();
+}
+
+CellScheduler::Stats PeerToPeer::schedulerStats() const
+{
+    return scheduler_.stats();
+}
+
+FragmentAssembler::Stats PeerToPeer::fragmentStats() const
+{
+    return fragments_.stats();
+}
+
+int PeerToPeer::liveTunnelIds() const
+{
+    return tunnelIds_.size();
 }
 
 int PeerToPeer::nHops() const
@@ -705,55 +1108,101 @@ void PeerToPeer::buildTunnel(QHostAddress destinationAddr, quint16 destinationPo
     sample.dest = dest;
     sample.requesterId = requestId;
 
-    int sampleId = peerSampler_->requestPeers(nHops_);
+    int sampleId = requestPeerSample(nHops_);
     pendingPeerSamples_[sampleId] = sample;
     // wait for peersArrived()
 }
 
 void PeerToPeer::destroyTunnel(quint32 tunnelId)
 {
+    // what the client wrote before destroying still goes out
+    flushCoalesced(tunnelId);
+
     // find circuit with end-to-start tunnelid
-    for(QHash<quint32, CircuitState>::iterator it = circuits_.begin(); it != circuits_.end(); it++) {
-        CircuitState &state = it.value();
-        if(state.circuitApiTunnelId == tunnelId) {
-            state.lastMessage = MessageType::ONION_TUNNEL_DESTROY;
-            tearCircuit(it.key(), true);
-            return;
-        }
+    CircuitState *circuit = findCircuitByApiId(tunnelId);
+    if(circuit != nullptr) {
+        circuit->lastMessage = MessageType::ONION_TUNNEL_DESTROY;
+        tearCircuit(circuitsByApiId_.value(tunnelId), true);
+        return;
     }
 
     // find tunnel with tunnelid
-    TunnelState *state = findTunnelByPreviousHopId(tunnelId);
+    TunnelState *state = tunnels_.findByPreviousHop(tunnelId);
     if(state != nullptr) {
-        // cleanup tunnel
-        requestEndSession(state->tunnelIdPreviousHop);
-        sessions_.remove(state->tunnelIdPreviousHop);
-
-        // send truncated to source
+        // send truncated to source, while there is a session for it
         PeerToPeerMessage message = PeerToPeerMessage::makeRelayTruncated(state->circIdPreviousHop, 0);
         sendPeerToPeerMessage(message, state->previousHop);
 
-        tunnels_.removeOne(*state);
+        // cleanup tunnel
+        removeRelayTunnel(state);
     }
 }
 
 bool PeerToPeer::sendData(quint32 tunnelId, QByteArray data)
 {
-    // find circuit with end-to-start tunnelid
-    for(QHash<quint32, CircuitState>::iterator it = circuits_.begin(); it != circuits_.end(); it++) {
-        CircuitState &state = it.value();
-        if(state.circuitApiTunnelId == tunnelId) {
-            state.lastMessage = MessageType::ONION_TUNNEL_DATA;
-            PeerToPeerMessage message = PeerToPeerMessage::makeRelayData(0, 0, data);
-            sendPeerToPeerMessage(message, state.hopStates);
-            return true;
+    if(data.size() > PeerToPeerMessage::MaxMessageData) {
+        qDebug() << "write of" << data.size() << "bytes to tunnel" << tunnelId << "is too large, dropping it";
+        return false;
+    }
+
+    // cells as large as the circuit agreed on
+    const PeerToPeerMessage::CellSize cellSize = dataCellSize(tunnelId);
+    const int maxCellData = PeerToPeerMessage::maxCellData(cellSize);
+    if(coalesceDelay_ > 0 && PeerToPeerMessage::RecordHeaderLength + data.size() <= maxCellData) {
+        if(!hasDataTunnel(tunnelId)) {
+            qDebug() << "failed to send data along tunnel" << tunnelId;
+            return false;
+        }
+        coalesceWrite(tunnelId, data);
+        return true;
+    }
+
+    // small writes queued before this one go first
+    flushCoalesced(tunnelId);
+
+    bool compressed = false;
+    if(data.size() >= DataCompressor::MinSize && compressesData(tunnelId)) {
+        QByteArray smaller = DataCompressor::compress(data);
+        if(smaller.size() < data.size()) {
+            data = smaller;
+            compressed = true;
         }
     }
 
+    if(data.size() <= maxCellData) {
+        PeerToPeerMessage message = PeerToPeerMessage::makeRelayData(0, 0, data);
+        message.dataFlags = compressed ? PeerToPeerMessage::DATA_COMPRESSED : 0;
+        return sendRelayData(tunnelId, message);
+    }
+
+    // a burst of fragments, back to back without waiting on the other end
+    if(!hasDataTunnel(tunnelId)) {
+        qDebug() << "failed to send data along tunnel" << tunnelId;
+        return false;
+    }
+    for(PeerToPeerMessage fragment : PeerToPeerMessage::makeRelayDataFragments(0, 0, nextMessageId_++, data, cellSize)) {
+        if(compressed) {
+            fragment.fragmentFlags |= PeerToPeerMessage::FRAGMENT_COMPRESSED;
+        }
+        sendRelayData(tunnelId, fragment);
+    }
+    return true;
+}
+
+bool PeerToPeer::sendRelayData(quint32 tunnelId, PeerToPeerMessage message)
+{
+    // find circuit with end-to-start tunnelid
+    CircuitState *circuit = findCircuitByApiId(tunnelId);
+    if(circuit != nullptr) {
+        circuit->lastMessage = MessageType::ONION_TUNNEL_DATA;
+        sendPeerToPeerMessage(message, circuit->hopStates);
+        return true;
+    }
+
     // find backwards-tunnel with start-us tunnelid
-    TunnelState *tunnel = findTunnelByPreviousHopId(tunnelId);
+    TunnelState *tunnel = tunnels_.findByPreviousHop(tunnelId);
     if(tunnel != nullptr) {
-        PeerToPeerMessage message = PeerToPeerMessage::makeRelayData(tunnel->circIdPreviousHop, 0, data);
+        message.circuitId = tunnel->circIdPreviousHop;
         sendPeerToPeerMessage(message, tunnel->previousHop);
         return true;
     }
@@ -762,6 +1211,98 @@ bool PeerToPeer::sendData(quint32 tunnelId, QByteArray data)
     return false;
 }
 
+bool PeerToPeer::hasDataTunnel(quint32 tunnelId)
+{
+    return findCircuitByApiId(tunnelId) != nullptr || tunnels_.findByPreviousHop(tunnelId) != nullptr;
+}
+
+PeerToPeerMessage::CellSize PeerToPeer::dataCellSize(quint32 tunnelId)
+{
+    CircuitState *circuit = findCircuitByApiId(tunnelId);
+    if(circuit != nullptr) {
+        return circuit->hopStates.last().cellSize;
+    }
+    TunnelState *tunnel = tunnels_.findByPreviousHop(tunnelId);
+    return tunnel != nullptr ? tunnel->cellSize : PeerToPeerMessage::CELL_1K;
+}
+
+bool PeerToPeer::compressesData(quint32 tunnelId)
+{
+    CircuitState *circuit = findCircuitByApiId(tunnelId);
+    if(circuit != nullptr) {
+        return circuit->compress;
+    }
+    TunnelState *tunnel = tunnels_.findByPreviousHop(tunnelId);
+    return tunnel != nullptr && tunnel->compress;
+}
+
+bool PeerToPeer::decompressData(quint32 originatorTunnelId, QByteArray *data)
+{
+    QByteArray decompressed;
+    if(!DataCompressor::decompress(*data, &decompressed)) {
+        qDebug() << "compressed data does not decompress, originator seems to be" << tunnelIds_.describe(originatorTunnelId);
+        return false;
+    }
+    *data = decompressed;
+    TunnelState *tunnel = tunnels_.findByPreviousHop(originatorTunnelId);
+    if(tunnel != nullptr) {
+        tunnel->compress = true;
+    }
+    return true;
+}
+
+void PeerToPeer::coalesceWrite(quint32 tunnelId, const QByteArray &data)
+{
+    const int maxCellData = PeerToPeerMessage::maxCellData(dataCellSize(tunnelId));
+    int recordSize = PeerToPeerMessage::RecordHeaderLength + data.size();
+    if(coalesced_.value(tunnelId).size + recordSize > maxCellData) {
+        // the cell is as full as this write lets it get
+        flushCoalesced(tunnelId);
+    }
+
+    PendingWrites &pending = coalesced_[tunnelId];
+    pending.writes.append(data);
+    pending.size += recordSize;
+
+    if(pending.size + PeerToPeerMessage::RecordHeaderLength >= maxCellData) {
+        // not even a one byte write fits anymore
+        flushCoalesced(tunnelId);
+        return;
+    }
+    if(!coalesceTimer_.isActive()) {
+        coalesceTimer_.start(coalesceDelay_);
+    }
+}
+
+void PeerToPeer::flushCoalesced(quint32 tunnelId)
+{
+    if(!coalesced_.contains(tunnelId)) {
+        return;
+    }
+
+    // a lone write goes out as plain RELAY_DATA
+    PendingWrites pending = coalesced_.take(tunnelId);
+    if(pending.writes.size() == 1) {
+        sendRelayData(tunnelId, PeerToPeerMessage::makeRelayData(0, 0, pending.writes.first()));
+        return;
+    }
+
+    QByteArray records;
+    records.reserve(pending.size);
+    for(const QByteArray &write : pending.writes) {
+        PeerToPeerMessage::appendRecord(&records, write);
+    }
+    sendRelayData(tunnelId, PeerToPeerMessage::makeRelayDataRecords(0, 0, records));
+}
+
+void PeerToPeer::flushAllCoalesced()
+{
+    // one timer for all tunnels, started by the oldest pending write, none waits longer than the delay
+    for(quint32 tunnelId : coalesced_.keys()) {
+        flushCoalesced(tunnelId);
+    }
+}
+
 void PeerToPeer::coverTunnel(quint16 size)
 {
     // get some peers
@@ -769,7 +1310,7 @@ void PeerToPeer::coverTunnel(quint16 size)
     sample.isBuildTunnel = false;
     sample.coverTrafficBytes = size;
 
-    int sampleId = peerSampler_->requestPeers(nHops_ + 1); // add 1 for random dest
+    int sampleId = requestPeerSample(nHops_ + 1); // add 1 for random dest
     pendingPeerSamples_[sampleId] = sample;
     // wait for peersArrived()
 }
@@ -793,7 +1334,7 @@ void PeerToPeer::onEncrypted(quint32 requestId, quint16 sessionId, QByteArray pa
         if(debugLog_) {
             qDebug() << "sending encrypt-once message ->" << storage.debugString;
         }
-        forwardEncryptedMessage(storage.nextHop, storage.nextHopCircuitId, payload);
+        forwardEncryptedMessage(storage.nextHop, storage.nextHopCircuitId, payload, std::move(storage.cell), storage.isCover);
         return;
     }
 
@@ -804,7 +1345,7 @@ void PeerToPeer::onEncrypted(quint32 requestId, quint16 sessionId, QByteArray pa
             if(debugLog_) {
                 qDebug() << "sending encrypt-onion message ->" << storage.debugString;
             }
-            forwardEncryptedMessage(storage.nextHop, storage.nextHopCircuitId, payload);
+            forwardEncryptedMessage(storage.nextHop, storage.nextHopCircuitId, payload, std::move(storage.cell), storage.isCover);
             return;
         }
 
@@ -823,20 +1364,26 @@ void PeerToPeer::onDecrypted(quint32 requestId, QByteArray payload)
     //  b) forward to nexthop
 
     OnionAuthRequest storage = decryptQueue_.take(requestId);
-    PeerToPeerMessage message = PeerToPeerMessage::fromEncryptedPayload(payload, storage.circuitId);
-    message.sender = storage.peer;
+    if(!CellView::hasRelayHeader(payload)) {
+        qDebug() << "decrypted payload too short:" << payload.size();
+        return;
+    }
+
+    // the digest decides if this layer was the last one, only then the payload is decoded
+    if(CellDigest::verify(storage.digestKey, payload)) {
+        PeerToPeerMessage message = PeerToPeerMessage::fromEncryptedPayload(payload, storage.circuitId);
+        message.sender = storage.peer;
 
-    if(message.isValidDigest()) {
         // we need to figure out the sender of this message
         // and pass along the correct circuit ids and sender
         quint32 originatorTunnelId;
         if(storage.type == OnionAuthRequest::DecryptOnce) {
             // original sender is correct, along with circuit id
-            originatorTunnelId = tunnelIds_.tunnelId(storage.peer, storage.circuitId);
+            originatorTunnelId = tunnelIds_.find(storage.peer, storage.circuitId);
         } else if(storage.type == OnionAuthRequest::LayeredDecrypt) {
             // we decrypted <storag.operations> times from the beginning
             // => sender is at circuitHops[operations-1]
-            quint32 circuitTunnelId = tunnelIds_.tunnelId(storage.peer, storage.circuitId);
+            quint32 circuitTunnelId = tunnelIds_.find(storage.peer, storage.circuitId);
             if(!circuits_.contains(circuitTunnelId)) {
                 qDebug() << "successfully decrypted layered message from unknown circuit"
                          << tunnelIds_.describe(circuitTunnelId) << "it probably went down";
@@ -868,7 +1415,7 @@ void PeerToPeer::onDecrypted(quint32 requestId, QByteArray payload)
         if(debugLog_) {
             qDebug() << "forwarding peeled, but still encrypted packet along tunnel" << storage.nextHop.toString();
         }
-        forwardEncryptedMessage(storage.nextHop, storage.nextHopCircuitId, payload);
+        forwardEncryptedMessage(storage.nextHop, storage.nextHopCircuitId, payload, std::move(storage.cell), storage.isCover);
         return;
     }
 
@@ -899,6 +1446,7 @@ void PeerToPeer::onSessionHS1(quint32 requestId, quint16 sessionId, QByteArray h
         if(done) {
             // start building the tunnel
             CircuitState circuit;
+            bool allocated = true;
             for(BuildTunnelPeer hop : it->peers) {
                 HopState hopState;
                 hopState.peer = hop.peer;
@@ -906,14 +1454,33 @@ void PeerToPeer::onSessionHS1(quint32 requestId, quint16 sessionId, QByteArray h
                 hopState.peerHostkey = hop.hostkey;
                 hopState.peerHandshakeHS1 = hop.handshake;
                 hopState.status = Unconnected;
-                hopState.circuitId = tunnelIds_.nextCircId(hopState.peer);
-                hopState.tunnelId = tunnelIds_.tunnelId(hopState.peer, hopState.circuitId);
+                hopState.tunnelId = tunnelIds_.allocate(hopState.peer, &hopState.circuitId);
+                if(hopState.tunnelId == 0) {
+                    allocated = false;
+                    break;
+                }
                 circuit.hopStates.append(hopState);
             }
+            MessageType lastMessage = it->isBuildTunnel ? MessageType::ONION_TUNNEL_BUILD : MessageType::ONION_COVER;
+            if(!allocated) {
+                // no circuit id left towards a hop. nothing was sent yet, give back what the
+                // build holds. the circuit never got an api tunnel id
+                qDebug() << "building circuit failed, no circuit id left towards a hop";
+                for(const HopState &hop : circuit.hopStates) {
+                    releaseTunnelId(hop.tunnelId);
+                }
+                for(const BuildTunnelPeer &hop : it->peers) {
+                    requestEndSession(hop.sessionId);
+                }
+                it = pendingCircuitHandshakes_.erase(it);
+                tunnelError(0, lastMessage);
+                continue;
+            }
             circuit.requesterId = it->requesterId;
             circuit.circuitApiTunnelId = circuit.hopStates.last().tunnelId;
-            circuit.lastMessage = it->isBuildTunnel ? MessageType::ONION_TUNNEL_BUILD : MessageType::ONION_COVER;
+            circuit.lastMessage = lastMessage;
             circuit.remainingCoverData = it->isBuildTunnel ? 0 : it->coverTrafficBytes;
+            circuit.compress = it->isBuildTunnel && compress_;
 
             quint32 circuitId = circuit.hopStates.first().tunnelId;
 
@@ -925,6 +1492,7 @@ void PeerToPeer::onSessionHS1(quint32 requestId, quint16 sessionId, QByteArray h
             circuit.retryEstablishingTimer = retry;
 
             circuits_[circuitId] = circuit;
+            circuitsByApiId_[circuit.circuitApiTunnelId] = circuitId;
             continueBuildingTunnel(circuitId);
             it = pendingCircuitHandshakes_.erase(it);
         } else {
@@ -933,16 +1501,27 @@ void PeerToPeer::onSessionHS1(quint32 requestId, quint16 sessionId, QByteArray h
     }
 }
 
+void PeerToPeer::onAuthError(quint32 requestId)
+{
+    qDebug() << "auth failed request" << requestId;
+    dropIncomingTunnel(requestId);
+    encryptQueue_.remove(requestId);
+    decryptQueue_.remove(requestId);
+}
+
 void PeerToPeer::onSessionHS2(quint32 requestId, quint16 sessionId, QByteArray handshake)
 {
     if(!incomingTunnels_.contains(requestId)) {
+        // or came too late, see dropIncomingTunnel()
         qDebug() << "generated 2nd-half handshake does not match any connection";
+        requestEndSession(sessionId);
         return;
     }
 
 //    qDebug() << "onSessionHS2";
-    quint32 peerTunnelId = incomingTunnels_.take(requestId);
-    Binding previousHop;
+    IncomingTunnel incoming = incomingTunnels_.take(requestId);
+    quint32 peerTunnelId = incoming.tunnelId;
+    Endpoint previousHop;
     quint16 previousHopCircuitId;
     tunnelIds_.decompose(peerTunnelId, &previousHop, &previousHopCircuitId);
 
@@ -951,32 +1530,36 @@ void PeerToPeer::onSessionHS2(quint32 requestId, quint16 sessionId, QByteArray h
     newTunnel.previousHop = previousHop;
     newTunnel.circIdPreviousHop = previousHopCircuitId;
     newTunnel.tunnelIdPreviousHop = peerTunnelId;
+    // the source derives the same key from the handshake in CREATED/RELAY_EXTENDED
+    newTunnel.digestKey = CellDigest::deriveKey(handshake);
+    newTunnel.cellSize = incoming.cellSize;
+    TunnelState *existing = tunnels_.findByPreviousHop(peerTunnelId);
+    if(existing == nullptr) {
+        tunnels_.insert(newTunnel);
+    } else if(existing->hasNextHop() || pendingTunnelExtensions_.key(peerTunnelId) != 0) {
+        // a second BUILD for a tunnel that is in use already, the first one stays
+        requestEndSession(sessionId);
+        return;
+    } else {
+        // the source sent BUILD again, our CREATED got lost. it only knows the new handshake
+        requestEndSession(sessions_.get(peerTunnelId));
+        existing->digestKey = newTunnel.digestKey;
+        existing->cellSize = newTunnel.cellSize;
+    }
     // setup session established with other side
     sessions_.set(peerTunnelId, sessionId);
 
-    tunnels_.append(newTunnel);
-
     // send back handshake in a CREATED message
     PeerToPeerMessage created = PeerToPeerMessage::makeCreated(previousHopCircuitId, handshake);
-    QNetworkDatagram dgram = created.toDatagram(previousHop);
-    dgram.setSender(interface_, port_);
+    created.packing = cellPacking_;
+    created.circuitCellSize = incoming.cellSize;
     if(debugLog_) {
         qDebug() << "incoming tunnel -> sent CREATED to" << previousHop.toString();
     }
-    if(socket_.writeDatagram(dgram) == -1) {
-        qDebug() << "send failed ->" << socket_.error() << socket_.errorString();
-    }
+    transport_.send(previousHop, created.toBytes());
 
     // announce tunnel
-    tunnelIncoming(peerTunnelId);
-}
-
-bool PeerToPeer::TunnelState::operator ==(const PeerToPeer::TunnelState &other) const
-{
-    return previousHop == other.previousHop &&
-            nextHop == other.nextHop &&
-            circIdPreviousHop == other.circIdPreviousHop &&
-            circIdNextHop == other.circIdNextHop &&
-            tunnelIdPreviousHop == other.tunnelIdPreviousHop &&
-            tunnelIdNextHop == other.tunnelIdNextHop;
+    if(existing == nullptr) {
+        tunnelIncoming(peerTunnelId);
+    }
 }
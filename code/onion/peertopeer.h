@@ -5,12 +5,19 @@
 #include <QObject>
 #include <QUdpSocket>
 #include <QTcpSocket>
+#include <QTimer>
 
-#include "binding.h"
+#include "endpoint.h"
+#include "celldigest.h"
+#include "cellscheduler.h"
+#include "datagramengine.h"
+#include "fragmentassembler.h"
 #include "messagetypes.h"
 #include "peertopeermessage.h"
+#include "requestslots.h"
 #include "sessionkeystore.h"
 #include "tunnelidmapper.h"
+#include "tunneltable.h"
 #include "peersampler.h"
 
 // represents the UDP best effort connection to other onion modules.
@@ -26,19 +33,63 @@ public:
     int port() const;
     void setPort(int port);
 
-    bool start();
+    Q_INVOKABLE bool start();
+
+    // kernel buffers of the p2p socket in bytes, 0 for the system default. before start()
+    void setSocketBufferSizes(int receive, int send);
+
+    // receive through io_uring instead of recvmmsg, linux only. before start()
+    void setIoUring(bool ioUring);
+    // UDP GSO/GRO for runs of cells to one neighbour, linux only. before start()
+    void setSegmentationOffload(bool offload);
+    // offer neighbours to pack up to cells full cells into one datagram, as many as fit the
+    // path mtu in bytes. they answer with their own limit in BUILD/CREATED, the smaller one is
+    // used for the link. not with several shards, see start(). before start()
+    void setCellPacking(int cells, int pathMtu);
+    // the largest cells in bytes we offer and accept, one of the PeerToPeerMessage::CellSize lengths.
+    // every hop of a circuit agrees to at most what the hop before it offered, see peertopeermessage.h.
+    // before start()
+    void setMaxCellSize(int bytes);
+
+    // paces relayed cells to each neighbour, 0 cells per second sends them right away
+    void setNeighbourRate(int cellsPerSecond, int burst);
+    // small writes to a tunnel wait up to msecs for more to share their cell, see sendData().
+    // 0 sends every write in a cell of its own
+    void setCoalesceDelay(int msecs);
+    // compress writes to the tunnels we build, see DataCompressor. the other end of a tunnel
+    // compresses its writes back once compressed data came in. writes that do not get smaller
+    // go out as they are, small ones that get coalesced too
+    void setCompression(bool compress);
+
+    // run as shard index of count in a sharded relay, see ShardedPeerToPeer. before start()
+    void setShard(int index, int count);
+    int shardIndex() const;
 
     int nHops() const;
     void setNHops(int nHops);
 
+    // without one, samples are asked for with requestPeers(), see ShardedPeerToPeer
     void setPeerSampler(PeerSampler *sampler);
     
     void setDebugLog(bool debugLog);
 
+    DatagramEngine::Stats transportStats() const;
+    // datagrams the kernel dropped because we did not read fast enough, see DatagramEngine::Stats
+    quint64 kernelDrops() const;
+    int egressQueueDepth(Endpoint neighbour) const;
+    CellPool::Stats cellStats() const;
+    CellScheduler::Stats schedulerStats() const;
+    FragmentAssembler::Stats fragmentStats() const;
+    // of tunnels, circuit hops and BUILDs waiting for auth, each with its route
+    int liveTunnelIds() const;
+
 public slots:
     // from OnionApi
     void buildTunnel(QHostAddress destinationAddr, quint16 destinationPort, QByteArray hostkey, QTcpSocket *requestId);
     void destroyTunnel(quint32 tunnelId);
+    // with a coalesce delay, writes that fit a cell together are sent as one RELAY_DATA_RECORDS.
+    // writes larger than a cell go out as RELAY_DATA_FRAGMENTs, up to MaxMessageData bytes.
+    // compressed first on tunnels that compress, see setCompression()
     bool sendData(quint32 tunnelId, QByteArray data);
     void coverTunnel(quint16 size);
 
@@ -48,6 +99,7 @@ public slots:
 
     void onSessionHS1(quint32 requestId, quint16 sessionId, QByteArray handshake);
     void onSessionHS2(quint32 requestId, quint16 sessionId, QByteArray handshake);
+    void onAuthError(quint32 requestId);
 
 signals:
     // for OnionApi
@@ -70,6 +122,9 @@ signals:
 
     void requestEndSession(quint16 session);
 
+    // for the sampler of a relay shard, answered with peersArrived(id, peers)
+    void requestPeers(int id, int n);
+
 private:    // structs
     enum HopStatus {
         Unconnected,
@@ -81,13 +136,16 @@ private:    // structs
     struct HopState {
         QByteArray peerHostkey;
         QByteArray peerHandshakeHS1; // us -> him
-        Binding peer;
+        Endpoint peer;
         quint16 circuitId = 0;
         quint32 tunnelId = 0;
 
         HopStatus status = Unconnected;
+        int retries = 0; // BUILDs sent again, first hop only
 
         quint16 sessionKey; // with this peer
+        CellDigest::Key digestKey; // from his handshake answer, for cells between him and us
+        PeerToPeerMessage::CellSize cellSize = PeerToPeerMessage::CELL_1K; // of cells to this hop
     };
 
     // state of a circuit (src==us, a, b, ..., dest)
@@ -98,24 +156,11 @@ private:    // structs
         MessageType lastMessage;
 
         int remainingCoverData = 0; // if this is a cover tunnel
+        bool compress = false; // writes to it, see setCompression()
         QTcpSocket *requesterId = nullptr;
         QTimer *retryEstablishingTimer = nullptr;
     };
 
-    struct TunnelState {
-        Binding previousHop;
-        Binding nextHop;
-
-        quint16 circIdPreviousHop = 0;
-        quint16 circIdNextHop = 0;
-
-        quint32 tunnelIdPreviousHop = 0;
-        quint32 tunnelIdNextHop = 0;
-
-        bool hasNextHop() const { return nextHop.isValid(); }
-        bool operator ==(const TunnelState &other) const;
-    };
-
     struct OnionAuthRequest {
         // save additional data to payload here
         enum ReqType {
@@ -129,14 +174,23 @@ private:    // structs
         QVector<HopState> remainingHops; // remaining for encryption/decryption
         quint16 circuitId; // original circid
 
-        Binding peer; // source
-        Binding nextHop; // dest - if applicable
+        Endpoint peer; // source
+        Endpoint nextHop; // dest - if applicable
         quint16 nextHopCircuitId; // dest - if applicable
         int operations = 0; // number of decrypts/encrypts on this request
+        CellDigest::Key digestKey; // of the hop whose layer the pending decrypt peels
 
+        CellBuffer cell; // the received cell, auth reads its payload in place. reused to forward
+        bool isCover = false; // we originated cover traffic, first to go if the egress queue is full
         QString debugString;
     };
 
+    // a BUILD waiting for auth to answer the handshake
+    struct IncomingTunnel {
+        quint32 tunnelId = 0;
+        PeerToPeerMessage::CellSize cellSize = PeerToPeerMessage::CELL_1K; // we agreed to
+    };
+
     struct PeerSample {
         bool isBuildTunnel = false;
         PeerSampler::Peer dest;
@@ -145,13 +199,19 @@ private:    // structs
     };
 
     struct BuildTunnelPeer {
-        Binding peer;
+        Endpoint peer;
         QByteArray hostkey;
         QByteArray handshake;
         quint32 authRequestId = 0;
         quint16 sessionId;
     };
 
+    // small writes to one tunnel waiting for the coalesce timer
+    struct PendingWrites {
+        QList<QByteArray> writes;
+        int size = 0; // as records
+    };
+
     struct CircuitHandshakes {
         bool isBuildTunnel = false;
         quint16 coverTrafficBytes;
@@ -161,10 +221,13 @@ private:    // structs
 
 private slots:
     void onDatagram();
-    void handleDatagram(QNetworkDatagram datagram);
+    // index into receiveBatch_, receiveHeaders_ and receiveTunnelIds_
+    void handleDatagram(const DatagramEngine::Datagram &datagram, int index);
 
     void handleBuild(PeerToPeerMessage message);
     void handleCreated(PeerToPeerMessage message);
+    // link packing with the sender of a BUILD/CREATED, see setCellPacking()
+    void negotiatePacking(const PeerToPeerMessage &message);
 
     // it is actually for us and decrypted
     void handleMessage(PeerToPeerMessage message, quint32 originatorTunnelId);
@@ -172,51 +235,98 @@ private slots:
     void continueLayeredDecrypt(OnionAuthRequest request, QByteArray payload);
     void continueLayeredEncrypt(OnionAuthRequest request, QByteArray payload);
 
-    void forwardEncryptedMessage(Binding to, quint16 circuitId, QByteArray payload);
-    void sendPeerToPeerMessage(PeerToPeerMessage unencrypted, Binding target);
+    void forwardEncryptedMessage(Endpoint to, quint16 circuitId, QByteArray payload, CellBuffer cell = CellBuffer(), bool isCover = false);
+    void sendCell(Endpoint to, CellBuffer cell, bool isCover);
+    void sendPeerToPeerMessage(PeerToPeerMessage unencrypted, Endpoint target);
     void sendPeerToPeerMessage(PeerToPeerMessage unencrypted, QVector<HopState> tunnel);
 
     void tearCircuit(quint32 tunnelId, bool clean); // sends destroy messages along the circuit
     void cleanCircuit(quint32 tunnelId); // cleans up resources
+    void removeRelayTunnel(TunnelState *state); // and its tunnel ids
+    void dropIncomingTunnel(quint32 requestId); // a BUILD auth did not answer
+    void releaseTunnelId(quint32 tunnelId); // and the link state of an unused neighbour
 
     void peersArrived(int id, QList<PeerSampler::Peer> peers);
     void continueBuildingTunnel(quint32 id, bool isRetry = false);
+    // another circuit id towards the first hop of circuit id, the new id of the circuit
+    quint32 renumberFirstHop(quint32 id);
     void sendCoverData(quint32 tunnelId);
 
-    void disconnectPeer(Binding who);
+    bool sendRelayData(quint32 tunnelId, PeerToPeerMessage message);
+    bool hasDataTunnel(quint32 tunnelId);
+    // of the cells that carry data of an api tunnel, CELL_1K for unknown tunnels
+    PeerToPeerMessage::CellSize dataCellSize(quint32 tunnelId);
+    bool compressesData(quint32 tunnelId);
+    // a compressed write that came in from originatorTunnelId, false if it does not decompress.
+    // we answer compressed on that tunnel from then on
+    bool decompressData(quint32 originatorTunnelId, QByteArray *data);
+    void coalesceWrite(quint32 tunnelId, const QByteArray &data);
+    void flushCoalesced(quint32 tunnelId);
+    void flushAllCoalesced();
+
+    void disconnectPeer(Endpoint who);
 private:
+    quint32 nextAuthRequestId();
+    int requestPeerSample(int n);
+
     TunnelIdMapper tunnelIds_;
 
     // maps a peer to our auth session id with that peer
     SessionKeystore sessions_;
 
-    // all hashed by requestId as sent to auth
-    QHash<quint32, OnionAuthRequest> encryptQueue_;
-    QHash<quint32, OnionAuthRequest> decryptQueue_;
-    QHash<quint32, quint32> incomingTunnels_; // hashes auth reqId -> tunnelId
+    // all by requestId as sent to auth. relayed cells wait in these, so they allocate nothing
+    RequestSlots<OnionAuthRequest> encryptQueue_;
+    RequestSlots<OnionAuthRequest> decryptQueue_;
+    QHash<quint32, IncomingTunnel> incomingTunnels_; // hashed by auth reqId
     quint32 nextAuthRequest_ = 1;
 
     // hashes tunnelId of CREATED message to tunnelId of previous hop for a relay_extend
     QHash<quint32, quint32> pendingTunnelExtensions_;
 
     QHash<int, PeerSample> pendingPeerSamples_;
+    int nextPeerSample_ = 1; // without a sampler of our own
     QList<CircuitHandshakes> pendingCircuitHandshakes_;
 
     // we're source here, tunnelId is src<->a
     // tunnelId propagated to API is src<->dst!!
     QHash<quint32, CircuitState> circuits_;
+    // api tunnel id -> key of its circuit in circuits_, every write to a tunnel looks it up
+    QHash<quint32, quint32> circuitsByApiId_;
+    // the circuit of an api tunnel, nullptr if there is none. valid until circuits_ changes
+    CircuitState *findCircuitByApiId(quint32 tunnelId);
     // we're in the path, thus two valid tunnelIds: a <-> us <-> b
-    QList<TunnelState> tunnels_;
+    TunnelTable tunnels_;
     quint32 nextTunnelId_ = 1;
 
-    TunnelState *findTunnelByPreviousHopId(quint32 tId);
-    TunnelState *findTunnelByNextHopId(quint32 tId);
+    DatagramEngine transport_;
+    CellScheduler scheduler_;
+    QVector<DatagramEngine::Datagram> receiveBatch_;
+    PeerToPeerMessage::HeaderBatch receiveHeaders_;
+    QVector<RouteKey> receiveKeys_;
+    QVector<quint32> receiveTunnelIds_; // 0 for cells of circuits we do not know
+
+    // by api tunnel id
+    QHash<quint32, PendingWrites> coalesced_;
+    QTimer coalesceTimer_;
+    int coalesceDelay_ = 0;
+    bool compress_ = false;
 
-    QUdpSocket socket_;
+    // writes that came in fragments, by originator tunnel id
+    FragmentAssembler fragments_;
+    quint16 nextMessageId_ = 0;
 
     QHostAddress interface_;
     int port_;
     int nHops_ = 2;
+    int receiveBufferSize_ = 0;
+    int sendBufferSize_ = 0;
+    bool ioUring_ = false;
+    bool segmentationOffload_ = false;
+    int cellPacking_ = 1;
+    PeerToPeerMessage::CellSize maxCellSize_ = PeerToPeerMessage::CELL_1K;
+
+    int shardIndex_ = 0;
+    int shardCount_ = 1;
 
     PeerSampler *peerSampler_ = nullptr;
 
@@ -1,4 +1,5 @@
 #include "peertopeermessage.h"
+#include "cellcodec.h"
 #include <QDebug>
 
 PeerToPeerMessage::PeerToPeerMessage()
@@ -28,6 +29,10 @@ QString PeerToPeerMessage::typeString() const
             return "ENCRYPTED -> CMD_DESTROY";
         case PeerToPeerMessage::CMD_COVER:
             return "ENCRYPTED -> CMD_COVER";
+        case PeerToPeerMessage::RELAY_DATA_RECORDS:
+            return "ENCRYPTED -> RELAY_DATA_RECORDS";
+        case PeerToPeerMessage::RELAY_DATA_FRAGMENT:
+            return "ENCRYPTED -> RELAY_DATA_FRAGMENT";
         default:
             return "ENCRYPTED <invalid>";
         }
@@ -38,18 +43,6 @@ QString PeerToPeerMessage::typeString() const
     }
 }
 
-void PeerToPeerMessage::calculateDigest()
-{
-    // digest is mock (not crc) for now -> 0
-    digest = 0;
-}
-
-bool PeerToPeerMessage::isValidDigest() const
-{
-    // digest is mock for now -> correct if 0
-    return digest == 0;
-}
-
 PeerToPeerMessage PeerToPeerMessage::makeBuild(quint16 circId, QByteArray handshake)
 {
     PeerToPeerMessage msg;
@@ -76,21 +69,19 @@ PeerToPeerMessage PeerToPeerMessage::makeRelayData(quint16 circId, quint16 strea
     msg.command = PeerToPeerMessage::RELAY_DATA;
     msg.streamId = streamId;
     msg.data = data;
-    msg.calculateDigest();
     return msg;
 }
 
-PeerToPeerMessage PeerToPeerMessage::makeRelayExtend(quint16 circId, quint16 streamId, Binding targetAddress, QByteArray handshake)
+PeerToPeerMessage PeerToPeerMessage::makeRelayExtend(quint16 circId, quint16 streamId, Endpoint targetAddress, QByteArray handshake)
 {
     PeerToPeerMessage msg;
     msg.celltype = PeerToPeerMessage::ENCRYPTED;
     msg.circuitId = circId;
     msg.command = PeerToPeerMessage::RELAY_EXTEND;
     msg.streamId = streamId;
-    msg.address = targetAddress.address;
+    msg.address = targetAddress.hostAddress();
     msg.port = targetAddress.port;
     msg.data = handshake;
-    msg.calculateDigest();
     return msg;
 }
 
@@ -102,7 +93,6 @@ PeerToPeerMessage PeerToPeerMessage::makeRelayExtended(quint16 circId, quint16 s
     msg.command = PeerToPeerMessage::RELAY_EXTENDED;
     msg.streamId = streamId;
     msg.data = handshake;
-    msg.calculateDigest();
     return msg;
 }
 
@@ -113,7 +103,6 @@ PeerToPeerMessage PeerToPeerMessage::makeRelayTruncated(quint16 circId, quint16
     msg.circuitId = circId;
     msg.command = PeerToPeerMessage::RELAY_TRUNCATED;
     msg.streamId = streamId;
-    msg.calculateDigest();
     return msg;
 }
 
@@ -124,7 +113,6 @@ PeerToPeerMessage PeerToPeerMessage::makeCommandDestroy(quint16 circId)
     msg.circuitId = circId;
     msg.command = PeerToPeerMessage::CMD_DESTROY;
     msg.streamId = 0;
-    msg.calculateDigest();
     return msg;
 }
 
@@ -135,118 +123,160 @@ PeerToPeerMessage PeerToPeerMessage::makeCommandCover(quint16 circId)
     msg.circuitId = circId;
     msg.command = PeerToPeerMessage::CMD_COVER;
     msg.streamId = 0;
-    msg.calculateDigest();
     return msg;
 }
 
+PeerToPeerMessage PeerToPeerMessage::makeRelayDataRecords(quint16 circId, quint16 streamId, QByteArray records)
+{
+    PeerToPeerMessage msg = makeRelayData(circId, streamId, records);
+    msg.command = PeerToPeerMessage::RELAY_DATA_RECORDS;
+    return msg;
+}
+
+void PeerToPeerMessage::appendRecord(QByteArray *records, const QByteArray &record)
+{
+    char length[RecordHeaderLength];
+    qToBigEndian<quint16>(record.size(), length);
+    records->append(length, RecordHeaderLength);
+    records->append(record);
+}
+
+bool PeerToPeerMessage::splitRecords(const QByteArray &records, QList<QByteArray> *out)
+{
+    CellReader reader(records.constData(), records.size());
+    while(!reader.atEnd()) {
+        quint16 size = reader.get<quint16>();
+        QByteArray record = reader.getRaw(size);
+        if(!reader.ok()) {
+            return false;
+        }
+        out->append(record);
+    }
+    return true;
+}
+
+int PeerToPeerMessage::cellSizeOf(int length)
+{
+    for(int size = CELL_1K; size <= CELL_MAX; size++) {
+        if(length == cellLength(static_cast<CellSize>(size))) {
+            return size;
+        }
+    }
+    return -1;
+}
+
+QList<PeerToPeerMessage> PeerToPeerMessage::makeRelayDataFragments(quint16 circId, quint16 streamId, quint16 messageId, const QByteArray &data,
+                                                                   CellSize cellSize)
+{
+    Q_ASSERT(data.size() <= MaxMessageData);
+    const int fragmentData = maxFragmentData(cellSize);
+    QList<PeerToPeerMessage> fragments;
+    int offset = 0;
+    do {
+        PeerToPeerMessage msg = makeRelayData(circId, streamId, data.mid(offset, fragmentData));
+        msg.command = PeerToPeerMessage::RELAY_DATA_FRAGMENT;
+        msg.cellSize = cellSize;
+        msg.messageId = messageId;
+        msg.fragmentIndex = fragments.size();
+        offset += fragmentData;
+        if(offset >= data.size()) {
+            msg.fragmentFlags = FRAGMENT_FINAL;
+        }
+        fragments.append(msg);
+    } while(offset < data.size());
+    return fragments;
+}
+
 PeerToPeerMessage PeerToPeerMessage::fromDatagram(QNetworkDatagram dgram)
 {
     PeerToPeerMessage msg = fromBytes(dgram.data());
-    msg.sender = Binding(dgram.senderAddress(), dgram.senderPort());
+    msg.sender = Endpoint(dgram.senderAddress(), dgram.senderPort());
     return msg;
 }
 
 PeerToPeerMessage PeerToPeerMessage::fromBytes(QByteArray fullPacket)
 {
-    if(fullPacket.size() != MESSAGE_LENGTH) {
+    if(cellSizeOf(fullPacket.size()) < 0) {
         qDebug() << "invalid packet size in fromBytes, got" << fullPacket.size();
         PeerToPeerMessage response;
         response.malformed = true;
         return response;
     }
 
-    // parse messagetype byte
-    QDataStream stream(fullPacket);
-    stream.setByteOrder(QDataStream::BigEndian);
-
-    // first byte
-    quint8 ctypeChar;
-    quint16 circId;
-    stream >> ctypeChar >> circId;
-    PeerToPeerMessage::Celltype ctype = static_cast<PeerToPeerMessage::Celltype>(ctypeChar);
+    // parse messagetype byte and circuit id
+    PeerToPeerMessage header;
+    CellReader reader(fullPacket.constData(), fullPacket.size());
+    CellHeaderLayout::decode(reader, &header);
 
     // for 01/02 parse full packet, otherwise forward to fromDecrypted
-    if(ctype == PeerToPeerMessage::BUILD || ctype == PeerToPeerMessage::CREATED) {
+    if(header.celltype == PeerToPeerMessage::BUILD || header.celltype == PeerToPeerMessage::CREATED) {
         // | 01/02 | circId | handshake_len (2B) | handshake
-        QByteArray handshake;
-        bool ok = readPayload(stream, &handshake);
         PeerToPeerMessage result;
-        result.celltype = ctype;
-        result.circuitId = circId;
-        result.data = handshake;
+        if(fullPacket.size() != MESSAGE_LENGTH) {
+            qDebug() << "handshake cell of" << fullPacket.size() << "bytes";
+            result.malformed = true;
+            return result;
+        }
+        CellReader handshake(fullPacket.constData(), fullPacket.size());
+        bool ok = HandshakeLayout::decode(handshake, &result);
         result.malformed = !ok;
+        if(ok) {
+            readExtensions(handshake, &result);
+        }
 
         return result;
     }
 
-    if(ctype != PeerToPeerMessage::ENCRYPTED) {
-        qDebug() << "invalid celltype fromBytes, got" << ctype;
+    if(header.celltype != PeerToPeerMessage::ENCRYPTED) {
+        qDebug() << "invalid celltype fromBytes, got" << header.celltype;
         PeerToPeerMessage response;
         response.malformed = true;
         return response;
     }
 
-    QByteArray payload = fullPacket.mid(3);
-    PeerToPeerMessage fromEncrypted = fromEncryptedPayload(payload, false); // should still be encrypted
+    // should still be encrypted
+    QByteArray payload = QByteArray::fromRawData(fullPacket.constData() + UNENCRYPTED_HEADER_LEN,
+                                                 fullPacket.size() - UNENCRYPTED_HEADER_LEN);
+    PeerToPeerMessage fromEncrypted = fromEncryptedPayload(payload);
     // set what we parsed
-    fromEncrypted.circuitId = circId;
-    fromEncrypted.celltype = ctype;
+    fromEncrypted.circuitId = header.circuitId;
+    fromEncrypted.celltype = header.celltype;
     return fromEncrypted;
 }
 
 PeerToPeerMessage PeerToPeerMessage::fromEncryptedPayload(QByteArray encryptedMessage)
 {
-    QDataStream stream(encryptedMessage);
-    stream.setByteOrder(QDataStream::BigEndian);
+    CellReader reader(encryptedMessage.constData(), encryptedMessage.size());
 
     // parse relay header
     PeerToPeerMessage message;
     message.celltype = PeerToPeerMessage::ENCRYPTED;
-    quint8 commandChar;
-    stream >> commandChar >> message.digest >> message.streamId;
-
-    if(!message.isValidDigest()) {
-        // message is still encrypted
+    int cellSize = cellSizeOf(encryptedMessage.size() + UNENCRYPTED_HEADER_LEN);
+    message.cellSize = cellSize < 0 ? CELL_1K : static_cast<CellSize>(cellSize);
+    if(!RelayHeaderLayout::decode(reader, &message)) {
+        qDebug() << "relay header cut short, got" << encryptedMessage.size() << "bytes";
         message.command = PeerToPeerMessage::CMD_INVALID;
+        message.malformed = true;
         return message;
     }
 
-    // parse fully, stream is now at start of command payload
-    message.command = static_cast<PeerToPeerMessage::Commandtype>(commandChar);
-
+    // parse fully, reader is now at start of command payload. the caller verified the digest,
+    // a payload that is still encrypted does not get here
     switch (message.command) {
     case PeerToPeerMessage::RELAY_DATA:
-        // data_size (2B) | data
-        message.malformed = !readPayload(stream, &message.data);
+        message.malformed = !RelayDataLayout::decode(reader, &message);
         break;
-    case PeerToPeerMessage::RELAY_EXTEND:
-        // ip_v (1B) | ip (4B/16B) | port (2B) | handshake_len (2B) | handshake
-    {
-        quint8 ipv;
-        stream >> ipv;
-        if(ipv == 4) {
-            quint32 ip;
-            stream >> ip;
-            message.address.setAddress(ip);
-        } else if(ipv == 6) {
-            QByteArray ipArr;
-            ipArr.resize(16);
-            stream.readRawData(ipArr.data(), 16);
-            message.address.setAddress(reinterpret_cast<quint8*>(ipArr.data()));
-        } else {
-            qDebug() << "IPV invalid in RELAY_EXTEND message" << ipv;
-            message.malformed = true;
-        }
-        stream >> message.port;
-        bool ok = readPayload(stream, &message.data);
-        if(!ok) {
-            message.malformed = true;
-        }
-    }
+    case PeerToPeerMessage::RELAY_DATA_RECORDS:
+        message.malformed = !RelayPayloadLayout::decode(reader, &message);
         break;
     case PeerToPeerMessage::RELAY_EXTENDED:
-        // handshake_len (2B) | handshake
-        message.malformed = !readPayload(stream, &message.data);
+        message.malformed = !RelayExtendedLayout::decode(reader, &message);
+        break;
+    case PeerToPeerMessage::RELAY_DATA_FRAGMENT:
+        message.malformed = !RelayFragmentLayout::decode(reader, &message);
+        break;
+    case PeerToPeerMessage::RELAY_EXTEND:
+        message.malformed = !RelayExtendLayout::decode(reader, &message);
         break;
     case PeerToPeerMessage::RELAY_TRUNCATED:
     case PeerToPeerMessage::CMD_DESTROY:
@@ -270,48 +300,71 @@ PeerToPeerMessage PeerToPeerMessage::fromEncryptedPayload(QByteArray encryptedMe
     return message;
 }
 
+int PeerToPeerMessage::wireLength() const
+{
+    return celltype == ENCRYPTED ? cellLength(cellSize) : MESSAGE_LENGTH;
+}
+
 QByteArray PeerToPeerMessage::toEncryptedPayload() const
 {
-    QByteArray payload;
-    QDataStream stream(&payload, QIODevice::ReadWrite);
-    stream.setByteOrder(QDataStream::BigEndian);
+    QByteArray payload(wireLength() - UNENCRYPTED_HEADER_LEN, Qt::Uninitialized);
+    writeEncryptedPayload(payload.data());
+    return payload;
+}
 
-    // write header
-    stream << static_cast<quint8>(command) << digest << streamId;
+QByteArray PeerToPeerMessage::toBytes() const
+{
+    if(celltype != BUILD && celltype != CREATED && celltype != ENCRYPTED) {
+        qDebug() << "invalid celltype in toBytes" << celltype;
+        return QByteArray();
+    }
+
+    QByteArray packet(wireLength(), Qt::Uninitialized);
+    writeCell(packet.data());
+    return packet;
+}
+
+void PeerToPeerMessage::writeCell(char *cell) const
+{
+    CellWriter writer(cell, wireLength());
+    if(celltype == BUILD || celltype == CREATED) {
+        // 01/02 | circId | handshake_len | handshake
+        HandshakeLayout::encode(writer, *this);
+        writeExtensions(writer);
+        // not random, random padding could start with EXTENSIONS_MAGIC
+        writer.pad();
+        return;
+    }
+
+    CellHeaderLayout::encode(writer, *this);
+    writeEncryptedPayload(cell + UNENCRYPTED_HEADER_LEN);
+}
+
+void PeerToPeerMessage::writeEncryptedPayload(char *payload) const
+{
+    CellWriter writer(payload, wireLength() - UNENCRYPTED_HEADER_LEN);
+    RelayHeaderLayout::encode(writer, *this);
 
     // write command payload
     switch (command) {
     case PeerToPeerMessage::RELAY_DATA:
-        // data_size (2B) | data
-        writePayload(stream, data);
+        RelayDataLayout::encode(writer, *this);
         break;
-    case PeerToPeerMessage::RELAY_EXTEND:
-        // ip_v (1B) | ip (4B/16B) | port (2B) | handshake_len (2B) | handshake
-    {
-        if(address.isNull()) {
-            qDebug() << "invalid hostaddress while building RELAY_EXTEND message";
-        }
-        bool ipv4 = address.protocol() == QAbstractSocket::IPv4Protocol;
-        stream << static_cast<quint8>(ipv4 ? 4 : 6);
-        if(ipv4) {
-            stream << address.toIPv4Address();
-        } else {
-            Q_IPV6ADDR addr = address.toIPv6Address();
-            for(int i = 0; i < 16; i++) {
-                stream << addr[i];
-            }
-        }
-        stream << port;
-        writePayload(stream, data);
-    }
+    case PeerToPeerMessage::RELAY_DATA_RECORDS:
+        RelayPayloadLayout::encode(writer, *this);
         break;
     case PeerToPeerMessage::RELAY_EXTENDED:
-        // handshake_len (2B) | handshake
-        writePayload(stream, data);
+        RelayExtendedLayout::encode(writer, *this);
+        break;
+    case PeerToPeerMessage::RELAY_DATA_FRAGMENT:
+        RelayFragmentLayout::encode(writer, *this);
+        break;
+    case PeerToPeerMessage::RELAY_EXTEND:
+        RelayExtendLayout::encode(writer, *this);
         break;
     case PeerToPeerMessage::RELAY_TRUNCATED:
     case PeerToPeerMessage::CMD_DESTROY:
-    case PeerToPeerMessage::CMD_COVER: // padding also fills data up, so no extra random data.
+    case PeerToPeerMessage::CMD_COVER: // the random padding is the cover data
         // no more data to write
         break;
     case PeerToPeerMessage::CMD_INVALID:
@@ -320,36 +373,14 @@ QByteArray PeerToPeerMessage::toEncryptedPayload() const
         break;
     }
 
-    return pad(payload, MESSAGE_LENGTH - 3); // we're not a full packet
-}
-
-QByteArray PeerToPeerMessage::toBytes() const
-{
-    QByteArray packet;
-    QDataStream stream(&packet, QIODevice::ReadWrite);
-    stream.setByteOrder(QDataStream::BigEndian);
-
-    if(celltype == BUILD || celltype == CREATED) {
-        // 01/02 | circId | handshake_len | handshake
-        stream << static_cast<quint8>(celltype);
-        stream << circuitId;
-        writePayload(stream, data);
-        return pad(packet, MESSAGE_LENGTH);
-    }
-
-    if(celltype == ENCRYPTED) {
-        stream << static_cast<quint8>(celltype);
-        stream << circuitId;
-        QByteArray payload = toEncryptedPayload();
-        stream.writeRawData(payload.data(), payload.size());
-        return packet;
+    if(!writer.ok()) {
+        qDebug() << typeString() << "does not fit a cell, cut short";
     }
-
-    qDebug() << "invalid celltype in toBytes" << celltype;
-    return QByteArray();
+    // we're not a full packet. random, so short and cover cells look like any other
+    writer.padRandom();
 }
 
-QNetworkDatagram PeerToPeerMessage::toDatagram(Binding target) const
+QNetworkDatagram PeerToPeerMessage::toDatagram(Endpoint target) const
 {
     QByteArray data = toBytes();
     if(!target.isValid()) {
@@ -360,56 +391,130 @@ QNetworkDatagram PeerToPeerMessage::toDatagram(Binding target) const
         qDebug() << "toDatagram -> invalid target and unset sender in P2PMessage. Datagram will fail to send.";
     }
 
-    QNetworkDatagram dgram(data, target.address, target.port);
+    QNetworkDatagram dgram(data, target.hostAddress(), target.port);
     return dgram;
 }
 
-QByteArray PeerToPeerMessage::pad(QByteArray packet, int length)
+void PeerToPeerMessage::readExtensions(CellReader &reader, PeerToPeerMessage *message)
 {
-    QByteArray padding(length - packet.size(), '?');
-    padding.prepend(packet);
-    return padding;
+    if(reader.get<quint8>() != EXTENSIONS_MAGIC) {
+        return; // padding, all defaults
+    }
+
+    while(!reader.atEnd()) {
+        quint8 type = reader.get<quint8>();
+        if(type == EXT_END) {
+            return;
+        }
+        quint8 length = reader.get<quint8>();
+        QByteArray value = reader.getRaw(length);
+        if(!reader.ok()) {
+            qDebug() << "truncated extension" << type;
+            return;
+        }
+
+        switch(type) {
+        case EXT_PACKING:
+            if(length == 1) {
+                message->packing = qMax<quint8>(1, (quint8)value[0]);
+            }
+            break;
+        case EXT_CELL_SIZE:
+            if(length == 1) {
+                // a size we do not know is larger than all we do
+                message->circuitCellSize = static_cast<CellSize>(qMin<quint8>(CELL_MAX, (quint8)value[0]));
+            }
+            break;
+        default:
+            // newer peer, ignore
+            break;
+        }
+    }
 }
 
-bool readPayload(QDataStream &stream, QByteArray *target, quint16 maxSize)
+void PeerToPeerMessage::writeExtensions(CellWriter &writer) const
 {
-    quint16 size;
-    stream >> size;
-
-    if(size > maxSize) {
-        qDebug() << "unreasonable payload size to read" << size;
-        return false;
+    // | type | len | value, the defaults are left out
+    char extensions[6];
+    int size = 0;
+    if(packing > 1) {
+        extensions[size++] = (char)EXT_PACKING;
+        extensions[size++] = 1;
+        extensions[size++] = (char)packing;
+    }
+    if(circuitCellSize != CELL_1K) {
+        extensions[size++] = (char)EXT_CELL_SIZE;
+        extensions[size++] = 1;
+        extensions[size++] = (char)circuitCellSize;
+    }
+    if(size == 0) {
+        return;
     }
 
-    QByteArray data;
-    data.resize(size);
-    stream.readRawData(data.data(), size);
-    *target = data;
-    return true;
+    // magic and end marker around them. the end of the cell ends them as well, like on read
+    if(size + 1 > writer.remaining()) {
+        qDebug() << "no room for build/created extensions, handshake too long";
+        return;
+    }
+    writer.put<quint8>(EXTENSIONS_MAGIC);
+    writer.putRaw(extensions, size);
+    if(writer.remaining() > 0) {
+        writer.put<quint8>(EXT_END);
+    }
 }
 
-bool writePayload(QDataStream &stream, QByteArray source, quint16 maxSize)
+QByteArray PeerToPeerMessage::composeEncrypted(quint16 circId, QByteArray encryptedPayload)
 {
-    quint16 size = source.size();
-    if(source.size() > maxSize) {
-        qDebug() << "unreasonable payload size to write" << source.size() << "truncating to" << maxSize;
-        size = maxSize;
+    int length = UNENCRYPTED_HEADER_LEN + encryptedPayload.size();
+    if(cellSizeOf(length) < 0) {
+        length = MESSAGE_LENGTH;
     }
-
-    stream << size;
-    stream.writeRawData(source.data(), size);
-    return size == source.size();
+    QByteArray arr(length, Qt::Uninitialized);
+    CellWriter writer(arr.data(), length);
+    writer.put<quint8>(PeerToPeerMessage::ENCRYPTED);
+    writer.put<quint16>(circId);
+    writer.putRaw(encryptedPayload.constData(), qMin(encryptedPayload.size(), writer.remaining()));
+    writer.padRandom();
+    return arr;
 }
 
+void PeerToPeerMessage::composeEncrypted(quint16 circId, const QByteArray &encryptedPayload, CellBuffer *cell)
+{
+    char *out = cell->data();
+    const int payloadLength = cell->capacity() - UNENCRYPTED_HEADER_LEN;
+    int size = qMin(encryptedPayload.size(), payloadLength);
 
-QByteArray PeerToPeerMessage::composeEncrypted(quint16 circId, QByteArray encryptedPayload)
+    // payload first, it may be a view on this very cell
+    memmove(out + UNENCRYPTED_HEADER_LEN, encryptedPayload.constData(), size);
+    RandomPool::local().fill(out + UNENCRYPTED_HEADER_LEN + size, payloadLength - size);
+
+    out[0] = static_cast<char>(PeerToPeerMessage::ENCRYPTED);
+    out[1] = static_cast<char>(circId >> 8);
+    out[2] = static_cast<char>(circId & 0xff);
+}
+
+int PeerToPeerMessage::decodeHeaders(const char *const *cells, const int *sizes, int count, HeaderBatch *headers)
 {
-    QByteArray arr;
-    QDataStream stream(&arr, QIODevice::ReadWrite);
-    stream.setByteOrder(QDataStream::BigEndian);
-
-    stream << static_cast<quint8>(PeerToPeerMessage::ENCRYPTED);
-    stream << circId;
-    stream.writeRawData(encryptedPayload.data(), encryptedPayload.length());
-    return PeerToPeerMessage::pad(arr, MESSAGE_LENGTH);
+    headers->celltypes.resize(count);
+    headers->circuitIds.resize(count);
+    headers->payloads.resize(count);
+    headers->count = count;
+
+    // one pass per field, the header of every cell is in its first cache line
+    Celltype *celltypes = headers->celltypes.data();
+    for(int i = 0; i < count; i++) {
+        Celltype celltype = static_cast<Celltype>((quint8)cells[i][0]);
+        bool known = celltype == BUILD || celltype == CREATED || celltype == ENCRYPTED;
+        celltypes[i] = known && (sizes[i] == MESSAGE_LENGTH || cellSizeOf(sizes[i]) >= 0) ? celltype : Invalid;
+    }
+
+    int valid = 0;
+    quint16 *circuitIds = headers->circuitIds.data();
+    const char **payloads = headers->payloads.data();
+    for(int i = 0; i < count; i++) {
+        circuitIds[i] = qFromBigEndian<quint16>(cells[i] + 1);
+        payloads[i] = cells[i] + UNENCRYPTED_HEADER_LEN;
+        valid += celltypes[i] != Invalid;
+    }
+    return valid;
 }
@@ -1,43 +1,76 @@
 #ifndef PEERTOPEERMESSAGE_H
 #define PEERTOPEERMESSAGE_H
 
-#include "binding.h"
+#include "endpoint.h"
+#include "cellbuffer.h"
 
-#include <QDataStream>
 #include <QHostAddress>
+#include <QList>
 #include <QNetworkDatagram>
+#include <QVector>
+
+class CellReader;
+class CellWriter;
 
 // layout
-// fixed-size: 1027 B
+// fixed-size: 1027 B, unless a circuit negotiated larger cells (CellSize, EXT_CELL_SIZE)
 // with three byte unencrypted, encrypted payload will be multiple of 128, eliminating padding for encryption
 #define MESSAGE_LENGTH 1027
 #define UNENCRYPTED_HEADER_LEN 3
+// the largest cell size
+#define MAX_MESSAGE_LENGTH 8195
 // we dont wrap packets, but encrypt the payload consequtively => no hop limit
-#define MAX_RELAY_DATA_SIZE 1024
+#define MAX_RELAY_DATA_SIZE (MAX_MESSAGE_LENGTH - UNENCRYPTED_HEADER_LEN)
 //
 // first byte indicates build (01) / created (02) / encrypted (03) message
 //
-// build message:     | 01 | circ_id (2B) | handshake_len (2B) | handshake
-// created message:   | 02 | circ_id (2B) | handshake_len (2B) | handshake
+// build message:     | 01 | circ_id (2B) | handshake_len (2B) | handshake | [extensions]
+// created message:   | 02 | circ_id (2B) | handshake_len (2B) | handshake | [extensions]
 // encrypted message: | 03 | circ_id (2B) | <payload>
 //
+// build/created cells are padded with '?', encrypted payloads with random bytes (randompool.h)
+//
+// extensions negotiate link options, they are only written if an option is not the default:
+// | EXTENSIONS_MAGIC | type (1B) | len (1B) | value | ... | EXT_END (or the end of the cell)
+// peers that do not know them see padding. the magic is never '?', unknown types are skipped
+// EXT_PACKING: | cells (1B) | cells per datagram the sender accepts, default 1
+// EXT_CELL_SIZE: | size (1B) | CellSize, in BUILD the largest the sender offers for the circuit,
+//                              in CREATED the one agreed on. default CELL_1K
+//
+// cell sizes: a circuit runs with the largest size all of its hops support. every hop agrees to
+// at most what the hop before it offered, BUILD/CREATED for the first hop, RELAY_EXTEND/RELAY_EXTENDED
+// for the others, so the sizes never grow along a circuit. cells towards a hop have the size agreed
+// with that hop, which every hop on the way accepts as well. handshake cells are always MESSAGE_LENGTH
+#define EXTENSIONS_MAGIC 0xE5
+//
 // payload:  | celltype (1B) | digest (4B) | streamId (2B) | <command payload>
-// celltype can be CMD_DESTROY, RELAY_DATA, RELAY_EXTEND, RELAY_EXTENDED, RELAY_TRUNCATED
+// the digest is keyed with the session of the hop the payload is meant for, see celldigest.h
+// celltype can be CMD_DESTROY, RELAY_DATA, RELAY_EXTEND, RELAY_EXTENDED, RELAY_TRUNCATED, RELAY_DATA_RECORDS,
+// RELAY_DATA_FRAGMENT
 //
 // command payload:
 // | CMD_DESTROY     | digest (4B) | reserved (2B) // to fit header size
-// | CMD_COVER       | digest (4B) | reserved (2B) // to fit header size
-// | RELAY_DATA      | digest (4B) | streamId (2B) | data_size (2B) | data
-// | RELAY_EXTEND    | digest (4B) | streamId (2B) | ip_v (1B) | ip (4B/16B) | port (2B) | handshake_len (2B) | handshake
-// | RELAY_EXTENDED  | digest (4B) | streamId (2B) | handshake_len (2B) | handshake
+// | CMD_COVER       | digest (4B) | reserved (2B) // to fit header size, then random bytes
+// | RELAY_DATA      | digest (4B) | streamId (2B) | flags (2 bit) data_size (14 bit) | data
+// | RELAY_EXTEND    | digest (4B) | streamId (2B) | ip_v (1B) | ip (4B/16B) | port (2B) | handshake_len (2B) | handshake | cell_size (1B)
+// | RELAY_EXTENDED  | digest (4B) | streamId (2B) | handshake_len (2B) | handshake | cell_size (1B)
 // | RELAY_TRUNCATED | digest (4B) | streamId (2B) | --
+// | RELAY_DATA_RECORDS | digest (4B) | streamId (2B) | data_size (2B) | record_len (2B) | record | record_len (2B) | record | ...
+// | RELAY_DATA_FRAGMENT | digest (4B) | streamId (2B) | message_id (2B) | fragment (1B) | flags (1B) | data_size (2B) | data
+// RELAY_DATA_RECORDS carries several small writes to a tunnel in one cell, each is delivered on its own.
+// a write too large for one cell goes out as RELAY_DATA_FRAGMENTs numbered from 0, all but the last
+// one full (MaxFragmentData), the last one flagged FRAGMENT_FINAL. see fragmentassembler.h
+// a compressed write (datacompressor.h) is flagged DATA_COMPRESSED as RELAY_DATA, or FRAGMENT_COMPRESSED
+// on every fragment, which carry the compressed write then. peers without compression reject the
+// RELAY_DATA flag as an oversized data_size, so only tunnels that opted in get it
 
 class PeerToPeerMessage
 {
 public:
     PeerToPeerMessage();
 
-    enum Celltype {
+    // celltype and command are one byte on the wire, every value of it is representable
+    enum Celltype : quint8 {
         Invalid = 0x00,
 
         BUILD = 0x01,
@@ -45,31 +78,72 @@ public:
         ENCRYPTED = 0x03
     };
 
-    enum Commandtype {
+    enum Extension {
+        EXT_END = 0x00,
+        EXT_PACKING = 0x01,
+        EXT_CELL_SIZE = 0x02
+    };
+
+    // cell sizes on the wire, a payload of 1, 4 or 8 KiB behind the three byte header
+    enum CellSize : quint8 {
+        CELL_1K = 0x00, // MESSAGE_LENGTH
+        CELL_4K = 0x01,
+        CELL_8K = 0x02, // MAX_MESSAGE_LENGTH
+        CELL_MAX = CELL_8K
+    };
+
+    enum Commandtype : quint8 {
         CMD_INVALID = 0x00,
         RELAY_DATA = 0x01,
         RELAY_EXTEND = 0x02,
         RELAY_EXTENDED = 0x03,
         RELAY_TRUNCATED = 0x04,
         CMD_DESTROY = 0x05,
-        CMD_COVER = 0x07
+        CMD_COVER = 0x07,
+        RELAY_DATA_RECORDS = 0x08,
+        RELAY_DATA_FRAGMENT = 0x09
+    };
+
+    enum DataFlag {
+        DATA_COMPRESSED = 0x01
+    };
+
+    enum FragmentFlag {
+        FRAGMENT_FINAL = 0x01,
+        FRAGMENT_COMPRESSED = 0x02
     };
 
+    // data bytes a RELAY_DATA cell carries
+    static constexpr int MaxCellData = MESSAGE_LENGTH - UNENCRYPTED_HEADER_LEN - 7 - 2;
+    // the length in front of every record of RELAY_DATA_RECORDS
+    static constexpr int RecordHeaderLength = 2;
+    // message_id, fragment and flags of RELAY_DATA_FRAGMENT
+    static constexpr int FragmentHeaderLength = 4;
+    static constexpr int MaxFragmentData = MaxCellData - FragmentHeaderLength;
+    // the largest write to a tunnel, what one api frame can carry. 65 fragments of CELL_1K
+    static constexpr int MaxMessageData = 0xFFFF;
+
+    // bytes on the wire of a cell of size, and the size of a cell of length bytes, -1 if there is none
+    static constexpr int cellLength(CellSize size) {
+        return UNENCRYPTED_HEADER_LEN + (MESSAGE_LENGTH - UNENCRYPTED_HEADER_LEN) * (size == CELL_1K ? 1 : size == CELL_4K ? 4 : 8);
+    }
+    static int cellSizeOf(int length);
+    // MaxCellData and MaxFragmentData for cells of size
+    static constexpr int maxCellData(CellSize size) { return cellLength(size) - (MESSAGE_LENGTH - MaxCellData); }
+    static constexpr int maxFragmentData(CellSize size) { return maxCellData(size) - FragmentHeaderLength; }
+
     bool isEncrypted() const { return celltype == ENCRYPTED; }
 
     QString typeString() const;
 
-    // compute digest after all other data is set
-    void calculateDigest();
-    bool isValidDigest() const;
-
     // general msg header
     Celltype celltype = Invalid;
     quint16 circuitId;
+    CellSize cellSize = CELL_1K; // of an encrypted cell, handshakes are always CELL_1K
 
     // relay msg header
     Commandtype command = CMD_INVALID;
-    quint32 digest = 0x00;
+    quint32 digest = 0x00; // as on the wire, CellDigest::seal() sets it in the encoded payload
     quint16 streamId = 0x00;
 
     // relay_extend
@@ -78,48 +152,90 @@ public:
 
     // relay_data, also handshake payload for build/created/extend/extended
     QByteArray data; // payload + payloadSize
+    quint8 dataFlags = 0; // relay_data only, in the top bits of its data_size
+
+    // relay_data_fragment
+    quint16 messageId = 0;
+    quint8 fragmentIndex = 0;
+    quint8 fragmentFlags = 0;
+    bool isFinalFragment() const { return fragmentFlags & FRAGMENT_FINAL; }
+
+    // data of relay_data or relay_data_fragment is compressed
+    bool isCompressed() const {
+        return command == RELAY_DATA_FRAGMENT ? fragmentFlags & FRAGMENT_COMPRESSED : dataFlags & DATA_COMPRESSED;
+    }
+
+    // build/created extensions
+    quint8 packing = 1;
+    // build/created extension, relay_extend/relay_extended: offered or agreed for the circuit
+    CellSize circuitCellSize = CELL_1K;
 
     bool malformed = false; // should close connection to this peer
 
-    Binding sender; // parsed from QNetworkDatagram if present
+    Endpoint sender; // parsed from QNetworkDatagram if present
 
 public:
     // factory shorthands
     static PeerToPeerMessage makeBuild(quint16 circId, QByteArray handshake);
     static PeerToPeerMessage makeCreated(quint16 circId, QByteArray handshake);
     static PeerToPeerMessage makeRelayData(quint16 circId, quint16 streamId, QByteArray data);
-    static PeerToPeerMessage makeRelayExtend(quint16 circId, quint16 streamId, Binding targetAddress, QByteArray handshake);
+    static PeerToPeerMessage makeRelayExtend(quint16 circId, quint16 streamId, Endpoint targetAddress, QByteArray handshake);
     static PeerToPeerMessage makeRelayExtended(quint16 circId, quint16 streamId, QByteArray handshake);
     static PeerToPeerMessage makeRelayTruncated(quint16 circId, quint16 streamId);
     static PeerToPeerMessage makeCommandDestroy(quint16 circId);
     static PeerToPeerMessage makeCommandCover(quint16 circId);
+    static PeerToPeerMessage makeRelayDataRecords(quint16 circId, quint16 streamId, QByteArray records);
+
+    // the records of RELAY_DATA_RECORDS
+    static void appendRecord(QByteArray *records, const QByteArray &record);
+    // false if the records are cut short, out is undefined then
+    static bool splitRecords(const QByteArray &records, QList<QByteArray> *out);
+
+    // data of up to MaxMessageData bytes as RELAY_DATA_FRAGMENTs of messageId, in order
+    static QList<PeerToPeerMessage> makeRelayDataFragments(quint16 circId, quint16 streamId, quint16 messageId, const QByteArray &data,
+                                                           CellSize cellSize = CELL_1K);
 
     // parsing
     static PeerToPeerMessage fromDatagram(QNetworkDatagram dgram);
     static PeerToPeerMessage fromBytes(QByteArray fullPacket);
 
-    // parse the payload of a 03 | circId | <encryptedMessage> msg
+    // parse the payload of a 03 | circId | <encryptedMessage> msg, once its digest verified.
+    // the cell size follows from the length of the payload
     static PeerToPeerMessage fromEncryptedPayload(QByteArray encryptedMessage); // ignores the preface 03 | circId
     static PeerToPeerMessage fromEncryptedPayload(QByteArray encryptedMessage, quint16 circId);
 
-    // exporting
+    // exporting, as a cell of cellSize
+    int wireLength() const; // bytes of the full packet
     QByteArray toEncryptedPayload() const; // make a packet without header
     QByteArray toBytes() const; // make a full packet
-    QNetworkDatagram toDatagram(Binding target = Binding()) const; // uses target or this.sender if sender is invalid
+    QNetworkDatagram toDatagram(Endpoint target = Endpoint()) const; // uses target or this.sender if sender is invalid
 
-    // compose a full message from the encrypted payload
+    // compose a full message from the encrypted payload, a cell as large as the payload makes it
     static QByteArray composeEncrypted(quint16 circId, QByteArray encryptedPayload);
+    // same, written into a pooled cell, which is filled. the payload may point into that cell
+    static void composeEncrypted(quint16 circId, const QByteArray &encryptedPayload, CellBuffer *cell);
+
+    // batches, for the receive loop
+
+    // the unencrypted headers of a batch of cells, an array per field. cells that are not
+    // cellLength() of some size long or have an unknown celltype are Invalid
+    struct HeaderBatch {
+        QVector<Celltype> celltypes;
+        QVector<quint16> circuitIds;
+        QVector<const char *> payloads; // into the cells, the cell size - UNENCRYPTED_HEADER_LEN bytes
+        int count = 0;
+    };
+    // headers of count cells at cells[i] with sizes[i] bytes, returns how many are valid.
+    // reuses the arrays of headers, the payloads point into the cells
+    static int decodeHeaders(const char *const *cells, const int *sizes, int count, HeaderBatch *headers);
 private:
-    static QByteArray pad(QByteArray packet, int length);
+    // encode through the layouts in cellcodec.h, into wireLength() bytes at cell
+    // or wireLength() - UNENCRYPTED_HEADER_LEN bytes at payload. both padded
+    void writeCell(char *cell) const;
+    void writeEncryptedPayload(char *payload) const;
+    static void readExtensions(CellReader &reader, PeerToPeerMessage *message);
+    void writeExtensions(CellWriter &writer) const;
 };
 
-// read a 16bit integer for length, and this amount of data after it into target message.
-// if the size is bigger than maxSize, content is discarded. Returns number of bytes consumed from stream
-bool readPayload(QDataStream& stream, QByteArray *target, quint16 maxSize = MAX_RELAY_DATA_SIZE);
-
-// write a source into stream, as a 16bit length integer with data following.
-// writes maxSize at maximum, truncating source. Returns true if source was written completely
-bool writePayload(QDataStream& stream, QByteArray source, quint16 maxSize = MAX_RELAY_DATA_SIZE);
-
 
 #endif // PEERTOPEERMESSAGE_H
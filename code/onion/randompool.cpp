@@ -0,0 +1,200 @@
+#include "randompool.h"
+
+#include <QtEndian>
+#include <cstring>
+#include <random>
+
+#if defined(__GNUC__)
+// four blocks side by side, one per lane. sse2/neon without asking for either
+#define ONION_CHACHA_VECTOR
+typedef quint32 Lanes __attribute__((vector_size(16)));
+#endif
+
+// "expand 32-byte k"
+static const quint32 Sigma[4] = { 0x61707865, 0x3320646e, 0x79622d32, 0x6b206574 };
+static const int DoubleRounds = 10;
+
+template<typename T>
+static inline T rotl(T x, int b)
+{
+    return (x << b) | (x >> (32 - b));
+}
+
+#define QUARTERROUND(a, b, c, d) \
+    do { \
+        a += b; d ^= a; d = rotl(d, 16); \
+        c += d; b ^= c; b = rotl(b, 12); \
+        a += b; d ^= a; d = rotl(d, 8); \
+        c += d; b ^= c; b = rotl(b, 7); \
+    } while(0)
+
+template<typename T>
+static inline void doubleRound(T x[16])
+{
+    // columns
+    QUARTERROUND(x[0], x[4], x[8], x[12]);
+    QUARTERROUND(x[1], x[5], x[9], x[13]);
+    QUARTERROUND(x[2], x[6], x[10], x[14]);
+    QUARTERROUND(x[3], x[7], x[11], x[15]);
+    // diagonals
+    QUARTERROUND(x[0], x[5], x[10], x[15]);
+    QUARTERROUND(x[1], x[6], x[11], x[12]);
+    QUARTERROUND(x[2], x[7], x[8], x[13]);
+    QUARTERROUND(x[3], x[4], x[9], x[14]);
+}
+
+#undef QUARTERROUND
+
+static void setupState(quint32 state[16], const quint32 key[8], const quint32 nonce[3], quint32 counter)
+{
+    memcpy(state, Sigma, sizeof(Sigma));
+    memcpy(state + 4, key, 8 * sizeof(quint32));
+    state[12] = counter;
+    memcpy(state + 13, nonce, 3 * sizeof(quint32));
+}
+
+static void blockScalar(const quint32 input[16], char *out)
+{
+    quint32 x[16];
+    memcpy(x, input, sizeof(x));
+    for(int i = 0; i < DoubleRounds; i++) {
+        doubleRound(x);
+    }
+    for(int i = 0; i < 16; i++) {
+        qToLittleEndian<quint32>(x[i] + input[i], out + 4 * i);
+    }
+}
+
+#ifdef ONION_CHACHA_VECTOR
+// blocks counter .. counter + 3 into 4 * 64 bytes at out
+static void blocksVector(const quint32 input[16], char *out)
+{
+    Lanes x[16], start[16];
+    for(int i = 0; i < 16; i++) {
+        start[i] = Lanes{ input[i], input[i], input[i], input[i] };
+    }
+    start[12] += Lanes{ 0, 1, 2, 3 };
+
+    memcpy(x, start, sizeof(x));
+    for(int i = 0; i < DoubleRounds; i++) {
+        doubleRound(x);
+    }
+    for(int i = 0; i < 16; i++) {
+        x[i] += start[i];
+    }
+
+    for(int lane = 0; lane < 4; lane++) {
+        char *block = out + lane * RandomPool::BlockSize;
+        for(int i = 0; i < 16; i++) {
+            qToLittleEndian<quint32>(x[i][lane], block + 4 * i);
+        }
+    }
+}
+#endif
+
+void RandomPool::generate(const quint32 key[8], const quint32 nonce[3], quint32 counter, char *out, int blocks)
+{
+    quint32 state[16];
+    setupState(state, key, nonce, counter);
+
+    int i = 0;
+#ifdef ONION_CHACHA_VECTOR
+    for(; i + 4 <= blocks; i += 4) {
+        blocksVector(state, out + i * BlockSize);
+        state[12] += 4;
+    }
+#endif
+    for(; i < blocks; i++) {
+        blockScalar(state, out + i * BlockSize);
+        state[12]++;
+    }
+}
+
+void RandomPool::keystream(const QByteArray &key, const QByteArray &nonce, quint32 counter, char *out, int blocks)
+{
+    Q_ASSERT(key.size() == 32 && nonce.size() == 12);
+    quint32 keyWords[8], nonceWords[3];
+    for(int i = 0; i < 8; i++) {
+        keyWords[i] = qFromLittleEndian<quint32>(key.constData() + 4 * i);
+    }
+    for(int i = 0; i < 3; i++) {
+        nonceWords[i] = qFromLittleEndian<quint32>(nonce.constData() + 4 * i);
+    }
+    generate(keyWords, nonceWords, counter, out, blocks);
+}
+
+RandomPool::RandomPool()
+{
+    std::random_device system;
+    for(int i = 0; i < 8; i++) {
+        key_[i] = system();
+    }
+}
+
+RandomPool::RandomPool(const QByteArray &key)
+{
+    Q_ASSERT(key.size() == 32);
+    for(int i = 0; i < 8; i++) {
+        key_[i] = qFromLittleEndian<quint32>(key.constData() + 4 * i);
+    }
+}
+
+RandomPool &RandomPool::local()
+{
+    thread_local RandomPool pool;
+    return pool;
+}
+
+void RandomPool::refill()
+{
+    const int blocks = PoolSize / BlockSize;
+    generate(key_, nonce_, counter_, pool_, blocks);
+    counter_ += blocks;
+    if(counter_ == 0) {
+        // 256 GiB later, PoolSize divides the counter range so it lands on zero exactly
+        nonce_[0]++;
+    }
+    pos_ = 0;
+}
+
+void RandomPool::fill(char *data, int size)
+{
+    while(size > 0) {
+        if(pos_ == PoolSize) {
+            refill();
+        }
+        int chunk = qMin(size, PoolSize - pos_);
+        memcpy(data, pool_ + pos_, chunk);
+        // handed out once
+        pos_ += chunk;
+        data += chunk;
+        size -= chunk;
+    }
+}
+
+QByteArray RandomPool::bytes(int size)
+{
+    QByteArray out(size, Qt::Uninitialized);
+    fill(out.data(), size);
+    return out;
+}
+
+quint32 RandomPool::next()
+{
+    char word[4];
+    fill(word, sizeof(word));
+    return qFromLittleEndian<quint32>(word);
+}
+
+quint32 RandomPool::bounded(quint32 range)
+{
+    // multiply and keep the high half, rejecting the few values that would bias it
+    quint64 m = (quint64)next() * range;
+    if((quint32)m < range) {
+        quint32 threshold = (0u - range) % range;
+        while((quint32)m < threshold) {
+            m = (quint64)next() * range;
+        }
+    }
+    return (quint32)(m >> 32);
+}
@@ -0,0 +1,47 @@
+#ifndef RANDOMPOOL_H
+#define RANDOMPOOL_H
+
+#include <QByteArray>
+#include <QtGlobal>
+
+// random bytes for cell padding and cover traffic. a ChaCha20 keystream (RFC 8439 block
+// function) generated four blocks at a time into a pool, handed out with memcpy. every
+// thread has its own pool, seeded from the system, relay shards never share one.
+//
+// unpredictable filler, so padded and cover cells do not stand out. not for keys, those
+// come from auth.
+class RandomPool
+{
+public:
+    static const int BlockSize = 64;
+    static const int PoolSize = 64 * BlockSize;
+
+    // seeded from std::random_device
+    RandomPool();
+    // a fixed 32 byte key, the same bytes every time. for tests
+    explicit RandomPool(const QByteArray &key);
+
+    // the pool of the calling thread
+    static RandomPool &local();
+
+    void fill(char *data, int size);
+    QByteArray bytes(int size);
+    quint32 next();
+    // uniform in [0, range)
+    quint32 bounded(quint32 range);
+
+    // blocks of raw keystream for key (32 B) and nonce (12 B), starting at block counter
+    static void keystream(const QByteArray &key, const QByteArray &nonce, quint32 counter, char *out, int blocks);
+
+private:
+    void refill();
+    static void generate(const quint32 key[8], const quint32 nonce[3], quint32 counter, char *out, int blocks);
+
+    quint32 key_[8];
+    quint32 nonce_[3] = { 0, 0, 0 };
+    quint32 counter_ = 0;
+    alignas(16) char pool_[PoolSize];
+    int pos_ = PoolSize; // empty
+};
+
+#endif // RANDOMPOOL_H
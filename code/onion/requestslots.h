@@ -0,0 +1,117 @@
+#ifndef REQUESTSLOTS_H
+#define REQUESTSLOTS_H
+
+#include <QVector>
+#include <QtGlobal>
+#include <utility>
+
+// requests waiting for an answer, by request id. in place of a QHash, which allocates a node
+// for every insert: the slots are allocated up front and reused, a request that comes and
+// goes touches no heap. ids come from a counter that steps by stride, id takes the slot
+// (id / stride) % capacity. ids in flight at once rarely meet in a slot, if one does the
+// table doubles. past MaxCapacity a request that went unanswered for that many ids is
+// given up instead
+template<typename T>
+class RequestSlots
+{
+public:
+    explicit RequestSlots(int capacity = 256) { reset(qMax(1, capacity)); }
+
+    // the step of the ids, before the first insert
+    void setStride(int stride) { stride_ = qMax(1, stride); }
+
+    // false if an old request was given up to make room
+    bool insert(quint32 id, T value) {
+        bool keptAll = true;
+        while(slots_[indexOf(id)].used && slots_[indexOf(id)].id != id) {
+            if(slots_.size() >= MaxCapacity) {
+                take(slots_[indexOf(id)].id);
+                keptAll = false;
+                break;
+            }
+            grow();
+        }
+        Slot &slot = slots_[indexOf(id)];
+        size_ += !slot.used;
+        slot.id = id;
+        slot.used = true;
+        slot.value = std::move(value);
+        return keptAll;
+    }
+    bool contains(quint32 id) const {
+        const Slot &slot = slots_[indexOf(id)];
+        return slot.used && slot.id == id;
+    }
+    // the request, T() if there is none
+    T take(quint32 id) {
+        Slot &slot = slots_[indexOf(id)];
+        if(!slot.used || slot.id != id) {
+            return T();
+        }
+        T value = std::move(slot.value);
+        // let go of what the request holds now, not when the slot is taken again
+        slot.value = T();
+        slot.used = false;
+        size_--;
+        return value;
+    }
+    void remove(quint32 id) { take(id); }
+
+    int size() const { return size_; }
+    int capacity() const { return slots_.size(); }
+
+    static const int MaxCapacity = 1 << 16;
+
+private:
+    struct Slot {
+        quint32 id = 0;
+        bool used = false;
+        T value;
+    };
+
+    int indexOf(quint32 id) const { return (id / stride_) & (slots_.size() - 1); }
+    void reset(int capacity) {
+        int size = 1;
+        while(size < capacity) {
+            size *= 2;
+        }
+        slots_ = QVector<Slot>(size);
+        size_ = 0;
+    }
+    // whether the requests take a slot each in capacity slots
+    bool fits(int capacity) const {
+        QVector<bool> taken(capacity, false);
+        for(const Slot &slot : slots_) {
+            if(!slot.used) {
+                continue;
+            }
+            int index = (slot.id / stride_) & (capacity - 1);
+            if(taken[index]) {
+                return false;
+            }
+            taken[index] = true;
+        }
+        return true;
+    }
+    void grow() {
+        int capacity = slots_.size() * 2;
+        while(!fits(capacity)) {
+            capacity *= 2;
+        }
+        QVector<Slot> old;
+        old.swap(slots_);
+        reset(capacity);
+        for(Slot &slot : old) {
+            if(slot.used) {
+                slots_[indexOf(slot.id)] = std::move(slot);
+                size_++;
+            }
+        }
+    }
+
+    QVector<Slot> slots_;
+    int stride_ = 1;
+    int size_ = 0;
+};
+
+#endif // REQUESTSLOTS_H
@@ -0,0 +1,170 @@
+#include "routetable.h"
+
+#include <QVarLengthArray>
+#include <cstring>
+
+static_assert(sizeof(RouteKey) == 20, "RouteKey is hashed and compared as 20 bytes");
+
+static inline void prefetch(const void *address)
+{
+#ifdef Q_CC_GNU
+    __builtin_prefetch(address);
+#else
+    Q_UNUSED(address);
+#endif
+}
+
+RouteKey RouteKey::make(const Endpoint &endpoint, quint16 circId)
+{
+    RouteKey key;
+    memcpy(key.address, endpoint.address, sizeof(key.address));
+    key.port = endpoint.port;
+    key.circId = circId;
+    return key;
+}
+
+Endpoint RouteKey::endpoint() const
+{
+    return Endpoint::fromIPv6(address, port);
+}
+
+bool RouteKey::operator ==(const RouteKey &other) const
+{
+    return memcmp(this, &other, sizeof(RouteKey)) == 0;
+}
+
+RouteTable::RouteTable(quint64 seed) :
+    seed_(seed)
+{
+    rehash(MinCapacity);
+}
+
+quint32 RouteTable::hash(const RouteKey &key) const
+{
+    return keyedHash(&key, sizeof(RouteKey), seed_);
+}
+
+quint32 RouteTable::find(const RouteKey &key) const
+{
+    return findFrom(key, hash(key));
+}
+
+void RouteTable::findBatch(const RouteKey *keys, int count, quint32 *values) const
+{
+    QVarLengthArray<quint32, 64> hashes(count);
+    for(int i = 0; i < count; i++) {
+        hashes[i] = hash(keys[i]);
+    }
+
+    // the entries of the next keys are on their way while this one is compared
+    const Entry *entries = entries_.constData();
+    for(int i = 0; i < count && i < PrefetchDistance; i++) {
+        prefetch(entries + (hashes[i] & mask_));
+    }
+    for(int i = 0; i < count; i++) {
+        if(i + PrefetchDistance < count) {
+            prefetch(entries + (hashes[i + PrefetchDistance] & mask_));
+        }
+        values[i] = findFrom(keys[i], hashes[i]);
+    }
+}
+
+quint32 RouteTable::findFrom(const RouteKey &key, quint32 h) const
+{
+    // entries further from home than us would have taken our place, once we
+    // are further out than the entry at index the key is not in
+    const Entry *entries = entries_.constData();
+    int index = h & mask_;
+    for(int d = 0; entries[index].value != 0 && distance(index) >= d; d++) {
+        if(entries[index].hash == h && entries[index].key == key) {
+            return entries[index].value;
+        }
+        index = (index + 1) & mask_;
+    }
+    return 0;
+}
+
+bool RouteTable::insert(const RouteKey &key, quint32 value)
+{
+    Q_ASSERT(value != 0);
+    quint32 h = hash(key);
+    if(findFrom(key, h) != 0) {
+        return false;
+    }
+
+    // at most 4/5 full, probe sequences stay short
+    if((size_ + 1) * 5 > capacity() * 4) {
+        rehash(capacity() * 2);
+    }
+
+    Entry entry;
+    entry.key = key;
+    entry.hash = h;
+    entry.value = value;
+    place(entry);
+    size_++;
+    return true;
+}
+
+bool RouteTable::remove(const RouteKey &key)
+{
+    quint32 h = hash(key);
+    int index = h & mask_;
+    for(int d = 0; ; d++) {
+        const Entry &entry = entries_[index];
+        if(entry.value == 0 || distance(index) < d) {
+            return false;
+        }
+        if(entry.hash == h && entry.key == key) {
+            break;
+        }
+        index = (index + 1) & mask_;
+    }
+
+    // shift the entries after it back by one, up to the next one that is home or empty.
+    // no tombstones, lookups stay as short as they were before the insert
+    int next = (index + 1) & mask_;
+    while(entries_[next].value != 0 && distance(next) > 0) {
+        entries_[index] = entries_[next];
+        index = next;
+        next = (next + 1) & mask_;
+    }
+    entries_[index].value = 0;
+    size_--;
+
+    // give memory back when most tunnels are gone
+    if(capacity() > MinCapacity && size_ * 8 < capacity()) {
+        rehash(capacity() / 2);
+    }
+    return true;
+}
+
+void RouteTable::place(Entry entry)
+{
+    int index = entry.hash & mask_;
+    int d = 0;
+    while(entries_[index].value != 0) {
+        // take from the rich: whoever is closer to home moves on
+        int existing = distance(index);
+        if(existing < d) {
+            qSwap(entry, entries_[index]);
+            d = existing;
+        }
+        index = (index + 1) & mask_;
+        d++;
+    }
+    entries_[index] = entry;
+}
+
+void RouteTable::rehash(int capacity)
+{
+    QVector<Entry> old;
+    old.swap(entries_);
+    entries_.resize(capacity);
+    mask_ = capacity - 1;
+    for(const Entry &entry : old) {
+        if(entry.value != 0) {
+            place(entry);
+        }
+    }
+}
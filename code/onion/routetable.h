@@ -0,0 +1,69 @@
+#ifndef ROUTETABLE_H
+#define ROUTETABLE_H
+
+#include <QVector>
+#include <QtGlobal>
+
+#include "endpoint.h"
+
+// what a cell is routed by: the neighbour it came from and its circuit id, packed into 20
+// bytes. an Endpoint with the circuit id in place of its reserved bytes
+struct RouteKey {
+    quint8 address[16];
+    quint16 port;
+    quint16 circId;
+
+    static RouteKey make(const Endpoint &endpoint, quint16 circId);
+    Endpoint endpoint() const;
+    bool operator ==(const RouteKey &other) const;
+};
+
+// (neighbour, circuit id) -> tunnel id, every received cell looks one up. open addressing
+// with Robin Hood probing in one flat array: a lookup hashes the key once and reads a
+// few neighbouring entries, mostly in a single cache line, instead of following QHash
+// nodes. keys are hashed with keyedHash(), so peers cannot line up long probe sequences.
+// findBatch() resolves a burst of cells and fetches the entries of the next keys while
+// it compares the current one.
+//
+// values are never 0, 0 is what find() returns for a key that is not in
+class RouteTable
+{
+public:
+    explicit RouteTable(quint64 seed = 0);
+
+    quint32 find(const RouteKey &key) const;
+    // values[i] for keys[i], count of them
+    void findBatch(const RouteKey *keys, int count, quint32 *values) const;
+    // false if key is in already
+    bool insert(const RouteKey &key, quint32 value);
+    // false if key is not in
+    bool remove(const RouteKey &key);
+
+    int size() const { return size_; }
+    int capacity() const { return entries_.size(); }
+
+private:
+    struct Entry {
+        RouteKey key;
+        quint32 hash;
+        quint32 value = 0; // 0 is empty
+    };
+
+    static const int MinCapacity = 64;
+    // how far ahead findBatch() fetches
+    static const int PrefetchDistance = 8;
+
+    quint32 hash(const RouteKey &key) const;
+    // how far entry at index is from where its hash puts it
+    int distance(int index) const { return (index - entries_[index].hash) & mask_; }
+    quint32 findFrom(const RouteKey &key, quint32 h) const;
+    void place(Entry entry);
+    void rehash(int capacity);
+
+    QVector<Entry> entries_;
+    int mask_ = 0;
+    int size_ = 0;
+    quint64 seed_;
+};
+
+#endif // ROUTETABLE_H
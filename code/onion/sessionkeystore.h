@@ -2,7 +2,6 @@
 #define SESSIONKEYSTORE_H
 
 #include <QHash>
-#include "binding.h"
 
 class SessionKeystore
 {
@@ -22,6 +22,63 @@ bool Settings::load()
     tmp = settings_.value("api_address").toString();
     ok &= readBinding(tmp, &onionApiAddress_, "[onion]->api_address");
 
+    // optional, number of p2p relay threads
+    relayThreads_ = settings_.value("relay_threads", 1).toInt();
+    if(relayThreads_ < 1 || relayThreads_ > 64) {
+        qDebug() << relayThreads_ << "is not a valid thread count. Check [onion]->relay_threads";
+        ok = false;
+    }
+
+    // optional, p2p socket buffers in bytes. 0 keeps the system default
+    ok &= readSize("recv_buffer", &receiveBufferSize_);
+    ok &= readSize("send_buffer", &sendBufferSize_);
+
+    // optional, receive p2p datagrams through io_uring (linux 6.0+)
+    ioUring_ = settings_.value("io_uring", false).toBool();
+    // optional, hand runs of cells to the kernel as one buffer (UDP GSO/GRO, linux 5.0+)
+    segmentationOffload_ = settings_.value("udp_offload", false).toBool();
+
+    // optional, cells packed into one datagram on links that negotiated it, bounded by the path mtu
+    cellPacking_ = settings_.value("cell_packing", 1).toInt();
+    if(cellPacking_ < 1 || cellPacking_ > 63) {
+        qDebug() << cellPacking_ << "is not a valid cell count. Check [onion]->cell_packing";
+        ok = false;
+    }
+    pathMtu_ = settings_.value("path_mtu", 1500).toInt();
+    if(pathMtu_ < 576 || pathMtu_ > 65535) {
+        qDebug() << pathMtu_ << "is not a valid mtu. Check [onion]->path_mtu";
+        ok = false;
+    }
+
+    // optional, the largest cells circuits through us may use. circuits agree on it hop by hop
+    cellSize_ = settings_.value("cell_size", MESSAGE_LENGTH).toInt();
+    if(PeerToPeerMessage::cellSizeOf(cellSize_) < 0) {
+        qDebug() << cellSize_ << "is not a valid cell size, 1027, 4099 or 8195. Check [onion]->cell_size";
+        ok = false;
+    }
+
+    // optional, pacing of relayed cells per neighbour in cells per second. 0 does not pace
+    neighbourRate_ = settings_.value("neighbour_rate", 0).toInt();
+    if(neighbourRate_ < 0) {
+        qDebug() << neighbourRate_ << "is not a valid rate. Check [onion]->neighbour_rate";
+        ok = false;
+    }
+    neighbourBurst_ = settings_.value("neighbour_burst", 32).toInt();
+    if(neighbourBurst_ < 1) {
+        qDebug() << neighbourBurst_ << "is not a valid burst. Check [onion]->neighbour_burst";
+        ok = false;
+    }
+
+    // optional, ms a small tunnel write waits for more to share its cell. 0 does not wait
+    coalesceDelay_ = settings_.value("coalesce_delay", 0).toInt();
+    if(coalesceDelay_ < 0 || coalesceDelay_ > 100) {
+        qDebug() << coalesceDelay_ << "is not a valid delay. Check [onion]->coalesce_delay";
+        ok = false;
+    }
+
+    // optional, compress what goes into the tunnels we build
+    compressData_ = settings_.value("compress_data", false).toBool();
+
     settings_.endGroup();
 
     ok &= readBinding(settings_.value("rps/api_address").toString(), &rpsApiAddress_, "[rps]->api_address");
@@ -70,11 +127,95 @@ void Settings::dump() const
     qDebug() << "\t[onion]/hostkey:" << hostkeyFile_;
     qDebug() << "\t[onion]/listen_address:" << p2pAddress_.toString();
     qDebug() << "\t[onion]/api_address:" << onionApiAddress_.toString();
+    qDebug() << "\t[onion]/relay_threads:" << relayThreads_;
+    qDebug() << "\t[onion]/recv_buffer:" << receiveBufferSize_;
+    qDebug() << "\t[onion]/send_buffer:" << sendBufferSize_;
+    qDebug() << "\t[onion]/io_uring:" << ioUring_;
+    qDebug() << "\t[onion]/udp_offload:" << segmentationOffload_;
+    qDebug() << "\t[onion]/cell_packing:" << cellPacking_;
+    qDebug() << "\t[onion]/path_mtu:" << pathMtu_;
+    qDebug() << "\t[onion]/cell_size:" << cellSize_;
+    qDebug() << "\t[onion]/neighbour_rate:" << neighbourRate_;
+    qDebug() << "\t[onion]/neighbour_burst:" << neighbourBurst_;
+    qDebug() << "\t[onion]/coalesce_delay:" << coalesceDelay_;
+    qDebug() << "\t[onion]/compress_data:" << compressData_;
     qDebug() << "\t[rps]/api_address:" << rpsApiAddress_.toString();
     qDebug() << "\t[auth]/api_address:" << authApiAddress_.toString();
     qDebug() << "\n";
 }
 
+bool Settings::readSize(QString key, int *size)
+{
+    bool ok;
+    *size = settings_.value(key, 0).toInt(&ok);
+    if(!ok || *size < 0) {
+        qDebug() << settings_.value(key).toString() << "is not a valid size in bytes. Check [onion]->" + key;
+        *size = 0;
+        return false;
+    }
+    return true;
+}
+
+int Settings::receiveBufferSize() const
+{
+    return receiveBufferSize_;
+}
+
+int Settings::sendBufferSize() const
+{
+    return sendBufferSize_;
+}
+
+bool Settings::ioUring() const
+{
+    return ioUring_;
+}
+
+bool Settings::segmentationOffload() const
+{
+    return segmentationOffload_;
+}
+
+int Settings::cellPacking() const
+{
+    return cellPacking_;
+}
+
+int Settings::pathMtu() const
+{
+    return pathMtu_;
+}
+
+int Settings::cellSize() const
+{
+    return cellSize_;
+}
+
+int Settings::neighbourRate() const
+{
+    return neighbourRate_;
+}
+
+int Settings::neighbourBurst() const
+{
+    return neighbourBurst_;
+}
+
+int Settings::coalesceDelay() const
+{
+    return coalesceDelay_;
+}
+
+bool Settings::compressData() const
+{
+    return compressData_;
+}
+
+int Settings::relayThreads() const
+{
+    return relayThreads_;
+}
+
 Binding Settings::authApiAddress() const
 {
     return authApiAddress_;
@@ -4,6 +4,7 @@
 #include <QHostAddress>
 #include <QSettings>
 #include "binding.h"
+#include "peertopeermessage.h"
 
 class Settings
 {
@@ -17,10 +18,23 @@ public:
     Binding rpsApiAddress() const;
     Binding authApiAddress() const;
     QString hostkeyFile() const;
+    int relayThreads() const;
+    int receiveBufferSize() const;
+    int sendBufferSize() const;
+    bool ioUring() const;
+    bool segmentationOffload() const;
+    int cellPacking() const;
+    int pathMtu() const;
+    int cellSize() const;
+    int neighbourRate() const;
+    int neighbourBurst() const;
+    int coalesceDelay() const;
+    bool compressData() const;
 
     void dump() const;
 private:
     bool readBinding(QString str, Binding *binding, QString errorPos) const;
+    bool readSize(QString key, int *size); // within the current group
 
     QSettings settings_;
 
@@ -29,6 +43,18 @@ private:
     Binding rpsApiAddress_;
     Binding authApiAddress_;
     QString hostkeyFile_;
+    int relayThreads_ = 1;
+    int receiveBufferSize_ = 0;
+    int sendBufferSize_ = 0;
+    bool ioUring_ = false;
+    bool segmentationOffload_ = false;
+    int cellPacking_ = 1;
+    int pathMtu_ = 1500;
+    int cellSize_ = MESSAGE_LENGTH;
+    int neighbourRate_ = 0;
+    int neighbourBurst_ = 32;
+    int coalesceDelay_ = 0;
+    bool compressData_ = false;
 };
 
 #endif // SETTINGS_H
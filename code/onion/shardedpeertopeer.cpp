@@ -0,0 +1,270 @@
+#include "shardedpeertopeer.h"
+
+ShardedPeerToPeer::ShardedPeerToPeer(int shards, QObject *parent) : QObject(parent)
+{
+    shards = qMax(1, shards);
+    for(int i = 0; i < shards; i++) {
+        // no parent, the shard is moved to its thread in start()
+        PeerToPeer *shard = new PeerToPeer();
+        shard->setShard(i, shards);
+        shards_.append(shard);
+
+        // results towards the apis, queued to our thread
+        connect(shard, &PeerToPeer::tunnelReady, this, &ShardedPeerToPeer::tunnelReady);
+        connect(shard, &PeerToPeer::tunnelIncoming, this, &ShardedPeerToPeer::tunnelIncoming);
+        connect(shard, &PeerToPeer::tunnelData, this, &ShardedPeerToPeer::tunnelData);
+        connect(shard, &PeerToPeer::tunnelError, this, &ShardedPeerToPeer::tunnelError);
+
+        connect(shard, &PeerToPeer::requestEncrypt, this, &ShardedPeerToPeer::requestEncrypt);
+        connect(shard, &PeerToPeer::requestDecrypt, this, &ShardedPeerToPeer::requestDecrypt);
+        connect(shard, &PeerToPeer::requestLayeredEncrypt, this, &ShardedPeerToPeer::requestLayeredEncrypt);
+        connect(shard, &PeerToPeer::requestLayeredDecrypt, this, &ShardedPeerToPeer::requestLayeredDecrypt);
+        connect(shard, &PeerToPeer::requestStartSession, this, &ShardedPeerToPeer::requestStartSession);
+        connect(shard, &PeerToPeer::sessionIncomingHS1, this, &ShardedPeerToPeer::sessionIncomingHS1);
+        connect(shard, &PeerToPeer::sessionIncomingHS2, this, &ShardedPeerToPeer::sessionIncomingHS2);
+        connect(shard, &PeerToPeer::requestEndSession, this, &ShardedPeerToPeer::requestEndSession);
+        connect(shard, &PeerToPeer::requestPeers, this, [=](int id, int n) { requestPeers(shard, id, n); });
+    }
+}
+
+ShardedPeerToPeer::~ShardedPeerToPeer()
+{
+    stop();
+    qDeleteAll(shards_);
+}
+
+int ShardedPeerToPeer::shardCount() const
+{
+    return shards_.size();
+}
+
+void ShardedPeerToPeer::setInterface(QHostAddress address)
+{
+    for(PeerToPeer *shard : shards_) {
+        shard->setInterface(address);
+    }
+}
+
+void ShardedPeerToPeer::setPort(int port)
+{
+    for(PeerToPeer *shard : shards_) {
+        shard->setPort(port);
+    }
+}
+
+void ShardedPeerToPeer::setNHops(int nHops)
+{
+    for(PeerToPeer *shard : shards_) {
+        shard->setNHops(nHops);
+    }
+}
+
+void ShardedPeerToPeer::setPeerSampler(PeerSampler *sampler)
+{
+    peerSampler_ = sampler;
+    connect(sampler, &PeerSampler::peersArrived, this, &ShardedPeerToPeer::onPeersArrived);
+}
+
+void ShardedPeerToPeer::setDebugLog(bool debugLog)
+{
+    for(PeerToPeer *shard : shards_) {
+        shard->setDebugLog(debugLog);
+    }
+}
+
+void ShardedPeerToPeer::setSocketBufferSizes(int receive, int send)
+{
+    for(PeerToPeer *shard : shards_) {
+        shard->setSocketBufferSizes(receive, send);
+    }
+}
+
+void ShardedPeerToPeer::setIoUring(bool ioUring)
+{
+    for(PeerToPeer *shard : shards_) {
+        shard->setIoUring(ioUring);
+    }
+}
+
+void ShardedPeerToPeer::setSegmentationOffload(bool offload)
+{
+    for(PeerToPeer *shard : shards_) {
+        shard->setSegmentationOffload(offload);
+    }
+}
+
+void ShardedPeerToPeer::setCellPacking(int cells, int pathMtu)
+{
+    for(PeerToPeer *shard : shards_) {
+        shard->setCellPacking(cells, pathMtu);
+    }
+}
+
+void ShardedPeerToPeer::setMaxCellSize(int bytes)
+{
+    for(PeerToPeer *shard : shards_) {
+        shard->setMaxCellSize(bytes);
+    }
+}
+
+void ShardedPeerToPeer::setNeighbourRate(int cellsPerSecond, int burst)
+{
+    // a neighbour's cells are spread over all shards, each gets its share of the rate
+    int n = shards_.size();
+    for(PeerToPeer *shard : shards_) {
+        shard->setNeighbourRate(cellsPerSecond > 0 ? qMax(1, cellsPerSecond / n) : 0, qMax(1, burst / n));
+    }
+}
+
+void ShardedPeerToPeer::setCoalesceDelay(int msecs)
+{
+    for(PeerToPeer *shard : shards_) {
+        shard->setCoalesceDelay(msecs);
+    }
+}
+
+void ShardedPeerToPeer::setCompression(bool compress)
+{
+    for(PeerToPeer *shard : shards_) {
+        shard->setCompression(compress);
+    }
+}
+
+bool ShardedPeerToPeer::start()
+{
+    if(!threads_.isEmpty() || shards_.contains(nullptr)) {
+        return false;
+    }
+
+    // sockets join the reuseport group in shard order, the steering filter relies on it
+    for(PeerToPeer *shard : shards_) {
+        QThread *thread = new QThread();
+        thread->setObjectName(QString("p2p shard %1").arg(shard->shardIndex()));
+        threads_.append(thread);
+        shard->moveToThread(thread);
+        connect(thread, &QThread::finished, shard, &QObject::deleteLater);
+        thread->start();
+
+        bool ok = false;
+        QMetaObject::invokeMethod(shard, "start", Qt::BlockingQueuedConnection, Q_RETURN_ARG(bool, ok));
+        if(!ok) {
+            qDebug() << "p2p shard" << shard->shardIndex() << "failed to start";
+            stop();
+            return false;
+        }
+    }
+
+    qDebug() << "p2p relay running on" << shards_.size() << "threads";
+    return true;
+}
+
+void ShardedPeerToPeer::buildTunnel(QHostAddress destinationAddr, quint16 destinationPort, QByteArray hostkey, QTcpSocket *requestId)
+{
+    QMetaObject::invokeMethod(nextShard(), "buildTunnel", Qt::QueuedConnection,
+                              Q_ARG(QHostAddress, destinationAddr), Q_ARG(quint16, destinationPort),
+                              Q_ARG(QByteArray, hostkey), Q_ARG(QTcpSocket*, requestId));
+}
+
+void ShardedPeerToPeer::destroyTunnel(quint32 tunnelId)
+{
+    QMetaObject::invokeMethod(shardByTunnel(tunnelId), "destroyTunnel", Qt::QueuedConnection,
+                              Q_ARG(quint32, tunnelId));
+}
+
+void ShardedPeerToPeer::sendData(quint32 tunnelId, QByteArray data)
+{
+    QMetaObject::invokeMethod(shardByTunnel(tunnelId), "sendData", Qt::QueuedConnection,
+                              Q_ARG(quint32, tunnelId), Q_ARG(QByteArray, data));
+}
+
+void ShardedPeerToPeer::coverTunnel(quint16 size)
+{
+    QMetaObject::invokeMethod(nextShard(), "coverTunnel", Qt::QueuedConnection, Q_ARG(quint16, size));
+}
+
+void ShardedPeerToPeer::onEncrypted(quint32 requestId, quint16 sessionId, QByteArray payload)
+{
+    QMetaObject::invokeMethod(shardByRequest(requestId), "onEncrypted", Qt::QueuedConnection,
+                              Q_ARG(quint32, requestId), Q_ARG(quint16, sessionId), Q_ARG(QByteArray, payload));
+}
+
+void ShardedPeerToPeer::onDecrypted(quint32 requestId, QByteArray payload)
+{
+    QMetaObject::invokeMethod(shardByRequest(requestId), "onDecrypted", Qt::QueuedConnection,
+                              Q_ARG(quint32, requestId), Q_ARG(QByteArray, payload));
+}
+
+void ShardedPeerToPeer::onSessionHS1(quint32 requestId, quint16 sessionId, QByteArray handshake)
+{
+    QMetaObject::invokeMethod(shardByRequest(requestId), "onSessionHS1", Qt::QueuedConnection,
+                              Q_ARG(quint32, requestId), Q_ARG(quint16, sessionId), Q_ARG(QByteArray, handshake));
+}
+
+void ShardedPeerToPeer::onSessionHS2(quint32 requestId, quint16 sessionId, QByteArray handshake)
+{
+    QMetaObject::invokeMethod(shardByRequest(requestId), "onSessionHS2", Qt::QueuedConnection,
+                              Q_ARG(quint32, requestId), Q_ARG(quint16, sessionId), Q_ARG(QByteArray, handshake));
+}
+
+void ShardedPeerToPeer::onAuthError(quint32 requestId)
+{
+    QMetaObject::invokeMethod(shardByRequest(requestId), "onAuthError", Qt::QueuedConnection,
+                              Q_ARG(quint32, requestId));
+}
+
+void ShardedPeerToPeer::requestPeers(PeerToPeer *shard, int id, int n)
+{
+    if(peerSampler_ == nullptr) {
+        qDebug() << "p2p shard" << shard->shardIndex() << "asked for peers, there is no sampler";
+        return;
+    }
+    PendingSample sample;
+    sample.shard = shard;
+    sample.id = id;
+    pendingSamples_[peerSampler_->requestPeers(n)] = sample;
+}
+
+void ShardedPeerToPeer::onPeersArrived(int samplerId, QList<PeerSampler::Peer> peers)
+{
+    // the sampler may serve others as well
+    if(!pendingSamples_.contains(samplerId)) {
+        return;
+    }
+    PendingSample sample = pendingSamples_.take(samplerId);
+    QMetaObject::invokeMethod(sample.shard, "peersArrived", Qt::QueuedConnection,
+                              Q_ARG(int, sample.id), Q_ARG(QList<PeerSampler::Peer>, peers));
+}
+
+void ShardedPeerToPeer::stop()
+{
+    // a started shard is deleted on its thread as that finishes, its sockets and timers
+    // belong to it. the others never left ours
+    for(QThread *thread : threads_) {
+        thread->quit();
+        thread->wait();
+    }
+    // gone with their threads, the relay does not start again
+    for(int i = 0; i < threads_.size(); i++) {
+        shards_[i] = nullptr;
+    }
+    qDeleteAll(threads_);
+    threads_.clear();
+    pendingSamples_.clear();
+}
+
+PeerToPeer *ShardedPeerToPeer::shardByTunnel(quint32 tunnelId) const
+{
+    return shards_[TunnelIdMapper::shardOf(tunnelId, shards_.size())];
+}
+
+PeerToPeer *ShardedPeerToPeer::shardByRequest(quint32 requestId) const
+{
+    return shards_[requestId % shards_.size()];
+}
+
+PeerToPeer *ShardedPeerToPeer::nextShard()
+{
+    PeerToPeer *shard = shards_[nextShard_];
+    nextShard_ = (nextShard_ + 1) % shards_.size();
+    return shard;
+}
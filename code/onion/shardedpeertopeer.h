@@ -0,0 +1,109 @@
+#ifndef SHARDEDPEERTOPEER_H
+#define SHARDEDPEERTOPEER_H
+
+#include <QObject>
+#include <QThread>
+#include <QTcpSocket>
+
+#include "messagetypes.h"
+#include "peertopeer.h"
+
+// multi-threaded relay: runs one PeerToPeer per worker thread, each with its own
+// SO_REUSEPORT socket on the shared p2p port and its own tunnels, circuits and ids.
+// the kernel steers cells by circuit id (DatagramEngine::setShardSteering), shards only
+// hand out circuit ids that steer back to themselves, so a circuit never changes thread.
+// towards OnionApi and OAuthApi this class looks like a single PeerToPeer: calls are
+// queued to the owning shard, chosen by tunnel id or auth request id.
+class ShardedPeerToPeer : public QObject
+{
+    Q_OBJECT
+public:
+    explicit ShardedPeerToPeer(int shards, QObject *parent = 0);
+    ~ShardedPeerToPeer();
+
+    int shardCount() const;
+
+    // forwarded to every shard, before start()
+    void setInterface(QHostAddress address);
+    void setPort(int port);
+    void setNHops(int nHops);
+    // stays on our thread, shards ask for samples through us
+    void setPeerSampler(PeerSampler *sampler);
+    void setDebugLog(bool debugLog);
+    void setSocketBufferSizes(int receive, int send);
+    void setIoUring(bool ioUring);
+    void setSegmentationOffload(bool offload);
+    // only with a single shard, see PeerToPeer::setCellPacking()
+    void setCellPacking(int cells, int pathMtu);
+    void setMaxCellSize(int bytes);
+    // the rate of each neighbour is split evenly between the shards
+    void setNeighbourRate(int cellsPerSecond, int burst);
+    void setCoalesceDelay(int msecs);
+    void setCompression(bool compress);
+
+    // false if a shard fails to start, those started before it are stopped again
+    bool start();
+
+public slots:
+    // from OnionApi
+    void buildTunnel(QHostAddress destinationAddr, quint16 destinationPort, QByteArray hostkey, QTcpSocket *requestId);
+    void destroyTunnel(quint32 tunnelId);
+    // queued to the shard of the tunnel, there is no result to wait for. the shard reports
+    // unknown tunnels and writes it drops itself, see PeerToPeer::sendData()
+    void sendData(quint32 tunnelId, QByteArray data);
+    void coverTunnel(quint16 size);
+
+    // from AuthApi
+    void onEncrypted(quint32 requestId, quint16 sessionId, QByteArray payload);
+    void onDecrypted(quint32 requestId, QByteArray payload);
+
+    void onSessionHS1(quint32 requestId, quint16 sessionId, QByteArray handshake);
+    void onSessionHS2(quint32 requestId, quint16 sessionId, QByteArray handshake);
+    void onAuthError(quint32 requestId);
+
+signals:
+    // same as PeerToPeer, emitted on the thread of this object
+    void tunnelReady(QTcpSocket *requestId, quint32 tunnelId, QByteArray hostkey);
+    void tunnelIncoming(quint32 tunnelId);
+    void tunnelData(quint32 tunnelId, QByteArray data);
+    void tunnelError(quint32 tunnelId, MessageType lastMessage);
+
+    void requestEncrypt(quint32 requestId, quint16 sessionId, QByteArray payload);
+    void requestDecrypt(quint32 requestId, quint16 sessionId, QByteArray payload);
+
+    void requestLayeredEncrypt(quint32 requestId, QVector<quint16> sessionIds, QByteArray payload);
+    void requestLayeredDecrypt(quint32 requestId, QVector<quint16> sessionIds, QByteArray payload);
+
+    void requestStartSession(quint32 requestId, QByteArray hostkey);
+    void sessionIncomingHS1(quint32 requestId, QByteArray handshake);
+    void sessionIncomingHS2(quint32 requestId, quint16 sessionId, QByteArray handshake);
+
+    void requestEndSession(quint16 session);
+
+private slots:
+    // queued from and back to the shard that asked, neither thread waits for the other
+    void requestPeers(PeerToPeer *shard, int id, int n);
+    void onPeersArrived(int samplerId, QList<PeerSampler::Peer> peers);
+
+private:
+    // quits and waits for the shard threads, their shards go with them
+    void stop();
+
+    // a sample a shard asked for, by id of the sampler
+    struct PendingSample {
+        PeerToPeer *shard = nullptr;
+        int id = 0; // of the shard
+    };
+
+    PeerToPeer *shardByTunnel(quint32 tunnelId) const;
+    PeerToPeer *shardByRequest(quint32 requestId) const;
+    PeerToPeer *nextShard(); // round robin for new circuits
+
+    QList<PeerToPeer *> shards_;
+    QList<QThread *> threads_;
+    PeerSampler *peerSampler_ = nullptr;
+    QHash<int, PendingSample> pendingSamples_;
+    int nextShard_ = 0;
+};
+
+#endif // SHARDEDPEERTOPEER_H
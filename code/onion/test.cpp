@@ -2,6 +2,19 @@
 #include "tests/rpsapitester.h"
 #include "tests/peertopeermessagetester.h"
 #include "tests/oauthapitester.h"
+#include "tests/datagramenginetester.h"
+#include "tests/cellbuffertester.h"
+#include "tests/cellschedulertester.h"
+#include "tests/celldigesttester.h"
+#include "tests/randompooltester.h"
+#include "tests/fragmentassemblertester.h"
+#include "tests/datacompressortester.h"
+#include "tests/tunneltabletester.h"
+#include "tests/tunnelidmappertester.h"
+#include "tests/routetabletester.h"
+#include "tests/requestslotstester.h"
+#include "tests/endpointtester.h"
+#include "tests/peertopeertester.h"
 #include <QTest>
 #include <QCoreApplication>
 
@@ -16,7 +29,20 @@ int main(int argc, char *argv[])
          new OnionApiTester(),
          new RPSApiTester(),
          new PeerToPeerMessageTester(),
-         new OAuthApiTester()
+         new OAuthApiTester(),
+         new DatagramEngineTester(),
+         new CellBufferTester(),
+         new CellSchedulerTester(),
+         new CellDigestTester(),
+         new RandomPoolTester(),
+         new FragmentAssemblerTester(),
+         new DataCompressorTester(),
+         new TunnelTableTester(),
+         new TunnelIdMapperTester(),
+         new RouteTableTester(),
+         new RequestSlotsTester(),
+         new EndpointTester(),
+         new PeerToPeerTester()
     });
 
     bool ok = true;
@@ -0,0 +1,135 @@
+#include "cellbuffertester.h"
+#include "peertopeermessage.h"
+
+CellBufferTester::CellBufferTester(QObject *parent) : QObject(parent)
+{
+
+}
+
+void CellBufferTester::testRefcount()
+{
+    CellPool pool(4);
+    CellBuffer a = pool.acquire();
+    QVERIFY(!a.isNull());
+    QVERIFY(!a.isShared());
+    QCOMPARE(pool.stats().inUse, 1);
+
+    {
+        CellBuffer b = a;
+        QVERIFY(a.isShared());
+        QCOMPARE(b.constData(), a.constData());
+        QCOMPARE(pool.stats().inUse, 1);
+    }
+    QVERIFY(!a.isShared());
+
+    CellBuffer moved = std::move(a);
+    QVERIFY(a.isNull());
+    QCOMPARE(pool.stats().inUse, 1);
+
+    moved.clear();
+    QCOMPARE(pool.stats().inUse, 0);
+}
+
+void CellBufferTester::testSlabReuse()
+{
+    CellPool pool(8);
+    for(int i = 0; i < 10000; i++) {
+        CellBuffer cell = pool.acquire();
+        cell.data()[0] = (char)i;
+    }
+
+    // released cells come back through the free list, the heap is touched once
+    CellPool::Stats stats = pool.stats();
+    QCOMPARE(stats.slabAllocations, (quint64)1);
+    QCOMPARE(stats.acquired, (quint64)10000);
+    QCOMPARE(stats.inUse, 0);
+
+    QVector<CellBuffer> held;
+    for(int i = 0; i < 9; i++) {
+        held.append(pool.acquire());
+    }
+    QCOMPARE(pool.stats().slabAllocations, (quint64)2);
+    QCOMPARE(pool.stats().capacity, 16);
+}
+
+void CellBufferTester::testPoolOutlived()
+{
+    CellBuffer survivor;
+    {
+        CellPool pool(2);
+        survivor = pool.acquire();
+        memset(survivor.data(), 'x', survivor.capacity());
+    }
+
+    // the slab stays until its last cell is gone
+    QCOMPARE(survivor.bytes(), QByteArray(CELL_CAPACITY, 'x'));
+    survivor.clear();
+    QVERIFY(survivor.isNull());
+}
+
+void CellBufferTester::testComposeInPlace()
+{
+    CellPool pool(2);
+    CellBuffer cell = pool.acquire();
+    QByteArray payload(MESSAGE_LENGTH - UNENCRYPTED_HEADER_LEN, 'p');
+    memcpy(cell.data() + UNENCRYPTED_HEADER_LEN, payload.constData(), payload.size());
+
+    // the payload view points into the very cell we compose into
+    PeerToPeerMessage::composeEncrypted(0x1234, cell.mid(UNENCRYPTED_HEADER_LEN), &cell);
+    QCOMPARE(cell.bytes(), PeerToPeerMessage::composeEncrypted(0x1234, payload));
+
+    // short payloads are padded to a full cell, with random bytes
+    PeerToPeerMessage::composeEncrypted(7, QByteArray("abc"), &cell);
+    QByteArray composed = PeerToPeerMessage::composeEncrypted(7, QByteArray("abc"));
+    QCOMPARE(composed.size(), MESSAGE_LENGTH);
+    QCOMPARE(cell.bytes(UNENCRYPTED_HEADER_LEN + 3), composed.left(UNENCRYPTED_HEADER_LEN + 3));
+}
+
+void CellBufferTester::testSizedPool()
+{
+    const int size = PeerToPeerMessage::cellLength(PeerToPeerMessage::CELL_8K);
+    CellPool pool(2, size);
+    QCOMPARE(pool.cellSize(), size);
+    CellBuffer a = pool.acquire(), b = pool.acquire();
+    QCOMPARE(a.capacity(), size);
+    QCOMPARE(a.bytes().size(), size);
+    QCOMPARE(CellBuffer().capacity(), 0);
+
+    // neighbouring cells of a slab do not overlap
+    memset(a.data(), 'a', size);
+    memset(b.data(), 'b', size);
+    QCOMPARE(a.bytes(), QByteArray(size, 'a'));
+    QCOMPARE(a.mid(size - 10), QByteArray(10, 'a'));
+
+    // a cell is composed as large as the pool's cells
+    PeerToPeerMessage data = PeerToPeerMessage::makeRelayData(9, 0, QByteArray(5000, 'd'));
+    data.cellSize = PeerToPeerMessage::CELL_8K;
+    QByteArray payload = data.toEncryptedPayload();
+    PeerToPeerMessage::composeEncrypted(9, payload, &a);
+    QCOMPARE(a.bytes(), PeerToPeerMessage::composeEncrypted(9, payload));
+    PeerToPeerMessage message = PeerToPeerMessage::fromBytes(a.bytes());
+    QVERIFY(!message.malformed);
+    QCOMPARE(message.cellSize, PeerToPeerMessage::CELL_8K);
+    QCOMPARE(message.data, data.data);
+}
+
+void CellBufferTester::testPayloadView()
+{
+    const int length = MESSAGE_LENGTH - UNENCRYPTED_HEADER_LEN;
+    CellPool pool(2);
+    CellBuffer cell = pool.acquire();
+    memset(cell.data(), 'h', UNENCRYPTED_HEADER_LEN);
+    memset(cell.data() + UNENCRYPTED_HEADER_LEN, 'p', length);
+
+    // up to the end of the cell it is the view made with the slab, every call shares it
+    QByteArray payload = cell.payload(length);
+    QCOMPARE(payload, QByteArray(length, 'p'));
+    QVERIFY(payload.constData() == cell.constData() + UNENCRYPTED_HEADER_LEN);
+    QVERIFY(payload.isSharedWith(cell.payload(length)));
+
+    // shorter ones are views of their own
+    QByteArray shorter = cell.payload(10);
+    QCOMPARE(shorter, QByteArray(10, 'p'));
+    QVERIFY(!shorter.isSharedWith(payload));
+    QCOMPARE(CellBuffer().payload(10), QByteArray());
+}
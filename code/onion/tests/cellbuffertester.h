@@ -0,0 +1,23 @@
+#ifndef CELLBUFFERTESTER_H
+#define CELLBUFFERTESTER_H
+
+#include <QObject>
+#include <QTest>
+#include "cellbuffer.h"
+
+class CellBufferTester : public QObject
+{
+    Q_OBJECT
+public:
+    explicit CellBufferTester(QObject *parent = 0);
+
+private slots:
+    void testRefcount();
+    void testSlabReuse();
+    void testPoolOutlived();
+    void testComposeInPlace();
+    void testSizedPool();
+    void testPayloadView();
+};
+
+#endif // CELLBUFFERTESTER_H
@@ -0,0 +1,94 @@
+#include "celldigesttester.h"
+#include "cellview.h"
+#include "peertopeermessage.h"
+
+#include <QElapsedTimer>
+
+CellDigestTester::CellDigestTester(QObject *parent) : QObject(parent)
+{
+
+}
+
+void CellDigestTester::testCrc32c()
+{
+    // the CRC32C check value
+    QCOMPARE(CellDigest::crc32c("123456789", 9), (quint32)0xE3069283);
+    QCOMPARE(CellDigest::crc32c("", 0), (quint32)0);
+
+    // continuing equals one pass, also across the 8 byte steps
+    QByteArray data(1021, 'x');
+    for(int i = 0; i < data.size(); i++) {
+        data[i] = (char)(i * 7);
+    }
+    quint32 crc = CellDigest::crc32c(data.constData(), 13);
+    QCOMPARE(CellDigest::crc32c(data.constData() + 13, data.size() - 13, crc), CellDigest::crc32c(data.constData(), data.size()));
+}
+
+void CellDigestTester::testSealVerify()
+{
+    CellDigest::Key key = CellDigest::deriveKey("handshake");
+    QByteArray payload = PeerToPeerMessage::makeRelayData(0, 3, "hello").toEncryptedPayload();
+    QVERIFY(!CellDigest::verify(key, payload));
+
+    CellDigest::seal(key, &payload);
+    QVERIFY(CellView::digest(payload) != 0);
+    QVERIFY(CellDigest::verify(key, payload));
+
+    // the digest covers everything but itself
+    PeerToPeerMessage message = PeerToPeerMessage::fromEncryptedPayload(payload);
+    QCOMPARE(message.command, PeerToPeerMessage::RELAY_DATA);
+    QCOMPARE(message.data, QByteArray("hello"));
+    for(int offset : { CellView::CommandOffset, CellView::StreamIdOffset, 20, payload.size() - 1 }) {
+        QByteArray changed = payload;
+        changed[offset] = changed[offset] ^ 0x01;
+        QVERIFY2(!CellDigest::verify(key, changed), qPrintable(QString::number(offset)));
+    }
+    QVERIFY(!CellDigest::verify(key, payload.left(payload.size() - 1)));
+    QVERIFY(!CellDigest::verify(key, payload.left(CellView::RelayHeaderLength - 1)));
+}
+
+void CellDigestTester::testKeyedPerHop()
+{
+    CellDigest::Key first = CellDigest::deriveKey("first hop");
+    CellDigest::Key second = CellDigest::deriveKey("second hop");
+    QVERIFY(!(first == second));
+    QVERIFY(first == CellDigest::deriveKey("first hop"));
+
+    // a payload sealed for the second hop does not verify at the first one
+    QByteArray payload = PeerToPeerMessage::makeCommandCover(0).toEncryptedPayload();
+    CellDigest::seal(second, &payload);
+    QVERIFY(!CellDigest::verify(first, payload));
+    QVERIFY(CellDigest::verify(second, payload));
+
+    // the old mock digest is no longer accepted
+    QByteArray zero = PeerToPeerMessage::makeCommandCover(0).toEncryptedPayload();
+    QCOMPARE(CellView::digest(zero), (quint32)0);
+    QVERIFY(!CellDigest::verify(first, zero));
+}
+
+void CellDigestTester::benchmarkVerify()
+{
+    const int cells = 60;
+
+    QVector<CellDigest::Key> keys(cells);
+    QVector<QByteArray> payloads(cells);
+    for(int i = 0; i < cells; i++) {
+        keys[i] = CellDigest::deriveKey(QByteArray::number(i));
+        payloads[i] = PeerToPeerMessage::makeRelayData(0, i, QByteArray(900, 'd')).toEncryptedPayload();
+        CellDigest::seal(keys[i], &payloads[i]);
+    }
+
+    int verified = 0;
+    qint64 nsecs = 0;
+    QBENCHMARK {
+        QElapsedTimer timer;
+        timer.start();
+        verified = 0;
+        for(int i = 0; i < cells; i++) {
+            verified += CellDigest::verify(keys[i], payloads[i]);
+        }
+        nsecs = timer.nsecsElapsed();
+    }
+    QCOMPARE(verified, cells);
+    qDebug() << nsecs / cells << "ns/cell, sse4.2:" << CellDigest::accelerated();
+}
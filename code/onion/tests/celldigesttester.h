@@ -0,0 +1,23 @@
+#ifndef CELLDIGESTTESTER_H
+#define CELLDIGESTTESTER_H
+
+#include <QObject>
+#include <QTest>
+#include "celldigest.h"
+
+class CellDigestTester : public QObject
+{
+    Q_OBJECT
+public:
+    explicit CellDigestTester(QObject *parent = 0);
+
+private slots:
+    void testCrc32c();
+    void testSealVerify();
+    void testKeyedPerHop();
+
+    // ns per cell
+    void benchmarkVerify();
+};
+
+#endif // CELLDIGESTTESTER_H
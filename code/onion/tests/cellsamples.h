@@ -0,0 +1,60 @@
+#ifndef CELLSAMPLES_H
+#define CELLSAMPLES_H
+
+#include <QPair>
+#include <QString>
+#include <QVector>
+#include "datacompressor.h"
+#include "peertopeermessage.h"
+
+// one message of every kind the factories make, named by kind. the fuzz seed corpus and the
+// per command benchmark in PeerToPeerMessageTester both start from these
+inline QVector<QPair<QString, PeerToPeerMessage>> cellSamples()
+{
+    QVector<QPair<QString, PeerToPeerMessage>> samples;
+    QByteArray handshake(32, 'h');
+    Endpoint v4(QHostAddress("10.0.0.1"), 8000);
+    Endpoint v6(QHostAddress("fe80::1"), 8000);
+
+    PeerToPeerMessage packed = PeerToPeerMessage::makeCreated(2, handshake);
+    packed.packing = 4;
+    PeerToPeerMessage offer = PeerToPeerMessage::makeBuild(1, handshake);
+    offer.circuitCellSize = PeerToPeerMessage::CELL_8K;
+    PeerToPeerMessage large = PeerToPeerMessage::makeRelayData(3, 1, QByteArray(PeerToPeerMessage::maxCellData(PeerToPeerMessage::CELL_8K), 'd'));
+    large.cellSize = PeerToPeerMessage::CELL_8K;
+    QByteArray text;
+    while(text.size() < 2000) {
+        text += "{\"peer\": \"10.0.0." + QByteArray::number(text.size() % 250) + "\", \"online\": true},";
+    }
+    PeerToPeerMessage compressed = PeerToPeerMessage::makeRelayData(3, 1, DataCompressor::compress(text));
+    compressed.dataFlags = PeerToPeerMessage::DATA_COMPRESSED;
+
+    samples.append(qMakePair(QString("build"), PeerToPeerMessage::makeBuild(1, handshake)));
+    samples.append(qMakePair(QString("created"), PeerToPeerMessage::makeCreated(2, handshake)));
+    samples.append(qMakePair(QString("created_packing"), packed));
+    samples.append(qMakePair(QString("build_cell_size"), offer));
+    samples.append(qMakePair(QString("relay_data_empty"), PeerToPeerMessage::makeRelayData(3, 1, QByteArray())));
+    samples.append(qMakePair(QString("relay_data"), PeerToPeerMessage::makeRelayData(3, 1, QByteArray(100, 'd'))));
+    samples.append(qMakePair(QString("relay_data_full"), PeerToPeerMessage::makeRelayData(3, 1, QByteArray(PeerToPeerMessage::MaxCellData, 'd'))));
+    samples.append(qMakePair(QString("relay_data_8k"), large));
+    samples.append(qMakePair(QString("relay_data_compressed"), compressed));
+    samples.append(qMakePair(QString("relay_extend_ipv4"), PeerToPeerMessage::makeRelayExtend(4, 0, v4, handshake)));
+    samples.append(qMakePair(QString("relay_extend_ipv6"), PeerToPeerMessage::makeRelayExtend(4, 0, v6, handshake)));
+    samples.append(qMakePair(QString("relay_extended"), PeerToPeerMessage::makeRelayExtended(5, 0, handshake)));
+    samples.append(qMakePair(QString("relay_truncated"), PeerToPeerMessage::makeRelayTruncated(6, 0)));
+    samples.append(qMakePair(QString("destroy"), PeerToPeerMessage::makeCommandDestroy(7)));
+    samples.append(qMakePair(QString("cover"), PeerToPeerMessage::makeCommandCover(8)));
+
+    QByteArray records;
+    for(int i = 0; i < 10; i++) {
+        PeerToPeerMessage::appendRecord(&records, QByteArray(20, 'r'));
+    }
+    samples.append(qMakePair(QString("relay_data_records"), PeerToPeerMessage::makeRelayDataRecords(9, 0, records)));
+
+    QList<PeerToPeerMessage> fragments = PeerToPeerMessage::makeRelayDataFragments(10, 0, 1, QByteArray(PeerToPeerMessage::MaxFragmentData + 100, 'f'));
+    samples.append(qMakePair(QString("relay_data_fragment"), fragments.first()));
+    samples.append(qMakePair(QString("relay_data_fragment_final"), fragments.last()));
+    return samples;
+}
+
+#endif // CELLSAMPLES_H
@@ -0,0 +1,120 @@
+#include "cellschedulertester.h"
+
+CellSchedulerTester::CellSchedulerTester(QObject *parent) : QObject(parent)
+{
+
+}
+
+void CellSchedulerTester::testPassThrough()
+{
+    CellPool pool;
+    CellScheduler scheduler;
+    Endpoint neighbour(QHostAddress::LocalHost, 4000);
+
+    int dispatched = 0;
+    connect(&scheduler, &CellScheduler::dispatch, [&](Endpoint to, CellBuffer cell, bool isCover) {
+        QCOMPARE(to, neighbour);
+        QVERIFY(!cell.isNull());
+        QVERIFY(!isCover);
+        dispatched++;
+    });
+
+    for(int i = 0; i < 100; i++) {
+        QVERIFY(scheduler.enqueue(neighbour, 1, pool.acquire(), false));
+    }
+    QCOMPARE(dispatched, 100);
+    QCOMPARE(scheduler.stats().delayed, (quint64)0);
+}
+
+void CellSchedulerTester::testTokenBucket()
+{
+    CellPool pool;
+    CellScheduler scheduler;
+    scheduler.setRate(100, 5);
+    Endpoint neighbour(QHostAddress::LocalHost, 4000);
+
+    int dispatched = 0;
+    connect(&scheduler, &CellScheduler::dispatch, [&](Endpoint, CellBuffer, bool) { dispatched++; });
+
+    for(int i = 0; i < 20; i++) {
+        QVERIFY(scheduler.enqueue(neighbour, 1, pool.acquire(), false));
+    }
+    // only the burst goes out right away
+    QCOMPARE(dispatched, 5);
+    QCOMPARE(scheduler.queued(neighbour), 15);
+
+    // the rest trickles out at 100 cells per second
+    QTRY_COMPARE_WITH_TIMEOUT(dispatched, 20, 2000);
+    QCOMPARE(scheduler.queued(neighbour), 0);
+    QCOMPARE(scheduler.stats().delayed, (quint64)15);
+    QCOMPARE(pool.stats().inUse, 0);
+}
+
+void CellSchedulerTester::testRoundRobin()
+{
+    CellPool pool;
+    CellScheduler scheduler;
+    scheduler.setRate(1000, 1);
+    Endpoint neighbour(QHostAddress::LocalHost, 4000);
+
+    QList<quint16> order;
+    connect(&scheduler, &CellScheduler::dispatch, [&](Endpoint, CellBuffer cell, bool) {
+        order.append((quint8)cell.constData()[0]);
+    });
+
+    // a bulk circuit fills the queue before an interactive one sends its single cell
+    for(int i = 0; i < 10; i++) {
+        CellBuffer cell = pool.acquire();
+        cell.data()[0] = 'a';
+        scheduler.enqueue(neighbour, 1, cell, false);
+    }
+    CellBuffer cell = pool.acquire();
+    cell.data()[0] = 'b';
+    scheduler.enqueue(neighbour, 2, cell, false);
+    cell.clear();
+
+    QTRY_COMPARE_WITH_TIMEOUT(order.size(), 11, 2000);
+    // first a went out on the burst, then the queues alternate
+    QCOMPARE(order.at(0), (quint16)'a');
+    QCOMPARE(order.at(1), (quint16)'a');
+    QCOMPARE(order.at(2), (quint16)'b');
+}
+
+void CellSchedulerTester::testQueueLimit()
+{
+    CellPool pool;
+    CellScheduler scheduler;
+    scheduler.setRate(1, 1);
+    scheduler.setQueueLimit(4);
+    Endpoint neighbour(QHostAddress::LocalHost, 4000);
+    Endpoint other(QHostAddress::LocalHost, 4001);
+
+    QVERIFY(scheduler.enqueue(neighbour, 1, pool.acquire(), false)); // burst
+    for(int i = 0; i < 4; i++) {
+        QVERIFY(scheduler.enqueue(neighbour, 1, pool.acquire(), false));
+    }
+    QVERIFY(!scheduler.enqueue(neighbour, 2, pool.acquire(), false));
+    QCOMPARE(scheduler.stats().dropped, (quint64)1);
+
+    // other neighbours have their own bucket and queue
+    QVERIFY(scheduler.enqueue(other, 1, pool.acquire(), false));
+    QCOMPARE(scheduler.queued(other), 0);
+}
+
+void CellSchedulerTester::testIdleNeighbours()
+{
+    CellPool pool;
+    CellScheduler scheduler;
+    scheduler.setRate(1000, 2);
+
+    for(int i = 0; i < 1000; i++) {
+        QVERIFY(scheduler.enqueue(Endpoint(QHostAddress::LocalHost, 5000 + i), 1, pool.acquire(), false));
+    }
+    // their buckets fill up again, then they are as good as new
+    QTest::qWait(20);
+    for(int i = 0; i < 1000; i++) {
+        QVERIFY(scheduler.enqueue(Endpoint(QHostAddress::LocalHost, 7000 + i), 1, pool.acquire(), false));
+    }
+    QVERIFY(scheduler.stats().neighbours <= 1000);
+    QCOMPARE(scheduler.stats().dispatched, (quint64)2000);
+}
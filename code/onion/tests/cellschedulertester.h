@@ -0,0 +1,22 @@
+#ifndef CELLSCHEDULERTESTER_H
+#define CELLSCHEDULERTESTER_H
+
+#include <QObject>
+#include <QTest>
+#include "cellscheduler.h"
+
+class CellSchedulerTester : public QObject
+{
+    Q_OBJECT
+public:
+    explicit CellSchedulerTester(QObject *parent = 0);
+
+private slots:
+    void testPassThrough();
+    void testTokenBucket();
+    void testRoundRobin();
+    void testQueueLimit();
+    void testIdleNeighbours();
+};
+
+#endif // CELLSCHEDULERTESTER_H
@@ -0,0 +1,121 @@
+#include "datacompressortester.h"
+
+#include <QElapsedTimer>
+#include <random>
+
+// records as a client of the api would write them
+static QByteArray json(int size)
+{
+    std::mt19937 rng(size);
+    QByteArray data;
+    while(data.size() < size) {
+        data += "{\"id\": " + QByteArray::number((uint)(rng() % 100000)) + ", \"name\": \"peer\", \"online\": true},";
+    }
+    return data.left(size);
+}
+
+static QByteArray noise(int size)
+{
+    std::mt19937 rng(size);
+    QByteArray data(size, Qt::Uninitialized);
+    for(int i = 0; i < size; i++) {
+        data[i] = (char)rng();
+    }
+    return data;
+}
+
+DataCompressorTester::DataCompressorTester(QObject *parent) : QObject(parent)
+{
+
+}
+
+void DataCompressorTester::testRoundTrip_data()
+{
+    QTest::addColumn<QByteArray>("data");
+    QTest::addColumn<bool>("smaller");
+    QTest::newRow("empty") << QByteArray() << false;
+    QTest::newRow("shorter than a match") << QByteArray("abcabcabcab") << false;
+    QTest::newRow("one byte repeated") << QByteArray(DataCompressor::MaxSize, 'a') << true;
+    QTest::newRow("json") << json(4000) << true;
+    QTest::newRow("json, largest") << json(DataCompressor::MaxSize) << true;
+    QTest::newRow("noise") << noise(3000) << false;
+    // long literal runs between matches
+    QTest::newRow("mixed") << noise(700) + json(300) + noise(400) + json(300) << true;
+}
+
+void DataCompressorTester::testRoundTrip()
+{
+    QFETCH(QByteArray, data);
+    QFETCH(bool, smaller);
+
+    QByteArray compressed = DataCompressor::compress(data);
+    QCOMPARE(compressed.size() < data.size(), smaller);
+    QByteArray out;
+    QVERIFY(DataCompressor::decompress(compressed, &out));
+    QCOMPARE(out, data);
+}
+
+void DataCompressorTester::testLz4Block()
+{
+    // size 13 | "ab", a match at offset 2 over 8 bytes, overlapping itself | "abcde"
+    QByteArray out;
+    QVERIFY(DataCompressor::decompress(QByteArray::fromHex("000f" "24" "6162" "0200" "50" "6162636465"), &out));
+    QCOMPARE(out, QByteArray("ababababababcde"));
+
+    // text makes a half as large block
+    QVERIFY(DataCompressor::compress(json(4000)).size() < 2000);
+}
+
+void DataCompressorTester::testCorrupt()
+{
+    QByteArray data = json(2000);
+    QByteArray compressed = DataCompressor::compress(data);
+    QByteArray out;
+
+    QVERIFY(!DataCompressor::decompress(QByteArray(), &out));
+    QVERIFY(!DataCompressor::decompress(compressed.left(2), &out));
+    // cut short, or with a size that does not match the block
+    QVERIFY(!DataCompressor::decompress(compressed.left(compressed.size() - 1), &out));
+    QByteArray size = compressed;
+    size[1] = size[1] + 1;
+    QVERIFY(!DataCompressor::decompress(size, &out));
+    // a match before the start
+    QVERIFY(!DataCompressor::decompress(QByteArray::fromHex("0008" "10" "61" "0500" "50" "6162636465"), &out));
+    QVERIFY(!DataCompressor::decompress(QByteArray::fromHex("0008" "10" "61" "0000" "50" "6162636465"), &out));
+    // a length that never ends
+    QVERIFY(!DataCompressor::decompress(QByteArray::fromHex("ffff" "f0") + QByteArray(600, (char)0xFF), &out));
+
+    // whatever else, it stays inside its buffers. asan tells
+    std::mt19937 rng(1);
+    for(int i = 0; i < 2000; i++) {
+        QByteArray changed = compressed;
+        changed[rng() % changed.size()] = (char)rng();
+        if(DataCompressor::decompress(changed, &out)) {
+            QCOMPARE(out.size(), data.size());
+        }
+    }
+}
+
+void DataCompressorTester::benchmarkCompress_data()
+{
+    QTest::addColumn<QByteArray>("data");
+    QTest::newRow("json") << json(DataCompressor::MaxSize);
+    QTest::newRow("noise") << noise(DataCompressor::MaxSize);
+}
+
+void DataCompressorTester::benchmarkCompress()
+{
+    QFETCH(QByteArray, data);
+
+    QByteArray compressed;
+    qint64 nsecs = 0;
+    QBENCHMARK {
+        QElapsedTimer timer;
+        timer.start();
+        compressed = DataCompressor::compress(data);
+        nsecs = timer.nsecsElapsed();
+    }
+    QByteArray out;
+    QVERIFY(DataCompressor::decompress(compressed, &out));
+    qDebug() << data.size() * 1000 / qMax<qint64>(1, nsecs) << "MB/s," << data.size() << "->" << compressed.size() << "bytes";
+}
@@ -0,0 +1,25 @@
+#ifndef DATACOMPRESSORTESTER_H
+#define DATACOMPRESSORTESTER_H
+
+#include <QObject>
+#include <QTest>
+#include "datacompressor.h"
+
+class DataCompressorTester : public QObject
+{
+    Q_OBJECT
+public:
+    explicit DataCompressorTester(QObject *parent = 0);
+
+private slots:
+    void testRoundTrip_data();
+    void testRoundTrip();
+    void testLz4Block();
+    void testCorrupt();
+
+    // MB/s of json and of random bytes
+    void benchmarkCompress_data();
+    void benchmarkCompress();
+};
+
+#endif // DATACOMPRESSORTESTER_H
@@ -0,0 +1,457 @@
+#include "datagramenginetester.h"
+#include "peertopeermessage.h"
+#include "tunnelidmapper.h"
+
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QUdpSocket>
+
+DatagramEngineTester::DatagramEngineTester(QObject *parent) : QObject(parent)
+{
+
+}
+
+void DatagramEngineTester::testSendReceive()
+{
+    DatagramEngine a, b;
+    QVERIFY(a.bind(0));
+    QVERIFY(b.bind(0));
+
+    QByteArray cell(MESSAGE_LENGTH, 'x');
+    cell[0] = 0x03;
+    a.send(Endpoint(QHostAddress::LocalHost, b.localPort()), cell);
+
+    QVector<DatagramEngine::Datagram> received = receiveAll(&b, 1);
+    QCOMPARE(received.size(), 1);
+    QCOMPARE(received[0].size, MESSAGE_LENGTH);
+    QCOMPARE(received[0].data(), cell);
+    QCOMPARE(received[0].sender.port, a.localPort());
+    QCOMPARE(received[0].sender.hostAddress(), QHostAddress(QHostAddress::LocalHost));
+}
+
+void DatagramEngineTester::testBatchedFlush()
+{
+    DatagramEngine a, b;
+    QVERIFY(a.bind(0));
+    QVERIFY(b.bind(0));
+
+    // everything queued in one event loop iteration goes out in one flush
+    int n = a.batchSize() - 1;
+    Endpoint target(QHostAddress::LocalHost, b.localPort());
+    for(int i = 0; i < n; i++) {
+        a.send(target, QByteArray(MESSAGE_LENGTH, (char)i));
+    }
+    QCOMPARE(a.stats().sendCalls, (quint64)0);
+
+    QVector<DatagramEngine::Datagram> received = receiveAll(&b, n);
+    QCOMPARE(received.size(), n);
+    for(int i = 0; i < n; i++) {
+        QCOMPARE(received[i].data(), QByteArray(MESSAGE_LENGTH, (char)i));
+    }
+
+    QCOMPARE(a.stats().sendCalls, (quint64)1);
+    QCOMPARE(a.stats().sentDatagrams, (quint64)n);
+    QCOMPARE(a.stats().maxSendBatch, n);
+    QVERIFY(b.stats().receiveCalls <= (quint64)n);
+}
+
+void DatagramEngineTester::testOversizedDatagram()
+{
+    DatagramEngine a, b;
+    QVERIFY(a.bind(0));
+    QVERIFY(b.bind(0));
+
+    a.send(Endpoint(QHostAddress::LocalHost, b.localPort()), QByteArray(MESSAGE_LENGTH + 100, 'x'));
+
+    // reported with its real size, so p2p can reject it
+    QVector<DatagramEngine::Datagram> received = receiveAll(&b, 1);
+    QCOMPARE(received.size(), 1);
+    QCOMPARE(received[0].size, MESSAGE_LENGTH + 100);
+}
+
+void DatagramEngineTester::testShardSteering()
+{
+#ifndef Q_OS_LINUX
+    QSKIP("shard steering is linux only");
+#endif
+    // two shards on one port, joined in shard order
+    DatagramEngine shard0, shard1, sender;
+    shard0.setReusePort(true);
+    shard1.setReusePort(true);
+    QVERIFY(shard0.bind(0));
+    QVERIFY(shard1.bind(shard0.localPort()));
+    QVERIFY(shard0.setShardSteering(2));
+    QVERIFY(sender.bind(0));
+
+    Endpoint target(QHostAddress::LocalHost, shard0.localPort());
+    for(quint16 circId = 10; circId < 18; circId++) {
+        QByteArray cell(MESSAGE_LENGTH, '?');
+        cell[1] = (char)(circId >> 8);
+        cell[2] = (char)circId;
+        sender.send(target, cell);
+    }
+
+    QVector<DatagramEngine::Datagram> received0 = receiveAll(&shard0, 4);
+    QVector<DatagramEngine::Datagram> received1 = receiveAll(&shard1, 4);
+    QCOMPARE(received0.size(), 4);
+    QCOMPARE(received1.size(), 4);
+    for(const DatagramEngine::Datagram &datagram : received0) {
+        quint16 circId = ((quint8)datagram.data()[1] << 8) | (quint8)datagram.data()[2];
+        QCOMPARE(TunnelIdMapper::shardOfCircuit(circId, 2), 0);
+    }
+    for(const DatagramEngine::Datagram &datagram : received1) {
+        quint16 circId = ((quint8)datagram.data()[1] << 8) | (quint8)datagram.data()[2];
+        QCOMPARE(TunnelIdMapper::shardOfCircuit(circId, 2), 1);
+    }
+}
+
+void DatagramEngineTester::testForwardWithoutAllocation()
+{
+    DatagramEngine a, relay, c;
+    QVERIFY(a.bind(0));
+    QVERIFY(relay.bind(0));
+    QVERIFY(c.bind(0));
+
+    Endpoint toRelay(QHostAddress::LocalHost, relay.localPort());
+    Endpoint toC(QHostAddress::LocalHost, c.localPort());
+    quint64 slabs = 0;
+
+    for(int round = 0; round < 20; round++) {
+        for(int i = 0; i < 16; i++) {
+            a.send(toRelay, QByteArray(MESSAGE_LENGTH, (char)i));
+        }
+
+        // the relay sends the cells it received, as they are
+        QVector<DatagramEngine::Datagram> received = receiveAll(&relay, 16);
+        QCOMPARE(received.size(), 16);
+        for(DatagramEngine::Datagram &datagram : received) {
+            relay.send(toC, std::move(datagram.cell));
+        }
+        received.clear();
+        QCOMPARE(receiveAll(&c, 16).size(), 16);
+
+        if(round == 0) {
+            slabs = relay.cellPoolStats().slabAllocations;
+        }
+    }
+
+    // after the first round, every cell came from the free list
+    QCOMPARE(relay.cellPoolStats().slabAllocations, slabs);
+    QCOMPARE(relay.cellPoolStats().inUse, relay.batchSize());
+}
+
+void DatagramEngineTester::testEgressDropPolicy()
+{
+    DatagramEngine a, b;
+    a.setBatchSize(64); // no early flush, everything stays queued until the event loop runs
+    a.setEgressLimit(4);
+    QVERIFY(a.bind(0));
+    QVERIFY(b.bind(0));
+
+    Endpoint target(QHostAddress::LocalHost, b.localPort());
+    QVERIFY(a.send(target, QByteArray(MESSAGE_LENGTH, 'a')));
+    QVERIFY(a.send(target, QByteArray(MESSAGE_LENGTH, 'c'), true));
+    QVERIFY(a.send(target, QByteArray(MESSAGE_LENGTH, 'b')));
+    QVERIFY(a.send(target, QByteArray(MESSAGE_LENGTH, 'd'), true));
+    QCOMPARE(a.queueDepth(target), 4);
+
+    // full: data pushes out the oldest cover cell, new cover cells are dropped
+    QVERIFY(a.send(target, QByteArray(MESSAGE_LENGTH, 'e')));
+    QVERIFY(!a.send(target, QByteArray(MESSAGE_LENGTH, 'f'), true));
+    QCOMPARE(a.stats().droppedCover, (quint64)2);
+    QCOMPARE(a.stats().droppedData, (quint64)0);
+
+    // only cover left to push out is 'd'
+    QVERIFY(a.send(target, QByteArray(MESSAGE_LENGTH, 'g')));
+    QVERIFY(!a.send(target, QByteArray(MESSAGE_LENGTH, 'h')));
+    QCOMPARE(a.stats().droppedCover, (quint64)3);
+    QCOMPARE(a.stats().droppedData, (quint64)1);
+    QCOMPARE(a.stats().queuedDatagrams, 4);
+    QCOMPARE(a.stats().maxQueueDepth, 4);
+
+    QVector<DatagramEngine::Datagram> received = receiveAll(&b, 4);
+    QCOMPARE(received.size(), 4);
+    QByteArray order;
+    for(const DatagramEngine::Datagram &datagram : received) {
+        order += datagram.data()[0];
+    }
+    QCOMPARE(order, QByteArray("abeg"));
+    QCOMPARE(a.queueDepth(target), 0);
+    QCOMPARE(a.stats().queuedDatagrams, 0);
+}
+
+void DatagramEngineTester::testDrainedQueues()
+{
+    DatagramEngine a, b, c;
+    QVERIFY(a.bind(0));
+    QVERIFY(b.bind(0));
+    QVERIFY(c.bind(0));
+
+    Endpoint toB(QHostAddress::LocalHost, b.localPort());
+    Endpoint toC(QHostAddress::LocalHost, c.localPort());
+    for(int i = 0; i < 10; i++) {
+        a.send(toB, QByteArray(MESSAGE_LENGTH, 'b'));
+        a.send(toC, QByteArray(MESSAGE_LENGTH, 'c'));
+    }
+    QCOMPARE(a.stats().egressQueues, 2);
+
+    // a neighbour with nothing to send keeps no queue
+    QCOMPARE(receiveAll(&b, 10).size(), 10);
+    QCOMPARE(receiveAll(&c, 10).size(), 10);
+    QCOMPARE(a.stats().egressQueues, 0);
+
+    // and gets one again with the next datagram
+    a.send(toB, QByteArray(MESSAGE_LENGTH, 'b'));
+    QCOMPARE(a.queueDepth(toB), 1);
+    QCOMPARE(a.stats().egressQueues, 1);
+    QCOMPARE(receiveAll(&b, 1).size(), 1);
+    QCOMPARE(a.stats().egressQueues, 0);
+}
+
+void DatagramEngineTester::testKernelDrops()
+{
+#ifndef Q_OS_LINUX
+    QSKIP("SO_RXQ_OVFL is linux only");
+#endif
+    // a tiny receive buffer that overflows after a few cells
+    DatagramEngine a, b;
+    b.setSocketBufferSizes(4096, 0);
+    QVERIFY(a.bind(0));
+    QVERIFY(b.bind(0));
+    QVERIFY(b.receiveBufferSize() < 64 * MESSAGE_LENGTH);
+
+    Endpoint target(QHostAddress::LocalHost, b.localPort());
+    for(int i = 0; i < 64; i++) {
+        a.send(target, QByteArray(MESSAGE_LENGTH, 'x'));
+    }
+    QTest::qWait(50);
+    QVector<DatagramEngine::Datagram> received = receiveAll(&b, 64, 200);
+    QVERIFY(received.size() < 64);
+
+    // the counter travels with the datagrams queued after the drops
+    a.send(target, QByteArray(MESSAGE_LENGTH, 'y'));
+    QCOMPARE(receiveAll(&b, 1).size(), 1);
+    QCOMPARE(b.stats().kernelDrops, (quint64)(64 - received.size()));
+}
+
+void DatagramEngineTester::testIoUring()
+{
+    DatagramEngine a, b;
+    b.setIoUring(true);
+    QVERIFY(a.bind(0));
+    QVERIFY(b.bind(0));
+    if(!b.usesIoUring()) {
+        QSKIP("io_uring is not available");
+    }
+
+    // more than one batch, and one datagram that does not fit a cell. all of them fit the
+    // default receive buffer
+    Endpoint target(QHostAddress::LocalHost, b.localPort());
+    for(int i = 0; i < 60; i++) {
+        a.send(target, QByteArray(MESSAGE_LENGTH, (char)i));
+    }
+    a.send(target, QByteArray(MESSAGE_LENGTH + 100, 'x'));
+
+    QVector<DatagramEngine::Datagram> received = receiveAll(&b, 61);
+    QCOMPARE(received.size(), 61);
+    for(int i = 0; i < 60; i++) {
+        QCOMPARE(received[i].size, MESSAGE_LENGTH);
+        QCOMPARE(received[i].data(), QByteArray(MESSAGE_LENGTH, (char)i));
+        QCOMPARE(received[i].sender.port, a.localPort());
+        QCOMPARE(received[i].sender.hostAddress(), QHostAddress(QHostAddress::LocalHost));
+    }
+    QCOMPARE(received[60].size, MESSAGE_LENGTH + 100);
+    QVERIFY(b.stats().maxReceiveBatch <= b.batchSize());
+}
+
+void DatagramEngineTester::testSegmentationOffload()
+{
+#ifndef Q_OS_LINUX
+    QSKIP("UDP GSO/GRO is linux only");
+#endif
+    DatagramEngine a, b, plain;
+    a.setSegmentationOffload(true);
+    b.setSegmentationOffload(true);
+    QVERIFY(a.bind(0));
+    QVERIFY(b.bind(0));
+    QVERIFY(plain.bind(0));
+
+    // a bulk run ending in a short datagram, to a GRO receiver and to a plain one
+    for(Endpoint target : { Endpoint(QHostAddress::LocalHost, b.localPort()), Endpoint(QHostAddress::LocalHost, plain.localPort()) }) {
+        for(int i = 0; i < 60; i++) {
+            a.send(target, QByteArray(MESSAGE_LENGTH, (char)i));
+        }
+        a.send(target, QByteArray(100, 'x'));
+    }
+
+    for(DatagramEngine *receiver : { &b, &plain }) {
+        QVector<DatagramEngine::Datagram> received = receiveAll(receiver, 61);
+        QCOMPARE(received.size(), 61);
+        for(int i = 0; i < 60; i++) {
+            QCOMPARE(received[i].size, MESSAGE_LENGTH);
+            QCOMPARE(received[i].data(), QByteArray(MESSAGE_LENGTH, (char)i));
+            QCOMPARE(received[i].sender.port, a.localPort());
+        }
+        QCOMPARE(received[60].data(), QByteArray(100, 'x'));
+    }
+
+    QCOMPARE(a.stats().sentDatagrams, (quint64)122);
+    QVERIFY(a.stats().offloadedSends > 0);
+    QVERIFY(a.stats().offloadedSends < 122);
+    QVERIFY(b.stats().coalescedReceives > 0);
+    QCOMPARE(plain.stats().coalescedReceives, (quint64)0);
+}
+
+void DatagramEngineTester::testCellPacking()
+{
+#ifndef Q_OS_LINUX
+    QSKIP("packing several cells per datagram is linux only");
+#endif
+    DatagramEngine a, b, strict;
+    a.setMaxPackedCells(4);
+    b.setMaxPackedCells(4);
+    QVERIFY(a.bind(0));
+    QVERIFY(b.bind(0));
+    QVERIFY(strict.bind(0));
+    Endpoint toB(QHostAddress::LocalHost, b.localPort());
+    a.setPacking(toB, 4);
+    b.setPacking(Endpoint(QHostAddress::LocalHost, a.localPort()), 4);
+    QCOMPARE(a.packing(toB), 4);
+
+    // full cells share datagrams, the short one goes on its own
+    for(int i = 0; i < 10; i++) {
+        a.send(toB, QByteArray(MESSAGE_LENGTH, (char)i));
+    }
+    a.send(toB, QByteArray(100, 'x'));
+
+    QVector<DatagramEngine::Datagram> received = receiveAll(&b, 11);
+    QCOMPARE(received.size(), 11);
+    for(int i = 0; i < 10; i++) {
+        QCOMPARE(received[i].size, MESSAGE_LENGTH);
+        QCOMPARE(received[i].data(), QByteArray(MESSAGE_LENGTH, (char)i));
+        QCOMPARE(received[i].sender.port, a.localPort());
+    }
+    QCOMPARE(received[10].data(), QByteArray(100, 'x'));
+    QCOMPARE(a.stats().packedSends, (quint64)3); // 4 + 4 + 2
+    QCOMPARE(b.stats().packedReceives, (quint64)3);
+
+    // a receiver that did not negotiate sees one oversized datagram
+    Endpoint toStrict(QHostAddress::LocalHost, strict.localPort());
+    a.setPacking(toStrict, 2);
+    a.send(toStrict, QByteArray(MESSAGE_LENGTH, 'a'));
+    a.send(toStrict, QByteArray(MESSAGE_LENGTH, 'b'));
+    received = receiveAll(&strict, 1);
+    QCOMPARE(received.size(), 1);
+    QCOMPARE(received[0].size, 2 * MESSAGE_LENGTH);
+}
+
+void DatagramEngineTester::testLargeCells()
+{
+    const int large = PeerToPeerMessage::cellLength(PeerToPeerMessage::CELL_8K);
+    DatagramEngine a, b;
+    b.setCellSizes(QVector<int>() << PeerToPeerMessage::cellLength(PeerToPeerMessage::CELL_4K) << large);
+    QCOMPARE(b.maxCellSize(), large);
+    QVERIFY(a.cellPool(large) == nullptr);
+    QVERIFY(a.bind(0));
+    QVERIFY(b.bind(0));
+
+    // sent from a cell of its size, received into one
+    CellBuffer cell = b.cellPool(large)->acquire();
+    memset(cell.data(), 'l', large);
+    QByteArray expected = cell.bytes();
+    Endpoint toB(QHostAddress::LocalHost, b.localPort());
+    a.send(toB, QByteArray(MESSAGE_LENGTH, 's'));
+    a.send(toB, cell);
+    a.send(toB, QByteArray(MESSAGE_LENGTH + 100, 'x'));
+
+    QVector<DatagramEngine::Datagram> received = receiveAll(&b, 3);
+    QCOMPARE(received.size(), 3);
+    QCOMPARE(received[0].data(), QByteArray(MESSAGE_LENGTH, 's'));
+    QCOMPARE(received[1].size, large);
+    QCOMPARE(received[1].cell.capacity(), large);
+    QCOMPARE(received[1].data(), expected);
+    // sizes that were not registered are still cut off
+    QCOMPARE(received[2].size, MESSAGE_LENGTH + 100);
+    QCOMPARE(received[2].cell.capacity(), CELL_CAPACITY);
+}
+
+void DatagramEngineTester::benchmarkReceive_data()
+{
+    QTest::addColumn<QString>("backend");
+    QTest::newRow("qudpsocket") << "qudpsocket";
+    QTest::newRow("recvmmsg") << "recvmmsg";
+    QTest::newRow("io_uring") << "io_uring";
+}
+
+void DatagramEngineTester::benchmarkReceive()
+{
+    QFETCH(QString, backend);
+    const int cells = 4096;
+    const int burst = 64; // in flight at a time, well within the receive buffer
+
+    DatagramEngine sender;
+    QVERIFY(sender.bind(0));
+
+    // every backend wakes up through the event loop, like p2p does
+    DatagramEngine engine;
+    QUdpSocket socket;
+    QVector<DatagramEngine::Datagram> batch;
+    char buffer[CELL_CAPACITY];
+    int received = 0;
+    quint16 port;
+    if(backend == "qudpsocket") {
+        QVERIFY(socket.bind(QHostAddress::LocalHost, 0));
+        socket.setSocketOption(QAbstractSocket::ReceiveBufferSizeSocketOption, 1 << 20);
+        port = socket.localPort();
+        connect(&socket, &QUdpSocket::readyRead, [&]() {
+            while(socket.hasPendingDatagrams()) {
+                socket.readDatagram(buffer, sizeof(buffer));
+                received++;
+            }
+        });
+    } else {
+        engine.setIoUring(backend == "io_uring");
+        engine.setSocketBufferSizes(1 << 20, 0);
+        QVERIFY(engine.bind(0));
+        if(backend == "io_uring" && !engine.usesIoUring()) {
+            QSKIP("io_uring is not available");
+        }
+        port = engine.localPort();
+        connect(&engine, &DatagramEngine::readyRead, [&]() { received += engine.receive(&batch); });
+    }
+
+    Endpoint target(QHostAddress::LocalHost, port);
+    QByteArray cell(MESSAGE_LENGTH, '?');
+    qint64 nsecs = 0;
+    QBENCHMARK {
+        received = 0;
+        QElapsedTimer timer;
+        timer.start();
+        for(int sent = 0; sent < cells; sent += burst) {
+            for(int i = 0; i < burst; i++) {
+                sender.send(target, cell);
+            }
+            sender.flush();
+            while(received < sent + burst && timer.elapsed() < 5000) {
+                QCoreApplication::processEvents();
+            }
+        }
+        nsecs = timer.nsecsElapsed();
+    }
+    QCOMPARE(received, cells);
+    qDebug() << backend << "received" << (qint64)(cells * 1e9 / qMax<qint64>(nsecs, 1)) << "cells/s";
+}
+
+QVector<DatagramEngine::Datagram> DatagramEngineTester::receiveAll(DatagramEngine *engine, int count, int timeout)
+{
+    QVector<DatagramEngine::Datagram> all, batch;
+    QElapsedTimer timer;
+    timer.start();
+    while(all.size() < count && timer.elapsed() < timeout) {
+        QTest::qWait(10);
+        while(engine->receive(&batch) > 0) {
+            all += batch;
+        }
+    }
+    return all;
+}
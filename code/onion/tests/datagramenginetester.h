@@ -0,0 +1,38 @@
+#ifndef DATAGRAMENGINETESTER_H
+#define DATAGRAMENGINETESTER_H
+
+#include <QObject>
+#include <QSignalSpy>
+#include <QTest>
+#include "datagramengine.h"
+
+class DatagramEngineTester : public QObject
+{
+    Q_OBJECT
+public:
+    explicit DatagramEngineTester(QObject *parent = 0);
+
+private slots:
+    void testSendReceive();
+    void testBatchedFlush();
+    void testOversizedDatagram();
+    void testShardSteering();
+    void testForwardWithoutAllocation();
+    void testEgressDropPolicy();
+    void testDrainedQueues();
+    void testKernelDrops();
+    void testIoUring();
+    void testSegmentationOffload();
+    void testCellPacking();
+    void testLargeCells();
+
+    // cells per second received on loopback, per receive backend
+    void benchmarkReceive_data();
+    void benchmarkReceive();
+
+private:
+    // collects everything b receives until count datagrams arrived or timeout hits
+    QVector<DatagramEngine::Datagram> receiveAll(DatagramEngine *engine, int count, int timeout = 2000);
+};
+
+#endif // DATAGRAMENGINETESTER_H
@@ -0,0 +1,62 @@
+#include "endpointtester.h"
+
+#include <QSet>
+
+EndpointTester::EndpointTester(QObject *parent) : QObject(parent)
+{
+
+}
+
+void EndpointTester::testIPv4()
+{
+    Endpoint endpoint(QHostAddress("192.168.1.2"), 4000);
+    QVERIFY(endpoint.isValid());
+    QVERIFY(endpoint.isIPv4());
+    QCOMPARE(endpoint.ipv4(), (quint32)0xC0A80102);
+    QVERIFY(endpoint == Endpoint::fromIPv4(0xC0A80102, 4000));
+    // the same neighbour as its IPv4-mapped IPv6 address, as Binding has it
+    QVERIFY(endpoint == Endpoint(QHostAddress("::ffff:192.168.1.2"), 4000));
+    QVERIFY(endpoint != Endpoint(QHostAddress("192.168.1.2"), 4001));
+
+    // back at the api it is plain IPv4
+    QCOMPARE(endpoint.hostAddress().protocol(), QAbstractSocket::IPv4Protocol);
+    QCOMPARE(endpoint.hostAddress(), QHostAddress("192.168.1.2"));
+    QVERIFY(endpoint.toBinding() == Binding(QHostAddress("192.168.1.2"), 4000));
+    QCOMPARE(endpoint.toString(), QString("192.168.1.2:4000"));
+}
+
+void EndpointTester::testIPv6()
+{
+    Endpoint endpoint(QHostAddress("2001:db8::1"), 4000);
+    QVERIFY(endpoint.isValid());
+    QVERIFY(!endpoint.isIPv4());
+    QCOMPARE(endpoint.address[0], (quint8)0x20);
+    QCOMPARE(endpoint.address[15], (quint8)0x01);
+    QCOMPARE(endpoint.hostAddress(), QHostAddress("2001:db8::1"));
+    QVERIFY(Endpoint(endpoint.toBinding()) == endpoint);
+    QVERIFY(endpoint != Endpoint(QHostAddress("2001:db8::2"), 4000));
+}
+
+void EndpointTester::testInvalid()
+{
+    QVERIFY(!Endpoint().isValid());
+    QVERIFY(Endpoint().hostAddress().isNull());
+    QVERIFY(Endpoint(Binding()) == Endpoint());
+    QVERIFY(!Endpoint(QHostAddress("10.0.0.1"), 0).isValid());
+}
+
+void EndpointTester::testHash()
+{
+    Endpoint a(QHostAddress("10.0.0.1"), 4000);
+    Endpoint b(QHostAddress("::ffff:10.0.0.1"), 4000);
+    QCOMPARE(qHash(a), qHash(b));
+    QVERIFY(qHash(a, 1) != qHash(a, 2));
+
+    // neighbours that differ in the address or the port hash apart
+    QSet<uint> hashes;
+    for(quint32 i = 0; i < 1000; i++) {
+        hashes.insert(qHash(Endpoint::fromIPv4(0x0A000000 + i, 4000)));
+        hashes.insert(qHash(Endpoint::fromIPv4(0x0A000000, 5000 + i)));
+    }
+    QVERIFY(hashes.size() > 1990);
+}
@@ -0,0 +1,21 @@
+#ifndef ENDPOINTTESTER_H
+#define ENDPOINTTESTER_H
+
+#include <QObject>
+#include <QTest>
+#include "endpoint.h"
+
+class EndpointTester : public QObject
+{
+    Q_OBJECT
+public:
+    explicit EndpointTester(QObject *parent = 0);
+
+private slots:
+    void testIPv4();
+    void testIPv6();
+    void testInvalid();
+    void testHash();
+};
+
+#endif // ENDPOINTTESTER_H
@@ -0,0 +1,234 @@
+#include "fragmentassemblertester.h"
+
+static QByteArray pattern(int size, int seed)
+{
+    QByteArray data(size, Qt::Uninitialized);
+    for(int i = 0; i < size; i++) {
+        data[i] = (char)(i * 31 + seed);
+    }
+    return data;
+}
+
+FragmentAssemblerTester::FragmentAssemblerTester(QObject *parent) : QObject(parent)
+{
+
+}
+
+void FragmentAssemblerTester::testInOrder()
+{
+    FragmentAssembler assembler;
+    QByteArray data = pattern(PeerToPeerMessage::MaxMessageData, 1);
+    QList<PeerToPeerMessage> fragments = PeerToPeerMessage::makeRelayDataFragments(1, 0, 9, data);
+
+    QByteArray message;
+    for(int i = 0; i < fragments.size() - 1; i++) {
+        QVERIFY(!assembler.add(5, fragments[i], &message));
+    }
+    QCOMPARE(assembler.stats().pending, 1);
+    QVERIFY(assembler.add(5, fragments.last(), &message));
+    QCOMPARE(message, data);
+
+    FragmentAssembler::Stats stats = assembler.stats();
+    QCOMPARE(stats.completed, (quint64)1);
+    QCOMPARE(stats.pending, 0);
+    QCOMPARE(stats.bufferedBytes, 0);
+
+    // a write that fits one fragment needs no buffering
+    fragments = PeerToPeerMessage::makeRelayDataFragments(1, 0, 10, "small");
+    QCOMPARE(fragments.size(), 1);
+    QVERIFY(assembler.add(5, fragments.first(), &message));
+    QCOMPARE(message, QByteArray("small"));
+}
+
+void FragmentAssemblerTester::testOutOfOrder()
+{
+    FragmentAssembler assembler;
+    QByteArray data = pattern(5 * PeerToPeerMessage::MaxFragmentData + 17, 2);
+    QList<PeerToPeerMessage> fragments = PeerToPeerMessage::makeRelayDataFragments(1, 0, 3, data);
+    QCOMPARE(fragments.size(), 6);
+
+    // final first, the rest backwards
+    QByteArray message;
+    for(int i = fragments.size() - 1; i > 0; i--) {
+        QVERIFY(!assembler.add(5, fragments[i], &message));
+    }
+    QVERIFY(assembler.add(5, fragments.first(), &message));
+    QCOMPARE(message, data);
+}
+
+void FragmentAssemblerTester::testInterleavedTunnels()
+{
+    FragmentAssembler assembler;
+    QByteArray a = pattern(3 * PeerToPeerMessage::MaxFragmentData, 3);
+    QByteArray b = pattern(2 * PeerToPeerMessage::MaxFragmentData + 1, 4);
+    // the same message id on two tunnels, and a second message on the first one
+    QList<PeerToPeerMessage> first = PeerToPeerMessage::makeRelayDataFragments(1, 0, 1, a);
+    QList<PeerToPeerMessage> second = PeerToPeerMessage::makeRelayDataFragments(1, 0, 1, b);
+    QList<PeerToPeerMessage> third = PeerToPeerMessage::makeRelayDataFragments(1, 0, 2, b);
+
+    QList<QByteArray> done;
+    QByteArray message;
+    for(int i = 0; i < 3; i++) {
+        if(assembler.add(5, first[i], &message)) {
+            done.append(message);
+        }
+        if(assembler.add(6, second[i], &message)) {
+            done.append(message);
+        }
+        if(assembler.add(5, third[i], &message)) {
+            done.append(message);
+        }
+    }
+    QCOMPARE(done, QList<QByteArray>({ a, b, b }));
+    QCOMPARE(assembler.stats().pending, 0);
+}
+
+void FragmentAssemblerTester::testInvalidFragments()
+{
+    FragmentAssembler assembler;
+    QList<PeerToPeerMessage> fragments = PeerToPeerMessage::makeRelayDataFragments(1, 0, 1, pattern(3 * PeerToPeerMessage::MaxFragmentData, 5));
+    QByteArray message;
+
+    // a short fragment that is not the final one
+    PeerToPeerMessage shortFragment = fragments[0];
+    shortFragment.data.chop(1);
+    QVERIFY(!assembler.add(5, shortFragment, &message));
+    QCOMPARE(assembler.stats().pending, 0);
+
+    // past the largest message
+    PeerToPeerMessage far = fragments[2];
+    far.fragmentIndex = 255;
+    QVERIFY(!assembler.add(5, far, &message));
+    QCOMPARE(assembler.stats().pending, 0);
+
+    // a duplicate drops what was there
+    QVERIFY(!assembler.add(5, fragments[0], &message));
+    QVERIFY(!assembler.add(5, fragments[0], &message));
+    QCOMPARE(assembler.stats().pending, 0);
+    QCOMPARE(assembler.stats().dropped, (quint64)1);
+
+    // a fragment after the final one
+    QVERIFY(!assembler.add(5, fragments[2], &message));
+    PeerToPeerMessage after = fragments[1];
+    after.fragmentIndex = 3;
+    QVERIFY(!assembler.add(5, after, &message));
+    QCOMPARE(assembler.stats().pending, 0);
+    QCOMPARE(assembler.stats().bufferedBytes, 0);
+}
+
+void FragmentAssemblerTester::testPendingLimit()
+{
+    FragmentAssembler assembler;
+    QByteArray data = pattern(2 * PeerToPeerMessage::MaxFragmentData, 6);
+    QByteArray message;
+    // a copy, QCOMPARE takes its arguments by reference
+    const int maxPending = FragmentAssembler::MaxPendingPerTunnel;
+
+    // first halves of more messages than a tunnel may have open, the oldest ones go
+    int messages = maxPending + 2;
+    for(int id = 0; id < messages; id++) {
+        QVERIFY(!assembler.add(5, PeerToPeerMessage::makeRelayDataFragments(1, 0, id, data).first(), &message));
+    }
+    QCOMPARE(assembler.stats().pending, maxPending);
+    QCOMPARE(assembler.stats().dropped, (quint64)2);
+
+    QVERIFY(!assembler.add(5, PeerToPeerMessage::makeRelayDataFragments(1, 0, 0, data).last(), &message));
+    QVERIFY(assembler.add(5, PeerToPeerMessage::makeRelayDataFragments(1, 0, messages - 1, data).last(), &message));
+    QCOMPARE(message, data);
+    QCOMPARE(assembler.stats().pending, maxPending - 1);
+    QCOMPARE(assembler.stats().dropped, (quint64)3);
+
+    // other tunnels have their own share
+    for(int id = 0; id < maxPending; id++) {
+        QVERIFY(!assembler.add(6, PeerToPeerMessage::makeRelayDataFragments(1, 0, id, data).first(), &message));
+    }
+    QCOMPARE(assembler.stats().pending, 2 * maxPending - 1);
+    QCOMPARE(assembler.stats().dropped, (quint64)3);
+}
+
+void FragmentAssemblerTester::testMemoryLimit()
+{
+    FragmentAssembler assembler(4 * PeerToPeerMessage::MaxFragmentData);
+    QByteArray data = pattern(3 * PeerToPeerMessage::MaxFragmentData, 7);
+    QList<PeerToPeerMessage> older = PeerToPeerMessage::makeRelayDataFragments(1, 0, 1, data);
+    QList<PeerToPeerMessage> newer = PeerToPeerMessage::makeRelayDataFragments(1, 0, 2, data);
+    QByteArray message;
+
+    QVERIFY(!assembler.add(5, older[0], &message));
+    QVERIFY(!assembler.add(5, older[1], &message));
+    QVERIFY(!assembler.add(6, newer[0], &message));
+    QVERIFY(!assembler.add(6, newer[1], &message));
+    QCOMPARE(assembler.stats().bufferedBytes, 4 * PeerToPeerMessage::MaxFragmentData);
+
+    // over the limit, the older message makes room
+    QVERIFY(assembler.add(6, newer[2], &message));
+    QCOMPARE(message, data);
+    QCOMPARE(assembler.stats().dropped, (quint64)1);
+    QCOMPARE(assembler.stats().bufferedBytes, 0);
+    QVERIFY(!assembler.add(5, older[2], &message));
+}
+
+void FragmentAssemblerTester::testRemoveTunnel()
+{
+    FragmentAssembler assembler;
+    QList<PeerToPeerMessage> fragments = PeerToPeerMessage::makeRelayDataFragments(1, 0, 1, pattern(2 * PeerToPeerMessage::MaxFragmentData, 8));
+    QByteArray message;
+
+    QVERIFY(!assembler.add(5, fragments[0], &message));
+    QVERIFY(!assembler.add(6, fragments[0], &message));
+    assembler.removeTunnel(5);
+    QCOMPARE(assembler.stats().pending, 1);
+    const int fragmentData = PeerToPeerMessage::MaxFragmentData;
+    QCOMPARE(assembler.stats().bufferedBytes, fragmentData);
+
+    // starts over
+    QVERIFY(!assembler.add(5, fragments[1], &message));
+    QVERIFY(assembler.add(6, fragments[1], &message));
+}
+
+void FragmentAssemblerTester::testLargeCells()
+{
+    FragmentAssembler assembler;
+    const PeerToPeerMessage::CellSize size = PeerToPeerMessage::CELL_8K;
+    QByteArray data = pattern(PeerToPeerMessage::MaxMessageData, 7);
+    QList<PeerToPeerMessage> fragments = PeerToPeerMessage::makeRelayDataFragments(1, 0, 4, data, size);
+    QCOMPARE(fragments.size(), (data.size() + PeerToPeerMessage::maxFragmentData(size) - 1) / PeerToPeerMessage::maxFragmentData(size));
+
+    QByteArray message;
+    for(int i = fragments.size() - 1; i > 0; i--) {
+        QVERIFY(!assembler.add(5, fragments[i], &message));
+    }
+    QVERIFY(assembler.add(5, fragments[0], &message));
+    QCOMPARE(message, data);
+
+    // a message does not change its cell size half way
+    QVERIFY(!assembler.add(5, fragments[0], &message));
+    PeerToPeerMessage small = PeerToPeerMessage::makeRelayDataFragments(1, 0, 4, data).at(1);
+    QVERIFY(!assembler.add(5, small, &message));
+    QCOMPARE(assembler.stats().pending, 0);
+    QCOMPARE(assembler.stats().dropped, (quint64)1);
+}
+
+void FragmentAssemblerTester::testCompressed()
+{
+    FragmentAssembler assembler;
+    QByteArray data = pattern(3 * PeerToPeerMessage::MaxFragmentData, 3);
+    QList<PeerToPeerMessage> fragments = PeerToPeerMessage::makeRelayDataFragments(1, 0, 8, data);
+    for(PeerToPeerMessage &fragment : fragments) {
+        fragment.fragmentFlags |= PeerToPeerMessage::FRAGMENT_COMPRESSED;
+    }
+
+    // the flag rides along, the data comes out as it went in
+    QByteArray message;
+    QVERIFY(!assembler.add(5, fragments[0], &message));
+    QVERIFY(!assembler.add(5, fragments[1], &message));
+    QVERIFY(assembler.add(5, fragments[2], &message));
+    QCOMPARE(message, data);
+
+    // but a message is compressed as a whole or not at all
+    QVERIFY(!assembler.add(5, fragments[0], &message));
+    fragments[1].fragmentFlags &= ~PeerToPeerMessage::FRAGMENT_COMPRESSED;
+    QVERIFY(!assembler.add(5, fragments[1], &message));
+    QCOMPARE(assembler.stats().pending, 0);
+    QCOMPARE(assembler.stats().dropped, (quint64)1);
+}
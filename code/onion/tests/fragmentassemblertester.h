@@ -0,0 +1,26 @@
+#ifndef FRAGMENTASSEMBLERTESTER_H
+#define FRAGMENTASSEMBLERTESTER_H
+
+#include <QObject>
+#include <QTest>
+#include "fragmentassembler.h"
+
+class FragmentAssemblerTester : public QObject
+{
+    Q_OBJECT
+public:
+    explicit FragmentAssemblerTester(QObject *parent = 0);
+
+private slots:
+    void testInOrder();
+    void testOutOfOrder();
+    void testInterleavedTunnels();
+    void testInvalidFragments();
+    void testPendingLimit();
+    void testMemoryLimit();
+    void testRemoveTunnel();
+    void testLargeCells();
+    void testCompressed();
+};
+
+#endif // FRAGMENTASSEMBLERTESTER_H
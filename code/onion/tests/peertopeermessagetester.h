@@ -21,6 +21,7 @@ public slots:
 private slots:
     void testCmdBuild();
     void testCmdCreated();
+    void testHandshakeExtensions();
     void testCmdDestroy();
     void testCmdCover();
     void testRelayData();
@@ -28,6 +29,18 @@ private slots:
     void testRelayExtend6();
     void testRelayExtended();
     void testRelayTruncated();
+    void testRelayDataRecords();
+    void testRelayDataFragments();
+    void testCellView();
+    void testHeaderBatch();
+    void testCellSizes();
+
+    // ns per cell for the cell codec, next to the QDataStream code it replaced
+    void benchmarkCodec_data();
+    void benchmarkCodec();
+    // cells/s through fromBytes() for every kind of cell, see cellsamples.h
+    void benchmarkCommands_data();
+    void benchmarkCommands();
 
 private:
     void verifyWritePayload(PeerToPeerMessage message, QByteArray expectedPayload);
@@ -0,0 +1,168 @@
+#include "peertopeertester.h"
+
+#include <QElapsedTimer>
+#include <QSignalSpy>
+
+PeerToPeerTester::PeerToPeerTester(QObject *parent) : QObject(parent)
+{
+
+}
+
+void PeerToPeerTester::testBuildRetry()
+{
+    PeerToPeer p2p;
+    quint16 port = freePort();
+    p2p.setInterface(QHostAddress::LocalHost);
+    p2p.setPort(port);
+    QVERIFY(p2p.start());
+
+    // auth answers every BUILD with a new session
+    quint16 nextSession = 1;
+    QList<quint16> ended;
+    connect(&p2p, &PeerToPeer::sessionIncomingHS1, &p2p, [&](quint32 requestId, QByteArray handshake) {
+        p2p.onSessionHS2(requestId, nextSession++, handshake);
+    }, Qt::QueuedConnection);
+    connect(&p2p, &PeerToPeer::requestEndSession, &p2p, [&](quint16 session) {
+        ended.append(session);
+    });
+    QSignalSpy incoming(&p2p, &PeerToPeer::tunnelIncoming);
+
+    QUdpSocket neighbour;
+    QVERIFY(neighbour.bind(QHostAddress::LocalHost, 0));
+    QByteArray build = PeerToPeerMessage::makeBuild(7, "hs").toBytes();
+
+    neighbour.writeDatagram(build, QHostAddress::LocalHost, port);
+    PeerToPeerMessage created = receive(&neighbour);
+    QCOMPARE(created.celltype, PeerToPeerMessage::CREATED);
+    QCOMPARE(created.circuitId, (quint16)7);
+    QCOMPARE(incoming.count(), 1);
+    QVERIFY(ended.isEmpty());
+
+    // CREATED got lost, the source sends the same BUILD again and gets an answer
+    neighbour.writeDatagram(build, QHostAddress::LocalHost, port);
+    created = receive(&neighbour);
+    QCOMPARE(created.celltype, PeerToPeerMessage::CREATED);
+    QCOMPARE(created.circuitId, (quint16)7);
+    // on the same tunnel, only the first session is given up
+    QCOMPARE(incoming.count(), 1);
+    QCOMPARE(ended, QList<quint16>({ 1 }));
+}
+
+void PeerToPeerTester::testAuthError()
+{
+    PeerToPeer p2p;
+    quint16 port = freePort();
+    p2p.setInterface(QHostAddress::LocalHost);
+    p2p.setPort(port);
+    QVERIFY(p2p.start());
+
+    QList<quint32> requests;
+    QList<quint16> ended;
+    connect(&p2p, &PeerToPeer::sessionIncomingHS1, &p2p, [&](quint32 requestId, QByteArray) {
+        requests.append(requestId);
+    });
+    connect(&p2p, &PeerToPeer::requestEndSession, &p2p, [&](quint16 session) {
+        ended.append(session);
+    });
+    QSignalSpy incoming(&p2p, &PeerToPeer::tunnelIncoming);
+
+    QUdpSocket neighbour;
+    QVERIFY(neighbour.bind(QHostAddress::LocalHost, 0));
+    QByteArray build = PeerToPeerMessage::makeBuild(7, "hs").toBytes();
+    neighbour.writeDatagram(build, QHostAddress::LocalHost, port);
+    QTRY_COMPARE_WITH_TIMEOUT(requests.size(), 1, 2000);
+
+    // auth gives up on the handshake, the BUILD is forgotten
+    p2p.onAuthError(requests[0]);
+    // an answer after all is too late, its session is ended and nothing is sent
+    p2p.onSessionHS2(requests[0], 1, "hs");
+    QCOMPARE(ended, QList<quint16>({ 1 }));
+    QCOMPARE(incoming.count(), 0);
+    QCOMPARE(receive(&neighbour, 200).celltype, PeerToPeerMessage::Invalid);
+
+    // the source retries on the same circuit id and gets through
+    neighbour.writeDatagram(build, QHostAddress::LocalHost, port);
+    QTRY_COMPARE_WITH_TIMEOUT(requests.size(), 2, 2000);
+    p2p.onSessionHS2(requests[1], 2, "hs");
+    QCOMPARE(receive(&neighbour).celltype, PeerToPeerMessage::CREATED);
+    QCOMPARE(incoming.count(), 1);
+    // the first BUILD released its id, the slot comes back in its next generation
+    QCOMPARE(incoming.at(0).at(0).toUInt() >> TunnelIdMapper::SlotBits, 2U);
+}
+
+void PeerToPeerTester::testTruncated()
+{
+    PeerToPeer p2p;
+    quint16 port = freePort();
+    p2p.setInterface(QHostAddress::LocalHost);
+    p2p.setPort(port);
+    p2p.setNHops(1);
+    QVERIFY(p2p.start());
+
+    // the first hop, the destination behind it never answers
+    QUdpSocket neighbour;
+    QVERIFY(neighbour.bind(QHostAddress::LocalHost, 0));
+    MockPeerSampler sampler;
+    sampler.setMockPeers({ Binding(QHostAddress::LocalHost, neighbour.localPort()) });
+    p2p.setPeerSampler(&sampler);
+
+    // auth starts a session per hop and leaves payloads as they are
+    quint16 nextSession = 1;
+    QList<quint16> ended;
+    connect(&p2p, &PeerToPeer::requestStartSession, &p2p, [&](quint32 requestId, QByteArray) {
+        p2p.onSessionHS1(requestId, nextSession++, "hs");
+    }, Qt::QueuedConnection);
+    connect(&p2p, &PeerToPeer::requestEncrypt, &p2p, [&](quint32 requestId, quint16 sessionId, QByteArray payload) {
+        p2p.onEncrypted(requestId, sessionId, payload);
+    }, Qt::QueuedConnection);
+    connect(&p2p, &PeerToPeer::requestDecrypt, &p2p, [&](quint32 requestId, quint16, QByteArray payload) {
+        p2p.onDecrypted(requestId, payload);
+    }, Qt::QueuedConnection);
+    connect(&p2p, &PeerToPeer::requestEndSession, &p2p, [&](quint16 session) {
+        ended.append(session);
+    });
+    QSignalSpy error(&p2p, &PeerToPeer::tunnelError);
+
+    int before = p2p.liveTunnelIds();
+    p2p.buildTunnel(QHostAddress::LocalHost, freePort(), "destkey", nullptr);
+    PeerToPeerMessage build = receive(&neighbour);
+    QCOMPARE(build.celltype, PeerToPeerMessage::BUILD);
+    QCOMPARE(p2p.liveTunnelIds(), before + 2);
+
+    // the first hop is up and gets the RELAY_EXTEND for the destination
+    quint16 circId = build.circuitId;
+    neighbour.writeDatagram(PeerToPeerMessage::makeCreated(circId, "hs").toBytes(), QHostAddress::LocalHost, port);
+    QCOMPARE(receive(&neighbour).celltype, PeerToPeerMessage::ENCRYPTED);
+
+    // and gives up on it
+    QByteArray payload = PeerToPeerMessage::makeRelayTruncated(circId, 0).toEncryptedPayload();
+    CellDigest::seal(CellDigest::deriveKey("hs"), &payload);
+    neighbour.writeDatagram(PeerToPeerMessage::composeEncrypted(circId, payload), QHostAddress::LocalHost, port);
+    QTRY_COMPARE_WITH_TIMEOUT(error.count(), 1, 2000);
+    // the destination's session right away, the first hop's once the circuit is cleaned
+    QCOMPARE(ended, QList<quint16>({ 2 }));
+    QTRY_COMPARE_WITH_TIMEOUT(p2p.liveTunnelIds(), before, 3000);
+    QCOMPARE(ended, QList<quint16>({ 2, 1 }));
+}
+
+quint16 PeerToPeerTester::freePort()
+{
+    QUdpSocket socket;
+    socket.bind(QHostAddress::LocalHost, 0);
+    return socket.localPort();
+}
+
+PeerToPeerMessage PeerToPeerTester::receive(QUdpSocket *socket, int timeout)
+{
+    QElapsedTimer timer;
+    timer.start();
+    while(!socket->hasPendingDatagrams() && timer.elapsed() < timeout) {
+        QTest::qWait(10);
+    }
+    if(!socket->hasPendingDatagrams()) {
+        return PeerToPeerMessage();
+    }
+    QByteArray datagram(socket->pendingDatagramSize(), 0);
+    socket->readDatagram(datagram.data(), datagram.size());
+    return PeerToPeerMessage::fromBytes(datagram);
+}
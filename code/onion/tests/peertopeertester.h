@@ -0,0 +1,29 @@
+#ifndef PEERTOPEERTESTER_H
+#define PEERTOPEERTESTER_H
+
+#include <QObject>
+#include <QTest>
+#include <QUdpSocket>
+#include "peertopeer.h"
+#include "mockpeersampler.h"
+
+// a PeerToPeer on localhost, a plain socket plays the neighbour and the test answers for auth
+class PeerToPeerTester : public QObject
+{
+    Q_OBJECT
+public:
+    explicit PeerToPeerTester(QObject *parent = 0);
+
+private slots:
+    void testBuildRetry();
+    void testAuthError();
+    void testTruncated();
+
+private:
+    // a port nobody listens on
+    static quint16 freePort();
+    // the next cell to socket, an Invalid one after timeout ms
+    static PeerToPeerMessage receive(QUdpSocket *socket, int timeout = 2000);
+};
+
+#endif // PEERTOPEERTESTER_H
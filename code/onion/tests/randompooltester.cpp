@@ -0,0 +1,145 @@
+#include "randompooltester.h"
+#include "peertopeermessage.h"
+
+#include <QElapsedTimer>
+#include <random>
+#include <thread>
+
+RandomPoolTester::RandomPoolTester(QObject *parent) : QObject(parent)
+{
+
+}
+
+static QByteArray counting(int size)
+{
+    QByteArray bytes(size, Qt::Uninitialized);
+    for(int i = 0; i < size; i++) {
+        bytes[i] = (char)i;
+    }
+    return bytes;
+}
+
+void RandomPoolTester::testKeystream()
+{
+    // RFC 8439 2.3.2
+    QByteArray key = counting(32);
+    QByteArray nonce = QByteArray::fromHex("000000090000004a00000000");
+    QByteArray block(RandomPool::BlockSize, Qt::Uninitialized);
+    RandomPool::keystream(key, nonce, 1, block.data(), 1);
+    QCOMPARE(block.toHex(), QByteArray("10f1e7e4d13b5915500fdd1fa32071c4c7d1f4c733c068030422aa9ac3d46c4e"
+                                       "d2826446079faa0914c2d705d98b02a2b5129cd1de164eb9cbd083e8a2503c4e"));
+
+    // four blocks side by side give the same as one at a time
+    QByteArray wide(9 * RandomPool::BlockSize, Qt::Uninitialized);
+    RandomPool::keystream(key, nonce, 1, wide.data(), 9);
+    for(int i = 0; i < 9; i++) {
+        RandomPool::keystream(key, nonce, 1 + i, block.data(), 1);
+        QCOMPARE(wide.mid(i * RandomPool::BlockSize, RandomPool::BlockSize), block);
+    }
+}
+
+void RandomPoolTester::testFillAcrossRefills()
+{
+    RandomPool whole(counting(32)), pieces(counting(32));
+    QByteArray expected = whole.bytes(3 * RandomPool::PoolSize + 100);
+
+    // odd sizes, some crossing a refill
+    QByteArray got;
+    int sizes[] = { 1, 3, 1021, RandomPool::PoolSize, 7, 2000 };
+    for(int i = 0; got.size() < expected.size(); i++) {
+        got.append(pieces.bytes(qMin(sizes[i % 6], expected.size() - got.size())));
+    }
+    QCOMPARE(got, expected);
+
+    // the pool starts with the keystream at counter 0
+    QByteArray block(RandomPool::BlockSize, Qt::Uninitialized);
+    RandomPool::keystream(counting(32), QByteArray(12, 0), 0, block.data(), 1);
+    QCOMPARE(expected.left(RandomPool::BlockSize), block);
+}
+
+void RandomPoolTester::testBounded()
+{
+    RandomPool pool(counting(32));
+    int counts[10] = { 0 };
+    for(int i = 0; i < 100000; i++) {
+        quint32 value = pool.bounded(10);
+        QVERIFY(value < 10);
+        counts[value]++;
+    }
+    for(int count : counts) {
+        QVERIFY(qAbs(count - 10000) < 500);
+    }
+    QCOMPARE(pool.bounded(1), (quint32)0);
+}
+
+void RandomPoolTester::testThreadPools()
+{
+    // every thread seeds its own pool
+    QByteArray here = RandomPool::local().bytes(64);
+    QByteArray there;
+    std::thread thread([&there]() { there = RandomPool::local().bytes(64); });
+    thread.join();
+
+    QCOMPARE(there.size(), 64);
+    QVERIFY(here != there);
+    QVERIFY(RandomPool::local().bytes(64) != here);
+}
+
+void RandomPoolTester::testCoverCells()
+{
+    // cover cells differ from each other past the relay header, handshakes stay '?' padded
+    QByteArray first = PeerToPeerMessage::makeCommandCover(7).toBytes();
+    QByteArray second = PeerToPeerMessage::makeCommandCover(7).toBytes();
+    const int header = UNENCRYPTED_HEADER_LEN + 7;
+    QCOMPARE(first.left(header), second.left(header));
+    QVERIFY(first.mid(header) != second.mid(header));
+
+    QByteArray build = PeerToPeerMessage::makeBuild(7, "HS").toBytes();
+    QCOMPARE(build.right(100), QByteArray(100, '?'));
+
+    // bytes spread over all values, no single one dominates
+    int counts[256] = { 0 };
+    for(int i = 0; i < 64; i++) {
+        QByteArray cell = PeerToPeerMessage::makeCommandCover(7).toBytes();
+        for(int j = header; j < cell.size(); j++) {
+            counts[(quint8)cell[j]]++;
+        }
+    }
+    for(int count : counts) {
+        QVERIFY(count > 0 && count < 600);
+    }
+}
+
+void RandomPoolTester::benchmarkPadding_data()
+{
+    QTest::addColumn<bool>("pooled");
+    QTest::newRow("pool") << true;
+    QTest::newRow("per byte") << false;
+}
+
+void RandomPoolTester::benchmarkPadding()
+{
+    QFETCH(bool, pooled);
+    const int cells = 100;
+    const int padding = MESSAGE_LENGTH - UNENCRYPTED_HEADER_LEN - 7;
+
+    QByteArray cell(MESSAGE_LENGTH, Qt::Uninitialized);
+    std::mt19937 rng(1);
+    qint64 nsecs = 0;
+    QBENCHMARK {
+        QElapsedTimer timer;
+        timer.start();
+        for(int i = 0; i < cells; i++) {
+            char *out = cell.data() + MESSAGE_LENGTH - padding;
+            if(pooled) {
+                RandomPool::local().fill(out, padding);
+            } else {
+                for(int j = 0; j < padding; j++) {
+                    out[j] = (char)rng();
+                }
+            }
+        }
+        nsecs = timer.nsecsElapsed();
+    }
+    qDebug() << (pooled ? "pool" : "per byte") << nsecs / cells << "ns/cell";
+}
@@ -0,0 +1,26 @@
+#ifndef RANDOMPOOLTESTER_H
+#define RANDOMPOOLTESTER_H
+
+#include <QObject>
+#include <QTest>
+#include "randompool.h"
+
+class RandomPoolTester : public QObject
+{
+    Q_OBJECT
+public:
+    explicit RandomPoolTester(QObject *parent = 0);
+
+private slots:
+    void testKeystream();
+    void testFillAcrossRefills();
+    void testBounded();
+    void testThreadPools();
+    void testCoverCells();
+
+    // ns per cell of padding, pool against one rng call per byte
+    void benchmarkPadding_data();
+    void benchmarkPadding();
+};
+
+#endif // RANDOMPOOLTESTER_H
@@ -0,0 +1,74 @@
+#include "requestslotstester.h"
+
+RequestSlotsTester::RequestSlotsTester(QObject *parent) : QObject(parent)
+{
+
+}
+
+void RequestSlotsTester::testTake()
+{
+    RequestSlots<QByteArray> requests(4);
+    requests.setStride(3);
+    requests.insert(3, "three");
+    requests.insert(6, "six");
+    QCOMPARE(requests.size(), 2);
+    QVERIFY(requests.contains(6));
+    QVERIFY(!requests.contains(9));
+
+    QCOMPARE(requests.take(6), QByteArray("six"));
+    QVERIFY(!requests.contains(6));
+    QCOMPARE(requests.take(6), QByteArray());
+    QCOMPARE(requests.take(9), QByteArray());
+    requests.remove(3);
+    QCOMPARE(requests.size(), 0);
+}
+
+void RequestSlotsTester::testGrow()
+{
+    RequestSlots<QByteArray> requests(4);
+    requests.setStride(3);
+    for(quint32 id = 3; id <= 12; id += 3) {
+        QVERIFY(requests.insert(id, QByteArray::number(id)));
+    }
+    QCOMPARE(requests.capacity(), 4);
+
+    // 15 takes the slot of 3, which is still waiting
+    QVERIFY(requests.insert(15, "15"));
+    QCOMPARE(requests.capacity(), 8);
+    QCOMPARE(requests.size(), 5);
+    for(quint32 id = 3; id <= 12; id += 3) {
+        QCOMPARE(requests.take(id), QByteArray::number(id));
+    }
+    QCOMPARE(requests.take(15), QByteArray("15"));
+}
+
+void RequestSlotsTester::testSteadyState()
+{
+    RequestSlots<QByteArray> requests(8);
+    for(quint32 id = 1; id < 100000; id++) {
+        requests.insert(id, "x");
+        if(id > 4) {
+            requests.remove(id - 4);
+        }
+    }
+    QCOMPARE(requests.capacity(), 8);
+    QCOMPARE(requests.size(), 4);
+}
+
+void RequestSlotsTester::testGiveUp()
+{
+    const int max = RequestSlots<int>::MaxCapacity;
+    RequestSlots<int> requests(2);
+    requests.insert(0, 42);
+
+    // auth never answers 0, it keeps its slot until the table cannot grow any more
+    quint32 id = 1;
+    while(requests.insert(id, 1)) {
+        requests.remove(id);
+        id++;
+    }
+    QCOMPARE(id, (quint32)max);
+    QCOMPARE(requests.capacity(), max);
+    QVERIFY(!requests.contains(0));
+    QVERIFY(requests.contains(id));
+}
@@ -0,0 +1,23 @@
+#ifndef REQUESTSLOTSTESTER_H
+#define REQUESTSLOTSTESTER_H
+
+#include <QObject>
+#include <QTest>
+#include "requestslots.h"
+
+class RequestSlotsTester : public QObject
+{
+    Q_OBJECT
+public:
+    explicit RequestSlotsTester(QObject *parent = 0);
+
+private slots:
+    void testTake();
+    // ids in flight that meet in a slot double the table
+    void testGrow();
+    // requests that come and go keep to the slots they have
+    void testSteadyState();
+    void testGiveUp();
+};
+
+#endif // REQUESTSLOTSTESTER_H
@@ -0,0 +1,188 @@
+#include "routetabletester.h"
+
+#include <QElapsedTimer>
+#include <QHash>
+
+#include "randompool.h"
+
+// how TunnelIdMapper kept its keys before
+struct CircuitBinding {
+    CircuitBinding(Binding b, quint16 c) : binding(b), circId(c) {}
+    Binding binding;
+    quint16 circId;
+    bool operator ==(const CircuitBinding &other) const { return binding == other.binding && circId == other.circId; }
+};
+
+static uint qHash(const CircuitBinding &key)
+{
+    return qHash(key.binding) ^ qHash(key.circId);
+}
+
+static RouteKey key(quint32 neighbour, quint16 circId)
+{
+    QHostAddress address(QString("10.%1.%2.%3").arg(neighbour >> 16 & 0xFF).arg(neighbour >> 8 & 0xFF).arg(neighbour & 0xFF));
+    return RouteKey::make(Endpoint(address, 4000), circId);
+}
+
+RouteTableTester::RouteTableTester(QObject *parent) : QObject(parent)
+{
+
+}
+
+void RouteTableTester::testKey()
+{
+    Endpoint peer(QHostAddress("192.168.1.2"), 4000);
+    RouteKey key = RouteKey::make(peer, 7);
+    QVERIFY(key.endpoint() == peer);
+    QCOMPARE(key.circId, (quint16)7);
+
+    QVERIFY(!(key == RouteKey::make(Endpoint(QHostAddress("192.168.1.2"), 4001), 7)));
+    QVERIFY(!(key == RouteKey::make(peer, 8)));
+    QVERIFY(!(key == RouteKey::make(Endpoint(QHostAddress("192.168.1.3"), 4000), 7)));
+    QVERIFY(!(key == RouteKey::make(Endpoint(QHostAddress("2001:db8::1"), 4000), 7)));
+}
+
+void RouteTableTester::testFind()
+{
+    RouteTable table;
+    QCOMPARE(table.find(key(1, 5)), (quint32)0);
+
+    QVERIFY(table.insert(key(1, 5), 100));
+    QVERIFY(table.insert(key(1, 6), 101));
+    QVERIFY(table.insert(key(2, 5), 102));
+    QVERIFY(!table.insert(key(1, 5), 103));
+    QCOMPARE(table.size(), 3);
+
+    QCOMPARE(table.find(key(1, 5)), (quint32)100);
+    QCOMPARE(table.find(key(1, 6)), (quint32)101);
+    QCOMPARE(table.find(key(2, 5)), (quint32)102);
+    QCOMPARE(table.find(key(2, 6)), (quint32)0);
+}
+
+void RouteTableTester::testRemove()
+{
+    RouteTable table;
+    for(quint16 circId = 1; circId <= 40; circId++) {
+        table.insert(key(1, circId), circId);
+    }
+    QVERIFY(table.remove(key(1, 20)));
+    QVERIFY(!table.remove(key(1, 20)));
+    QCOMPARE(table.size(), 39);
+
+    // the others moved up, none got lost
+    for(quint16 circId = 1; circId <= 40; circId++) {
+        QCOMPARE(table.find(key(1, circId)), circId == 20 ? (quint32)0 : circId);
+    }
+    QVERIFY(table.insert(key(1, 20), 120));
+    QCOMPARE(table.find(key(1, 20)), (quint32)120);
+}
+
+void RouteTableTester::testChurn()
+{
+    RandomPool random(QByteArray(32, 'k'));
+    RouteTable table((quint64)random.next() << 32 | random.next());
+    QHash<quint32, quint32> reference;
+
+    // up to 20000 circuits of 500 neighbours, then back down
+    for(int round = 0; round < 2; round++) {
+        for(int i = 0; i < 60000; i++) {
+            quint32 k = random.bounded(40000);
+            RouteKey routeKey = key(k % 500, k / 500);
+            bool grow = round == 0 ? random.bounded(4) != 0 : random.bounded(4) == 0;
+            if(grow) {
+                QCOMPARE(table.insert(routeKey, k + 1), !reference.contains(k));
+                reference.insert(k, k + 1);
+            } else {
+                QCOMPARE(table.remove(routeKey), reference.remove(k) == 1);
+            }
+        }
+        QCOMPARE(table.size(), reference.size());
+        for(quint32 k = 0; k < 40000; k++) {
+            QCOMPARE(table.find(key(k % 500, k / 500)), reference.value(k, 0));
+        }
+    }
+    // shrunk with the table
+    QVERIFY(table.capacity() <= 8 * qMax(64, table.size()));
+}
+
+void RouteTableTester::testFindBatch()
+{
+    RouteTable table;
+    QVector<RouteKey> keys;
+    for(quint32 i = 0; i < 100; i++) {
+        keys.append(key(i, i));
+        // every other one is unknown
+        if(i % 2 == 0) {
+            table.insert(keys.last(), 1000 + i);
+        }
+    }
+
+    QVector<quint32> values(keys.size());
+    table.findBatch(keys.constData(), keys.size(), values.data());
+    for(int i = 0; i < keys.size(); i++) {
+        QCOMPARE(values[i], i % 2 == 0 ? (quint32)(1000 + i) : (quint32)0);
+    }
+}
+
+void RouteTableTester::benchmarkLookup_data()
+{
+    QTest::addColumn<int>("circuits");
+    QTest::addColumn<bool>("flat");
+    for(int circuits : { 100, 5000, 50000 }) {
+        QTest::newRow(qPrintable(QString("QHash, %1 circuits").arg(circuits))) << circuits << false;
+        QTest::newRow(qPrintable(QString("table, %1 circuits").arg(circuits))) << circuits << true;
+    }
+}
+
+void RouteTableTester::benchmarkLookup()
+{
+    QFETCH(int, circuits);
+    QFETCH(bool, flat);
+
+    // circuits to 500 neighbours, as TunnelIdMapper kept them before
+    const int neighbours = 500;
+    RouteTable table;
+    QHash<CircuitBinding, quint32> hash;
+    QVector<Binding> bindings;
+    QVector<Endpoint> endpoints;
+    for(int i = 0; i < neighbours; i++) {
+        bindings.append(Binding(QHostAddress(QString("10.0.%1.%2").arg(i / 256).arg(i % 256)), 4000));
+        endpoints.append(Endpoint(bindings.last()));
+    }
+    for(int i = 0; i < circuits; i++) {
+        table.insert(RouteKey::make(endpoints[i % neighbours], i / neighbours), i + 1);
+        hash.insert(CircuitBinding(bindings[i % neighbours], i / neighbours), i + 1);
+    }
+
+    // bursts of 32 cells of spread out circuits, as the receive path sees them
+    const int bursts = 100;
+    const int burst = 32;
+    QVector<RouteKey> keys(burst);
+    QVector<quint32> values(burst);
+    quint64 found = 0;
+    qint64 nsecs = 0;
+    QBENCHMARK {
+        QElapsedTimer timer;
+        timer.start();
+        found = 0;
+        for(int b = 0; b < bursts; b++) {
+            for(int j = 0; j < burst; j++) {
+                int i = (quint32)((b * burst + j) * 7919) % circuits;
+                if(flat) {
+                    keys[j] = RouteKey::make(endpoints[i % neighbours], i / neighbours);
+                } else {
+                    found += hash.value(CircuitBinding(bindings[i % neighbours], i / neighbours)) != 0;
+                }
+            }
+            if(flat) {
+                table.findBatch(keys.constData(), burst, values.data());
+                for(quint32 value : values) {
+                    found += value != 0;
+                }
+            }
+        }
+        nsecs = timer.nsecsElapsed();
+    }
+    QCOMPARE(found, (quint64)(bursts * burst));
+    qDebug() << QTest::currentDataTag() << nsecs / (bursts * burst) << "ns/lookup";
+}
@@ -0,0 +1,27 @@
+#ifndef ROUTETABLETESTER_H
+#define ROUTETABLETESTER_H
+
+#include <QObject>
+#include <QTest>
+#include "routetable.h"
+
+class RouteTableTester : public QObject
+{
+    Q_OBJECT
+public:
+    explicit RouteTableTester(QObject *parent = 0);
+
+private slots:
+    void testKey();
+    void testFind();
+    void testRemove();
+    // random inserts and removes against a QHash, through growing and shrinking
+    void testChurn();
+    void testFindBatch();
+
+    // ns per lookup with more and more circuits, next to the QHash it replaced
+    void benchmarkLookup_data();
+    void benchmarkLookup();
+};
+
+#endif // ROUTETABLETESTER_H
@@ -0,0 +1,251 @@
+#include "tunnelidmappertester.h"
+
+#include <QSet>
+
+static const Endpoint peer(QHostAddress("10.0.0.1"), 4000);
+static const Endpoint other(QHostAddress("10.0.0.2"), 4000);
+
+TunnelIdMapperTester::TunnelIdMapperTester(QObject *parent) : QObject(parent)
+{
+
+}
+
+void TunnelIdMapperTester::testFindDoesNotCreate()
+{
+    TunnelIdMapper mapper;
+    QCOMPARE(mapper.find(peer, 5), (quint32)0);
+    QCOMPARE(mapper.size(), 0);
+
+    quint32 id = mapper.accept(peer, 5);
+    QVERIFY(id != 0);
+    QCOMPARE(mapper.accept(peer, 5), id);
+    QCOMPARE(mapper.find(peer, 5), id);
+    QCOMPARE(mapper.find(peer, 6), (quint32)0);
+    QCOMPARE(mapper.find(other, 5), (quint32)0);
+    QCOMPARE(mapper.size(), 1);
+
+    Endpoint endpoint;
+    quint16 circId;
+    mapper.decompose(id, &endpoint, &circId);
+    QVERIFY(endpoint == peer);
+    QCOMPARE(circId, (quint16)5);
+}
+
+void TunnelIdMapperTester::testRelease()
+{
+    TunnelIdMapper mapper;
+    quint32 first = mapper.accept(peer, 5);
+    quint32 second = mapper.accept(other, 5);
+    QVERIFY(first != second);
+
+    Endpoint neighbour;
+    QVERIFY(mapper.release(first, &neighbour));
+    QVERIFY(neighbour == peer);
+    QVERIFY(!mapper.release(first));
+    QCOMPARE(mapper.size(), 1);
+    QVERIFY(!mapper.hasTunnels(peer));
+    QVERIFY(mapper.hasTunnels(other));
+    QCOMPARE(mapper.find(peer, 5), (quint32)0);
+    QCOMPARE(mapper.find(other, 5), second);
+    QCOMPARE(mapper.describe(first), QString("<invalid tunnelid>"));
+
+    // churn does not grow the mapper beyond the tunnels alive at once
+    for(int i = 0; i < 10000; i++) {
+        quint16 circId = 100 + i % 50;
+        if(i >= 50) {
+            QVERIFY(mapper.release(mapper.find(peer, circId)));
+        }
+        QVERIFY(mapper.accept(peer, circId) != 0);
+    }
+    QCOMPARE(mapper.size(), 51);
+}
+
+void TunnelIdMapperTester::testStaleIds()
+{
+    TunnelIdMapper mapper;
+    quint32 old = mapper.accept(peer, 5);
+    mapper.release(old);
+
+    // the same circuit again, in the same slot but not under the same id
+    quint32 again = mapper.accept(peer, 5);
+    QVERIFY(again != old);
+    QVERIFY(!mapper.release(old));
+    QCOMPARE(mapper.describe(old), QString("<invalid tunnelid>"));
+    QCOMPARE(mapper.find(peer, 5), again);
+
+    Endpoint endpoint;
+    quint16 circId;
+    mapper.decompose(old, &endpoint, &circId);
+    QVERIFY(!endpoint.isValid());
+}
+
+void TunnelIdMapperTester::testShard()
+{
+    for(int count : { 1, 3, 64 }) {
+        for(int index = 0; index < count; index++) {
+            TunnelIdMapper mapper;
+            mapper.setShard(index, count);
+            // through several generations of a slot
+            for(int i = 0; i < 200; i++) {
+                quint32 id = mapper.accept(peer, 5);
+                QVERIFY(id != 0);
+                QCOMPARE(TunnelIdMapper::shardOf(id, count), index);
+                QCOMPARE(mapper.find(peer, 5), id);
+                QVERIFY(mapper.release(id));
+            }
+            for(int i = 0; i < 100; i++) {
+                quint16 circId;
+                QVERIFY(mapper.allocate(peer, &circId) != 0);
+                QCOMPARE(TunnelIdMapper::shardOfCircuit(circId, count), index);
+            }
+        }
+    }
+}
+
+void TunnelIdMapperTester::testSplitHalves()
+{
+    // both ends of the link, each picks from its own half
+    TunnelIdMapper lower;
+    lower.setLocalEndpoint(peer);
+    TunnelIdMapper higher;
+    higher.setLocalEndpoint(other);
+    for(int i = 0; i < 1000; i++) {
+        quint16 circId;
+        QVERIFY(lower.allocate(other, &circId) != 0);
+        QVERIFY(circId != 0 && circId < 0x8000);
+        QVERIFY(higher.allocate(peer, &circId) != 0);
+        QVERIFY(circId >= 0x8000);
+    }
+
+    // the same address, the port decides
+    TunnelIdMapper mapper;
+    mapper.setLocalEndpoint(Endpoint(QHostAddress("10.0.0.1"), 5000));
+    quint16 circId;
+    QVERIFY(mapper.allocate(peer, &circId) != 0);
+    QVERIFY(circId >= 0x8000);
+}
+
+void TunnelIdMapperTester::testReuse()
+{
+    TunnelIdMapper mapper;
+    mapper.setLocalEndpoint(peer);
+    mapper.setShard(1, 4);
+
+    // our half has about 0x8000 / 4 ids in this shard, far fewer than we go through
+    QList<quint32> live;
+    QSet<quint16> circIds;
+    for(int i = 0; i < 100000; i++) {
+        if(live.size() == 500) {
+            QVERIFY(mapper.release(live.takeFirst()));
+        }
+        quint16 circId;
+        quint32 id = mapper.allocate(other, &circId);
+        QVERIFY(id != 0);
+        QVERIFY(circId < 0x8000);
+        QCOMPARE(TunnelIdMapper::shardOfCircuit(circId, 4), 1);
+        QCOMPARE(mapper.find(other, circId), id);
+        circIds.insert(circId);
+        live.append(id);
+    }
+    QCOMPARE(mapper.size(), 500);
+    // 5, 9, .. 0x7FFD, all of them came around
+    QCOMPARE(circIds.size(), (0x7FFF - 5) / 4 + 1);
+
+    // all of them live, then there is none left
+    TunnelIdMapper full;
+    full.setLocalEndpoint(peer);
+    full.setShard(0, 64);
+    quint16 circId;
+    quint32 last = 0;
+    // 64, 128, .. 0x7FC0
+    for(int i = 0; i < (0x7FFF - 64) / 64 + 1; i++) {
+        last = full.allocate(other, &circId);
+        QVERIFY(last != 0);
+    }
+    QCOMPARE(full.allocate(other, &circId), (quint32)0);
+    QVERIFY(full.release(last));
+    QVERIFY(full.allocate(other, &circId) != 0);
+}
+
+void TunnelIdMapperTester::testOneAtATime()
+{
+    TunnelIdMapper mapper;
+    mapper.setLocalEndpoint(peer);
+
+    // a lost DESTROY leaves the last circuit at the neighbour, the next one takes another id
+    QSet<quint16> circIds;
+    quint16 previous = 0;
+    for(int i = 0; i < 0x7FFF - 5 + 1; i++) {
+        quint16 circId;
+        quint32 id = mapper.allocate(other, &circId);
+        QVERIFY(id != 0);
+        QVERIFY(circId != previous);
+        circIds.insert(circId);
+        previous = circId;
+        QVERIFY(mapper.release(id));
+    }
+    // all of our half before any one came again
+    QCOMPARE(circIds.size(), 0x7FFF - 5 + 1);
+    quint16 circId;
+    QVERIFY(mapper.allocate(other, &circId) != 0);
+    QCOMPARE(circId, (quint16)5);
+}
+
+void TunnelIdMapperTester::testCollisions()
+{
+    // no local address and the same port, both ends pick from all ids
+    TunnelIdMapper mapper;
+    mapper.setLocalEndpoint(Endpoint(QHostAddress::Any, 4000));
+
+    quint16 ours;
+    quint32 id = mapper.allocate(peer, &ours);
+    QVERIFY(id != 0);
+    // the neighbour may not build on it
+    QCOMPARE(mapper.accept(peer, ours), (quint32)0);
+    QCOMPARE(mapper.find(peer, ours), id);
+
+    // and we do not pick what the neighbour built on
+    quint32 theirs = mapper.accept(peer, ours + 1);
+    QVERIFY(theirs != 0);
+    quint16 circId;
+    QVERIFY(mapper.allocate(peer, &circId) != 0);
+    QVERIFY(circId != ours + 1);
+
+    // nor once it comes around again
+    QVERIFY(mapper.release(id));
+    for(int i = 0; i < 0xFFFF; i++) {
+        if(mapper.allocate(peer, &circId) == 0) {
+            break;
+        }
+        QVERIFY(circId != ours + 1);
+    }
+    QCOMPARE(mapper.find(peer, ours + 1), theirs);
+}
+
+void TunnelIdMapperTester::testConcurrentPick()
+{
+    // one end knows its address, the other listens on any with the same port: they
+    // disagree on the halves and pick the same id at once
+    TunnelIdMapper a;
+    a.setLocalEndpoint(peer);
+    TunnelIdMapper b;
+    b.setLocalEndpoint(Endpoint(QHostAddress::Any, 4000));
+
+    quint16 circIdA, circIdB;
+    quint32 idA = a.allocate(other, &circIdA);
+    quint32 idB = b.allocate(peer, &circIdB);
+    QCOMPARE(circIdA, circIdB);
+    // each rejects the BUILD of the other
+    QCOMPARE(a.accept(other, circIdB), (quint32)0);
+    QCOMPARE(b.accept(peer, circIdA), (quint32)0);
+
+    // a retry with another circuit id gets through, as PeerToPeer::renumberFirstHop() does it
+    quint16 retried;
+    quint32 renumbered = a.allocate(other, &retried);
+    QVERIFY(renumbered != 0);
+    QVERIFY(retried != circIdA);
+    QVERIFY(a.release(idA));
+    QVERIFY(b.accept(peer, retried) != 0);
+    QCOMPARE(a.find(other, retried), renumbered);
+    QCOMPARE(b.find(peer, circIdB), idB);
+}
@@ -0,0 +1,26 @@
+#ifndef TUNNELIDMAPPERTESTER_H
+#define TUNNELIDMAPPERTESTER_H
+
+#include <QObject>
+#include <QTest>
+#include "tunnelidmapper.h"
+
+class TunnelIdMapperTester : public QObject
+{
+    Q_OBJECT
+public:
+    explicit TunnelIdMapperTester(QObject *parent = 0);
+
+private slots:
+    void testFindDoesNotCreate();
+    void testRelease();
+    void testStaleIds();
+    void testShard();
+    void testSplitHalves();
+    void testReuse();
+    void testOneAtATime();
+    void testCollisions();
+    void testConcurrentPick();
+};
+
+#endif // TUNNELIDMAPPERTESTER_H
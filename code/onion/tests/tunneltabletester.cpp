@@ -0,0 +1,162 @@
+#include "tunneltabletester.h"
+
+#include <QElapsedTimer>
+#include <QList>
+
+static TunnelState tunnel(quint32 previousHopId, quint32 nextHopId = 0)
+{
+    TunnelState state;
+    state.previousHop = Endpoint(QHostAddress("10.0.0.1"), 4000);
+    state.circIdPreviousHop = previousHopId & 0xFFFF;
+    state.tunnelIdPreviousHop = previousHopId;
+    if(nextHopId != 0) {
+        state.nextHop = Endpoint(QHostAddress("10.0.0.2"), 4000);
+        state.circIdNextHop = nextHopId & 0xFFFF;
+        state.tunnelIdNextHop = nextHopId;
+    }
+    return state;
+}
+
+TunnelTableTester::TunnelTableTester(QObject *parent) : QObject(parent)
+{
+
+}
+
+void TunnelTableTester::testFind()
+{
+    TunnelTable table;
+    QVERIFY(table.findByPreviousHop(1) == nullptr);
+
+    TunnelState *first = table.insert(tunnel(1, 101));
+    TunnelState *second = table.insert(tunnel(2));
+    QVERIFY(first != nullptr && second != nullptr);
+    QCOMPARE(table.size(), 2);
+
+    QVERIFY(table.findByPreviousHop(1) == first);
+    QVERIFY(table.findByNextHop(101) == first);
+    QVERIFY(table.findByPreviousHop(2) == second);
+    QVERIFY(!second->hasNextHop());
+    // ids of one side are not found on the other
+    QVERIFY(table.findByNextHop(1) == nullptr);
+    QVERIFY(table.findByPreviousHop(101) == nullptr);
+    // nor a tunnel without a next hop by 0
+    QVERIFY(table.findByNextHop(0) == nullptr);
+
+    // a previous hop id is taken once
+    QVERIFY(table.insert(tunnel(1)) == nullptr);
+    QVERIFY(table.insert(tunnel(3, 101)) == nullptr);
+    QCOMPARE(table.size(), 2);
+}
+
+void TunnelTableTester::testSetNextHop()
+{
+    TunnelTable table;
+    TunnelState *state = table.insert(tunnel(1));
+
+    Endpoint next(QHostAddress("10.0.0.3"), 5000);
+    table.setNextHop(state, next, 7, 107);
+    QVERIFY(state->hasNextHop());
+    QCOMPARE(state->circIdNextHop, (quint16)7);
+    QVERIFY(table.findByNextHop(107) == state);
+
+    // extended again, the old id is gone
+    table.setNextHop(state, next, 8, 108);
+    QVERIFY(table.findByNextHop(107) == nullptr);
+    QVERIFY(table.findByNextHop(108) == state);
+}
+
+void TunnelTableTester::testRemove()
+{
+    TunnelTable table;
+    TunnelState *state = table.insert(tunnel(1, 101));
+    table.insert(tunnel(2, 102));
+
+    table.remove(state);
+    QCOMPARE(table.size(), 1);
+    QVERIFY(table.findByPreviousHop(1) == nullptr);
+    QVERIFY(table.findByNextHop(101) == nullptr);
+    QVERIFY(table.findByNextHop(102) != nullptr);
+
+    // the slot is reused, and the ids can come back
+    TunnelState *again = table.insert(tunnel(1, 101));
+    QVERIFY(again == state);
+    QVERIFY(table.findByNextHop(101) == again);
+    QCOMPARE(table.size(), 2);
+}
+
+void TunnelTableTester::testStablePointers()
+{
+    TunnelTable table;
+    QVector<TunnelState *> states;
+    for(quint32 id = 1; id <= 1000; id++) {
+        states.append(table.insert(tunnel(id, 100000 + id)));
+    }
+    // removing and adding many more leaves the others in place
+    for(quint32 id = 1; id <= 1000; id += 2) {
+        table.remove(states[id - 1]);
+    }
+    for(quint32 id = 2000; id < 4000; id++) {
+        table.insert(tunnel(id));
+    }
+    QCOMPARE(table.size(), 500 + 2000);
+    for(quint32 id = 2; id <= 1000; id += 2) {
+        QVERIFY(table.findByPreviousHop(id) == states[id - 1]);
+        QCOMPARE(states[id - 1]->tunnelIdNextHop, 100000 + id);
+    }
+}
+
+void TunnelTableTester::benchmarkLookup_data()
+{
+    QTest::addColumn<int>("tunnels");
+    QTest::addColumn<bool>("indexed");
+    for(int tunnels : { 100, 5000, 50000 }) {
+        QTest::newRow(qPrintable(QString("list, %1 tunnels").arg(tunnels))) << tunnels << false;
+        QTest::newRow(qPrintable(QString("table, %1 tunnels").arg(tunnels))) << tunnels << true;
+    }
+}
+
+void TunnelTableTester::benchmarkLookup()
+{
+    QFETCH(int, tunnels);
+    QFETCH(bool, indexed);
+
+    TunnelTable table;
+    QList<TunnelState> list;
+    for(int i = 1; i <= tunnels; i++) {
+        table.insert(tunnel(i, tunnels + i));
+        list.append(tunnel(i, tunnels + i));
+    }
+
+    // a cell from each side of spread out tunnels, as a busy relay sees them
+    const int lookups = 1000;
+    int found = 0;
+    qint64 nsecs = 0;
+    QBENCHMARK {
+        QElapsedTimer timer;
+        timer.start();
+        found = 0;
+        for(int i = 0; i < lookups; i++) {
+            quint32 id = 1 + (quint32)(i * 7919) % tunnels;
+            if(indexed) {
+                found += table.findByPreviousHop(id) != nullptr;
+                found += table.findByNextHop(tunnels + id) != nullptr;
+            } else {
+                for(const TunnelState &candidate : list) {
+                    if(candidate.tunnelIdPreviousHop == id) {
+                        found++;
+                        break;
+                    }
+                }
+                for(const TunnelState &candidate : list) {
+                    if(candidate.tunnelIdNextHop == tunnels + id) {
+                        found++;
+                        break;
+                    }
+                }
+            }
+        }
+        nsecs = timer.nsecsElapsed();
+    }
+    QCOMPARE(found, 2 * lookups);
+    qDebug() << QTest::currentDataTag() << nsecs / (2 * lookups) << "ns/lookup";
+}
@@ -0,0 +1,25 @@
+#ifndef TUNNELTABLETESTER_H
+#define TUNNELTABLETESTER_H
+
+#include <QObject>
+#include <QTest>
+#include "tunneltable.h"
+
+class TunnelTableTester : public QObject
+{
+    Q_OBJECT
+public:
+    explicit TunnelTableTester(QObject *parent = 0);
+
+private slots:
+    void testFind();
+    void testSetNextHop();
+    void testRemove();
+    void testStablePointers();
+
+    // ns per lookup with more and more tunnels, next to the list scan it replaced
+    void benchmarkLookup_data();
+    void benchmarkLookup();
+};
+
+#endif // TUNNELTABLETESTER_H
@@ -1,65 +1,256 @@
 #include "tunnelidmapper.h"
 
+#include <QDebug>
+#include <cstring>
+
 TunnelIdMapper::TunnelIdMapper()
 {
+    setShard(0, 1);
+}
+
+void TunnelIdMapper::setShard(int index, int count)
+{
+    Q_ASSERT(slots_.isEmpty());
+    shardIndex_ = index;
+    shardCount_ = qMax(1, count);
+
+    // as many generations as fit into 32 bits next to the slot, after the last the first
+    // comes again
+    maxGeneration_ = ((0xFFFFFFFFU - shardIndex_) / shardCount_) >> SlotBits;
+}
+
+int TunnelIdMapper::shardOf(quint32 tunnelId, int count)
+{
+    return tunnelId % count;
+}
 
+int TunnelIdMapper::shardOfCircuit(quint16 circId, int count)
+{
+    // has to match the steering filter in DatagramEngine::setShardSteering
+    return circId % count;
 }
 
-quint32 TunnelIdMapper::tunnelId(Binding binding, quint16 circId)
+void TunnelIdMapper::setLocalEndpoint(const Endpoint &local)
 {
-    return tunnelId(CircuitBinding(binding, circId));
+    Q_ASSERT(allocators_.isEmpty());
+    local_ = local;
 }
 
-quint32 TunnelIdMapper::tunnelId(TunnelIdMapper::CircuitBinding id)
+quint32 TunnelIdMapper::allocate(const Endpoint &peer, quint16 *circId)
 {
-    if(!forward_.contains(id)) {
-        quint32 tid = nextTunnelId_++;
-        forward_[id] = tid;
-        backward_[tid] = id;
+    if(free_.isEmpty() && slots_.size() >= (1 << SlotBits)) {
+        qDebug() << "no tunnel id left for a circuit to" << peer.toString();
+        return 0;
+    }
+
+    int first, last;
+    circIdRange(peer, &first, &last);
+    QHash<Endpoint, CircIdAllocator>::iterator it = allocators_.find(peer);
+    if(it == allocators_.end()) {
+        CircIdAllocator allocator;
+        allocator.next = first;
+        allocator.fresh = (last - first) / shardCount_ + 1;
+        it = allocators_.insert(peer, allocator);
+        idleAllocators_++;
+    }
+    CircIdAllocator &allocator = *it;
+
+    // fresh ids first, then the released ones. one the neighbour has a circuit on goes to
+    // the back, that happens only where the halves could not be told apart
+    for(int candidates = allocator.fresh + allocator.released.size() - allocator.head; candidates > 0; candidates--) {
+        quint16 candidate;
+        if(allocator.fresh > 0) {
+            candidate = allocator.next;
+            allocator.next = candidate + shardCount_ <= last ? candidate + shardCount_ : first;
+            allocator.fresh--;
+        } else {
+            candidate = allocator.released[allocator.head++];
+        }
+
+        RouteKey key = RouteKey::make(peer, candidate);
+        if(forward_.find(key) != 0) {
+            allocator.released.append(candidate);
+            continue;
+        }
+
+        if(allocator.head > 64 && allocator.head * 2 > allocator.released.size()) {
+            allocator.released.remove(0, allocator.head);
+            allocator.head = 0;
+        }
+        if(allocator.live++ == 0) {
+            idleAllocators_--;
+        }
+        *circId = candidate;
+        return insert(key, true);
     }
 
-    return forward_[id];
+    qDebug() << "no circuit id left to" << peer.toString();
+    return 0;
 }
 
-quint16 TunnelIdMapper::nextCircId(Binding binding)
+quint32 TunnelIdMapper::accept(const Endpoint &peer, quint16 circId)
 {
-    if(!nextCircIds_.contains(binding)) {
-        nextCircIds_[binding] = 5;
+    RouteKey key = RouteKey::make(peer, circId);
+    quint32 existing = forward_.find(key);
+    if(existing != 0) {
+        if(slots_[slotOf(existing)].outgoing) {
+            qDebug() << peer.toString() << "picked our circuit id" << circId;
+            return 0;
+        }
+        return existing;
     }
+    return insert(key, false);
+}
 
-    return nextCircIds_[binding]++;
+quint32 TunnelIdMapper::insert(const RouteKey &key, bool outgoing)
+{
+    int slot;
+    if(!free_.isEmpty()) {
+        slot = free_.takeFirst();
+    } else if(slots_.size() < (1 << SlotBits)) {
+        slot = slots_.size();
+        slots_.append(Slot());
+    } else {
+        qDebug() << "no tunnel id left for" << key.endpoint().toString() << key.circId;
+        return 0;
+    }
+
+    Slot &s = slots_[slot];
+    s.key = key;
+    s.used = true;
+    s.outgoing = outgoing;
+    quint32 tid = encode(slot, s.generation);
+    forward_.insert(key, tid);
+    neighbours_[key.endpoint()]++;
+    return tid;
 }
 
-void TunnelIdMapper::decompose(quint32 tunnelId, Binding *outBinding, quint16 *outCircId)
+quint32 TunnelIdMapper::find(const Endpoint &peer, quint16 circId) const
 {
-    if(!backward_.contains(tunnelId)) {
-        qDebug() << "decompose with nonexisting tunnelid";
-        *outBinding = Binding();
-        *outCircId = 0;
-        return;
+    return forward_.find(RouteKey::make(peer, circId));
+}
+
+void TunnelIdMapper::findBatch(const RouteKey *keys, int count, quint32 *tunnelIds) const
+{
+    forward_.findBatch(keys, count, tunnelIds);
+}
+
+bool TunnelIdMapper::release(quint32 tunnelId, Endpoint *neighbour)
+{
+    int slot = slotOf(tunnelId);
+    if(slot < 0) {
+        return false;
     }
 
-    CircuitBinding id = backward_[tunnelId];
-    *outBinding = id.binding;
-    *outCircId = id.circId;
+    Slot &s = slots_[slot];
+    Endpoint peer = s.key.endpoint();
+    QHash<Endpoint, int>::iterator live = neighbours_.find(peer);
+    if(--*live == 0) {
+        neighbours_.erase(live);
+    }
+    if(neighbour != nullptr) {
+        *neighbour = peer;
+    }
+    if(s.outgoing) {
+        QHash<Endpoint, CircIdAllocator>::iterator it = allocators_.find(peer);
+        if(it != allocators_.end()) {
+            if(--it->live == 0) {
+                // nothing of ours to the neighbour is left, all ids are fresh again. they
+                // come in turn from the one after the last, the neighbour may still think
+                // the last ones live
+                int first, last;
+                circIdRange(it.key(), &first, &last);
+                it->next = s.key.circId + shardCount_ <= last ? s.key.circId + shardCount_ : first;
+                it->fresh = (last - first) / shardCount_ + 1;
+                it->released.clear();
+                it->head = 0;
+                if(++idleAllocators_ > MaxIdleAllocators) {
+                    expireIdleAllocators();
+                }
+            } else {
+                it->released.append(s.key.circId);
+            }
+        }
+    }
+    forward_.remove(s.key);
+    s.used = false;
+    s.generation = s.generation >= maxGeneration_ ? 1 : s.generation + 1;
+    free_.append(slot);
+    return true;
 }
 
-QString TunnelIdMapper::describe(quint32 tunnelId)
+void TunnelIdMapper::expireIdleAllocators()
 {
-    if(!backward_.contains(tunnelId)) {
-        return "<invalid tunnelid>";
+    // any of them, down to half the limit. a neighbour of those starts over at its first id
+    for(QHash<Endpoint, CircIdAllocator>::iterator it = allocators_.begin(); it != allocators_.end() && idleAllocators_ > MaxIdleAllocators / 2;) {
+        if(it->live == 0) {
+            it = allocators_.erase(it);
+            idleAllocators_--;
+        } else {
+            it++;
+        }
+    }
+}
+
+void TunnelIdMapper::circIdRange(const Endpoint &peer, int *first, int *last) const
+{
+    // compared the same way on both ends: the addresses byte by byte, then the ports
+    static const quint8 none[16] = {};
+    bool knowAddress = memcmp(local_.address, none, sizeof(none)) != 0 &&
+            !(local_.isIPv4() && local_.ipv4() == 0);
+    int order = knowAddress ? memcmp(local_.address, peer.address, sizeof(none)) : 0;
+    if(order == 0) {
+        order = local_.port - peer.port;
     }
 
-    CircuitBinding id = backward_[tunnelId];
-    return QString("%1@x%2").arg(id.binding.toString(), QString::number(id.circId, 16).rightJustified(4, '0'));
+    // the first few ids stay unused, as they always did
+    int low = order > 0 ? 0x8000 : 5;
+    *last = order < 0 ? 0x7FFF : 0xFFFF;
+    // the first one of our shard
+    *first = low + (shardIndex_ - shardOfCircuit(low, shardCount_) + shardCount_) % shardCount_;
 }
 
-uint qHash(TunnelIdMapper::CircuitBinding key)
+quint32 TunnelIdMapper::encode(int slot, quint32 generation) const
 {
-    return qHash(key.binding) ^ qHash(key.circId);
+    // generation is never 0, so neither is the id
+    return shardIndex_ + shardCount_ * ((generation << SlotBits) | slot);
 }
 
-bool TunnelIdMapper::CircuitBinding::operator ==(const TunnelIdMapper::CircuitBinding &other) const
+int TunnelIdMapper::slotOf(quint32 tunnelId) const
 {
-    return binding == other.binding && circId == other.circId;
+    if(shardOf(tunnelId, shardCount_) != shardIndex_) {
+        return -1;
+    }
+    quint32 encoded = tunnelId / shardCount_;
+    int slot = encoded & ((1 << SlotBits) - 1);
+    if(slot >= slots_.size() || !slots_[slot].used || slots_[slot].generation != encoded >> SlotBits) {
+        return -1;
+    }
+    return slot;
+}
+
+void TunnelIdMapper::decompose(quint32 tunnelId, Endpoint *outPeer, quint16 *outCircId)
+{
+    int slot = slotOf(tunnelId);
+    if(slot < 0) {
+        qDebug() << "decompose with nonexisting tunnelid";
+        *outPeer = Endpoint();
+        *outCircId = 0;
+        return;
+    }
+
+    const RouteKey &key = slots_[slot].key;
+    *outPeer = key.endpoint();
+    *outCircId = key.circId;
+}
+
+QString TunnelIdMapper::describe(quint32 tunnelId)
+{
+    int slot = slotOf(tunnelId);
+    if(slot < 0) {
+        return "<invalid tunnelid>";
+    }
+
+    const RouteKey &key = slots_[slot].key;
+    return QString("%1@x%2").arg(key.endpoint().toString(), QString::number(key.circId, 16).rightJustified(4, '0'));
 }
@@ -2,37 +2,102 @@
 #define TUNNELIDMAPPER_H
 
 #include <QHash>
-#include "binding.h"
+#include <QList>
+#include <QVector>
+#include "endpoint.h"
+#include "routetable.h"
 
+// the tunnel id of every (neighbour, circuit id) we have a tunnel or circuit with. ids are
+// only made where one is set up, for circuit ids we pick (allocate()) or a neighbour picked
+// (accept()). cells from anywhere else only look them up (find()) and leave nothing behind.
+// release() gives an id up when its tunnel goes.
+//
+// both ends of a link pick circuit ids, each from its own half of them: the end with the
+// lower endpoint the ids below 0x8000, the other those from 0x8000. the half is the top bit,
+// the low bits steer cells to shards. circuit ids we released are picked again after all
+// fresh ones, oldest first, so a neighbour has long forgotten the old circuit. that holds
+// for one circuit at a time as well, the ids go round from the one after the last
+//
+// an id names a slot and the generation of the slot: a released slot is taken again last
+// and with the next generation, an id kept around after release() does not find the
+// tunnel that has the slot now
 class TunnelIdMapper
 {
 public:
     TunnelIdMapper();
 
-    struct CircuitBinding {
-        CircuitBinding() {}
-        CircuitBinding(Binding b, quint16 c) : binding(b), circId(c) {}
+    // restrict ids to one shard of a sharded relay: tunnelIds and circIds we
+    // hand out are all congruent to index modulo count. before the first id
+    void setShard(int index, int count);
+    static int shardOf(quint32 tunnelId, int count);
+    static int shardOfCircuit(quint16 circId, int count);
 
-        Binding binding;
-        quint16 circId;
+    // where we are as our neighbours see us, it decides which half of the circuit ids we
+    // pick. with no address (listening on any) only the ports decide, with the same port
+    // as well we pick from all ids and rely on the checks. before the first id
+    void setLocalEndpoint(const Endpoint &local);
 
-        bool operator ==(const CircuitBinding &other) const;
-    };
-
-    quint32 tunnelId(Binding binding, quint16 circId);
-    quint32 tunnelId(CircuitBinding id);
-    quint16 nextCircId(Binding binding);
-    void decompose(quint32 tunnelId, Binding *outBinding, quint16 *outCircId);
+    // a circuit id of ours to peer and its tunnel id, 0 if all our ids to peer are live
+    // or all slots are taken
+    quint32 allocate(const Endpoint &peer, quint16 *circId);
+    // the id of the circuit peer picked circId for, made if there is none. 0 if circId is
+    // one of ours to peer or all slots are taken
+    quint32 accept(const Endpoint &peer, quint16 circId);
+    // the id of peer and circId, 0 if there is none
+    quint32 find(const Endpoint &peer, quint16 circId) const;
+    // the ids of count received cells at once, 0 for those without
+    void findBatch(const RouteKey *keys, int count, quint32 *tunnelIds) const;
+    // forget tunnelId, false if it is not a live id. neighbour is set to the one it was with
+    bool release(quint32 tunnelId, Endpoint *neighbour = nullptr);
+    // whether any live id is with peer
+    bool hasTunnels(const Endpoint &peer) const { return neighbours_.contains(peer); }
+    void decompose(quint32 tunnelId, Endpoint *outPeer, quint16 *outCircId);
 
     QString describe(quint32 tunnelId);
+    // live ids
+    int size() const { return forward_.size(); }
+
+    // 2^SlotBits ids are live at most
+    static const int SlotBits = 20;
 
 private:
-    QHash<Binding, quint16> nextCircIds_;
-    QHash<quint32, CircuitBinding> backward_;
-    QHash<CircuitBinding, quint32> forward_;
-    quint32 nextTunnelId_ = 10;
-};
+    struct Slot {
+        RouteKey key;
+        quint32 generation = 1;
+        bool used = false;
+        bool outgoing = false; // the circuit id is one of ours
+    };
 
-uint qHash(TunnelIdMapper::CircuitBinding key);
+    // the circuit ids we pick towards one neighbour
+    struct CircIdAllocator {
+        int next = 0; // the next fresh one, after the last one of the range the first
+        int fresh = 0; // how many fresh ones are left from next on
+        QVector<quint16> released; // oldest first, from head on
+        int head = 0;
+        int live = 0;
+    };
+    // neighbours we have no circuits with any more keep their allocator, up to this many
+    static const int MaxIdleAllocators = 4096;
+
+    quint32 insert(const RouteKey &key, bool outgoing);
+    // the range of circuit ids we pick towards peer, only those of our shard
+    void circIdRange(const Endpoint &peer, int *first, int *last) const;
+    void expireIdleAllocators();
+    quint32 encode(int slot, quint32 generation) const;
+    // the slot of a live tunnelId, -1 if it is not one
+    int slotOf(quint32 tunnelId) const;
+
+    Endpoint local_;
+    QHash<Endpoint, CircIdAllocator> allocators_;
+    int idleAllocators_ = 0; // without live circuit ids
+    QHash<Endpoint, int> neighbours_; // live ids per neighbour
+    RouteTable forward_;
+    QVector<Slot> slots_;
+    QList<int> free_; // oldest released first
+    quint32 maxGeneration_ = 0;
+
+    int shardIndex_ = 0;
+    int shardCount_ = 1;
+};
 
 #endif // TUNNELIDMAPPER_H
@@ -0,0 +1,86 @@
+#include "tunneltable.h"
+
+#include <QDebug>
+
+TunnelTable::TunnelTable()
+{
+}
+
+TunnelTable::~TunnelTable()
+{
+    qDeleteAll(chunks_);
+}
+
+TunnelState *TunnelTable::insert(const TunnelState &tunnel)
+{
+    if(byPreviousHop_.contains(tunnel.tunnelIdPreviousHop) ||
+            (tunnel.tunnelIdNextHop != 0 && byNextHop_.contains(tunnel.tunnelIdNextHop))) {
+        qDebug() << "tunnel" << tunnel.tunnelIdPreviousHop << "is relayed already";
+        return nullptr;
+    }
+
+    int index;
+    if(!free_.isEmpty()) {
+        index = free_.takeLast();
+    } else {
+        if(used_ == chunks_.size() * ChunkSize) {
+            chunks_.append(new Chunk);
+        }
+        index = used_++;
+    }
+
+    TunnelState &state = slot(index);
+    state = tunnel;
+    byPreviousHop_.insert(tunnel.tunnelIdPreviousHop, index);
+    if(tunnel.tunnelIdNextHop != 0) {
+        byNextHop_.insert(tunnel.tunnelIdNextHop, index);
+    }
+    return &state;
+}
+
+TunnelState *TunnelTable::findByPreviousHop(quint32 tunnelId)
+{
+    QHash<quint32, int>::const_iterator it = byPreviousHop_.constFind(tunnelId);
+    return it != byPreviousHop_.constEnd() ? &slot(it.value()) : nullptr;
+}
+
+TunnelState *TunnelTable::findByNextHop(quint32 tunnelId)
+{
+    QHash<quint32, int>::const_iterator it = byNextHop_.constFind(tunnelId);
+    return it != byNextHop_.constEnd() ? &slot(it.value()) : nullptr;
+}
+
+void TunnelTable::setNextHop(TunnelState *tunnel, const Endpoint &nextHop, quint16 circuitId, quint32 tunnelId)
+{
+    Q_ASSERT(findByPreviousHop(tunnel->tunnelIdPreviousHop) == tunnel);
+    if(tunnel->tunnelIdNextHop != 0) {
+        byNextHop_.remove(tunnel->tunnelIdNextHop);
+    }
+    tunnel->nextHop = nextHop;
+    tunnel->circIdNextHop = circuitId;
+    tunnel->tunnelIdNextHop = tunnelId;
+    byNextHop_.insert(tunnelId, byPreviousHop_.value(tunnel->tunnelIdPreviousHop));
+}
+
+void TunnelTable::remove(TunnelState *tunnel)
+{
+    QHash<quint32, int>::iterator it = byPreviousHop_.find(tunnel->tunnelIdPreviousHop);
+    if(it == byPreviousHop_.end() || &slot(it.value()) != tunnel) {
+        qDebug() << "tunnel" << tunnel->tunnelIdPreviousHop << "to remove is not in the table";
+        return;
+    }
+
+    int index = it.value();
+    byPreviousHop_.erase(it);
+    if(tunnel->tunnelIdNextHop != 0) {
+        byNextHop_.remove(tunnel->tunnelIdNextHop);
+    }
+    // let go of what it holds now, not when the slot is reused
+    *tunnel = TunnelState();
+    free_.append(index);
+}
+
+int TunnelTable::size() const
+{
+    return byPreviousHop_.size();
+}
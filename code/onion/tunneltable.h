@@ -0,0 +1,70 @@
+#ifndef TUNNELTABLE_H
+#define TUNNELTABLE_H
+
+#include <QHash>
+#include <QVector>
+
+#include "endpoint.h"
+#include "celldigest.h"
+#include "peertopeermessage.h"
+
+// a tunnel we relay, a <-> us <-> b
+struct TunnelState {
+    Endpoint previousHop;
+    Endpoint nextHop;
+
+    quint16 circIdPreviousHop = 0;
+    quint16 circIdNextHop = 0;
+
+    quint32 tunnelIdPreviousHop = 0;
+    quint32 tunnelIdNextHop = 0;
+
+    CellDigest::Key digestKey; // for cells between the source and us
+    PeerToPeerMessage::CellSize cellSize = PeerToPeerMessage::CELL_1K; // agreed with the source
+    bool compress = false; // the source sent compressed data, it takes it as well
+
+    bool hasNextHop() const { return nextHop.isValid(); }
+};
+
+// the tunnels we relay, found by the tunnel id on either side in O(1), every relayed cell
+// looks up one. tunnels live in chunks that never move, a pointer from the table stays
+// valid until its tunnel is removed, whatever else comes and goes. freed slots are reused.
+//
+// the tunnel ids of a tunnel in the table only change through setNextHop(), which keeps
+// the index in step
+class TunnelTable
+{
+public:
+    TunnelTable();
+    ~TunnelTable();
+
+    // nullptr if a tunnel with the same previous hop tunnel id is in already
+    TunnelState *insert(const TunnelState &tunnel);
+    // nullptr if there is none
+    TunnelState *findByPreviousHop(quint32 tunnelId);
+    TunnelState *findByNextHop(quint32 tunnelId);
+    // the next hop of an extended tunnel, with the tunnel id of that side
+    void setNextHop(TunnelState *tunnel, const Endpoint &nextHop, quint16 circuitId, quint32 tunnelId);
+    // tunnel is from this table, it is gone afterwards
+    void remove(TunnelState *tunnel);
+
+    int size() const;
+
+private:
+    Q_DISABLE_COPY(TunnelTable)
+
+    static const int ChunkSize = 256;
+    struct Chunk {
+        TunnelState tunnels[ChunkSize];
+    };
+
+    TunnelState &slot(int index) { return chunks_[index / ChunkSize]->tunnels[index % ChunkSize]; }
+
+    QVector<Chunk *> chunks_;
+    QVector<int> free_; // slots to reuse, last freed first
+    int used_ = 0; // slots handed out at least once
+    QHash<quint32, int> byPreviousHop_;
+    QHash<quint32, int> byNextHop_;
+};
+
+#endif // TUNNELTABLE_H
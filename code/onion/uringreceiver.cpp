@@ -0,0 +1,302 @@
+#include "uringreceiver.h"
+
+#ifdef ONION_IO_URING
+
+#include <QDebug>
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+// the only buffer group of the ring
+static const int BufferGroup = 0;
+
+UringReceiver::UringReceiver()
+{
+    memset(&layout_, 0, sizeof(layout_));
+}
+
+UringReceiver::~UringReceiver()
+{
+    close();
+}
+
+bool UringReceiver::open(int socketFd, int bufferCount, int payloadSize, int controlSize)
+{
+    close();
+    if(bufferCount < 1 || bufferCount > 32768 || (bufferCount & (bufferCount - 1)) != 0) {
+        errorString_ = "buffer count must be a power of two up to 32768";
+        return false;
+    }
+    socketFd_ = socketFd;
+    bufferCount_ = bufferCount;
+
+    // every buffer holds a datagram with its header, its address and its control messages.
+    // one completion per buffer, so the completion queue cannot overflow at twice the size
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = bufferCount * 2;
+    ringFd_ = (int)syscall(__NR_io_uring_setup, 4, &params);
+    if(ringFd_ == -1) {
+        errorString_ = QString("io_uring_setup: %1").arg(strerror(errno));
+        return false;
+    }
+    if(!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        errorString_ = "io_uring without IORING_FEAT_SINGLE_MMAP";
+        close();
+        return false;
+    }
+
+    sqRingSize_ = qMax<size_t>(params.sq_off.array + params.sq_entries * sizeof(unsigned),
+                               params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+    sqRing_ = mmap(nullptr, sqRingSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd_, IORING_OFF_SQ_RING);
+    sqesSize_ = params.sq_entries * sizeof(io_uring_sqe);
+    void *sqes = mmap(nullptr, sqesSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd_, IORING_OFF_SQES);
+    if(sqRing_ == MAP_FAILED || sqes == MAP_FAILED) {
+        errorString_ = QString("io_uring mmap: %1").arg(strerror(errno));
+        if(sqRing_ == MAP_FAILED) {
+            sqRing_ = nullptr;
+        }
+        if(sqes != MAP_FAILED) {
+            munmap(sqes, sqesSize_);
+        }
+        close();
+        return false;
+    }
+    sqes_ = static_cast<io_uring_sqe *>(sqes);
+
+    char *ring = static_cast<char *>(sqRing_);
+    sqTail_ = reinterpret_cast<unsigned *>(ring + params.sq_off.tail);
+    sqMask_ = reinterpret_cast<unsigned *>(ring + params.sq_off.ring_mask);
+    sqArray_ = reinterpret_cast<unsigned *>(ring + params.sq_off.array);
+    cqHead_ = reinterpret_cast<unsigned *>(ring + params.cq_off.head);
+    cqTail_ = reinterpret_cast<unsigned *>(ring + params.cq_off.tail);
+    cqMask_ = reinterpret_cast<unsigned *>(ring + params.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<io_uring_cqe *>(ring + params.cq_off.cqes);
+
+    // recvmsg writes io_uring_recvmsg_out | name | control | payload into each buffer
+    bufferSize_ = (int)(sizeof(io_uring_recvmsg_out) + sizeof(sockaddr_storage) + controlSize + payloadSize);
+    bufferSize_ = (bufferSize_ + 63) & ~63;
+    buffersSize_ = (size_t)bufferCount_ * bufferSize_;
+    bufferRingSize_ = (size_t)bufferCount_ * sizeof(io_uring_buf);
+    void *buffers = mmap(nullptr, buffersSize_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    void *bufferRing = mmap(nullptr, bufferRingSize_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(buffers == MAP_FAILED || bufferRing == MAP_FAILED) {
+        errorString_ = QString("buffer mmap: %1").arg(strerror(errno));
+        if(buffers != MAP_FAILED) {
+            munmap(buffers, buffersSize_);
+        }
+        if(bufferRing != MAP_FAILED) {
+            munmap(bufferRing, bufferRingSize_);
+        }
+        close();
+        return false;
+    }
+    buffers_ = static_cast<char *>(buffers);
+    bufferRing_ = static_cast<io_uring_buf_ring *>(bufferRing);
+
+    io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = reinterpret_cast<quint64>(bufferRing_);
+    reg.ring_entries = bufferCount_;
+    reg.bgid = BufferGroup;
+    if(syscall(__NR_io_uring_register, ringFd_, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+        errorString_ = QString("IORING_REGISTER_PBUF_RING: %1").arg(strerror(errno));
+        close();
+        return false;
+    }
+
+    Message message;
+    for(int i = 0; i < bufferCount_; i++) {
+        message.buffer = (quint16)i;
+        recycle(message);
+    }
+    __atomic_store_n(&bufferRing_->tail, bufferTail_, __ATOMIC_RELEASE);
+
+    eventFd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(eventFd_ == -1 || syscall(__NR_io_uring_register, ringFd_, IORING_REGISTER_EVENTFD, &eventFd_, 1) == -1) {
+        errorString_ = QString("IORING_REGISTER_EVENTFD: %1").arg(strerror(errno));
+        close();
+        return false;
+    }
+
+    layout_.msg_namelen = sizeof(sockaddr_storage);
+    layout_.msg_controllen = controlSize;
+
+    if(!arm()) {
+        close();
+        return false;
+    }
+    return true;
+}
+
+void UringReceiver::close()
+{
+    // pending receives are cancelled with the ring, the buffers go after it
+    if(ringFd_ != -1) {
+        ::close(ringFd_);
+        ringFd_ = -1;
+    }
+    if(eventFd_ != -1) {
+        ::close(eventFd_);
+        eventFd_ = -1;
+    }
+    if(sqes_ != nullptr) {
+        munmap(sqes_, sqesSize_);
+        sqes_ = nullptr;
+    }
+    if(sqRing_ != nullptr) {
+        munmap(sqRing_, sqRingSize_);
+        sqRing_ = nullptr;
+    }
+    if(buffers_ != nullptr) {
+        munmap(buffers_, buffersSize_);
+        buffers_ = nullptr;
+    }
+    if(bufferRing_ != nullptr) {
+        munmap(bufferRing_, bufferRingSize_);
+        bufferRing_ = nullptr;
+    }
+    bufferTail_ = 0;
+    armed_ = false;
+    socketFd_ = -1;
+}
+
+bool UringReceiver::isOpen() const
+{
+    return ringFd_ != -1;
+}
+
+QString UringReceiver::errorString() const
+{
+    return errorString_;
+}
+
+int UringReceiver::eventFd() const
+{
+    return eventFd_;
+}
+
+void UringReceiver::clearEvent()
+{
+    quint64 count;
+    if(::read(eventFd_, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+        qDebug() << "UringReceiver: eventfd read failed:" << strerror(errno);
+    }
+}
+
+bool UringReceiver::next(Message *message)
+{
+    unsigned head = *cqHead_; // only we move the head
+    unsigned tail = __atomic_load_n(cqTail_, __ATOMIC_ACQUIRE);
+
+    while(head != tail) {
+        const io_uring_cqe &cqe = cqes_[head & *cqMask_];
+        int res = cqe.res;
+        unsigned flags = cqe.flags;
+        head++;
+        __atomic_store_n(cqHead_, head, __ATOMIC_RELEASE);
+
+        if(!(flags & IORING_CQE_F_MORE)) {
+            // the multishot receive ended, finish() starts a new one
+            armed_ = false;
+        }
+        if(!(flags & IORING_CQE_F_BUFFER)) {
+            // ENOBUFS just means we were too slow to hand buffers back
+            if(res < 0 && res != -ENOBUFS) {
+                qDebug() << "UringReceiver: recvmsg failed:" << strerror(-res);
+            }
+            continue;
+        }
+
+        message->buffer = (quint16)(flags >> IORING_CQE_BUFFER_SHIFT);
+        if(res < 0) {
+            qDebug() << "UringReceiver: recvmsg failed:" << strerror(-res);
+            recycle(*message);
+            continue;
+        }
+
+        char *buffer = buffers_ + (size_t)message->buffer * bufferSize_;
+        const io_uring_recvmsg_out *out = reinterpret_cast<const io_uring_recvmsg_out *>(buffer);
+        char *name = buffer + sizeof(io_uring_recvmsg_out);
+        char *control = name + layout_.msg_namelen;
+        char *payload = control + layout_.msg_controllen;
+
+        message->name = reinterpret_cast<const sockaddr *>(name);
+        message->nameLength = qMin<socklen_t>(out->namelen, layout_.msg_namelen);
+        message->control = control;
+        message->controlLength = (int)qMin<size_t>(out->controllen, layout_.msg_controllen);
+        message->payload = payload;
+        message->size = (int)out->payloadlen; // the full size, we receive with MSG_TRUNC
+        message->received = qMin(message->size, res - (int)(payload - buffer));
+        return true;
+    }
+    return false;
+}
+
+void UringReceiver::recycle(const Message &message)
+{
+    // not bufferRing_->bufs, in c++ the empty struct of __DECLARE_FLEX_ARRAY shifts it by 8
+    io_uring_buf &buffer = reinterpret_cast<io_uring_buf *>(bufferRing_)[bufferTail_ & (bufferCount_ - 1)];
+    buffer.addr = reinterpret_cast<quint64>(buffers_ + (size_t)message.buffer * bufferSize_);
+    buffer.len = bufferSize_;
+    buffer.bid = message.buffer;
+    bufferTail_++;
+}
+
+void UringReceiver::finish()
+{
+    if(ringFd_ == -1) {
+        return;
+    }
+
+    __atomic_store_n(&bufferRing_->tail, bufferTail_, __ATOMIC_RELEASE);
+    if(!armed_) {
+        arm();
+    }
+
+    // the eventfd only fires on new completions, wake up for the ones we left
+    if(*cqHead_ != __atomic_load_n(cqTail_, __ATOMIC_ACQUIRE)) {
+        quint64 one = 1;
+        if(::write(eventFd_, &one, sizeof(one)) == -1) {
+            qDebug() << "UringReceiver: eventfd write failed:" << strerror(errno);
+        }
+    }
+}
+
+bool UringReceiver::arm()
+{
+    unsigned tail = *sqTail_;
+    unsigned index = tail & *sqMask_;
+    io_uring_sqe *sqe = &sqes_[index];
+    memset(sqe, 0, sizeof(io_uring_sqe));
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = socketFd_;
+    sqe->addr = reinterpret_cast<quint64>(&layout_);
+    sqe->len = 1;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BufferGroup;
+    sqe->msg_flags = MSG_TRUNC; // payloadlen reports the real size of oversized datagrams
+    sqArray_[index] = index;
+    __atomic_store_n(sqTail_, tail + 1, __ATOMIC_RELEASE);
+
+    if(enter(1, 0) != 1) {
+        errorString_ = QString("io_uring_enter: %1").arg(strerror(errno));
+        qDebug() << "UringReceiver: could not arm recvmsg:" << errorString_;
+        return false;
+    }
+    armed_ = true;
+    return true;
+}
+
+int UringReceiver::enter(unsigned toSubmit, unsigned flags)
+{
+    return (int)syscall(__NR_io_uring_enter, ringFd_, toSubmit, 0, flags, nullptr, 0);
+}
+
+#endif // ONION_IO_URING
@@ -0,0 +1,102 @@
+#ifndef URINGRECEIVER_H
+#define URINGRECEIVER_H
+
+#include <QString>
+#include <QtGlobal>
+
+#ifdef Q_OS_LINUX
+#include <linux/io_uring.h>
+// multishot recvmsg and provided buffer rings came with linux 6.0
+#ifdef IORING_RECV_MULTISHOT
+#define ONION_IO_URING
+#endif
+#endif
+
+#ifdef ONION_IO_URING
+
+#include <sys/socket.h>
+
+// receives datagrams of a udp socket through io_uring, see DatagramEngine::setIoUring().
+// a single multishot recvmsg stays armed on the socket, the kernel picks a buffer from a
+// ring of bufferCount provided buffers for every datagram and posts a completion, without
+// a syscall per wakeup or per datagram. completions signal eventFd(), for a QSocketNotifier.
+// the raw io_uring syscalls are used, there is no dependency on liburing.
+class UringReceiver
+{
+public:
+    UringReceiver();
+    ~UringReceiver();
+
+    // one received datagram, lives in a ring buffer until recycle()
+    struct Message {
+        const char *payload = nullptr;
+        int size = 0; // size on the wire
+        int received = 0; // bytes at payload, less than size if the buffer was too small
+        const sockaddr *name = nullptr;
+        socklen_t nameLength = 0;
+        char *control = nullptr;
+        int controlLength = 0;
+        quint16 buffer = 0;
+    };
+
+    // bufferCount must be a power of two, payloadSize the largest datagram that fits
+    bool open(int socketFd, int bufferCount, int payloadSize, int controlSize);
+    void close();
+    bool isOpen() const;
+    QString errorString() const;
+
+    int eventFd() const;
+
+    // resets eventFd(), call before taking completions
+    void clearEvent();
+    // the next completed datagram, false when there is none
+    bool next(Message *message);
+    // hands the buffer of message back to the kernel
+    void recycle(const Message &message);
+    // publishes recycled buffers and rearms the receive if the kernel stopped it.
+    // signals eventFd() again if completions were left for the next call
+    void finish();
+
+private:
+    Q_DISABLE_COPY(UringReceiver)
+
+    bool arm();
+    int enter(unsigned toSubmit, unsigned flags);
+
+    int socketFd_ = -1;
+    int ringFd_ = -1;
+    int eventFd_ = -1;
+    QString errorString_;
+    bool armed_ = false;
+
+    // submission queue, only ever holds the one recvmsg
+    void *sqRing_ = nullptr;
+    size_t sqRingSize_ = 0;
+    unsigned *sqTail_ = nullptr;
+    unsigned *sqMask_ = nullptr;
+    unsigned *sqArray_ = nullptr;
+    io_uring_sqe *sqes_ = nullptr;
+    size_t sqesSize_ = 0;
+
+    // completion queue, shares the mapping of the submission queue
+    unsigned *cqHead_ = nullptr;
+    unsigned *cqTail_ = nullptr;
+    unsigned *cqMask_ = nullptr;
+    io_uring_cqe *cqes_ = nullptr;
+
+    // provided buffers
+    io_uring_buf_ring *bufferRing_ = nullptr;
+    size_t bufferRingSize_ = 0;
+    char *buffers_ = nullptr;
+    size_t buffersSize_ = 0;
+    int bufferCount_ = 0;
+    int bufferSize_ = 0;
+    quint16 bufferTail_ = 0;
+
+    // layout of every receive, the kernel reads it once per completion
+    msghdr layout_;
+};
+
+#endif // ONION_IO_URING
+
+#endif // URINGRECEIVER_H